@@ -0,0 +1,951 @@
+#include "harness.h"
+#include <buf.h>
+#include <ndview.h>
+#include <kvnl.h>
+#include <scan.h>
+#include <relay.h>
+#include <dispatch.h>
+#include <uring.h>
+#include <expr.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define KiB (1024)
+#define MiB (1024 * 1024)
+
+/* a file on tmpfs when there is one, so that the disk stays out of it */
+static int open_scratch_file(void)
+{
+	char const * dirs[] = { getenv("BENCH_TMPDIR"), "/dev/shm", "/tmp" };
+	for (size_t i = 0; i < sizeof(dirs) / sizeof(*dirs); i++) {
+		if (dirs[i] == NULL) continue;
+		char path[256];
+		snprintf(path, sizeof(path), "%s/kvnl-bench-XXXXXX", dirs[i]);
+		int fd = mkstemp(path);
+		if (fd < 0) continue;
+		unlink(path);
+		return fd;
+	}
+	return -1;
+}
+
+
+/* buf */
+
+static void bench_buf_resize_grow(void * ctx)
+{
+	(void)ctx;
+	struct buf buf = NULL_BUF;
+	for (size_t size = 64; size <= MiB; size += 64) buf_resize(&buf, size);
+	bench_keep(buf.data);
+	buf_free(&buf);
+}
+
+static void bench_buf_resize_grow_only(void * ctx)
+{
+	(void)ctx;
+	struct buf buf = make_buf_grow_only(2.0f);
+	for (size_t size = 64; size <= MiB; size += 64) buf_resize(&buf, size);
+	bench_keep(buf.data);
+	buf_free(&buf);
+}
+
+/* growing in a file, with nothing left of the memory budget */
+static void bench_buf_resize_grow_spill(void * ctx)
+{
+	(void)ctx;
+	struct buf buf = make_buf_spill();
+	buf_set_memory_budget(0);
+	for (size_t size = 64; size <= MiB; size += 64) buf_resize(&buf, size);
+	buf_set_memory_budget(SIZE_MAX);
+	bench_keep(buf.data);
+	buf_free(&buf);
+}
+
+/* a buffer that is refilled with records of very different sizes */
+static void buf_resize_oscillate(struct buf buf)
+{
+	for (size_t i = 0; i < 10000; i++) buf_resize(&buf, i % 2 ? 64 * KiB : 64);
+	bench_keep(buf.data);
+	buf_free(&buf);
+}
+
+static void bench_buf_resize_oscillate(void * ctx)
+{
+	(void)ctx;
+	buf_resize_oscillate(NULL_BUF);
+}
+
+static void bench_buf_resize_oscillate_adaptive(void * ctx)
+{
+	(void)ctx;
+	buf_resize_oscillate(make_buf_adaptive());
+}
+
+static void bench_buf_append(void * ctx)
+{
+	(void)ctx;
+	static char piece[16] = "0123456789abcdef";
+	struct buf buf = NULL_BUF;
+	for (size_t i = 0; i < MiB / sizeof(piece); i++) buf_append(&buf, (struct view){ piece, sizeof(piece) });
+	bench_keep(buf.data);
+	buf_free(&buf);
+}
+
+static void bench_buf_push(void * ctx)
+{
+	(void)ctx;
+	static char piece[16] = "0123456789abcdef";
+	struct buf buf = NULL_BUF;
+	for (size_t i = 0; i < MiB / sizeof(piece); i++) buf_push(&buf, (struct view){ piece, sizeof(piece) });
+	bench_keep(buf.data);
+	buf_free(&buf);
+}
+
+static void bench_buf_push_byte(void * ctx)
+{
+	(void)ctx;
+	struct buf buf = NULL_BUF;
+	for (size_t i = 0; i < MiB; i++) buf_push_byte(&buf, (unsigned char)i);
+	bench_keep(buf.data);
+	buf_free(&buf);
+}
+
+static void * setup_buf(size_t param)
+{
+	(void)param;
+	struct buf * buf = malloc(sizeof(*buf));
+	if (buf != NULL) *buf = NULL_BUF;
+	return buf;
+}
+
+static void teardown_buf(void * ctx)
+{
+	struct buf * buf = ctx;
+	if (!buf_is_null(buf)) buf_free(buf);
+	free(buf);
+}
+
+/* a MiB record handed to FANOUT consumers, copied for each of them (param 0) or frozen and shared (1) */
+#define FANOUT 8
+
+struct fanout {
+	int share;
+	struct buf record, copies[FANOUT];
+};
+
+static void * setup_fanout(size_t share)
+{
+	struct fanout * fanout = malloc(sizeof(*fanout));
+	if (fanout == NULL) return NULL;
+	fanout->share = share;
+	fanout->record = NULL_BUF;
+	for (size_t i = 0; i < FANOUT; i++) fanout->copies[i] = NULL_BUF;
+	return fanout;
+}
+
+static void teardown_fanout(void * ctx)
+{
+	struct fanout * fanout = ctx;
+	if (!buf_is_null(&fanout->record)) buf_free(&fanout->record);
+	for (size_t i = 0; i < FANOUT; i++)
+		if (!buf_is_null(&fanout->copies[i])) buf_free(&fanout->copies[i]);
+	free(fanout);
+}
+
+static void bench_buf_fanout(void * ctx)
+{
+	struct fanout * fanout = ctx;
+	buf_resize(&fanout->record, MiB);
+	memset(fanout->record.data, 'x', MiB);
+	if (!fanout->share) {
+		for (size_t i = 0; i < FANOUT; i++) {
+			buf_clear(&fanout->copies[i]);
+			buf_push(&fanout->copies[i], buf_view(&fanout->record));
+			bench_keep(fanout->copies[i].data);
+		}
+		return;
+	}
+	struct buf_shared * shared = buf_freeze(&fanout->record);
+	for (size_t i = 0; i < FANOUT; i++) {
+		struct view_ref ref = view_ref(shared, buf_shared_view(shared));
+		bench_keep(ref.view.data);
+		view_ref_release(&ref);
+	}
+	buf_shared_unref(shared);
+}
+
+static void bench_buf_printf_into(void * ctx)
+{
+	struct buf * buf = ctx;
+	for (int i = 0; i < 10000; i++) buf_printf_into(buf, "%d:%s:%.17g\n", i, "value", i * 0.1);
+	bench_keep(buf->data);
+}
+
+static void bench_buf_appendf(void * ctx)
+{
+	struct buf * buf = ctx;
+	buf_clear(buf);
+	for (int i = 0; i < 10000; i++) buf_appendf(buf, "%d:%s:%.17g\n", i, "value", i * 0.1);
+	bench_keep(buf->data);
+}
+
+static void bench_buf_append_number(void * ctx)
+{
+	struct buf * buf = ctx;
+	buf_clear(buf);
+	for (int i = 0; i < 10000; i++) {
+		buf_append_int(buf, i);
+		buf_push(buf, (struct view){ ":value:", 7 });
+		buf_append_double(buf, i * 0.1);
+		buf_push_byte(buf, '\n');
+	}
+	bench_keep(buf->data);
+}
+
+
+/* view */
+
+static void * setup_haystack(size_t size)
+{
+	char * haystack = malloc(size);
+	if (haystack == NULL) return NULL;
+	memset(haystack, 'a', size);
+	memcpy(haystack + size - 6, "needle", 6);
+	return haystack;
+}
+
+static void bench_view_contains(void * ctx)
+{
+	struct view haystack = { ctx, MiB };
+	int found = view_contains(haystack, view_str("needle"));
+	bench_keep(&found);
+}
+
+#define FILL_SIZE (64 * MiB)
+
+struct fill {
+	void * data;
+	size_t size;
+	unsigned char pattern[64];
+};
+
+static void * setup_fill(size_t pattern_size)
+{
+	struct fill * fill = malloc(sizeof(*fill));
+	if (fill == NULL) return NULL;
+	fill->data = malloc(FILL_SIZE);
+	if (fill->data == NULL) { free(fill); return NULL; }
+	fill->size = pattern_size;
+	for (size_t i = 0; i < pattern_size; i++) fill->pattern[i] = i;
+	memset(fill->data, 0, FILL_SIZE);
+	return fill;
+}
+
+static void teardown_fill(void * ctx)
+{
+	struct fill * fill = ctx;
+	free(fill->data);
+	free(fill);
+}
+
+static void bench_view_fill(void * ctx)
+{
+	struct fill * fill = ctx;
+	view_fill((struct view){ fill->data, FILL_SIZE / fill->size * fill->size }, (struct view){ fill->pattern, fill->size });
+	bench_keep(fill->data);
+}
+
+
+/* ndview */
+
+#define CUBE 64
+
+struct cube {
+	double data[CUBE][CUBE][CUBE], dense[CUBE * CUBE * CUBE / 2];
+	size_t shape[3], half_shape[3];
+	ssize_t strides[3], every_other[3], dense_strides[3];
+};
+
+static void * setup_cube(size_t param)
+{
+	(void)param;
+	struct cube * cube = malloc(sizeof(*cube));
+	if (cube == NULL) return NULL;
+	for (size_t i = 0; i < CUBE * CUBE * CUBE; i++) (&cube->data[0][0][0])[i] = i;
+	for (size_t d = 0; d < 3; d++) cube->shape[d] = cube->half_shape[d] = CUBE;
+	cube->half_shape[2] = CUBE / 2;
+	ssize_t const strides[3] = { CUBE * CUBE * sizeof(double), CUBE * sizeof(double), sizeof(double) };
+	ssize_t const every_other[3] = { strides[0], strides[1], 2 * strides[2] };
+	ssize_t const dense_strides[3] = { CUBE * CUBE / 2 * sizeof(double), CUBE / 2 * sizeof(double), sizeof(double) };
+	memcpy(cube->strides, strides, sizeof(strides));
+	memcpy(cube->every_other, every_other, sizeof(every_other));
+	memcpy(cube->dense_strides, dense_strides, sizeof(dense_strides));
+	return cube;
+}
+
+static void bench_ndview_get(void * ctx)
+{
+	struct cube * cube = ctx;
+	struct ndview view = make_ndview(cube->data, 3, cube->shape, cube->strides);
+	double sum = 0;
+	for (size_t i = 0; i < CUBE; i++)
+		for (size_t j = 0; j < CUBE; j++)
+			for (size_t k = 0; k < CUBE; k++)
+				sum += *(double *)ndview_get(&view, i, j, k);
+	bench_keep(&sum);
+}
+
+/* gathering every other column, which can't be done with a single memcpy */
+static void bench_ndview_traverse(void * ctx)
+{
+	struct cube * cube = ctx;
+	struct ndview src = make_ndview(cube->data, 3, cube->half_shape, cube->every_other);
+	struct ndview dst = make_ndview(cube->dense, 3, cube->half_shape, cube->dense_strides);
+	ndview_copy(&dst, &src, sizeof(double));
+	bench_keep(cube->dense);
+}
+
+#define TAKE_ROWS (1024 * 1024)
+#define TAKE_INDICES (64 * 1024)
+
+struct take {
+	double * data, * out;
+	size_t * indices;
+	size_t shape[1], out_shape[1];
+	ssize_t strides[1];
+	size_t n_threads;
+};
+
+static void * setup_take(size_t n_threads)
+{
+	struct take * take = calloc(1, sizeof(*take));
+	if (take == NULL) return NULL;
+	take->data = malloc(TAKE_ROWS * sizeof(double));
+	take->out = malloc(TAKE_INDICES * sizeof(double));
+	take->indices = malloc(TAKE_INDICES * sizeof(size_t));
+	if (take->data == NULL || take->out == NULL || take->indices == NULL) return NULL;
+	for (size_t i = 0; i < TAKE_ROWS; i++) take->data[i] = i;
+	uint64_t x = 88172645463325252ull;
+	for (size_t i = 0; i < TAKE_INDICES; i++) {
+		x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+		take->indices[i] = x % TAKE_ROWS;
+	}
+	take->shape[0] = TAKE_ROWS;
+	take->out_shape[0] = TAKE_INDICES;
+	take->strides[0] = sizeof(double);
+	take->n_threads = n_threads;
+	return take;
+}
+
+static void teardown_take(void * ctx)
+{
+	struct take * take = ctx;
+	free(take->data);
+	free(take->out);
+	free(take->indices);
+	free(take);
+}
+
+/* random rows, the way events get picked out of a large array */
+static void bench_ndview_take(void * ctx)
+{
+	struct take * take = ctx;
+	struct ndview src = make_ndview(take->data, 1, take->shape, take->strides);
+	struct ndview dst = make_ndview(take->out, 1, take->out_shape, take->strides);
+	ndview_take(&dst, &src, 0, take->indices, sizeof(double), take->n_threads);
+	bench_keep(take->out);
+}
+
+
+/* expr */
+
+#define EXPR_ROWS (4 * 1024 * 1024)
+
+struct expr_arrays {
+	float * a, * b, * out, * temp;
+	size_t shape[1];
+	ssize_t strides[1];
+	size_t n_threads;
+};
+
+static void * setup_expr(size_t n_threads)
+{
+	struct expr_arrays * arrays = calloc(1, sizeof(*arrays));
+	if (arrays == NULL) return NULL;
+	arrays->a = malloc(EXPR_ROWS * sizeof(float));
+	arrays->b = malloc(EXPR_ROWS * sizeof(float));
+	arrays->out = malloc(EXPR_ROWS * sizeof(float));
+	arrays->temp = malloc(EXPR_ROWS * sizeof(float));
+	if (arrays->a == NULL || arrays->b == NULL || arrays->out == NULL || arrays->temp == NULL) return NULL;
+	for (size_t i = 0; i < EXPR_ROWS; i++) {
+		arrays->a[i] = i % 1000;
+		arrays->b[i] = i % 7;
+	}
+	arrays->shape[0] = EXPR_ROWS;
+	arrays->strides[0] = sizeof(float);
+	arrays->n_threads = n_threads;
+	return arrays;
+}
+
+static void teardown_expr(void * ctx)
+{
+	struct expr_arrays * arrays = ctx;
+	free(arrays->a);
+	free(arrays->b);
+	free(arrays->out);
+	free(arrays->temp);
+	free(arrays);
+}
+
+/* out = (a - mean) * scale + b a step at a time, each through memory */
+static void bench_expr_steps(void * ctx)
+{
+	struct expr_arrays * arrays = ctx;
+	for (size_t i = 0; i < EXPR_ROWS; i++) arrays->temp[i] = arrays->a[i] - 499.5f;
+	bench_keep(arrays->temp);
+	for (size_t i = 0; i < EXPR_ROWS; i++) arrays->temp[i] *= 0.25f;
+	bench_keep(arrays->temp);
+	for (size_t i = 0; i < EXPR_ROWS; i++) arrays->out[i] = arrays->temp[i] + arrays->b[i];
+	bench_keep(arrays->out);
+}
+
+static void bench_expr_eval(void * ctx)
+{
+	struct expr_arrays * arrays = ctx;
+	struct ndview a = make_ndview(arrays->a, 1, arrays->shape, arrays->strides);
+	struct ndview b = make_ndview(arrays->b, 1, arrays->shape, arrays->strides);
+	struct ndview out = make_ndview(arrays->out, 1, arrays->shape, arrays->strides);
+	struct dtype const float32 = make_dtype(DTYPE_FLOAT, 4);
+	struct expr expr = make_expr();
+	int x = expr_binary(&expr, EXPR_SUB, expr_input(&expr, &a, float32), expr_float(&expr, 499.5));
+	x = expr_binary(&expr, EXPR_MUL, x, expr_float(&expr, 0.25));
+	x = expr_binary(&expr, EXPR_ADD, x, expr_input(&expr, &b, float32));
+	expr_eval(&expr, x, &out, float32, arrays->n_threads);
+	bench_keep(arrays->out);
+}
+
+
+/* kvnl */
+
+#define ARRAY_ROWS 512
+#define ARRAY_COLS 1024
+#define ARRAY_SIZE (ARRAY_ROWS * ARRAY_COLS * sizeof(double))
+
+struct array_io {
+	int fd, pipe_fd, feed_fd;
+	pthread_t thread;
+	int has_thread;
+	double * data;
+	size_t shape[2];
+	ssize_t strides[2];
+	struct kvnl_ndview_writer writer;
+	struct kvnl_ndview_reader reader;
+	struct kvnl_value_reader values;
+	struct buf read_buf, fmt_buf;
+	struct buf blob;
+	size_t n_lines;
+};
+
+static struct ndview array_view(struct array_io * io)
+{
+	return make_ndview(io->data, 2, io->shape, io->strides);
+}
+
+static void * setup_array_io(size_t param)
+{
+	(void)param;
+	struct array_io * io = calloc(1, sizeof(*io));
+	if (io == NULL) return NULL;
+	io->fd = io->pipe_fd = -1;
+	io->data = malloc(ARRAY_SIZE);
+	if (io->data == NULL) { free(io); return NULL; }
+	for (size_t i = 0; i < ARRAY_ROWS * ARRAY_COLS; i++) io->data[i] = (double)(i % 1000) / 8;
+	io->shape[0] = ARRAY_ROWS;
+	io->shape[1] = ARRAY_COLS;
+	io->strides[0] = ARRAY_COLS * sizeof(double);
+	io->strides[1] = sizeof(double);
+	io->writer = make_kvnl_ndview_writer();
+	io->reader = make_kvnl_ndview_reader();
+	io->values = make_kvnl_value_reader(NULL, NULL);
+	io->read_buf = io->fmt_buf = io->blob = NULL_BUF;
+	return io;
+}
+
+static void teardown_array_io(void * ctx)
+{
+	struct array_io * io = ctx;
+	if (io->pipe_fd >= 0) close(io->pipe_fd);
+	if (io->has_thread) pthread_join(io->thread, NULL);
+	if (io->fd >= 0) close(io->fd);
+	kvnl_ndview_writer_free(&io->writer);
+	kvnl_ndview_reader_free(&io->reader);
+	kvnl_value_reader_free(&io->values);
+	if (!buf_is_null(&io->read_buf)) buf_free(&io->read_buf);
+	if (!buf_is_null(&io->fmt_buf)) buf_free(&io->fmt_buf);
+	if (!buf_is_null(&io->blob)) buf_free(&io->blob);
+	free(io->data);
+	free(io);
+}
+
+static void * setup_array_file(size_t param)
+{
+	struct array_io * io = setup_array_io(param);
+	if (io == NULL) return NULL;
+	io->fd = open_scratch_file();
+	if (io->fd < 0) { teardown_array_io(io); return NULL; }
+	return io;
+}
+
+static void bench_kvnl_write_ndview_file(void * ctx)
+{
+	struct array_io * io = ctx;
+	struct ndview view = array_view(io);
+	lseek(io->fd, 0, SEEK_SET);
+	kvnl_write_ndview_with(io->fd, &io->writer, &view, "<f8", sizeof(double), NULL, &io->fmt_buf);
+}
+
+static void * setup_array_file_lz(size_t param)
+{
+	struct array_io * io = setup_array_file(param);
+	if (io == NULL) return NULL;
+	io->writer.codec.shuffle = CODEC_SHUFFLE_BYTE;
+	io->writer.codec.lz = 1;
+	return io;
+}
+
+static void * setup_array_file_written(size_t param)
+{
+	struct array_io * io = setup_array_file(param);
+	if (io == NULL) return NULL;
+	bench_kvnl_write_ndview_file(io);
+	return io;
+}
+
+static void bench_kvnl_read_ndview_file(void * ctx)
+{
+	struct array_io * io = ctx;
+	lseek(io->fd, 0, SEEK_SET);
+	kvnl_ndview view = kvnl_read_ndview(io->fd, &io->reader, &io->read_buf, NULL);
+	bench_keep(view.view.data);
+}
+
+/* large sized records read into the line buffer (param 0), into picked memory (1), or past the page cache (2) */
+#define SIZED_RECORDS 16
+
+static struct view pick_array(void * ctx, struct view key, size_t size)
+{
+	(void)key;
+	struct array_io * io = ctx;
+	return size <= ARRAY_SIZE ? (struct view){ io->data, ARRAY_SIZE } : (struct view){ NULL, 0 };
+}
+
+static void * setup_sized_records_file(size_t mode)
+{
+	struct array_io * io = setup_array_file(mode);
+	if (io == NULL) return NULL;
+	for (size_t i = 0; i < SIZED_RECORDS; i++) {
+		if (kvnl_write_line(io->fd, "value", (struct view){ io->data, ARRAY_SIZE / SIZED_RECORDS }, 1, NULL, &io->fmt_buf) < 0) {
+			teardown_array_io(io);
+			return NULL;
+		}
+	}
+	if (mode >= 1) io->values = make_kvnl_value_reader(pick_array, io);
+	if (mode == 2) io->values.direct = 1;
+	return io;
+}
+
+static void bench_kvnl_read_sized_records_file(void * ctx)
+{
+	struct array_io * io = ctx;
+	lseek(io->fd, 0, SEEK_SET);
+	for (size_t i = 0; i < SIZED_RECORDS; i++) {
+		buf_clear(&io->read_buf);
+		kvnl_line line = kvnl_read_line_with(io->fd, &io->values, &io->read_buf, NULL);
+		bench_keep(line.value.data);
+	}
+}
+
+/* the sized records forwarded to another file, by relaying (param 1) or by reading and writing them (0) */
+static int route_to_pipe_fd(void * ctx, kvnl_line const * line)
+{
+	(void)line;
+	return ((struct array_io *)ctx)->pipe_fd;
+}
+
+static void * setup_sized_records_relay(size_t relay)
+{
+	struct array_io * io = setup_sized_records_file(0);
+	if (io == NULL) return NULL;
+	io->n_lines = relay;
+	io->pipe_fd = open_scratch_file();
+	if (io->pipe_fd < 0) { teardown_array_io(io); return NULL; }
+	return io;
+}
+
+static void bench_kvnl_forward_sized_records_file(void * ctx)
+{
+	struct array_io * io = ctx;
+	struct kvnl_relay relay = make_kvnl_relay(route_to_pipe_fd, io);
+	lseek(io->fd, 0, SEEK_SET);
+	lseek(io->pipe_fd, 0, SEEK_SET);
+	for (size_t i = 0; i < SIZED_RECORDS; i++) {
+		if (io->n_lines) {
+			kvnl_relay_line(io->fd, &relay, NULL);
+			continue;
+		}
+		buf_clear(&io->read_buf);
+		kvnl_line line = kvnl_read_line(io->fd, &io->read_buf, NULL);
+		kvnl_write_line(io->pipe_fd, "value", line.value, 1, NULL, &io->fmt_buf);
+	}
+	kvnl_relay_free(&relay);
+}
+
+/* the other end of the pipe: drains it, or keeps writing the blob into it, until it is closed */
+static void * drain_pipe(void * arg)
+{
+	int const fd = (intptr_t)arg;
+	static char sink[64 * KiB];
+	while (read(fd, sink, sizeof(sink)) > 0);
+	close(fd);
+	return NULL;
+}
+
+static void * feed_pipe(void * arg)
+{
+	struct array_io * io = arg;
+	int const fd = io->feed_fd;
+	for (;;) {
+		size_t offset = 0;
+		while (offset < io->blob.size) {
+			ssize_t n = write(fd, io->blob.data + offset, io->blob.size - offset);
+			if (n <= 0) { close(fd); return NULL; }
+			offset += n;
+		}
+	}
+}
+
+static void * setup_array_pipe(size_t param)
+{
+	struct array_io * io = setup_array_io(param);
+	if (io == NULL) return NULL;
+	int fds[2];
+	if (pipe(fds)) { teardown_array_io(io); return NULL; }
+	io->pipe_fd = fds[1];
+	if (pthread_create(&io->thread, NULL, drain_pipe, (void *)(intptr_t)fds[0])) {
+		close(fds[0]);
+		teardown_array_io(io);
+		return NULL;
+	}
+	io->has_thread = 1;
+	return io;
+}
+
+static void bench_kvnl_write_ndview_pipe(void * ctx)
+{
+	struct array_io * io = ctx;
+	struct ndview view = array_view(io);
+	kvnl_write_ndview_with(io->pipe_fd, &io->writer, &view, "<f8", sizeof(double), NULL, &io->fmt_buf);
+}
+
+/* a blob of records of the given size, endlessly fed into a pipe for kvnl_read_line() */
+static void * setup_lines_pipe(size_t value_size)
+{
+	struct array_io * io = setup_array_io(0);
+	if (io == NULL) return NULL;
+	io->n_lines = value_size < 1024 ? 1000 : 16;
+	if (buf_resize(&io->read_buf, value_size)) { teardown_array_io(io); return NULL; }
+	memset(io->read_buf.data, 'v', value_size);
+	for (size_t i = 0; i < io->n_lines; i++) {
+		char key[32];
+		snprintf(key, sizeof(key), "key%zu", i);
+		struct view value = { io->read_buf.data, value_size };
+		int sized = value_size >= 1024;
+		if (kvnl_encode_specification(key, sized ? (ssize_t)value_size : -1, &io->fmt_buf) < 0
+			|| buf_append(&io->blob, buf_view(&io->fmt_buf))
+			|| buf_append(&io->blob, (struct view){ "=", 1 })
+			|| buf_append(&io->blob, value)
+			|| buf_append(&io->blob, (struct view){ "\n", 1 })
+		) {
+			teardown_array_io(io);
+			return NULL;
+		}
+	}
+
+	int fds[2];
+	if (pipe(fds)) { teardown_array_io(io); return NULL; }
+	io->pipe_fd = fds[0];
+	io->feed_fd = fds[1];
+	if (pthread_create(&io->thread, NULL, feed_pipe, io)) {
+		close(fds[1]);
+		teardown_array_io(io);
+		return NULL;
+	}
+	io->has_thread = 1;
+	return io;
+}
+
+static void bench_kvnl_read_line_pipe(void * ctx)
+{
+	struct array_io * io = ctx;
+	for (size_t i = 0; i < io->n_lines; i++) {
+		buf_clear(&io->read_buf);
+		kvnl_line line = kvnl_read_line(io->pipe_fd, &io->read_buf, NULL);
+		bench_keep(line.value.data);
+	}
+}
+
+static void * setup_small_records(size_t param)
+{
+	struct array_io * io = setup_array_io(param);
+	if (io == NULL) return NULL;
+	int fds[2];
+	if (pipe(fds)) { teardown_array_io(io); return NULL; }
+	io->pipe_fd = fds[0];
+	io->fd = fds[1];
+	return io;
+}
+
+static void bench_kvnl_small_record_write(void * ctx)
+{
+	struct array_io * io = ctx;
+	lseek(io->fd, 0, SEEK_SET);
+	for (size_t i = 0; i < 1000; i++)
+		kvnl_write_line(io->fd, "temperature", view_str("21.5"), 0, NULL, &io->fmt_buf);
+}
+
+/* one record written into a pipe and read back out of it */
+static void bench_kvnl_small_record_latency(void * ctx)
+{
+	struct array_io * io = ctx;
+	kvnl_write_line(io->fd, "temperature", view_str("21.5"), 0, NULL, &io->fmt_buf);
+	buf_clear(&io->read_buf);
+	kvnl_line line = kvnl_read_line(io->pipe_fd, &io->read_buf, NULL);
+	bench_keep(line.value.data);
+}
+
+/* the same records, queued on an engine and flushed at the end */
+static void bench_kvnl_small_record_write_uring(void * ctx)
+{
+	struct array_io * io = ctx;
+	lseek(io->fd, 0, SEEK_SET);
+	struct kvnl_uring uring = make_kvnl_uring(io->fd, 0, 0);
+	for (size_t i = 0; i < 1000; i++)
+		kvnl_uring_write_line(&uring, "temperature", view_str("21.5"), 0, NULL, &io->fmt_buf);
+	kvnl_uring_flush(&uring);
+	kvnl_uring_free(&uring);
+}
+
+static void * setup_small_records_file(size_t param)
+{
+	struct array_io * io = setup_array_io(param);
+	if (io == NULL) return NULL;
+	io->fd = open_scratch_file();
+	if (io->fd < 0) { teardown_array_io(io); return NULL; }
+	return io;
+}
+
+
+/* a file of SCAN_RECORDS small records, scanned with param threads */
+#define SCAN_RECORDS (1024 * 1024)
+
+struct scan_io {
+	int fd;
+	size_t n_threads;
+};
+
+static void * setup_scan_file(size_t n_threads)
+{
+	struct scan_io * io = malloc(sizeof(*io));
+	if (io == NULL) return NULL;
+	io->n_threads = n_threads;
+	io->fd = open_scratch_file();
+	struct buf blob = NULL_BUF;
+	for (size_t i = 0; io->fd >= 0 && i < SCAN_RECORDS; i++) {
+		if (blob.size > MiB) {
+			if (write(io->fd, blob.data, blob.size) != (ssize_t)blob.size) break;
+			buf_clear(&blob);
+		}
+		char line[64];
+		int n = snprintf(line, sizeof(line), "sensor%zu=%zu.%zu\n", i % 64, i % 1000, i % 7);
+		buf_push(&blob, (struct view){ line, n });
+		if (i % 16 == 0) buf_push(&blob, view_str("blob:5=a\nb=c\n"));
+	}
+	if (io->fd < 0 || write(io->fd, blob.data, blob.size) != (ssize_t)blob.size) {
+		if (io->fd >= 0) close(io->fd);
+		free(io);
+		io = NULL;
+	}
+	if (!buf_is_null(&blob)) buf_free(&blob);
+	return io;
+}
+
+static void teardown_scan_file(void * ctx)
+{
+	struct scan_io * io = ctx;
+	close(io->fd);
+	free(io);
+}
+
+static int keep_record(void * state, kvnl_line const * line, off_t offset)
+{
+	(void)state;
+	(void)offset;
+	bench_keep(line->value.data);
+	return 0;
+}
+
+static void bench_kvnl_scan_file(void * ctx)
+{
+	struct scan_io * io = ctx;
+	struct kvnl_scanner scanner = { io->n_threads, 4 * MiB, NULL, NULL, keep_record, NULL, NULL, NULL };
+	kvnl_scan_result result = kvnl_scan(io->fd, &scanner);
+	bench_keep(&result);
+}
+
+/* the same file read sequentially, in blocks of up to param records */
+static void bench_kvnl_read_block_file(void * ctx)
+{
+	struct scan_io * io = ctx;
+	struct kvnl_block_reader reader = make_kvnl_block_reader(io->n_threads, 0);
+	lseek(io->fd, 0, SEEK_SET);
+	for (;;) {
+		kvnl_block block = kvnl_read_block(io->fd, &reader, NULL);
+		if (block.n_lines <= 0 || block.lines[block.n_lines - 1].error) break;
+		bench_keep(block.lines[block.n_lines - 1].value.data);
+	}
+	kvnl_block_reader_free(&reader);
+}
+
+static void bench_kvnl_read_block_file_uring(void * ctx)
+{
+	struct scan_io * io = ctx;
+	struct kvnl_block_reader reader = make_kvnl_block_reader(io->n_threads, 0);
+	lseek(io->fd, 0, SEEK_SET);
+	struct kvnl_uring uring = make_kvnl_uring(io->fd, 0, 0);
+	reader.uring = &uring;
+	for (;;) {
+		kvnl_block block = kvnl_read_block(io->fd, &reader, NULL);
+		if (block.n_lines <= 0 || block.lines[block.n_lines - 1].error) break;
+		bench_keep(block.lines[block.n_lines - 1].value.data);
+	}
+	kvnl_block_reader_free(&reader);
+	kvnl_uring_free(&uring);
+}
+
+/* dispatch: looking up the keys of DISPATCH_LOOKUPS records among param keys, with a table or one by one */
+#define DISPATCH_LOOKUPS 4096
+
+struct dispatch_keys {
+	struct kvnl_dispatch table;
+	size_t n_keys;
+	char names[DISPATCH_LOOKUPS][24];
+	size_t sizes[DISPATCH_LOOKUPS], lookups[DISPATCH_LOOKUPS];
+};
+
+static void * setup_dispatch(size_t n_keys)
+{
+	struct dispatch_keys * keys = malloc(sizeof(*keys));
+	if (keys == NULL) return NULL;
+	keys->table = make_kvnl_dispatch(NULL, NULL);
+	keys->n_keys = n_keys;
+	for (size_t i = 0; i < n_keys && i < DISPATCH_LOOKUPS; i++) {
+		keys->sizes[i] = snprintf(keys->names[i], sizeof(keys->names[i]), "sensor.%zu.value", i);
+		kvnl_dispatch_add(&keys->table, keys->names[i], NULL, NULL);
+	}
+	kvnl_dispatch_build(&keys->table);
+	for (size_t i = 0; i < DISPATCH_LOOKUPS; i++)
+		keys->lookups[i] = i * 7 % n_keys;
+	return keys;
+}
+
+static void teardown_dispatch(void * ctx)
+{
+	struct dispatch_keys * keys = ctx;
+	kvnl_dispatch_free(&keys->table);
+	free(keys);
+}
+
+static void bench_kvnl_dispatch_id(void * ctx)
+{
+	struct dispatch_keys * keys = ctx;
+	int sum = 0;
+	for (size_t i = 0; i < DISPATCH_LOOKUPS; i++) {
+		size_t const l = keys->lookups[i];
+		sum += kvnl_dispatch_id(&keys->table, (struct view){ keys->names[l], keys->sizes[l] });
+	}
+	bench_keep(&sum);
+}
+
+static void bench_kvnl_dispatch_chain(void * ctx)
+{
+	struct dispatch_keys * keys = ctx;
+	int sum = 0;
+	for (size_t i = 0; i < DISPATCH_LOOKUPS; i++) {
+		size_t const l = keys->lookups[i];
+		struct view const key = { keys->names[l], keys->sizes[l] };
+		for (size_t k = 0; k < keys->n_keys; k++)
+			if (view_equals(key, (struct view){ keys->names[k], keys->sizes[k] })) {
+				sum += k;
+				break;
+			}
+	}
+	bench_keep(&sum);
+}
+
+static struct bench const BENCHES[] = {
+	{ "buf_resize_grow", NULL, bench_buf_resize_grow, NULL, MiB, MiB, MiB / 64, 0 },
+	{ "buf_resize_grow_only", NULL, bench_buf_resize_grow_only, NULL, MiB, MiB, MiB / 64, 0 },
+	{ "buf_resize_grow_spill", NULL, bench_buf_resize_grow_spill, NULL, MiB, MiB, MiB / 64, 0 },
+	{ "buf_resize_oscillate", NULL, bench_buf_resize_oscillate, NULL, 64 * KiB, 0, 10000, 0 },
+	{ "buf_resize_oscillate_adaptive", NULL, bench_buf_resize_oscillate_adaptive, NULL, 64 * KiB, 0, 10000, 0 },
+	{ "buf_append", NULL, bench_buf_append, NULL, 16, MiB, MiB / 16, 0 },
+	{ "buf_push", NULL, bench_buf_push, NULL, 16, MiB, MiB / 16, 0 },
+	{ "buf_push_byte", NULL, bench_buf_push_byte, NULL, 1, MiB, MiB, 0 },
+	{ "buf_fanout", setup_fanout, bench_buf_fanout, teardown_fanout, 0, FANOUT * MiB, FANOUT, 0 },
+	{ "buf_fanout_shared", setup_fanout, bench_buf_fanout, teardown_fanout, 1, FANOUT * MiB, FANOUT, 0 },
+	{ "buf_printf_into", setup_buf, bench_buf_printf_into, teardown_buf, 0, 0, 10000, 0 },
+	{ "buf_appendf", setup_buf, bench_buf_appendf, teardown_buf, 0, 0, 10000, 0 },
+	{ "buf_append_number", setup_buf, bench_buf_append_number, teardown_buf, 0, 0, 10000, 0 },
+	{ "view_contains", setup_haystack, bench_view_contains, free, MiB, MiB, 0, 0 },
+	{ "view_fill", setup_fill, bench_view_fill, teardown_fill, 8, FILL_SIZE, 0, 0 },
+	{ "view_fill", setup_fill, bench_view_fill, teardown_fill, 24, FILL_SIZE, 0, 0 },
+	{ "ndview_get", setup_cube, bench_ndview_get, free, CUBE, CUBE * CUBE * CUBE * sizeof(double), CUBE * CUBE * CUBE, 0 },
+	{ "ndview_traverse", setup_cube, bench_ndview_traverse, free, CUBE, CUBE * CUBE * CUBE / 2 * sizeof(double), CUBE * CUBE * CUBE / 2, 0 },
+	{ "ndview_take", setup_take, bench_ndview_take, teardown_take, 1, TAKE_INDICES * sizeof(double), TAKE_INDICES, 0 },
+	{ "expr_steps", setup_expr, bench_expr_steps, teardown_expr, 1, EXPR_ROWS * sizeof(float), EXPR_ROWS, 0 },
+	{ "expr_eval", setup_expr, bench_expr_eval, teardown_expr, 1, EXPR_ROWS * sizeof(float), EXPR_ROWS, 0 },
+	{ "kvnl_write_ndview_file", setup_array_file, bench_kvnl_write_ndview_file, teardown_array_io, ARRAY_SIZE, ARRAY_SIZE, 1, 0 },
+	{ "kvnl_write_ndview_file_lz", setup_array_file_lz, bench_kvnl_write_ndview_file, teardown_array_io, ARRAY_SIZE, ARRAY_SIZE, 1, 0 },
+	{ "kvnl_read_ndview_file", setup_array_file_written, bench_kvnl_read_ndview_file, teardown_array_io, ARRAY_SIZE, ARRAY_SIZE, 1, 0 },
+	{ "kvnl_read_sized_records_file", setup_sized_records_file, bench_kvnl_read_sized_records_file, teardown_array_io, 0, ARRAY_SIZE, SIZED_RECORDS, 0 },
+	{ "kvnl_read_sized_records_file_picked", setup_sized_records_file, bench_kvnl_read_sized_records_file, teardown_array_io, 1, ARRAY_SIZE, SIZED_RECORDS, 0 },
+	{ "kvnl_read_sized_records_file_direct", setup_sized_records_file, bench_kvnl_read_sized_records_file, teardown_array_io, 2, ARRAY_SIZE, SIZED_RECORDS, 0 },
+	{ "kvnl_forward_sized_records_file", setup_sized_records_relay, bench_kvnl_forward_sized_records_file, teardown_array_io, 0, ARRAY_SIZE, SIZED_RECORDS, 0 },
+	{ "kvnl_forward_sized_records_file_relay", setup_sized_records_relay, bench_kvnl_forward_sized_records_file, teardown_array_io, 1, ARRAY_SIZE, SIZED_RECORDS, 0 },
+	{ "kvnl_write_ndview_pipe", setup_array_pipe, bench_kvnl_write_ndview_pipe, teardown_array_io, ARRAY_SIZE, ARRAY_SIZE, 1, 0 },
+	{ "kvnl_read_line_pipe_small", setup_lines_pipe, bench_kvnl_read_line_pipe, teardown_array_io, 16, 0, 1000, 0 },
+	{ "kvnl_read_line_pipe_large", setup_lines_pipe, bench_kvnl_read_line_pipe, teardown_array_io, 256 * KiB, 16 * 256 * KiB, 16, 0 },
+	{ "kvnl_small_record_write_file", setup_small_records_file, bench_kvnl_small_record_write, teardown_array_io, 0, 0, 1000, 0 },
+	{ "kvnl_small_record_write_file_uring", setup_small_records_file, bench_kvnl_small_record_write_uring, teardown_array_io, 0, 0, 1000, 0 },
+	{ "kvnl_scan_file", setup_scan_file, bench_kvnl_scan_file, teardown_scan_file, 1, 0, SCAN_RECORDS + SCAN_RECORDS / 16, 0 },
+	{ "kvnl_scan_file", setup_scan_file, bench_kvnl_scan_file, teardown_scan_file, 4, 0, SCAN_RECORDS + SCAN_RECORDS / 16, 0 },
+	{ "kvnl_read_block_file", setup_scan_file, bench_kvnl_read_block_file, teardown_scan_file, 64, 0, SCAN_RECORDS + SCAN_RECORDS / 16, 0 },
+	{ "kvnl_read_block_file", setup_scan_file, bench_kvnl_read_block_file, teardown_scan_file, 1024, 0, SCAN_RECORDS + SCAN_RECORDS / 16, 0 },
+	{ "kvnl_read_block_file_uring", setup_scan_file, bench_kvnl_read_block_file_uring, teardown_scan_file, 1024, 0, SCAN_RECORDS + SCAN_RECORDS / 16, 0 },
+	{ "kvnl_dispatch_id", setup_dispatch, bench_kvnl_dispatch_id, teardown_dispatch, 8, 0, DISPATCH_LOOKUPS, 0 },
+	{ "kvnl_dispatch_id", setup_dispatch, bench_kvnl_dispatch_id, teardown_dispatch, 64, 0, DISPATCH_LOOKUPS, 0 },
+	{ "kvnl_dispatch_chain", setup_dispatch, bench_kvnl_dispatch_chain, teardown_dispatch, 8, 0, DISPATCH_LOOKUPS, 0 },
+	{ "kvnl_dispatch_chain", setup_dispatch, bench_kvnl_dispatch_chain, teardown_dispatch, 64, 0, DISPATCH_LOOKUPS, 0 },
+	{ "kvnl_small_record_latency", setup_small_records, bench_kvnl_small_record_latency, teardown_array_io, 0, 0, 1, 10000 },
+};
+
+int main(int argc, char ** argv)
+{
+	/* the feeding threads learn that the benchmark is over from EPIPE */
+	signal(SIGPIPE, SIG_IGN);
+	return bench_main(argc, argv, BENCHES, sizeof(BENCHES) / sizeof(*BENCHES));
+}
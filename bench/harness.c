@@ -0,0 +1,189 @@
+#include "harness.h"
+#include <instr.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+enum bench_format {
+	BENCH_CSV,
+	BENCH_JSON,
+};
+
+struct bench_options {
+	enum bench_format format;
+	size_t reps, warmup;
+	int list;
+	char ** filters;
+	size_t n_filters;
+};
+
+struct bench_result {
+	size_t reps;
+	double min, mean, p50, p90, p99, max;
+	struct instr_snapshot instr;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int compare_u64(void const * a, void const * b)
+{
+	uint64_t const x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+	return (x > y) - (x < y);
+}
+
+/* nearest rank on sorted samples */
+static double percentile(uint64_t const * sorted, size_t n, double p)
+{
+	size_t rank = (size_t)(p / 100.0 * n + 0.999999);
+	if (rank < 1) rank = 1;
+	if (rank > n) rank = n;
+	return sorted[rank - 1];
+}
+
+static int bench_selected(struct bench const * bench, struct bench_options const * options)
+{
+	if (options->n_filters == 0) return 1;
+	for (size_t i = 0; i < options->n_filters; i++)
+		if (strstr(bench->name, options->filters[i]) != NULL) return 1;
+	return 0;
+}
+
+static int bench_measure(struct bench const * bench, struct bench_options const * options, struct bench_result * result)
+{
+	void * ctx = bench->setup ? bench->setup(bench->param) : NULL;
+	if (bench->setup && ctx == NULL) return -1;
+
+	size_t const reps = options->reps > bench->min_reps ? options->reps : bench->min_reps;
+	uint64_t * samples = malloc(reps * sizeof(*samples));
+	if (samples == NULL) {
+		if (bench->teardown) bench->teardown(ctx);
+		return -1;
+	}
+
+	for (size_t i = 0; i < options->warmup; i++) bench->run(ctx);
+	struct instr_snapshot before, after;
+	instr_snapshot(&before);
+	for (size_t i = 0; i < reps; i++) {
+		uint64_t const start = now_ns();
+		bench->run(ctx);
+		samples[i] = now_ns() - start;
+	}
+	instr_snapshot(&after);
+	if (bench->teardown) bench->teardown(ctx);
+
+	qsort(samples, reps, sizeof(*samples), compare_u64);
+	double sum = 0;
+	for (size_t i = 0; i < reps; i++) sum += samples[i];
+	*result = (struct bench_result){
+		.reps = reps,
+		.min = samples[0],
+		.mean = sum / reps,
+		.p50 = percentile(samples, reps, 50),
+		.p90 = percentile(samples, reps, 90),
+		.p99 = percentile(samples, reps, 99),
+		.max = samples[reps - 1],
+	};
+	instr_snapshot_diff(&after, &before, &result->instr);
+	free(samples);
+	return 0;
+}
+
+static void bench_report(
+	struct bench const * bench, struct bench_options const * options,
+	struct bench_result const * r, int first
+)
+{
+	double const mb_per_s = bench->bytes ? bench->bytes / r->p50 * 1e9 / 1e6 : 0;
+	double const ns_per_item = bench->items ? r->p50 / bench->items : 0;
+	if (options->format == BENCH_CSV) {
+		printf(
+			"%s,%zu,%zu,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%.2f,%.3f\n",
+			bench->name, bench->param, r->reps,
+			r->min, r->mean, r->p50, r->p90, r->p99, r->max, mb_per_s, ns_per_item
+		);
+	}
+	else {
+		printf(
+			"%s\n    {\"name\": \"%s\", \"param\": %zu, \"reps\": %zu, "
+			"\"min_ns\": %.0f, \"mean_ns\": %.0f, \"p50_ns\": %.0f, \"p90_ns\": %.0f, "
+			"\"p99_ns\": %.0f, \"max_ns\": %.0f, \"mb_per_s\": %.2f, \"ns_per_item\": %.3f",
+			first ? "" : ",", bench->name, bench->param, r->reps,
+			r->min, r->mean, r->p50, r->p90, r->p99, r->max, mb_per_s, ns_per_item
+		);
+		/* instrumented builds also tell what one repetition costs */
+		if (INSTR_ENABLED) {
+			fputs(", \"per_rep\": {", stdout);
+			for (size_t i = 0; i < INSTR_NUMBER_OF_COUNTERS; i++)
+				printf("%s\"%s\": %.1f", i ? ", " : "", INSTR_COUNTER_NAMES[i], (double)r->instr.counters[i] / r->reps);
+			fputs("}", stdout);
+		}
+		fputs("}", stdout);
+	}
+	fflush(stdout);
+}
+
+static int parse_options(int argc, char ** argv, struct bench_options * options)
+{
+	*options = (struct bench_options){ BENCH_CSV, 30, 3, 0, NULL, 0 };
+	options->filters = argv + 1;
+	for (int i = 1; i < argc; i++) {
+		char * end;
+		if (!strcmp(argv[i], "--csv")) options->format = BENCH_CSV;
+		else if (!strcmp(argv[i], "--json")) options->format = BENCH_JSON;
+		else if (!strcmp(argv[i], "--list")) options->list = 1;
+		else if ((!strcmp(argv[i], "--reps") || !strcmp(argv[i], "--warmup")) && i + 1 < argc) {
+			size_t n = strtoul(argv[i + 1], &end, 10);
+			if (*end != '\0' || (n == 0 && argv[i][2] == 'r')) return -1;
+			if (argv[i][2] == 'r') options->reps = n; else options->warmup = n;
+			i++;
+		}
+		else if (argv[i][0] == '-') return -1;
+		else options->filters[options->n_filters++] = argv[i];
+	}
+	return 0;
+}
+
+int bench_main(int argc, char ** argv, struct bench const * benches, size_t count)
+{
+	struct bench_options options;
+	if (parse_options(argc, argv, &options)) {
+		fprintf(stderr, "usage: %s [--csv | --json] [--reps N] [--warmup N] [--list] [name filter ...]\n", argv[0]);
+		return 2;
+	}
+
+	if (options.list) {
+		for (size_t i = 0; i < count; i++)
+			if (bench_selected(&benches[i], &options)) puts(benches[i].name);
+		return 0;
+	}
+
+	if (options.format == BENCH_CSV)
+		puts("name,param,reps,min_ns,mean_ns,p50_ns,p90_ns,p99_ns,max_ns,mb_per_s,ns_per_item");
+	else
+		printf(
+			"{\"compiler\": \"%s\", \"reps\": %zu, \"warmup\": %zu, \"results\": [",
+			__VERSION__, options.reps, options.warmup
+		);
+
+	int status = 0, first = 1;
+	for (size_t i = 0; i < count; i++) {
+		if (!bench_selected(&benches[i], &options)) continue;
+		struct bench_result result;
+		if (bench_measure(&benches[i], &options, &result)) {
+			fprintf(stderr, "%s: skipped, setup failed\n", benches[i].name);
+			status = 1;
+			continue;
+		}
+		bench_report(&benches[i], &options, &result, first);
+		first = 0;
+	}
+
+	if (options.format == BENCH_JSON) puts("\n]}");
+	return status;
+}
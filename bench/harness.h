@@ -0,0 +1,57 @@
+#ifndef __HARNESS_H__
+#define __HARNESS_H__
+#include <stdio.h>
+#include <stddef.h>
+
+/**
+ * harness - a small benchmark harness with machine-readable results
+ *
+ * A struct bench describes one benchmark:
+ *  - name: used to pick benchmarks and to tell the results apart
+ *  - setup(param): returns the context for run() and teardown(), or NULL if
+ *                  the benchmark can't run here (it is then skipped)
+ *  - run(ctx): one repetition, which is timed as a whole
+ *  - teardown(ctx): frees the context
+ *  - param: passed to setup() and reported, say the size of the data
+ *  - bytes, items: the work done by one repetition, for the throughput and
+ *                  the time per item (0 when not meaningful)
+ *  - min_reps: at least this many timed repetitions, for benchmarks with
+ *              short repetitions whose tail latencies matter
+ *
+ * bench_main(argc, argv, benches, count) runs the benchmarks whose names
+ * contain any of the non-option arguments (or all of them), each with some
+ * untimed warmup repetitions followed by the timed ones, and prints a CSV
+ * row or a JSON object per benchmark to stdout. Options:
+ *  - --csv (the default) or --json
+ *  - --reps N: the number of timed repetitions (default 30)
+ *  - --warmup N: the number of untimed repetitions (default 3)
+ *  - --list: only print the names
+ *
+ * Every result holds the minimum, mean, 50th, 90th and 99th percentile and
+ * maximum time of a repetition in nanoseconds, and the throughput at the
+ * median. Comparing two builds is a matter of joining their results on the
+ * name and param. Built with INSTRUMENT, the JSON results also hold the
+ * counters of inc/instr.h per repetition.
+ *
+ * bench_keep(ptr) keeps the compiler from optimizing away whatever produced
+ * the memory at ptr.
+ */
+
+struct bench {
+	char const * name;
+	void * (*setup)(size_t param);
+	void (*run)(void * ctx);
+	void (*teardown)(void * ctx);
+	size_t param;
+	size_t bytes, items;
+	size_t min_reps;
+};
+
+static inline void bench_keep(void const * ptr)
+{
+	__asm__ volatile("" : : "g"(ptr) : "memory");
+}
+
+int bench_main(int argc, char ** argv, struct bench const * benches, size_t count);
+
+#endif//__HARNESS_H__
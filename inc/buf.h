@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 
 /**
  * buf - simple memory allocation library
@@ -14,6 +15,12 @@
  *  - under: when size drops below (under * capacity), shrink the allocation
  *  - over: when reallocation, allocate (over * size) bytes
  *  - policy: the policy for exactly how much to allocate
+ *  - align: if not zero, the alignment of the data, a power of two
+ *  - stats: how many times the buffer was resized, and how many of those
+ *           allocated, grew or shrank it (see struct buf_stats)
+ *  - spill: if not zero, the data moves to a file past the memory budget
+ *  - mapped, fd: whether it has, and the file
+ * The remaining members are bookkeeping for buf_resize().
  *
  * The policy can be one of:
  *  - BUF_ALLOC_AUTO: BUF_ALLOC_WORD for sizes less than a page,
@@ -21,6 +28,13 @@
  *  - BUF_ALLOC_WORD: round up the capacity to the nearest word
  *  - BUF_ALLOC_PAGE: round up the capacity to the nearest page
  *  - BUF_ALLOC_EXACT: don't round
+ *  - BUF_ALLOC_ADAPTIVE: ignore under and over; grow to the next size class
+ *                        (a quarter of a power of two, or whole pages),
+ *                        and only shrink after the size has stayed well
+ *                        below the capacity for BUF_SHRINK_AFTER resizes,
+ *                        down to the class of a slowly decaying high-water
+ *                        mark of the size. Suits scratch buffers whose size
+ *                        jumps around from message to message.
  * Regardless of the policy and other parameters, at least 1 byte will be
  *
  * A special immutable buffer NULL_BUF has the first three of these zeroed,
@@ -42,6 +56,13 @@
  *                                   aren't sensible values and sets errno=EINVAL
  *  - make_buf_dynamic(under, over): same as above, but sets policy to BUF_ALLOC_AUTO
  *  - make_buf_grow_only(over): same as above, but sets under to 0.0
+ *  - make_buf_adaptive(): same as NULL_BUF, but with BUF_ALLOC_ADAPTIVE
+ *  - make_buf_aligned(align): same as NULL_BUF, but the data will always be
+ *                             aligned to align bytes, and the capacity
+ *                             rounded up to a multiple of it (useful for
+ *                             data that SIMD code works on)
+ *  - make_buf_spill(): same as NULL_BUF, but the buffer spills to disk when
+ *                      it would go over the memory budget (see below)
  *
  *
  * All other functions take a (struct buf *) or a (struct buf const *) as their
@@ -60,7 +81,25 @@
  * Subsequent calls may or may not reallocate memory. If the requested size is
  * larger than the current size, but less than the capacity, the size field is
  * simply increased without reallocating. If the requested size is less than
- * (under * capacity), we reallocate to shrink the size.
+ * (under * capacity), we reallocate to shrink the size. That threshold is
+ * worked out whenever the buffer is reallocated, so changing under only takes
+ * effect from the next reallocation on.
+ * Aligned buffers are moved to memory from posix_memalign() instead of being
+ * reallocated, so buf_resize_with() only uses its function for the others.
+ *
+ * Spilling buffers share one memory budget for the whole process, set with
+ * buf_set_memory_budget(bytes) (unlimited to begin with): their heap memory is
+ * charged to it, and one that would take the total past it moves into a
+ * temporary file (O_TMPFILE in $TMPDIR or /tmp) that is mapped into memory.
+ * The data is still in one piece, so views of it work as usual, but under
+ * memory pressure the kernel writes its pages back to the file rather than
+ * pushing everything else into swap. Once in a file, a buffer stays there
+ * until it is freed; resizing it resizes the file (reserving the disk space
+ * up front, so a full disk is an error rather than a SIGBUS) and remaps it.
+ * buf_memory_in_use() returns how much heap memory spilling buffers hold.
+ * Set spill on a buffer from any other make_buf*() to have it spill too. The
+ * functions given to buf_resize_with() and buf_free_with() aren't used for
+ * buffers in a file.
  *
  * buf_free(buf) frees an allocated buffer
  * Arguments:
@@ -70,6 +109,9 @@
  * If the user thinks freeing is still a good idea in case of an error,
  * free(buf->data) is always an option, but there's probably a bug somewhere.
  *
+ * buf_clear(buf) sets the size to zero without giving any memory back, so the
+ * buffer can be refilled without reallocating
+ *
  *
  * The following compare bufs in certain ways:
  *
@@ -99,6 +141,75 @@
  * buf_view(buf): creates a view from buf and returns it. For better or worse
  *                there's not validity check on the buffer here
  *
+ * view_fill(dst, src): fills dst with copies of src, whose size must divide
+ *                      the size of dst (EINVAL otherwise). Patterns of 1, 2,
+ *                      4, 8, 16 or 32 bytes are stored a vector at a time;
+ *                      others are copied once, and then what is filled so far
+ *                      is copied after itself, doubling it up to
+ *                      VIEW_FILL_BLOCK. Vector stores of fills of at least
+ *                      VIEW_FILL_STREAM bytes go around the cache, so that
+ *                      initializing a huge array doesn't evict everything else.
+ * view_fill_threads(dst, src, n_threads): the same, split among up to
+ *                                         n_threads threads, each of which
+ *                                         gets at least VIEW_FILL_THREAD_CHUNK
+ *                                         bytes (a single one if src overlaps
+ *                                         dst)
+ * view_copy(dst, src): copies src to dst, which must be the same size
+ *
+ *
+ * Filling a buffer piece by piece is done with these, which are inline: when
+ * the data fits into the capacity they amount to a bounds check and a memcpy,
+ * and they don't touch errno. Otherwise buf_grow() reallocates out of line.
+ * The data pushed must not be inside the buffer itself.
+ *
+ * buf_grow(buf, capacity): makes room for at least capacity bytes, keeping the
+ *                          size and the data (buf_resize() decides how much)
+ * buf_reserve(buf, extra): makes room for extra bytes more than the size
+ * buf_push(buf, view): appends the data of view
+ * buf_push_byte(buf, byte): appends a single byte
+ * buf_push_value(buf, value): appends the bytes of value, say an int or a
+ *                             struct
+ * buf_append(buf, view) is the same as buf_push(), but out of line and setting
+ * errno like everything else.
+ *
+ * Text is appended with these, which format straight into the room left in
+ * the capacity and grow the buffer at most once:
+ *  - buf_appendf(buf, fmt, ...), buf_vappendf(buf, fmt, args): like printf();
+ *    they return the number of bytes appended, or -1 and set errno. The size
+ *    doesn't count the NUL, but there is one after the data until the next
+ *    change to the buffer.
+ *  - buf_append_int(buf, n), buf_append_uint(buf, n): n in decimal
+ *  - buf_append_double(buf, x): the shortest decimal that reads back as x,
+ *                               written like repr() in Python (1.5, 1e+100,
+ *                               0.0001, -0.0, inf, nan)
+ * The last three don't go through printf() at all, and return 0 or an errno
+ * value like buf_append(). buf_printf_into(buf, fmt, ...) on the other hand
+ * replaces the data with the formatted string, counting its NUL in the size.
+ *
+ *
+ * Handing the data of a buffer to several consumers, say threads, without
+ * copying it for each of them goes through a frozen buffer: a struct
+ * buf_shared that owns the memory and counts references to it atomically.
+ *
+ * buf_freeze(buf): moves the memory of buf into a new frozen buffer holding
+ *                  one reference, and leaves buf empty (with the same
+ *                  parameters) to be filled again; NULL on failure
+ * buf_freeze_with(buf, extra): the same, with extra bytes of aligned memory
+ *                              that live as long as the data, found with
+ *                              buf_shared_extra(shared)
+ * buf_shared_ref(shared): takes another reference, and returns shared
+ * buf_shared_unref(shared): drops a reference; the last one frees the memory
+ * buf_shared_view(shared): the data, which must not be changed from then on
+ * buf_shared_refs(shared): how many references there are
+ *
+ * A struct view_ref is a view that holds a reference, so the memory stays
+ * around until it is released, however long the buffer it came from is gone:
+ *  - view_ref(owner, view): a reference for a view of (part of) the data of
+ *                           owner; a view outside of it is an error (EINVAL)
+ *  - view_ref_release(ref): drops the reference
+ * Pointers into the data stay the same through freezing, so views taken from
+ * the buffer (like keys and values read into it) can be handed out as they
+ * are. See ndview_freeze() for arrays.
  */
 
 typedef void * (*realloc_func)(void *, size_t);
@@ -109,7 +220,15 @@ enum buf_alloc_policy {
 	BUF_ALLOC_WORD = 1,
 	BUF_ALLOC_PAGE = 2,
 	BUF_ALLOC_EXACT = 3,
-	BUF_ALLOC_INVALID = 4,
+	BUF_ALLOC_ADAPTIVE = 4,
+	BUF_ALLOC_INVALID = 5,
+};
+
+/* an adaptive buffer shrinks after this many resizes in a row to under a quarter of its capacity */
+#define BUF_SHRINK_AFTER 64
+
+struct buf_stats {
+	size_t resizes, allocs, grows, shrinks;
 };
 
 struct buf {
@@ -117,6 +236,10 @@ struct buf {
 	size_t size, capacity;
 	float under, over;
 	enum buf_alloc_policy policy;
+	size_t align;
+	int spill, mapped, fd;
+	struct buf_stats stats;
+	size_t shrink_below, high_water, low_streak;
 };
 
 extern struct buf const NULL_BUF;
@@ -127,11 +250,18 @@ struct buf make_buf_exact(void);
 struct buf make_buf(float under, float over, enum buf_alloc_policy policy);
 struct buf make_buf_dynamic(float under, float over);
 struct buf make_buf_grow_only(float over);
+struct buf make_buf_adaptive(void);
+struct buf make_buf_aligned(size_t align);
+struct buf make_buf_spill(void);
+
+int buf_set_memory_budget(size_t budget);
+size_t buf_memory_in_use(void);
 
 int buf_resize_with(struct buf *, size_t, realloc_func);
 int buf_resize(struct buf *, size_t);
 int buf_free_with(struct buf * ptr, free_func);
 int buf_free(struct buf * ptr);
+int buf_clear(struct buf * ptr);
 
 int buf_equal(struct buf const *, struct buf const *);
 int buf_exactly_equal(struct buf const *, struct buf const *);
@@ -143,10 +273,15 @@ int buf_print(struct buf const *);
 
 struct view { void * const data; size_t const size; };
 
+#define VIEW_FILL_BLOCK (64 * 1024)
+#define VIEW_FILL_STREAM (16 * 1024 * 1024)
+#define VIEW_FILL_THREAD_CHUNK (64 * 1024 * 1024)
+
 struct view buf_view(struct buf const *);
 
 struct view make_view(void * const data, size_t const size);
 int view_fill(struct view, struct view);
+int view_fill_threads(struct view, struct view, size_t n_threads);
 int view_copy(struct view, struct view);
 struct view view_partial(struct view, size_t, size_t);
 
@@ -162,13 +297,63 @@ struct view view_partial(struct view, size_t, size_t);
 } while (0)
 
 int buf_append(struct buf *, struct view);
+int buf_grow(struct buf *, size_t capacity);
+
+static inline int buf_reserve(struct buf * buf, size_t extra)
+{
+	if (__builtin_expect(buf->size + extra <= buf->capacity, 1)) return 0;
+	return buf_grow(buf, buf->size + extra);
+}
+
+static inline int buf_push(struct buf * buf, struct view view)
+{
+	size_t const size = buf->size + view.size;
+	if (__builtin_expect(size > buf->capacity, 0) && buf_grow(buf, size)) return -1;
+	if (view.size) memcpy((char *)buf->data + buf->size, view.data, view.size);
+	buf->size = size;
+	return 0;
+}
+
+static inline int buf_push_byte(struct buf * buf, unsigned char byte)
+{
+	if (__builtin_expect(buf->size >= buf->capacity, 0) && buf_grow(buf, buf->size + 1)) return -1;
+	((unsigned char *)buf->data)[buf->size++] = byte;
+	return 0;
+}
+
+#define buf_push_value(buf, value) ({ \
+	__typeof__(value) __value = (value); \
+	buf_push((buf), (struct view){ (void *)&__value, sizeof(__value) }); \
+})
 
 struct view view_str(char *);
 
+struct buf_shared;
+
+struct view_ref {
+	struct view view;
+	struct buf_shared * owner;
+};
+
+struct buf_shared * buf_freeze(struct buf *);
+struct buf_shared * buf_freeze_with(struct buf *, size_t extra);
+struct buf_shared * buf_shared_ref(struct buf_shared *);
+int buf_shared_unref(struct buf_shared *);
+size_t buf_shared_refs(struct buf_shared const *);
+struct view buf_shared_view(struct buf_shared const *);
+void * buf_shared_extra(struct buf_shared *);
+struct view_ref view_ref(struct buf_shared * owner, struct view view);
+int view_ref_release(struct view_ref *);
+
 int view_equals(struct view, struct view);
 int view_contains(struct view, struct view);
 struct view view_difference(struct view, struct view);
 
 int buf_printf_into(struct buf * buf, char const * fmt, ...);
+int buf_appendf(struct buf * buf, char const * fmt, ...);
+int buf_vappendf(struct buf * buf, char const * fmt, va_list args);
+int buf_append_int(struct buf * buf, long long n);
+int buf_append_uint(struct buf * buf, unsigned long long n);
+int buf_append_double(struct buf * buf, double x);
 
 #endif//__BUF_H__
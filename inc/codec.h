@@ -0,0 +1,84 @@
+#ifndef __CODEC_H__
+#define __CODEC_H__
+#include <stdint.h>
+#include <buf.h>
+
+/**
+ * codec - filters and compression for array payloads
+ *
+ * A struct codec describes how dense array data is encoded, row-major (or
+ * column-major, with the axes taken in reverse). The stages run in this order
+ * when encoding (and in reverse when decoding):
+ *  - delta: every row along the leading axis is replaced by its difference to
+ *           the previous row, elementwise, as unsigned integers of elem_size
+ *           bytes (so it is lossless for floats as well)
+ *  - shuffle: CODEC_SHUFFLE_BYTE groups the k-th byte of every element
+ *             together, CODEC_SHUFFLE_BIT then also groups the k-th bit of
+ *             those bytes together
+ *  - lz: LZ77 compression in the LZ4 block layout
+ *
+ * The data is split into chunks of whole rows, about chunk_size bytes each.
+ * Every chunk is encoded independently (the delta restarts at every chunk), so
+ * chunks are encoded and decoded by up to n_threads threads at once.
+ *
+ * codec_encode(codec, src, row_size, dst, chunk_sizes) encodes src, a whole
+ * number of rows of row_size bytes, into dst, and stores the encoded size of
+ * every chunk as a size_t in chunk_sizes.
+ *
+ * codec_decode(codec, src, chunk_sizes, n_chunks, row_size, dst) decodes
+ * straight into dst, which must be exactly the size of the original data.
+ *
+ * codec_is_identity(codec) is true if encoding would not change the data.
+ *
+ * codec_snprint_filters(codec, str, size) formats the filter names, as
+ * understood by codec_parse_filter(), each preceded by a space, like
+ * snprintf().
+ */
+
+enum codec_shuffle {
+	CODEC_SHUFFLE_NONE = 0,
+	CODEC_SHUFFLE_BYTE = 1,
+	CODEC_SHUFFLE_BIT = 2,
+};
+
+struct codec {
+	int delta;
+	enum codec_shuffle shuffle;
+	int lz;
+	size_t elem_size;
+	size_t chunk_size;
+	size_t n_threads;
+};
+
+#define CODEC_DEFAULT_CHUNK_SIZE (256 * 1024)
+
+extern struct codec const IDENTITY_CODEC;
+
+int codec_is_identity(struct codec const *);
+size_t codec_chunk_rows(struct codec const *, size_t row_size);
+size_t codec_n_chunks(struct codec const *, size_t size, size_t row_size);
+
+int codec_encode(
+	struct codec const * codec,
+	struct view src,
+	size_t row_size,
+	struct buf * dst,
+	struct buf * chunk_sizes
+);
+int codec_decode(
+	struct codec const * codec,
+	struct view src,
+	size_t const * chunk_sizes,
+	size_t n_chunks,
+	size_t row_size,
+	struct view dst
+);
+
+int codec_parse_filter(struct codec *, struct view name);
+int codec_snprint_filters(struct codec const *, char * str, size_t size);
+
+size_t lz_bound(size_t size);
+size_t lz_compress(struct view dst, struct view src);
+ssize_t lz_decompress(struct view dst, struct view src);
+
+#endif//__CODEC_H__
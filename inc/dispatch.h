@@ -0,0 +1,77 @@
+#ifndef __DISPATCH_H__
+#define __DISPATCH_H__
+#include <stdint.h>
+#include <kvnl.h>
+
+/**
+ * dispatch - calling a handler per kvnl record key
+ *
+ * A dispatch table maps keys to handlers, so that consumers don't compare
+ * every key they know against every record they read.
+ *
+ * kvnl_dispatch_add(table, key, handler, ctx) registers a key and returns its
+ * id, the number of keys registered before it, or -1 with errno set (EEXIST
+ * for a key that is already there). A NULL handler only interns the key.
+ *
+ * kvnl_dispatch_build(table) builds a perfect hash of the keys, by hashing and
+ * displacing: every key hashes into a bucket of a few keys, and every bucket
+ * gets a displacement that moves all of its keys into free slots. Looking a
+ * key up then takes one hash, two loads and one comparison, however many keys
+ * there are. Adding keys afterwards needs building again, which
+ * kvnl_dispatch_line() does by itself.
+ *
+ * That only pays off for larger sets of keys, as hashing a key costs more than
+ * comparing it to a few others: at 8 keys, an id takes 35 ns against 27 ns for
+ * a chain of ifs, while at 64 keys it still takes 35 ns against 174 (see
+ * bench/bench.c). With a handful of keys, comparing them in turn is faster.
+ *
+ * kvnl_dispatch_id(table, key) returns the id of a key, or -1 if it isn't
+ * registered (or the table isn't built).
+ *
+ * kvnl_dispatch_line(fd, table, buf, hash) reads the specification of the
+ * next record and hands the rest of it to the handler of its key, which reads
+ * the value with kvnl_read_value(), or skips it with kvnl_skip_value(), or
+ * reads it some other way:
+ *  - handler(ctx, id, fd, spec, buf, hash): returns the line it read, which
+ *                                           kvnl_dispatch_line() returns
+ * Records whose keys have no handler go to the fallback with their id (-1 if
+ * the key isn't registered), or are skipped without one. Empty lines and
+ * errors reading the specification are returned right away, and a checksum
+ * record is read along with the record it covers, which is dispatched and then
+ * verified (so the handler has seen the record by the time a mismatch is
+ * known).
+ *
+ * kvnl_dispatch_free(table) frees the memory of the table.
+ */
+
+typedef kvnl_line (*kvnl_handler)(void * ctx, int id, int fd, kvnl_specification spec, struct buf * buf, kvnl_hash * hash);
+
+struct kvnl_dispatch_entry {
+	size_t key_offset, key_size;
+	uint64_t hash;
+	kvnl_handler handler;
+	void * ctx;
+};
+
+struct kvnl_dispatch {
+	kvnl_handler fallback;
+	void * fallback_ctx;
+	struct buf keys, entries;
+	struct buf slots, displacements;
+	size_t n_keys, n_slots, n_buckets;
+	uint64_t seed;
+	int built;
+};
+
+/* keys per bucket, and how many displacements are tried before changing the seed */
+#define KVNL_DISPATCH_BUCKET 4
+#define KVNL_DISPATCH_TRIES 4096
+
+struct kvnl_dispatch make_kvnl_dispatch(kvnl_handler fallback, void * fallback_ctx);
+int kvnl_dispatch_free(struct kvnl_dispatch *);
+int kvnl_dispatch_add(struct kvnl_dispatch * table, char const * key, kvnl_handler handler, void * ctx);
+int kvnl_dispatch_build(struct kvnl_dispatch * table);
+int kvnl_dispatch_id(struct kvnl_dispatch const * table, struct view key);
+kvnl_line kvnl_dispatch_line(int fd, struct kvnl_dispatch * table, struct buf * buf, kvnl_hash * hash);
+
+#endif//__DISPATCH_H__
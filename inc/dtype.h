@@ -0,0 +1,81 @@
+#ifndef __DTYPE_H__
+#define __DTYPE_H__
+#include <stdint.h>
+#include <buf.h>
+
+/**
+ * dtype - element type descriptors and conversion kernels
+ *
+ * A struct dtype describes one array element:
+ *  - kind: DTYPE_BOOL, DTYPE_INT, DTYPE_UINT, DTYPE_FLOAT or DTYPE_COMPLEX
+ *  - size: the size of the element in bytes
+ *  - endian: DTYPE_LITTLE or DTYPE_BIG; for single bytes, DTYPE_NOT_APPLICABLE
+ * INVALID_DTYPE has kind DTYPE_INVALID and is returned whenever something
+ * doesn't make sense.
+ *
+ * make_dtype(kind, size) describes a native element.
+ *
+ * dtype_parse(str) understands NumPy-style descriptors (an optional byte order
+ * character out of <, >, = and |, followed by a kind character out of b, i, u,
+ * f and c, and a size, such as "<f4" or "i2") and plain names (such as
+ * "float32", "uint8" or "bool"), which are native.
+ *
+ * dtype_snprint(dtype, str, size) formats the NumPy-style descriptor, like
+ * snprintf().
+ *
+ * dtype_convert(dst, dst_dtype, src, src_dtype) converts every element of src
+ * into dst, swapping bytes and casting as needed in a single pass. The values
+ * change as with a C cast; in particular, converting a float that is out of
+ * the range of an integer type gives an unspecified value. float16 converts
+ * through double, and rounds to the nearest half. Complex numbers can only be
+ * converted to complex numbers of the same size. dst must hold exactly as many
+ * elements as src, and must either not overlap src or be the same memory with
+ * the same element size.
+ *
+ * dtype_byteswap(dst, src, word_size) reverses the byte order of every word of
+ * src into dst, which may be src.
+ *
+ * The kernels use AVX2 or SSSE3 when the CPU has them.
+ */
+
+enum dtype_kind {
+	DTYPE_INVALID = 0,
+	DTYPE_BOOL = 1,
+	DTYPE_INT = 2,
+	DTYPE_UINT = 3,
+	DTYPE_FLOAT = 4,
+	DTYPE_COMPLEX = 5,
+};
+
+enum dtype_endian {
+	DTYPE_LITTLE = '<',
+	DTYPE_BIG = '>',
+	DTYPE_NOT_APPLICABLE = '|',
+};
+
+struct dtype {
+	enum dtype_kind kind;
+	size_t size;
+	enum dtype_endian endian;
+};
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define DTYPE_NATIVE DTYPE_BIG
+#else
+#define DTYPE_NATIVE DTYPE_LITTLE
+#endif
+
+extern struct dtype const INVALID_DTYPE;
+
+struct dtype make_dtype(enum dtype_kind kind, size_t size);
+struct dtype dtype_parse(struct view str);
+int dtype_snprint(struct dtype dtype, char * str, size_t size);
+
+int dtype_is_valid(struct dtype dtype);
+int dtype_is_native(struct dtype dtype);
+int dtype_equal(struct dtype a, struct dtype b);
+
+int dtype_convert(struct view dst, struct dtype dst_dtype, struct view src, struct dtype src_dtype);
+int dtype_byteswap(struct view dst, struct view src, size_t word_size);
+
+#endif//__DTYPE_H__
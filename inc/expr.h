@@ -0,0 +1,122 @@
+#ifndef __EXPR_H__
+#define __EXPR_H__
+#include <stdint.h>
+#include <ndview.h>
+#include <dtype.h>
+
+/**
+ * expr - fused elementwise expressions over ndviews
+ *
+ * Computing out = (a - mean) * scale + b one operation at a time makes a
+ * temporary array per step, and a pass over memory for each. An expression is
+ * built as a graph of nodes first, and evaluated in a single pass instead:
+ * blocks of EXPR_BLOCK elements of every input are loaded, the whole graph is
+ * applied to them, with the intermediate values of a block staying in the
+ * cache, and the result is stored into out, so memory sees every input and the
+ * output once, and no temporary array is ever allocated.
+ *
+ * struct expr holds the nodes; make_expr() returns an empty one, which
+ * allocates nothing and can be thrown away without freeing. Building functions
+ * add a node and return its id, to be used as the argument of later ones, or
+ * -1 if it can't be built (with errno set: EINVAL for arguments that make no
+ * sense, E2BIG past EXPR_MAX_NODES nodes). A -1 argument fails the node it is
+ * given to in turn, keeping errno, so an expression can be built without
+ * checking anything but its last id.
+ *  - expr_input(expr, view, dtype): the elements of an array of the given
+ *    dtype; the view (and its shape and strides) must stay valid until
+ *    evaluation
+ *  - expr_float(expr, value), expr_int(expr, value): a constant
+ *  - expr_cast(expr, a, dtype): a converted to dtype like dtype_convert() does
+ *    (say to uint8, wrapping around, or to float32, losing precision)
+ *  - expr_unary(expr, op, a): EXPR_NEG, EXPR_ABS, EXPR_SQRT, EXPR_NOT
+ *  - expr_binary(expr, op, a, b): EXPR_ADD, EXPR_SUB, EXPR_MUL, EXPR_DIV,
+ *    EXPR_MIN, EXPR_MAX, the comparisons EXPR_LT, EXPR_LE, EXPR_GT, EXPR_GE,
+ *    EXPR_EQ, EXPR_NE, and the logical EXPR_AND and EXPR_OR
+ *  - expr_select(expr, cond, a, b): a where cond is true, b elsewhere
+ * Values are booleans, 64-bit integers, floats or doubles: signed and unsigned
+ * integers of any size are computed with as int64, float32 as float, and
+ * float64 as double. Booleans count as 0 and 1 in arithmetic, and mixing
+ * integers and floats gives doubles, except that float32 stays float next to
+ * other floats, booleans and constants, like in NumPy, whose Python numbers
+ * take the type of the array they meet: constants are made of the type of the
+ * other operand. EXPR_DIV and EXPR_SQRT always give floats or doubles,
+ * comparisons and logical operators booleans; the operands of EXPR_NOT,
+ * EXPR_AND, EXPR_OR and the condition of expr_select() are true when not zero.
+ * Integers wrap around, and a NaN wins EXPR_MIN and EXPR_MAX like in NumPy.
+ *
+ * expr_eval(expr, root, out, dtype, n_threads) computes node root for every
+ * element of out, and stores it as dtype. Inputs broadcast to the shape of out
+ * like in NumPy: their shape, aligned with the end of the shape of out, has
+ * either the same size or 1 in every dimension, and missing leading dimensions
+ * count as 1. Dimensions that follow each other in memory the same way for out
+ * and every input are merged first, so that the inner loop runs over as many
+ * elements as it can (over the whole array when everything is dense), and
+ * elements that are dense and already of the type they are computed with are
+ * used in place rather than loaded. n_threads threads (0 is 1) take pieces of EXPR_TASK
+ * elements at a time. out may be one of the inputs (the same memory, strides
+ * and dtype), but must not overlap any of them otherwise. It returns 0, or
+ * EINVAL if a node is invalid or the shapes don't broadcast, or ENOMEM.
+ *
+ * Complex numbers aren't supported.
+ */
+
+#define EXPR_MAX_NODES 64
+#define EXPR_MAX_NDIM 32
+#define EXPR_BLOCK 256
+#define EXPR_TASK (64 * 1024)
+
+enum expr_op {
+	EXPR_INPUT,
+	EXPR_CONSTANT,
+	EXPR_CAST,
+	EXPR_NEG,
+	EXPR_ABS,
+	EXPR_SQRT,
+	EXPR_NOT,
+	EXPR_ADD,
+	EXPR_SUB,
+	EXPR_MUL,
+	EXPR_DIV,
+	EXPR_MIN,
+	EXPR_MAX,
+	EXPR_LT,
+	EXPR_LE,
+	EXPR_GT,
+	EXPR_GE,
+	EXPR_EQ,
+	EXPR_NE,
+	EXPR_AND,
+	EXPR_OR,
+	EXPR_SELECT,
+};
+
+/*
+ * A node computes values of type (native bool, int64, float32 or float64) out of the
+ * nodes args; dtype is that of an input, or the one a cast goes through.
+ */
+struct expr_node {
+	enum expr_op op;
+	struct dtype type;
+	int args[3];
+	struct dtype dtype;
+	struct ndview input;
+	double number;
+	int64_t integer;
+};
+
+struct expr {
+	size_t n_nodes;
+	struct expr_node nodes[EXPR_MAX_NODES];
+};
+
+struct expr make_expr(void);
+int expr_input(struct expr * expr, struct ndview const * view, struct dtype dtype);
+int expr_float(struct expr * expr, double value);
+int expr_int(struct expr * expr, int64_t value);
+int expr_cast(struct expr * expr, int a, struct dtype dtype);
+int expr_unary(struct expr * expr, enum expr_op op, int a);
+int expr_binary(struct expr * expr, enum expr_op op, int a, int b);
+int expr_select(struct expr * expr, int cond, int a, int b);
+int expr_eval(struct expr const * expr, int root, struct ndview const * out, struct dtype dtype, size_t n_threads);
+
+#endif//__EXPR_H__
@@ -0,0 +1,65 @@
+#ifndef __HASH_H__
+#define __HASH_H__
+#include <stdint.h>
+#include <buf.h>
+
+/**
+ * hash - fast non-cryptographic checksums
+ *
+ * Two algorithms are provided:
+ *  - HASH_CRC32C: CRC-32C (Castagnoli), using the SSE4.2 crc32 instruction
+ *                 when the CPU has it and a slicing-by-8 table otherwise
+ *  - HASH_XXH64: the 64-bit xxHash
+ *
+ * Running hashes are stored as structures (struct hash) that are created with
+ * make_hash(kind) and then fed with hash_update(hash, view) any number of
+ * times. hash_digest(hash) returns the hash of everything fed so far without
+ * changing the state, so it can be called repeatedly.
+ *
+ * hash_copy(hash, dst, src) copies src into dst and hashes the bytes while
+ * they are still in the cache. dst and src must have the same size.
+ *
+ * hash_update_func(hash, view) has the signature of a kvnl_update_func, so a
+ * struct hash can be handed to the kvnl readers and writers as the context.
+ *
+ * hash_name(kind) and hash_look_up(name) convert between kinds and the names
+ * used in kvnl checksum records ("crc32c" and "xxh64").
+ *
+ * One-shot versions are crc32c(view) and xxh64(view, seed).
+ */
+
+enum hash_kind {
+	HASH_NONE = 0,
+	HASH_CRC32C = 1,
+	HASH_XXH64 = 2,
+	HASH_INVALID = 3,
+};
+
+struct hash {
+	enum hash_kind kind;
+	union {
+		uint32_t crc32c;
+		struct {
+			uint64_t acc[4];
+			uint64_t seed, total;
+			unsigned char stripe[32];
+			size_t stripe_size;
+		} xxh64;
+	};
+};
+
+struct hash make_hash(enum hash_kind kind);
+struct hash make_hash_seeded(enum hash_kind kind, uint64_t seed);
+int hash_update(struct hash *, struct view);
+uint64_t hash_digest(struct hash const *);
+int hash_copy(struct hash *, struct view dst, struct view src);
+int hash_update_func(void * hash, struct view);
+
+char const * hash_name(enum hash_kind kind);
+enum hash_kind hash_look_up(struct view name);
+
+uint32_t crc32c_update(uint32_t crc, void const * data, size_t size);
+uint32_t crc32c(struct view);
+uint64_t xxh64(struct view, uint64_t seed);
+
+#endif//__HASH_H__
@@ -0,0 +1,161 @@
+#ifndef __INSTR_H__
+#define __INSTR_H__
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <buf.h>
+
+/**
+ * instr - optional counters and latency histograms
+ *
+ * Building with -DINSTRUMENT (make INSTRUMENT=1) makes the library count what
+ * it does, per thread, without any locking on the hot paths:
+ *  - buf: allocations, reallocations, frees, bytes allocated and bytes copied
+ *         by reallocations that moved the data, and buffers that spilled to
+ *         files
+ *  - syscalls: read(), write() and lseek() calls, and the bytes moved, as
+ *              well as the bytes moved between descriptors inside the kernel
+ *  - kvnl: records and bytes parsed, records and bytes written
+ * and keeps a latency histogram for every kvnl operation in enum instr_op.
+ * Without INSTRUMENT the hooks compile to nothing and snapshots are all zeros.
+ *
+ * Histograms are log-linear: every power of two of nanoseconds is split into
+ * 2^INSTR_SUB_BITS buckets, so any value is off by at most 25%.
+ *
+ * instr_snapshot(snapshot) adds up the counters and histograms of all threads,
+ * including the ones that have exited, into snapshot.
+ *
+ * instr_snapshot_diff(after, before, diff) subtracts two snapshots, which is
+ * how a piece of work is measured on its own.
+ *
+ * instr_histogram_percentile(histogram, p) is the upper bound of the bucket
+ * holding the p-th percentile, in nanoseconds.
+ *
+ * instr_dump(snapshot, buf) appends a "name value" line per counter and a line
+ * per histogram that isn't empty to buf; instr_fdump(snapshot, stream) writes
+ * them to stream.
+ *
+ * Library code uses these hooks:
+ *  - INSTR_ADD(counter, n): adds n to a counter
+ *  - INSTR_SCOPE(op): times the rest of the enclosing block as an op
+ */
+
+enum instr_counter {
+	INSTR_BUF_ALLOCS,
+	INSTR_BUF_REALLOCS,
+	INSTR_BUF_FREES,
+	INSTR_BUF_BYTES_ALLOCATED,
+	INSTR_BUF_BYTES_COPIED,
+	INSTR_BUF_SPILLS,
+	INSTR_READ_CALLS,
+	INSTR_READ_BYTES,
+	INSTR_WRITE_CALLS,
+	INSTR_WRITE_BYTES,
+	INSTR_SEEK_CALLS,
+	INSTR_KERNEL_BYTES,
+	INSTR_RECORDS_READ,
+	INSTR_BYTES_PARSED,
+	INSTR_RECORDS_WRITTEN,
+	INSTR_BYTES_WRITTEN,
+	INSTR_NUMBER_OF_COUNTERS,
+};
+
+enum instr_op {
+	INSTR_KVNL_READ_LINE,
+	INSTR_KVNL_READ_VALUE,
+	INSTR_KVNL_READ_BLOCK,
+	INSTR_KVNL_READ_NDVIEW,
+	INSTR_KVNL_WRITE_LINE,
+	INSTR_KVNL_WRITE_NDVIEW,
+	INSTR_NUMBER_OF_OPS,
+};
+
+#define INSTR_SUB_BITS 2
+#define INSTR_BUCKETS ((64 - INSTR_SUB_BITS + 1) << INSTR_SUB_BITS)
+
+extern char const * INSTR_COUNTER_NAMES[INSTR_NUMBER_OF_COUNTERS];
+extern char const * INSTR_OP_NAMES[INSTR_NUMBER_OF_OPS];
+
+struct instr_histogram {
+	uint64_t count, total_ns;
+	uint64_t buckets[INSTR_BUCKETS];
+};
+
+struct instr_snapshot {
+	uint64_t counters[INSTR_NUMBER_OF_COUNTERS];
+	struct instr_histogram histograms[INSTR_NUMBER_OF_OPS];
+};
+
+int instr_snapshot(struct instr_snapshot *);
+int instr_snapshot_diff(struct instr_snapshot const * after, struct instr_snapshot const * before, struct instr_snapshot * diff);
+uint64_t instr_histogram_percentile(struct instr_histogram const *, double p);
+int instr_dump(struct instr_snapshot const *, struct buf *);
+int instr_fdump(struct instr_snapshot const *, FILE *);
+
+/* the state of one thread, found through a thread-local pointer once registered */
+struct instr_thread {
+	uint64_t counters[INSTR_NUMBER_OF_COUNTERS];
+	struct instr_histogram histograms[INSTR_NUMBER_OF_OPS];
+	struct instr_thread * next;
+};
+
+extern __thread struct instr_thread * instr_self;
+struct instr_thread * instr_register_thread(void);
+
+/* only the owning thread writes, so a relaxed load and store is enough for snapshots to see whole values */
+static inline void instr_bump(uint64_t * counter, uint64_t n)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void instr_add(enum instr_counter counter, uint64_t n)
+{
+	struct instr_thread * self = instr_self ? instr_self : instr_register_thread();
+	if (self != NULL) instr_bump(&self->counters[counter], n);
+}
+
+static inline size_t instr_bucket(uint64_t ns)
+{
+	if (ns < (1u << INSTR_SUB_BITS)) return ns;
+	unsigned const e = 63 - __builtin_clzll(ns);
+	return ((e - INSTR_SUB_BITS + 1) << INSTR_SUB_BITS) | ((ns >> (e - INSTR_SUB_BITS)) & ((1u << INSTR_SUB_BITS) - 1));
+}
+
+struct instr_scope {
+	enum instr_op op;
+	struct timespec start;
+};
+
+static inline struct instr_scope instr_scope_begin(enum instr_op op)
+{
+	struct instr_scope scope = { op, { 0, 0 } };
+	clock_gettime(CLOCK_MONOTONIC, &scope.start);
+	return scope;
+}
+
+static inline void instr_scope_end(struct instr_scope * scope)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	uint64_t const ns = (end.tv_sec - scope->start.tv_sec) * 1000000000ull + end.tv_nsec - scope->start.tv_nsec;
+	struct instr_thread * self = instr_self ? instr_self : instr_register_thread();
+	if (self == NULL) return;
+	struct instr_histogram * histogram = &self->histograms[scope->op];
+	instr_bump(&histogram->count, 1);
+	instr_bump(&histogram->total_ns, ns);
+	instr_bump(&histogram->buckets[instr_bucket(ns)], 1);
+}
+
+#ifdef INSTRUMENT
+#define INSTR_ENABLED 1
+#define INSTR_ADD(counter, n) instr_add((counter), (n))
+#define INSTR_SCOPE(op) \
+	struct instr_scope __instr_scope __attribute__((cleanup(instr_scope_end))) = instr_scope_begin(op)
+#else
+#define INSTR_ENABLED 0
+/* sizeof keeps the arguments "used" without evaluating them */
+#define INSTR_ADD(counter, n) ((void)sizeof(counter), (void)sizeof(n))
+#define INSTR_SCOPE(op) ((void)0)
+#endif
+
+#endif//__INSTR_H__
@@ -4,6 +4,9 @@
 #include <unistd.h>
 #include <buf.h>
 #include <ndview.h>
+#include <hash.h>
+#include <codec.h>
+#include <dtype.h>
 
 enum KVNL_ERRORS {
 	KVNL_SUCCESS = 0x1000,
@@ -14,9 +17,10 @@ enum KVNL_ERRORS {
 	KVNL_WRITE_SIZES_FAILED = 0x1005,
 	KVNL_READ_UNCLEAR_SPECIFICATION = 0x1006,
 	KVNL_EXPECTED_NEWLINE = 0x1007,
+	KVNL_CHECKSUM_FAILED = 0x1008,
 };
 
-#define KVNL_NUMBER_OF_ERRORS 8
+#define KVNL_NUMBER_OF_ERRORS 9
 
 extern char const * KVNL_ERROR_MESSAGES[KVNL_NUMBER_OF_ERRORS];
 char const * kvnl_look_up_error(int error);
@@ -39,6 +43,11 @@ typedef struct kvnl_line {
 	const char * error;
 } kvnl_line;
 
+typedef struct kvnl_ndview {
+	struct ndview view;
+	const char * error;
+} kvnl_ndview;
+
 typedef struct kvnl_block {
 	ssize_t n_lines;
 	kvnl_line * lines;
@@ -86,18 +95,241 @@ typedef struct kvnl_block {
 
 
 struct kvnl_specification kvnl_decode_specification(struct view spec);
+int kvnl_parse_checksum(struct view value, enum hash_kind * kind, uint64_t * expected);
 
-typedef int (*kvnl_update_func)(struct view);
+#define KVNL_MAX_NDIM 32
+
+/*
+ * An ndview writer carries the options and scratch memory for writing arrays:
+ *  - codec: filters and compression for the data record (the element size is
+ *           taken from each call); dense column-major arrays are encoded in
+ *           their order, with the last axis leading, and arrays that are
+ *           dense in neither order are copied row-major into dense scratch
+ *           memory first
+ *  - checksum: the checksum record to precede the data record with, if any
+ *  - align: if not zero, a padding record goes before the data record so that
+ *           the payload starts at a multiple of align in the file (at most
+ *           KVNL_MAX_ALIGN; 64 suits any SIMD loads)
+ *  - offset: the file offset the next array starts at, advanced by every
+ *            write; -1 (the default) looks it up with lseek() on the first
+ *            aligned write, or starts at 0 if the file can't seek. Adjust it
+ *            when writing anything else in between to a file that can't seek.
+ *  - dedup: leave out the dtype, shape and strides records when they are the
+ *           same as for the previous array; a reader keeps the last ones it
+ *           read, so every array of such a stream must go through the same
+ *           reader, in order. Clear last_header to write them out again, say
+ *           when starting another file.
+ *  - layout: if not NULL, a layout record goes before the dtype record, for
+ *            arrays whose payload is arranged some other way than the shape
+ *            and strides say (see inc/tile.h); it must not contain newlines
+ * Read aligned payloads into a buffer from make_buf_aligned() to keep them
+ * aligned in memory too.
+ */
+struct kvnl_ndview_writer {
+	struct codec codec;
+	enum hash_kind checksum;
+	size_t align;
+	off_t offset;
+	int dedup;
+	char const * layout;
+	struct buf header, last_header;
+	struct buf dense, encoded, chunk_sizes;
+};
 
-ssize_t kvnl_write_some(int fd, struct view view, kvnl_update_func hash);
-ssize_t kvnl_write_newline(int fd, kvnl_update_func hash);
-ssize_t kvnl_write_specification(int fd, struct view spec, kvnl_update_func hash);
-ssize_t kvnl_write_value(int fd, struct view value, kvnl_update_func hash);
+#define KVNL_MAX_ALIGN 4096
+
+/*
+ * A value reader puts the values of sized records where the caller wants them
+ * rather than at the end of the line buffer, which saves copying them out (and
+ * moving what the buffer already holds when it grows):
+ *  - pick(ctx, key, size): returns the memory for the value of a record, at
+ *                          least size bytes, or a view with NULL data to have
+ *                          it read into the buffer as usual
+ *  - direct: values of at least this many bytes are read past the page cache,
+ *            so that streaming through a large file doesn't evict everything
+ *            else (0, the default, never): with O_DIRECT through a second
+ *            descriptor of the same file, in KVNL_DIRECT_CHUNK pieces through
+ *            an aligned bounce buffer, or straight into place when the memory
+ *            lines up with the file (see align above); where the file system
+ *            doesn't do O_DIRECT, the pages are dropped after reading instead
+ * Unsized values, and anything not read from a regular file, are read as usual.
+ * The key stays in the buffer. kvnl_value_reader_free() closes the second
+ * descriptor.
+ */
+typedef struct view (*kvnl_pick_func)(void * ctx, struct view key, size_t size);
+
+struct kvnl_value_reader {
+	kvnl_pick_func pick;
+	void * ctx;
+	size_t direct;
+	int direct_fd;
+	dev_t direct_dev;
+	ino_t direct_ino;
+	struct buf bounce;
+};
+
+#define KVNL_DIRECT_CHUNK (1024 * 1024)
+
+typedef int (*kvnl_update_func)(void * ctx, struct view);
+
+typedef struct kvnl_hash {
+	kvnl_update_func update;
+	void * ctx;
+} kvnl_hash;
+
+#define make_kvnl_hash(hash_ptr) ((kvnl_hash){ hash_update_func, (hash_ptr) })
+
+/*
+ * A check verifies the record a checksum record covers. kvnl_check_start()
+ * parses the value of the checksum record and points check->hash at the check,
+ * which passes everything read through it on to stream (which may be NULL) as
+ * well as to the checksum of the record. Once the covered record has been read
+ * through check->hash, kvnl_check_finish() gives NULL, or "checksum mismatch".
+ * kvnl_check_start() gives "malformed checksum" for a value it can't parse.
+ * The check must not move in between.
+ */
+struct kvnl_check {
+	struct hash record;
+	uint64_t expected;
+	kvnl_hash * stream;
+	kvnl_hash hash;
+};
+
+const char * kvnl_check_start(struct kvnl_check * check, struct view checksum, kvnl_hash * stream);
+const char * kvnl_check_finish(struct kvnl_check const * check);
+
+/*
+ * An ndview reader keeps the last header it read: the dtype, shape and strides,
+ * as well as the codec and the encoded chunk sizes of the data record. The
+ * shape and strides of returned ndviews point into it. Set codec.n_threads to
+ * decode with several threads. type is the parsed dtype, or INVALID_DTYPE if
+ * the dtype is free-form; raw payloads of a free-form dtype can't be checked
+ * against the shape and strides, so only encoded ones (whose element size the
+ * codec record gives) are read. The text of the header records is kept as
+ * well, so that repeated ones are recognized without parsing them again.
+ * layout is the value of the layout record of the array, empty if it had none.
+ *
+ * kvnl_read_ndview_as() converts the data to the given dtype: raw payloads are
+ * converted piece by piece while reading, encoded ones right after decoding.
+ * The strides must be whole multiples of the element size.
+ *
+ * Arrays too large to hold go through in pieces: kvnl_read_ndview_header()
+ * reads the records up to and including the specification of the data record,
+ * which it returns (with the payload size in size), after which the reader
+ * describes the array. kvnl_read_ndview_data() then reads the payload like
+ * kvnl_read_ndview() would, or kvnl_read_ndview_piece(fd, reader, size, buf,
+ * hash) appends the next piece of at most size bytes of it (0 for the rest) to
+ * buf, as it is in the stream (encoded payloads stay encoded), and once all of
+ * it is read, the trailing newline, returning an empty view. The checksum of
+ * the record, if any, is verified then. remaining is the number of bytes of
+ * the payload left, -1 when no data record is being read. Conversely,
+ * kvnl_write_ndview_header(fd, writer, ndview, dtype, hash, fmt_buf) writes
+ * everything of an array but its payload, the memory of ndview (whose data
+ * isn't touched), and the newline after it, which the caller writes with
+ * kvnl_write_some() and kvnl_write_newline(); writer.offset is advanced past
+ * them already. Encoded and checksummed arrays need their whole payload up
+ * front, so writers with a codec or a checksum fail with KVNL_ENCODING_FAILED.
+ */
+struct kvnl_ndview_reader {
+	struct buf line, layout, dtype, shape_line, strides_line;
+	struct dtype type;
+	size_t ndim;
+	size_t shape[KVNL_MAX_NDIM];
+	ssize_t strides[KVNL_MAX_NDIM];
+	ssize_t converted_strides[KVNL_MAX_NDIM];
+	struct codec codec;
+	struct buf chunk_sizes, encoded, decoded;
+	struct kvnl_check check;
+	int checked;
+	ssize_t remaining;
+};
+
+struct kvnl_ndview_writer make_kvnl_ndview_writer(void);
+int kvnl_ndview_writer_free(struct kvnl_ndview_writer *);
+struct kvnl_ndview_reader make_kvnl_ndview_reader(void);
+int kvnl_ndview_reader_free(struct kvnl_ndview_reader *);
+struct kvnl_value_reader make_kvnl_value_reader(kvnl_pick_func pick, void * ctx);
+int kvnl_value_reader_free(struct kvnl_value_reader *);
+
+/* records with keys starting with . carry stream metadata */
+#define KVNL_CHECKSUM_KEY ".checksum"
+#define KVNL_PAD_KEY ".pad"
+
+ssize_t kvnl_write_some(int fd, struct view view, kvnl_hash * hash);
+ssize_t kvnl_write_newline(int fd, kvnl_hash * hash);
+ssize_t kvnl_write_specification(int fd, struct view spec, kvnl_hash * hash);
+ssize_t kvnl_write_value(int fd, struct view value, kvnl_hash * hash);
 ssize_t kvnl_encode_specification(char * key, ssize_t size, struct buf * dest);
-ssize_t kvnl_write_line(int fd, char * key, struct view value, int sized, kvnl_update_func hash, struct buf * spec_buf);
-ssize_t kvnl_write_ndview(int fd, struct ndview * ndview, char * dtype, size_t elem_size, kvnl_update_func hash, struct buf * fmt_buf);
+ssize_t kvnl_write_line(int fd, char * key, struct view value, int sized, kvnl_hash * hash, struct buf * spec_buf);
+ssize_t kvnl_write_checked_line(int fd, char * key, struct view value, int sized, enum hash_kind checksum, kvnl_hash * hash, struct buf * spec_buf);
+ssize_t kvnl_write_ndview(int fd, struct ndview * ndview, char * dtype, size_t elem_size, kvnl_hash * hash, struct buf * fmt_buf);
+ssize_t kvnl_write_ndview_with(int fd, struct kvnl_ndview_writer * writer, struct ndview * ndview, char * dtype, size_t elem_size, kvnl_hash * hash, struct buf * fmt_buf);
+ssize_t kvnl_write_typed_ndview(int fd, struct kvnl_ndview_writer * writer, struct ndview * ndview, struct dtype dtype, kvnl_hash * hash, struct buf * fmt_buf);
+ssize_t kvnl_write_ndview_header(int fd, struct kvnl_ndview_writer * writer, struct ndview const * ndview, struct dtype dtype, kvnl_hash * hash, struct buf * fmt_buf);
+
+/*
+ * The functions below read exactly one record, and never past it, so that fd
+ * is left at the next one. Delimited parts (keys and unsized values) of records
+ * in regular files are read a chunk at a time, and the file offset is put back
+ * after the delimiter. A pipe or a socket can't be put back, so there they are
+ * read one byte per read() call, which costs a system call per byte of the key
+ * and the size. Streams of small records should rather go through a block
+ * reader (kvnl_read_block() below), which reads ahead and keeps what it read.
+ */
+kvnl_some kvnl_read_some(int fd, ssize_t size, char * delim, struct buf * buf, kvnl_hash * hash);
+kvnl_specification kvnl_read_specification(int fd, struct buf * buf, kvnl_hash * hash);
+kvnl_line kvnl_read_value(int fd, kvnl_specification spec, struct buf * buf, kvnl_hash * hash);
+kvnl_line kvnl_skip_value(int fd, kvnl_specification spec, struct buf * buf, kvnl_hash * hash);
+kvnl_line kvnl_read_line(int fd, struct buf * buf, kvnl_hash * hash);
+kvnl_line kvnl_read_line_with(int fd, struct kvnl_value_reader * reader, struct buf * buf, kvnl_hash * hash);
+
+/*
+ * kvnl_parse_line(input, consumed) parses the record at the start of input, in
+ * memory, the way kvnl_read_line() reads it (checksums included), and stores
+ * its size in bytes in consumed. The key and value point into input. A record
+ * cut short by the end of input is an "EOF" error.
+ */
+kvnl_line kvnl_parse_line(struct view input, size_t * consumed);
+
+/*
+ * A block reader reads records in batches: kvnl_read_block() reads ahead with
+ * as few read() calls as it can, parses up to max_lines records, or as many as
+ * add up to max_bytes bytes (at least one, however large), and returns them as
+ * a block. The keys and values point into one backing buffer, and the lines
+ * are in one array, both kept by the reader and reused by the next call, so
+ * everything in a block stays valid until then. A block only holds records
+ * that were already buffered when its first one was, so the buffer doesn't
+ * move under them. Records are parsed with kvnl_parse_line(), checksums
+ * included, and the stream hash gets the bytes of every record in the block.
+ *
+ * If reading or parsing fails, the last line of the block holds the error, and
+ * at the end of the stream a block has a single line with an "EOF" error. The
+ * bytes read past the last record are kept for the next call, so fd belongs to
+ * the reader until the end. n_lines is -1 if there's no memory for even the
+ * error line. 0 picks KVNL_BLOCK_LINES or KVNL_BLOCK_BYTES.
+ *
+ * Set uring to an engine bound to fd (see inc/uring.h) to read through it
+ * instead of with read(), with blocks of read-ahead in flight while the records
+ * already read are handled.
+ */
+struct kvnl_block_reader {
+	size_t max_lines, max_bytes;
+	struct buf data, lines;
+	size_t start;
+	int eof;
+	struct kvnl_uring * uring;
+};
+
+#define KVNL_BLOCK_LINES 1024
+#define KVNL_BLOCK_BYTES (256 * 1024)
+
+struct kvnl_block_reader make_kvnl_block_reader(size_t max_lines, size_t max_bytes);
+int kvnl_block_reader_free(struct kvnl_block_reader *);
+kvnl_block kvnl_read_block(int fd, struct kvnl_block_reader * reader, kvnl_hash * hash);
 
-kvnl_some kvnl_read_some(int fd, ssize_t size, char * delim, struct buf * buf, kvnl_update_func hash);
-kvnl_specification kvnl_read_specification(int fd, struct buf * buf, kvnl_update_func hash);
-kvnl_line kvnl_read_line(int fd, struct buf * buf, kvnl_update_func hash);
+kvnl_ndview kvnl_read_ndview(int fd, struct kvnl_ndview_reader * reader, struct buf * data, kvnl_hash * hash);
+kvnl_ndview kvnl_read_ndview_as(int fd, struct kvnl_ndview_reader * reader, struct dtype dtype, struct buf * data, kvnl_hash * hash);
+kvnl_specification kvnl_read_ndview_header(int fd, struct kvnl_ndview_reader * reader, kvnl_hash * hash);
+kvnl_ndview kvnl_read_ndview_data(int fd, struct kvnl_ndview_reader * reader, kvnl_specification spec, struct buf * data, kvnl_hash * hash);
+kvnl_some kvnl_read_ndview_piece(int fd, struct kvnl_ndview_reader * reader, size_t size, struct buf * buf, kvnl_hash * hash);
 #endif//__KVNL_H__
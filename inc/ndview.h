@@ -34,6 +34,7 @@ struct ndview make_ndview_row_major(
 int ndview_set_shape(struct ndview * ndview, char const * spec);
 int ndview_set_strides(struct ndview * ndview, char const * spec, size_t elem_size);
 int ndview_set_strides_row_major(struct ndview * ndview, size_t elem_size);
+int ndview_set_strides_column_major(struct ndview * ndview, size_t elem_size);
 //struct view ndview_view(struct ndview const * ndview);
 
 struct ndview ndview_at(struct ndview const * ndview, size_t idx);
@@ -77,5 +78,63 @@ int ndview_is_dense_row_major(struct ndview const *);
 
 struct extent ndview_extent(struct ndview const * ndview, size_t item_size);
 struct view ndview_memory(struct ndview const *, size_t item_size);
+size_t ndview_size(struct ndview const * ndview);
+int ndview_copy(struct ndview const * dst, struct ndview const * src, size_t item_size);
+
+/*
+ * Gathering and scattering slices along an axis, say rows picked out of a large
+ * array by event number:
+ *  - ndview_take(dst, src, axis, indices, item_size, n_threads): slice i of dst
+ *    along axis is slice indices[i] of src
+ *  - ndview_put(dst, src, axis, indices, item_size, n_threads): slice indices[i]
+ *    of dst is slice i of src (the last one wins for repeated indices, unless
+ *    several threads write them)
+ *  - ndview_compress(dst, src, axis, mask, item_size): dst is the slices of src
+ *    whose mask is not zero, in order
+ *  - ndview_expand(dst, src, axis, mask, item_size): the slices of dst whose
+ *    mask is not zero are those of src, in order; the others stay as they are
+ * There are as many indices as slices in src for ndview_put(), and in dst for
+ * ndview_take(); a mask has one byte for every slice of the array it masks, and
+ * ndview_mask_count(mask, n) counts the slices it keeps. Apart from the axis,
+ * dst and src have the same shape. They return 0, or EINVAL if the shapes
+ * don't fit or an index is out of range (before copying anything).
+ *
+ * Slices that are dense on both sides are copied with memcpy(), runs of
+ * consecutive indices at once if the axis is the outermost one, and the slice
+ * NDVIEW_PREFETCH indices ahead is prefetched if it spans at most
+ * NDVIEW_PREFETCH_LINES cache lines, which hides most of the latency of random
+ * indices. n_threads threads (0 is 1) share the indices, each of them at least
+ * NDVIEW_THREAD_INDICES. Element masks of a dense array work on it seen as one
+ * dimension.
+ */
+#define NDVIEW_PREFETCH 16
+#define NDVIEW_PREFETCH_LINES 4
+#define NDVIEW_THREAD_INDICES (64 * 1024)
+#define NDVIEW_MASK_BATCH 256
+
+int ndview_take(struct ndview const * dst, struct ndview const * src, size_t axis, size_t const * indices, size_t item_size, size_t n_threads);
+int ndview_put(struct ndview const * dst, struct ndview const * src, size_t axis, size_t const * indices, size_t item_size, size_t n_threads);
+int ndview_compress(struct ndview const * dst, struct ndview const * src, size_t axis, unsigned char const * mask, size_t item_size);
+int ndview_expand(struct ndview const * dst, struct ndview const * src, size_t axis, unsigned char const * mask, size_t item_size);
+size_t ndview_mask_count(unsigned char const * mask, size_t n);
+
+/*
+ * ndview_freeze(buf, view) freezes the buffer that holds the data of view (see
+ * buf_freeze()) together with copies of its shape and strides, and returns the
+ * array holding a reference to all of it, so that it can be handed to several
+ * consumers without copying. The view of the result is INVALID_NDVIEW if
+ * freezing fails or the data isn't in buf. ndview_ref_share(ref) takes another
+ * reference to the same array, ndview_ref_at(ref, idx) one to a slice of it
+ * (like ndview_at()), and ndview_ref_release(ref) drops one.
+ */
+struct ndview_ref {
+	struct ndview view;
+	struct buf_shared * owner;
+};
+
+struct ndview_ref ndview_freeze(struct buf * buf, struct ndview const * view);
+struct ndview_ref ndview_ref_share(struct ndview_ref const * ref);
+struct ndview_ref ndview_ref_at(struct ndview_ref const * ref, size_t idx);
+int ndview_ref_release(struct ndview_ref * ref);
 
 #endif//__NDVIEW_H__
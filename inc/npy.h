@@ -0,0 +1,95 @@
+#ifndef __NPY_H__
+#define __NPY_H__
+#include <sys/types.h>
+#include <kvnl.h>
+
+/**
+ * npy - NumPy .npy files as ndviews, and converting them to and from kvnl
+ *
+ * A .npy file is a magic string, a version, the length of the header, a
+ * header that is a Python dict literal (with the keys 'descr', 'fortran_order'
+ * and 'shape') padded so that the data starts at a multiple of
+ * NPY_ALIGN, and the dense data in C or Fortran order. Versions 1.0, 2.0 and
+ * 3.0 are read; 1.0 is written, as NPY_MAX_NDIM keeps headers short.
+ * Only plain dtypes are supported (see dtype_parse()); structured, string and
+ * object arrays are ENOTSUP.
+ *
+ * A struct npy_header is a parsed header:
+ *  - dtype, fortran_order and shape as in the file, with strides for them
+ *  - header_size: the size of everything before the data
+ *  - data_size: the size of the data
+ *
+ * npy_parse_header(input, header) parses the header at the start of input.
+ * npy_read_header(fd, header, buf) reads exactly the header from fd, through
+ * buf, so that fd is left at the data. Both return 0, or EINVAL if it is
+ * malformed, ENOTSUP for dtypes and versions they don't know, and ENODATA if
+ * it is cut short; npy_read_header() also passes read() errors on.
+ *
+ * npy_ndview(header, data) is the array of the header with its data at data;
+ * its shape and strides point into the header.
+ *
+ * npy_make_header(header, view, dtype) describes an array to write: in
+ * Fortran order if view is dense and column-major (and not row-major),
+ * otherwise in C order. npy_format_header(buf, header) appends the header,
+ * setting header_size.
+ *
+ * npy_write_ndview(fd, view, dtype, buf) writes an array as a .npy file and
+ * returns the number of bytes written, or -1 (with errno set). Dense arrays go
+ * out straight from their memory; others are copied into buf a few rows at a
+ * time.
+ *
+ * npy_map(map, fd, writable) maps a .npy file into memory, and map.view is
+ * its array, without copying anything (the header and the data have to be in
+ * the file from its start). Writable maps are shared with the file, others are
+ * private and read-only. npy_unmap(map) unmaps it. Both return 0 or an errno
+ * value.
+ *
+ * Converting streams one array at a time, without holding it in memory:
+ *  - npy_to_kvnl(npy_fd, kvnl_fd, writer, hash, buf): reads a .npy file from
+ *    npy_fd and writes it as an array record to kvnl_fd with writer (see
+ *    kvnl_write_ndview_with()), in NPY_CHUNK pieces through buf; a writer with
+ *    a codec or a checksum needs the whole array at once, which is mapped from
+ *    a regular file, or read into buf from anything else
+ *  - kvnl_to_npy(kvnl_fd, npy_fd, reader, hash, buf): reads the next array
+ *    record from kvnl_fd with reader (see kvnl_read_ndview()) and writes it as
+ *    a .npy file to npy_fd, in NPY_CHUNK pieces through buf if the payload is
+ *    raw and dense; encoded or strided ones are read whole into buf first
+ * Both return NULL, or an error like the kvnl readers do ("EOF" at the end of
+ * the kvnl stream). Fortran-order arrays keep their order both ways, encoded
+ * or not. hash is the stream hash of the kvnl side.
+ */
+
+#define NPY_MAX_NDIM KVNL_MAX_NDIM
+#define NPY_ALIGN 64
+#define NPY_CHUNK (256 * 1024)
+
+struct npy_header {
+	struct dtype dtype;
+	int fortran_order;
+	size_t ndim;
+	size_t shape[NPY_MAX_NDIM];
+	ssize_t strides[NPY_MAX_NDIM];
+	size_t header_size, data_size;
+};
+
+struct npy_map {
+	struct npy_header header;
+	struct ndview view;
+	void * data;
+	size_t size;
+};
+
+int npy_parse_header(struct view input, struct npy_header * header);
+int npy_read_header(int fd, struct npy_header * header, struct buf * buf);
+struct ndview npy_ndview(struct npy_header * header, void * data);
+int npy_make_header(struct npy_header * header, struct ndview const * view, struct dtype dtype);
+int npy_format_header(struct buf * buf, struct npy_header * header);
+ssize_t npy_write_ndview(int fd, struct ndview const * view, struct dtype dtype, struct buf * buf);
+
+int npy_map(struct npy_map * map, int fd, int writable);
+int npy_unmap(struct npy_map * map);
+
+const char * npy_to_kvnl(int npy_fd, int kvnl_fd, struct kvnl_ndview_writer * writer, kvnl_hash * hash, struct buf * buf);
+const char * kvnl_to_npy(int kvnl_fd, int npy_fd, struct kvnl_ndview_reader * reader, kvnl_hash * hash, struct buf * buf);
+
+#endif//__NPY_H__
@@ -0,0 +1,52 @@
+#ifndef __RELAY_H__
+#define __RELAY_H__
+#include <kvnl.h>
+
+/**
+ * relay - forwarding kvnl records between descriptors
+ *
+ * kvnl_relay_line(fd, relay, hash) reads the next record from fd and forwards
+ * it to the descriptor that relay.route() picks for it, or drops it. Only the
+ * specification is parsed: the value of a sized record larger than inspect
+ * bytes moves from fd to its destination inside the kernel, with
+ * copy_file_range() between files, splice() to or from pipes, sendfile() from
+ * files, and splice() through a pipe of the relay otherwise. Dropped values are
+ * skipped with lseek() or spliced into /dev/null. Whatever the kernel refuses
+ * is copied through memory instead.
+ *
+ * Values are only pulled into memory when something has to look at them:
+ *  - route(ctx, line): returns the descriptor to forward a record to, or
+ *                      KVNL_RELAY_DROP; line holds the key and the size, and
+ *                      the value of unsized records and sized ones of at most
+ *                      inspect bytes (those are forwarded with a single write,
+ *                      which beats the kernel for small values); larger values
+ *                      are NULL
+ *  - hash: the stream hash, as for kvnl_read_line(), needs every byte
+ *  - verify: checksum records are forwarded with the record they cover, and
+ *            verified on the way if set (the record has been forwarded by the
+ *            time a mismatch is known)
+ *
+ * The returned line is the record that was read (a checksum record is returned
+ * with the record it covers), with an error if reading or forwarding failed;
+ * "EOF" at the end of the stream. Its key lives in relay.buf until the next
+ * call. Blocking descriptors are assumed.
+ */
+
+#define KVNL_RELAY_DROP (-1)
+#define KVNL_RELAY_INSPECT 4096
+#define KVNL_RELAY_CHUNK (64 * 1024)
+
+struct kvnl_relay {
+	int (*route)(void * ctx, kvnl_line const * line);
+	void * ctx;
+	size_t inspect;
+	int verify;
+	struct buf buf, bounce;
+	int pipe[2], null_fd;
+};
+
+struct kvnl_relay make_kvnl_relay(int (*route)(void * ctx, kvnl_line const * line), void * ctx);
+int kvnl_relay_free(struct kvnl_relay *);
+kvnl_line kvnl_relay_line(int fd, struct kvnl_relay * relay, kvnl_hash * hash);
+
+#endif//__RELAY_H__
@@ -0,0 +1,74 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__
+#include <sys/types.h>
+#include <kvnl.h>
+
+/**
+ * scan - parallel scanning of kvnl files
+ *
+ * kvnl_scan(fd, scanner) goes through every record of a regular file, like
+ * calling kvnl_read_line() until EOF, but the file is split into chunks of
+ * about chunk_size bytes that up to n_threads threads parse at once. The file
+ * is mapped into memory and parsed in place with kvnl_parse_line(), so keys and
+ * values are only valid during the callback that gets them.
+ *
+ * Only the first chunk knows where its first record starts, as sized values
+ * may hold anything, newlines included. Every other chunk guesses: the first
+ * line start from which KVNL_SCAN_PROBE records parse (or the rest of the file
+ * does). Parsing a chunk goes on past its end up to the next record boundary,
+ * which is where the next chunk really starts, and the two are compared when
+ * the chunks are merged. A chunk that guessed wrong, say because it started
+ * inside a value that looks like records, is reset and parsed again from the
+ * right place, so the records are always the ones a sequential read gets.
+ *
+ * Records are delivered through callbacks, with a state per chunk (all of
+ * them are optional):
+ *  - begin(ctx, chunk): returns the state of a chunk, NULL on failure
+ *  - record(state, line, offset): gets a record and its offset in the file,
+ *                                 which is the offset of its checksum record if
+ *                                 it has one; return non-zero to stop (which
+ *                                 only stops the scan if the chunk started at
+ *                                 the right place, as record may also see the
+ *                                 records of a wrong guess before its reset)
+ *  - reset(state): forgets the records of a chunk that started at the wrong
+ *                  place
+ *  - merge(ctx, state): gets the states in file order, and owns them; return
+ *                       non-zero to stop
+ *  - discard(ctx, state): gets the states that won't be merged once the scan
+ *                         stopped early
+ * begin, record and reset run in several threads at once, for different
+ * chunks; merge runs for one chunk at a time. At most 2 * n_threads chunks are
+ * held at once, so memory stays bounded however large the file is. Leaving
+ * them all out validates the file (and its checksums) in parallel.
+ *
+ * The result holds the number of records, the offset where the scan stopped
+ * (the end of the file, or of the last record that was merged) and the reason
+ * if it stopped early: a malformed record, a checksum mismatch, a record cut
+ * short at the end of the file, or a callback.
+ *
+ * n_threads of 0 counts as 1; chunk_size of 0 picks KVNL_SCAN_CHUNK_SIZE.
+ */
+
+#define KVNL_SCAN_PROBE 8
+#define KVNL_SCAN_CHUNK_SIZE (16 * 1024 * 1024)
+
+struct kvnl_scanner {
+	size_t n_threads;
+	size_t chunk_size;
+	void * ctx;
+	void * (*begin)(void * ctx, size_t chunk);
+	int (*record)(void * state, kvnl_line const * line, off_t offset);
+	void (*reset)(void * state);
+	int (*merge)(void * ctx, void * state);
+	void (*discard)(void * ctx, void * state);
+};
+
+typedef struct kvnl_scan_result {
+	size_t n_records;
+	off_t offset;
+	const char * error;
+} kvnl_scan_result;
+
+kvnl_scan_result kvnl_scan(int fd, struct kvnl_scanner const * scanner);
+
+#endif//__SCAN_H__
@@ -0,0 +1,112 @@
+#ifndef __TILE_H__
+#define __TILE_H__
+#include <sys/types.h>
+#include <kvnl.h>
+
+/**
+ * tile - arrays stored as a grid of cache-sized tiles
+ *
+ * Row-major arrays keep the neighbours of an element along the rows close, but
+ * put the ones along the columns a whole row apart, so walking down a column
+ * touches a cache line (and soon a page) per element. A tiled array cuts the
+ * array into tiles of a fixed shape, each one dense in memory, and stores the
+ * tiles one after the other in row-major order of the grid: a kernel working
+ * on one tile at a time has all of it in the cache whichever way it goes.
+ *
+ * A struct tile_layout describes a tiled array of 1 to TILE_MAX_NDIM
+ * dimensions:
+ *  - shape: the shape of the array
+ *  - tile: the shape of a tile; tiles at the far edges are cut short by the
+ *          shape of the array but still take up the space of a whole tile
+ *  - grid: the number of tiles along each dimension
+ *  - item_size, tile_size: the size of an element and of a tile in bytes
+ *  - morton: the elements of a tile are in Morton (Z) order, interleaving the
+ *            bits of their indices, rather than in row-major order, so that
+ *            the elements near one are near it in memory too whichever the
+ *            direction; the tile shape must be powers of two then
+ * tile_make_layout(layout, ndim, shape, tile, item_size, morton) sets one up,
+ * returning 0, or EINVAL if it doesn't make sense (or overflows).
+ * tile_default_shape(ndim, item_size, tile) picks the largest power of two edge
+ * for which a tile fits in TILE_BYTES.
+ *
+ * tile_layout_size(layout) is the size of the tiled array in bytes, and
+ * tile_count(layout) the number of tiles. tile_offset(layout, index) is where
+ * element index of the array is, in bytes from the start of the tiled array.
+ *
+ * tile_pack(layout, tiled, src) copies the strided array src into the tiled
+ * array at tiled, and tile_unpack(layout, dst, tiled) copies it back out, both
+ * a tile at a time, so that the strided side is read or written in blocks that
+ * stay in the cache. Packing zeroes what edge tiles have past the array. Both
+ * return 0, or EINVAL if the shapes differ.
+ *
+ * tile_seek(layout, tiled, index, tile) describes the tile number index of the
+ * tiled array at tiled, and returns 0, or ERANGE past the last one:
+ *  - origin: the index of its first element in the array
+ *  - shape: its shape, cut short at the edges
+ *  - data: its memory
+ *  - view: its elements as an ndview (pointing into the tile) when they are in
+ *          row-major order; INVALID_NDVIEW in Morton order, where
+ *          tile_offset() finds them
+ * for tile_iter(layout, tiled, name) { ... } goes through all of them.
+ *
+ * tile_write(fd, writer, layout, tiled, dtype, hash, fmt_buf) writes a tiled
+ * array as an array record (see kvnl_write_ndview_with()) whose layout record
+ * holds the layout (see tile_snprint_layout()). The array of the record is the
+ * tiled array as it is in memory: its shape is the grid followed by the tile
+ * shape, or by the number of elements of a tile in Morton order, so readers
+ * that don't know about tiles still get the right elements, if in tiles.
+ * tile_read(fd, reader, layout, data, hash) reads such a record back, with the
+ * tiled array at the start of data, and sets layout; it returns NULL, or an
+ * error like kvnl_read_ndview() does, including for arrays that aren't tiled.
+ *
+ * tile_snprint_layout(layout, str, size) formats a layout like snprintf(), as
+ * "tiled", the shape, the tile shape and "morton" if it is in Morton order,
+ * separated by spaces; tile_parse_layout(layout, text, item_size) parses it
+ * back and returns 0, or EINVAL.
+ */
+
+#define TILE_MAX_NDIM 3
+#define TILE_BYTES (32 * 1024)
+
+struct tile_layout {
+	size_t ndim;
+	size_t shape[TILE_MAX_NDIM];
+	size_t tile[TILE_MAX_NDIM];
+	size_t grid[TILE_MAX_NDIM];
+	size_t item_size, tile_size;
+	int morton;
+};
+
+struct tile {
+	size_t index;
+	size_t origin[TILE_MAX_NDIM];
+	size_t shape[TILE_MAX_NDIM];
+	ssize_t strides[TILE_MAX_NDIM];
+	void * data;
+	struct ndview view;
+};
+
+int tile_make_layout(struct tile_layout * layout, size_t ndim, size_t const * shape, size_t const * tile, size_t item_size, int morton);
+int tile_default_shape(size_t ndim, size_t item_size, size_t * tile);
+size_t tile_layout_size(struct tile_layout const * layout);
+size_t tile_count(struct tile_layout const * layout);
+size_t tile_offset(struct tile_layout const * layout, size_t const * index);
+
+int tile_pack(struct tile_layout const * layout, void * tiled, struct ndview const * src);
+int tile_unpack(struct tile_layout const * layout, struct ndview const * dst, void const * tiled);
+
+int tile_seek(struct tile_layout const * layout, void * tiled, size_t index, struct tile * tile);
+
+#define tile_iter(layout, tiled, name) ( \
+	struct tile name = { 0 }; \
+	tile_seek((layout), (tiled), name.index, &name) == 0; \
+	name.index++ \
+)
+
+int tile_snprint_layout(struct tile_layout const * layout, char * str, size_t size);
+int tile_parse_layout(struct tile_layout * layout, struct view text, size_t item_size);
+
+ssize_t tile_write(int fd, struct kvnl_ndview_writer * writer, struct tile_layout const * layout, void const * tiled, struct dtype dtype, kvnl_hash * hash, struct buf * fmt_buf);
+const char * tile_read(int fd, struct kvnl_ndview_reader * reader, struct tile_layout * layout, struct buf * data, kvnl_hash * hash);
+
+#endif//__TILE_H__
@@ -0,0 +1,103 @@
+#ifndef __URING_H__
+#define __URING_H__
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <kvnl.h>
+
+/**
+ * uring - asynchronous reads and writes of kvnl streams through io_uring
+ *
+ * A struct kvnl_uring is an I/O engine bound to one descriptor, which either
+ * reads from it or writes to it, whichever it is used for first. It moves the
+ * data in blocks of block_size bytes, up to depth of them in flight at once,
+ * through a ring of its own set up with io_uring_setup(), and the blocks are
+ * registered with the kernel, so it doesn't map them for every request. A
+ * single io_uring_enter() submits all the blocks there is room for, and reaps
+ * whatever completed in the meantime; the calling thread only waits for a
+ * block when there is nothing else to do.
+ *
+ * Reading keeps depth blocks of read-ahead in flight at increasing offsets of
+ * a regular file, and hands them out as they complete: kvnl_uring_read(uring,
+ * dst, size) works like read(), but copies out of the blocks that are already
+ * in, and only waits if none is. Pipes and sockets get no read-ahead, as their
+ * data may never come: a block is read from them, one at a time, only when a
+ * call finds nothing left to copy, and the call waits for it. A short read or
+ * the end of the file cancels the read-ahead past it, and reading starts over
+ * from there the next time, so files that grow can be followed. Set uring on a
+ * block reader to have kvnl_read_block() read through it (see inc/kvnl.h).
+ *
+ * Writing goes the other way: kvnl_uring_write(uring, view) appends the bytes
+ * of encoded records to the current block, which is submitted once full while
+ * the next one fills up, so many small records go out in one request. A
+ * regular file gets its blocks written at increasing offsets, in any order and
+ * depth at a time; pipes, sockets and files opened with O_APPEND get one block
+ * at a time. kvnl_uring_write_line(uring, key, value, sized, hash, spec_buf)
+ * encodes a record like kvnl_write_line() into it. kvnl_uring_flush(uring)
+ * submits the last block, however full, waits for all of them, and moves the
+ * file offset of a regular file past what was written. Write errors surface
+ * from the call that finds them, which may be a later one (errors stick until
+ * the engine is freed), and short writes are retried.
+ *
+ * Where the kernel has no io_uring (or forbids it), the same calls fall back
+ * to plain read() and write(): reads go straight into dst, and writes still go
+ * out a block at a time. fallback is set then.
+ *
+ * make_kvnl_uring(fd, depth, block_size) returns an engine for fd; nothing is
+ * set up until the first read or write. 0 picks KVNL_URING_DEPTH and
+ * KVNL_URING_BLOCK, and depth is at most KVNL_URING_MAX_DEPTH.
+ * kvnl_uring_free(uring) cancels the reads in flight (IORING_OP_ASYNC_CANCEL),
+ * waits for the writes, drops what wasn't flushed, and tears the ring down; it
+ * doesn't close fd.
+ *
+ * kvnl_uring_read() and kvnl_uring_write() return the number of bytes, or -1
+ * and set errno; reading a descriptor bound to another engine, or writing to
+ * one that reads, is EINVAL. kvnl_uring_flush() returns 0 or an errno value.
+ * kvnl_uring_write_line() returns what kvnl_write_line() does. Blocking
+ * descriptors are assumed.
+ */
+
+#define KVNL_URING_DEPTH 8
+#define KVNL_URING_MAX_DEPTH 64
+#define KVNL_URING_BLOCK (64 * 1024)
+
+struct kvnl_uring_slot {
+	off_t offset;
+	size_t size, done;
+	int busy, error;
+	struct iovec iov;
+};
+
+enum kvnl_uring_mode {
+	KVNL_URING_UNUSED = 0,
+	KVNL_URING_READING = 1,
+	KVNL_URING_WRITING = 2,
+};
+
+struct kvnl_uring {
+	int fd;
+	size_t depth, block_size;
+	enum kvnl_uring_mode mode;
+	int fallback, fixed, seekable, error;
+	off_t offset;
+	uint64_t head, tail;
+	size_t used;
+	int cancelling;
+	struct buf blocks;
+	struct kvnl_uring_slot slots[KVNL_URING_MAX_DEPTH];
+	int ring_fd;
+	void * sq_ring, * cq_ring, * sqes;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned * sq_head, * sq_tail, * sq_array, * cq_head, * cq_tail;
+	unsigned sq_mask, cq_mask;
+	void * cqes;
+};
+
+struct kvnl_uring make_kvnl_uring(int fd, size_t depth, size_t block_size);
+int kvnl_uring_free(struct kvnl_uring * uring);
+ssize_t kvnl_uring_read(struct kvnl_uring * uring, void * dst, size_t size);
+ssize_t kvnl_uring_write(struct kvnl_uring * uring, struct view view);
+ssize_t kvnl_uring_write_line(struct kvnl_uring * uring, char * key, struct view value, int sized, kvnl_hash * hash, struct buf * spec_buf);
+int kvnl_uring_flush(struct kvnl_uring * uring);
+
+#endif//__URING_H__
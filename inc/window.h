@@ -0,0 +1,67 @@
+#ifndef __WINDOW_H__
+#define __WINDOW_H__
+#include <stdint.h>
+#include <kvnl.h>
+
+/**
+ * window - sliding windows over the rows of a stream of arrays
+ *
+ * A window keeps the latest rows of a stream of arrays (the rows of an array
+ * being its slices along the first dimension, all of the same shape and dtype)
+ * in a ring, and hands out the latest size rows at a time as an ndview into
+ * it, moving on by hop rows every time, without copying anything. The ring is
+ * mapped twice in a row, so that any capacity rows of it are one piece of
+ * memory even where they wrap around; windows are plain dense views, and so
+ * are batches of windows: an ndview whose first dimension goes from window to
+ * window in steps of hop rows, such that windows that overlap share memory.
+ *
+ * make_kvnl_window(size, hop, capacity) returns a window of size rows moving
+ * on by hop rows, whose ring holds at least capacity rows (0 picks
+ * KVNL_WINDOW_ROWS); nothing is allocated until the first rows come in. The
+ * capacity is rounded up to a whole number of pages, and grows to hold what
+ * it has to. kvnl_window_free(window) unmaps the ring.
+ *
+ * kvnl_window_push(window, rows, dtype) copies the rows of an array into the
+ * ring; the first one decides the dtype and the shape of a row, which the
+ * others have to have (EINVAL otherwise). Rows that no window will ever cover
+ * (with hop larger than size) are skipped. It returns 0 or an errno value.
+ * kvnl_window_read(fd, window, reader, data, hash) reads the next array of a
+ * kvnl stream with reader (see kvnl_read_ndview()), through data, and pushes
+ * its rows; it returns NULL or an error like kvnl_read_ndview() does ("EOF" at
+ * the end of the stream).
+ *
+ * kvnl_window_next(window, view) makes view the next window, of shape size
+ * followed by the shape of a row, and moves on; it returns 0, or EAGAIN if not
+ * enough rows have come in yet. kvnl_window_batch(window, max, view) does the
+ * same for as many of the next windows at once as are there, up to max (and as
+ * the capacity allows), with the number of windows as the first dimension of
+ * view. Views point into the window and stay valid until the next push or
+ * read, which may overwrite the rows that no later window needs.
+ *
+ * Counting rows from the start of the stream, end is the number of rows that
+ * came in, and next the first row of the next window; the ring holds the rows
+ * from next on.
+ */
+
+#define KVNL_WINDOW_ROWS 4096
+
+struct kvnl_window {
+	size_t size, hop, capacity;
+	struct dtype dtype;
+	size_t ndim;
+	size_t row_size;
+	uint64_t end, next;
+	char * ring;
+	size_t ring_size;
+	size_t shape[KVNL_MAX_NDIM + 1];
+	ssize_t strides[KVNL_MAX_NDIM + 1];
+};
+
+struct kvnl_window make_kvnl_window(size_t size, size_t hop, size_t capacity);
+int kvnl_window_free(struct kvnl_window * window);
+int kvnl_window_push(struct kvnl_window * window, struct ndview const * rows, struct dtype dtype);
+const char * kvnl_window_read(int fd, struct kvnl_window * window, struct kvnl_ndview_reader * reader, struct buf * data, kvnl_hash * hash);
+int kvnl_window_next(struct kvnl_window * window, struct ndview * view);
+int kvnl_window_batch(struct kvnl_window * window, size_t max, struct ndview * view);
+
+#endif//__WINDOW_H__
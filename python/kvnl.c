@@ -0,0 +1,804 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <errno.h>
+#include <string.h>
+#include <buf.h>
+#include <ndview.h>
+#include <dtype.h>
+#include <kvnl.h>
+
+/**
+ * kvnl - CPython bindings for bufs, ndviews and kvnl streams
+ *
+ * Built with make python, against the python3 found by python3-config (make
+ * python PYTHON=python3.12 picks another one). Everything is exchanged through
+ * the buffer protocol (PEP 3118), so that NumPy wraps arrays that were read
+ * without copying them, and writes arrays and bytes-like objects straight from
+ * their memory:
+ *
+ *  - kvnl.Buffer: a frozen buf (see buf_freeze()), or a view_ref into one;
+ *                 read-only bytes, valid for as long as anything holds them
+ *  - kvnl.NDView: a frozen ndview (see ndview_freeze()), exported with the
+ *                 shape, strides and format of its dtype ("<f8" is "d" on a
+ *                 little endian machine, ">f8" is ">d", "c16" is "Zd");
+ *                 numpy.asarray(ndview) is a read-only array over the same
+ *                 memory
+ *  - kvnl.Reader(file, threads=1): reads from a descriptor, or from anything
+ *                                  with a fileno()
+ *     - read_line(): the next record as (key, value), with the key as bytes
+ *                    and the value as a Buffer over the memory it was read
+ *                    into, or None at the end of the stream
+ *     - read_ndview(dtype=None): the next array as an NDView, converted to
+ *                                dtype if given, or None at the end
+ *     - iterating yields read_line() until the end
+ *  - kvnl.Writer(file, checksum=None, align=0, dedup=False, filters=None,
+ *                threads=1): writes to a descriptor, with the options of a
+ *                struct kvnl_ndview_writer (filters is a string such as
+ *                "shuffle lz", checksum "crc32c" or "xxh64")
+ *     - write_line(key, value, sized=None): value is a str or any bytes-like
+ *                                           object; sized=None sizes values
+ *                                           longer than 1024 bytes or holding
+ *                                           a newline
+ *     - write_ndview(array, dtype=None): array is anything exporting a strided
+ *                                        buffer with a format, or dtype to
+ *                                        override it with one of the same size
+ *    both return the number of bytes written
+ *
+ * The descriptors are read and written directly, past any buffering of a
+ * Python file object, so flush those first, and don't mix their reads with
+ * these. Readers and writers drop the GIL while doing I/O, and can't be used
+ * by two threads at once. Reading and parsing errors raise kvnl.Error, a
+ * ValueError, and failed system calls OSError.
+ */
+
+static PyObject * KvnlError;
+
+/* one thread at a time per reader or writer, since the GIL is dropped while they work */
+static int enter(int * busy, char const * what)
+{
+	if (*busy) {
+		PyErr_Format(PyExc_RuntimeError, "the %s is in use by another thread", what);
+		return -1;
+	}
+	*busy = 1;
+	return 0;
+}
+
+static PyObject * raise_read_error(char const * error, int saved_errno)
+{
+	if (strstr(error, "consult errno") && saved_errno) {
+		errno = saved_errno;
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+	PyErr_SetString(KvnlError, error);
+	return NULL;
+}
+
+static PyObject * raise_write_error(ssize_t r, int saved_errno)
+{
+	if (r == -1) {
+		errno = saved_errno ? saved_errno : EIO;
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+	PyErr_SetString(KvnlError, kvnl_look_up_error(r));
+	return NULL;
+}
+
+
+/* dtypes and PEP 3118 formats */
+
+static char format_code(enum dtype_kind kind, size_t size)
+{
+	switch (kind) {
+	case DTYPE_BOOL: return size == 1 ? '?' : 0;
+	case DTYPE_INT: return size == 1 ? 'b' : size == 2 ? 'h' : size == 4 ? 'i' : size == 8 ? 'q' : 0;
+	case DTYPE_UINT: return size == 1 ? 'B' : size == 2 ? 'H' : size == 4 ? 'I' : size == 8 ? 'Q' : 0;
+	case DTYPE_FLOAT: return size == 2 ? 'e' : size == 4 ? 'f' : size == 8 ? 'd' : 0;
+	case DTYPE_COMPLEX: return size == 8 ? 'f' : size == 16 ? 'd' : 0;
+	default: return 0;
+	}
+}
+
+/* native elements go without a byte order, so that memoryview can index them */
+static int dtype_format(struct dtype dtype, char * format)
+{
+	char const code = format_code(dtype.kind, dtype.size);
+	if (code == 0) return -1;
+	if (dtype.endian != DTYPE_NOT_APPLICABLE && !dtype_is_native(dtype)) *format++ = dtype.endian;
+	if (dtype.kind == DTYPE_COMPLEX) *format++ = 'Z';
+	*format++ = code;
+	*format = '\0';
+	return 0;
+}
+
+static struct dtype format_dtype(char const * format)
+{
+	if (format == NULL) return make_dtype(DTYPE_UINT, 1);
+	enum dtype_endian endian = DTYPE_NATIVE;
+	int standard = 1;
+	switch (*format) {
+	case '@': standard = 0; /* fall through */
+	case '=': format++; break;
+	case '<': endian = DTYPE_LITTLE; format++; break;
+	case '>': case '!': endian = DTYPE_BIG; format++; break;
+	default: standard = 0;
+	}
+	int const complex = *format == 'Z';
+	format += complex;
+	if (format[0] == '\0' || format[1] != '\0') return INVALID_DTYPE;
+
+	enum dtype_kind kind;
+	size_t size;
+	switch (*format) {
+	case '?': kind = DTYPE_BOOL; size = 1; break;
+	case 'b': kind = DTYPE_INT; size = 1; break;
+	case 'B': kind = DTYPE_UINT; size = 1; break;
+	case 'h': kind = DTYPE_INT; size = 2; break;
+	case 'H': kind = DTYPE_UINT; size = 2; break;
+	case 'i': kind = DTYPE_INT; size = standard ? 4 : sizeof(int); break;
+	case 'I': kind = DTYPE_UINT; size = standard ? 4 : sizeof(int); break;
+	case 'l': kind = DTYPE_INT; size = standard ? 4 : sizeof(long); break;
+	case 'L': kind = DTYPE_UINT; size = standard ? 4 : sizeof(long); break;
+	case 'q': kind = DTYPE_INT; size = 8; break;
+	case 'Q': kind = DTYPE_UINT; size = 8; break;
+	case 'n': kind = DTYPE_INT; size = sizeof(ssize_t); break;
+	case 'N': kind = DTYPE_UINT; size = sizeof(size_t); break;
+	case 'e': kind = DTYPE_FLOAT; size = 2; break;
+	case 'f': kind = DTYPE_FLOAT; size = 4; break;
+	case 'd': kind = DTYPE_FLOAT; size = 8; break;
+	default: return INVALID_DTYPE;
+	}
+	if (complex) {
+		if (kind != DTYPE_FLOAT) return INVALID_DTYPE;
+		kind = DTYPE_COMPLEX;
+		size *= 2;
+	}
+	struct dtype dtype = make_dtype(kind, size);
+	if (dtype_is_valid(dtype) && dtype.endian != DTYPE_NOT_APPLICABLE) dtype.endian = endian;
+	return dtype;
+}
+
+static int parse_dtype_arg(PyObject * arg, struct dtype * dtype)
+{
+	Py_ssize_t size;
+	char const * str = PyUnicode_AsUTF8AndSize(arg, &size);
+	if (str == NULL) return -1;
+	*dtype = dtype_parse((struct view){ (char *)str, size });
+	if (!dtype_is_valid(*dtype)) {
+		PyErr_Format(PyExc_ValueError, "invalid dtype %R", arg);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* kvnl.Buffer */
+
+typedef struct {
+	PyObject_HEAD
+	struct view_ref ref;
+} BufferObject;
+
+static PyTypeObject BufferType;
+
+static void Buffer_dealloc(BufferObject * self)
+{
+	view_ref_release(&self->ref);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int Buffer_getbuffer(BufferObject * self, Py_buffer * view, int flags)
+{
+	void * data = self->ref.view.data != NULL ? self->ref.view.data : "";
+	return PyBuffer_FillInfo(view, (PyObject *)self, data, self->ref.view.size, 1, flags);
+}
+
+static Py_ssize_t Buffer_length(BufferObject * self)
+{
+	return self->ref.view.size;
+}
+
+static PyObject * Buffer_repr(BufferObject * self)
+{
+	return PyUnicode_FromFormat("<kvnl.Buffer of %zd bytes>", (Py_ssize_t)self->ref.view.size);
+}
+
+static PyBufferProcs Buffer_as_buffer = {
+	.bf_getbuffer = (getbufferproc)Buffer_getbuffer,
+};
+
+static PySequenceMethods Buffer_as_sequence = {
+	.sq_length = (lenfunc)Buffer_length,
+};
+
+static PyTypeObject BufferType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "kvnl.Buffer",
+	.tp_doc = PyDoc_STR("Read-only bytes in a frozen buf, exported through the buffer protocol."),
+	.tp_basicsize = sizeof(BufferObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc = (destructor)Buffer_dealloc,
+	.tp_repr = (reprfunc)Buffer_repr,
+	.tp_as_buffer = &Buffer_as_buffer,
+	.tp_as_sequence = &Buffer_as_sequence,
+};
+
+/* takes over the reference of ref */
+static PyObject * make_buffer_object(struct view_ref ref)
+{
+	BufferObject * self = PyObject_New(BufferObject, &BufferType);
+	if (self == NULL) {
+		view_ref_release(&ref);
+		return NULL;
+	}
+	memcpy(&self->ref, &ref, sizeof(ref));
+	return (PyObject *)self;
+}
+
+
+/* kvnl.NDView */
+
+typedef struct {
+	PyObject_HEAD
+	struct ndview_ref ref;
+	struct dtype dtype;
+	char format[4];
+	Py_ssize_t len;
+	Py_ssize_t shape[KVNL_MAX_NDIM];
+	Py_ssize_t strides[KVNL_MAX_NDIM];
+} NDViewObject;
+
+static PyTypeObject NDViewType;
+
+static void NDView_dealloc(NDViewObject * self)
+{
+	ndview_ref_release(&self->ref);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int NDView_getbuffer(NDViewObject * self, Py_buffer * view, int flags)
+{
+	if (flags & PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError, "kvnl.NDView is read-only");
+		return -1;
+	}
+	*view = (Py_buffer){
+		.buf = self->ref.view.data != NULL ? self->ref.view.data : "",
+		.len = self->len,
+		.itemsize = self->dtype.size,
+		.readonly = 1,
+		.ndim = self->ref.view.ndim,
+		.format = self->format,
+		.shape = self->shape,
+		.strides = self->strides,
+	};
+
+	/* consumers that don't take strides, or ask for contiguity, get it or nothing */
+	char const order =
+		(flags & PyBUF_ANY_CONTIGUOUS) == PyBUF_ANY_CONTIGUOUS ? 'A' :
+		(flags & PyBUF_F_CONTIGUOUS) == PyBUF_F_CONTIGUOUS ? 'F' :
+		(flags & PyBUF_STRIDES) != PyBUF_STRIDES ? 'C' :
+		(flags & PyBUF_C_CONTIGUOUS) == PyBUF_C_CONTIGUOUS ? 'C' : 0;
+	if (order && !PyBuffer_IsContiguous(view, order)) {
+		PyErr_SetString(PyExc_BufferError, "kvnl.NDView is not contiguous");
+		return -1;
+	}
+	if (!(flags & PyBUF_FORMAT)) view->format = NULL;
+	if ((flags & PyBUF_STRIDES) != PyBUF_STRIDES) view->strides = NULL;
+	if (!(flags & PyBUF_ND)) view->shape = NULL;
+	view->obj = Py_NewRef(self);
+	return 0;
+}
+
+static PyObject * NDView_get_dtype(NDViewObject * self, void * closure)
+{
+	(void)closure;
+	char str[16];
+	dtype_snprint(self->dtype, str, sizeof(str));
+	return PyUnicode_FromString(str);
+}
+
+static PyObject * ssize_tuple(Py_ssize_t const * values, size_t n)
+{
+	PyObject * tuple = PyTuple_New(n);
+	if (tuple == NULL) return NULL;
+	for (size_t i = 0; i < n; i++) {
+		PyObject * item = PyLong_FromSsize_t(values[i]);
+		if (item == NULL) {
+			Py_DECREF(tuple);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(tuple, i, item);
+	}
+	return tuple;
+}
+
+static PyObject * NDView_get_shape(NDViewObject * self, void * closure)
+{
+	(void)closure;
+	return ssize_tuple(self->shape, self->ref.view.ndim);
+}
+
+static PyObject * NDView_get_strides(NDViewObject * self, void * closure)
+{
+	(void)closure;
+	return ssize_tuple(self->strides, self->ref.view.ndim);
+}
+
+static Py_ssize_t NDView_length(NDViewObject * self)
+{
+	if (self->ref.view.ndim == 0) {
+		PyErr_SetString(PyExc_TypeError, "len() of a 0-d kvnl.NDView");
+		return -1;
+	}
+	return self->shape[0];
+}
+
+static PyObject * NDView_repr(NDViewObject * self)
+{
+	char dtype[16];
+	dtype_snprint(self->dtype, dtype, sizeof(dtype));
+	PyObject * shape = NDView_get_shape(self, NULL);
+	if (shape == NULL) return NULL;
+	PyObject * repr = PyUnicode_FromFormat("<kvnl.NDView of %s with shape %R>", dtype, shape);
+	Py_DECREF(shape);
+	return repr;
+}
+
+static PyGetSetDef NDView_getset[] = {
+	{ "dtype", (getter)NDView_get_dtype, NULL, PyDoc_STR("NumPy-style descriptor of the elements"), NULL },
+	{ "shape", (getter)NDView_get_shape, NULL, PyDoc_STR("shape, as a tuple"), NULL },
+	{ "strides", (getter)NDView_get_strides, NULL, PyDoc_STR("strides in bytes, as a tuple"), NULL },
+	{ NULL },
+};
+
+static PyBufferProcs NDView_as_buffer = {
+	.bf_getbuffer = (getbufferproc)NDView_getbuffer,
+};
+
+static PySequenceMethods NDView_as_sequence = {
+	.sq_length = (lenfunc)NDView_length,
+};
+
+static PyTypeObject NDViewType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "kvnl.NDView",
+	.tp_doc = PyDoc_STR("A read-only array in a frozen buf, exported through the buffer protocol."),
+	.tp_basicsize = sizeof(NDViewObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc = (destructor)NDView_dealloc,
+	.tp_repr = (reprfunc)NDView_repr,
+	.tp_getset = NDView_getset,
+	.tp_as_buffer = &NDView_as_buffer,
+	.tp_as_sequence = &NDView_as_sequence,
+};
+
+/* freezes data, which holds view; an empty array may have no memory at all */
+static PyObject * make_ndview_object(struct buf * data, struct ndview const * view, struct dtype dtype)
+{
+	NDViewObject * self = PyObject_New(NDViewObject, &NDViewType);
+	if (self == NULL) return NULL;
+	self->ref = (struct ndview_ref){ INVALID_NDVIEW, NULL };
+	self->dtype = dtype;
+	if (dtype_format(dtype, self->format)) {
+		Py_DECREF(self);
+		PyErr_SetString(PyExc_ValueError, "no buffer format for this dtype");
+		return NULL;
+	}
+	self->len = dtype.size;
+	for (size_t i = 0; i < view->ndim; i++) {
+		self->shape[i] = view->shape[i];
+		self->strides[i] = view->strides[i];
+		self->len *= view->shape[i];
+	}
+
+	struct ndview_ref ref = self->len ? ndview_freeze(data, view) : (struct ndview_ref){ *view, NULL };
+	if (ref.view.data == NULL && self->len) {
+		Py_DECREF(self);
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+	memcpy(&self->ref, &ref, sizeof(ref));
+	return (PyObject *)self;
+}
+
+
+/* kvnl.Reader */
+
+typedef struct {
+	PyObject_HEAD
+	PyObject * file;
+	int fd, busy;
+	struct buf line, data;
+	struct kvnl_ndview_reader ndview;
+} ReaderObject;
+
+static int Reader_init(ReaderObject * self, PyObject * args, PyObject * kwargs)
+{
+	static char * keywords[] = { "file", "threads", NULL };
+	PyObject * file;
+	Py_ssize_t threads = 1;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|n:Reader", keywords, &file, &threads))
+		return -1;
+	int const fd = PyObject_AsFileDescriptor(file);
+	if (fd < 0) return -1;
+	if (threads < 1) {
+		PyErr_SetString(PyExc_ValueError, "threads must be at least 1");
+		return -1;
+	}
+	Py_XSETREF(self->file, Py_NewRef(file));
+	self->fd = fd;
+	self->ndview.codec.n_threads = threads;
+	return 0;
+}
+
+static PyObject * Reader_new(PyTypeObject * type, PyObject * args, PyObject * kwargs)
+{
+	(void)args, (void)kwargs;
+	ReaderObject * self = (ReaderObject *)type->tp_alloc(type, 0);
+	if (self == NULL) return NULL;
+	self->fd = -1;
+	self->line = make_buf_grow_only(2.0f);
+	self->data = make_buf_aligned(64);
+	self->ndview = make_kvnl_ndview_reader();
+	return (PyObject *)self;
+}
+
+static void Reader_dealloc(ReaderObject * self)
+{
+	buf_free(&self->line);
+	buf_free(&self->data);
+	kvnl_ndview_reader_free(&self->ndview);
+	Py_XDECREF(self->file);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* an empty value needs no memory */
+static struct view_ref freeze_value(struct buf * buf, struct view value)
+{
+	if (value.size == 0) return (struct view_ref){ { NULL, 0 }, NULL };
+	struct buf_shared * owner = buf_freeze(buf);
+	if (owner == NULL) return (struct view_ref){ { NULL, 0 }, NULL };
+	struct view_ref const ref = view_ref(owner, value);
+	buf_shared_unref(owner);
+	return ref;
+}
+
+static PyObject * Reader_read_line(ReaderObject * self, PyObject * unused)
+{
+	(void)unused;
+	if (enter(&self->busy, "reader")) return NULL;
+	buf_clear(&self->line);
+	PyThreadState * state = PyEval_SaveThread();
+	kvnl_line const line = kvnl_read_line(self->fd, &self->line, NULL);
+	int const error = errno;
+	PyEval_RestoreThread(state);
+	self->busy = 0;
+
+	if (line.error != NULL && line.key.size == 0 && strcmp(line.error, "EOF") == 0)
+		Py_RETURN_NONE;
+	if (line.error != NULL)
+		return raise_read_error(line.error, error);
+
+	/* the value stays where it was read, and the reader starts over with new memory */
+	PyObject * key = PyBytes_FromStringAndSize(line.key.data, line.key.size);
+	if (key == NULL) return NULL;
+	struct view_ref const ref = freeze_value(&self->line, line.value);
+	if (ref.view.size != line.value.size) {
+		Py_DECREF(key);
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+	PyObject * value = make_buffer_object(ref);
+	if (value == NULL) {
+		Py_DECREF(key);
+		return NULL;
+	}
+	return Py_BuildValue("(NN)", key, value);
+}
+
+static PyObject * Reader_read_ndview(ReaderObject * self, PyObject * args, PyObject * kwargs)
+{
+	static char * keywords[] = { "dtype", NULL };
+	PyObject * dtype_arg = Py_None;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:read_ndview", keywords, &dtype_arg))
+		return NULL;
+	struct dtype as = INVALID_DTYPE;
+	if (dtype_arg != Py_None && parse_dtype_arg(dtype_arg, &as)) return NULL;
+
+	if (enter(&self->busy, "reader")) return NULL;
+	PyThreadState * state = PyEval_SaveThread();
+	kvnl_ndview const result = dtype_is_valid(as)
+		? kvnl_read_ndview_as(self->fd, &self->ndview, as, &self->data, NULL)
+		: kvnl_read_ndview(self->fd, &self->ndview, &self->data, NULL);
+	int const error = errno;
+	PyEval_RestoreThread(state);
+	self->busy = 0;
+
+	if (result.error != NULL && strcmp(result.error, "EOF") == 0)
+		Py_RETURN_NONE;
+	if (result.error != NULL)
+		return raise_read_error(result.error, error);
+	struct dtype const dtype = dtype_is_valid(as) ? as : self->ndview.type;
+	if (!dtype_is_valid(dtype))
+		return PyErr_Format(KvnlError, "free-form dtype %.*s", (int)self->ndview.dtype.size, (char *)self->ndview.dtype.data);
+	return make_ndview_object(&self->data, &result.view, dtype);
+}
+
+static PyObject * Reader_iternext(ReaderObject * self)
+{
+	PyObject * line = Reader_read_line(self, NULL);
+	if (line == Py_None) {
+		Py_DECREF(line);
+		return NULL;
+	}
+	return line;
+}
+
+static PyMethodDef Reader_methods[] = {
+	{ "read_line", (PyCFunction)Reader_read_line, METH_NOARGS,
+		PyDoc_STR("read_line() -> (key, value) or None\n\nThe next record, with the value as a kvnl.Buffer.") },
+	{ "read_ndview", (PyCFunction)(void (*)(void))Reader_read_ndview, METH_VARARGS | METH_KEYWORDS,
+		PyDoc_STR("read_ndview(dtype=None) -> kvnl.NDView or None\n\nThe next array, converted to dtype if given.") },
+	{ NULL },
+};
+
+static PyTypeObject ReaderType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "kvnl.Reader",
+	.tp_doc = PyDoc_STR("Reader(file, threads=1)\n\nReads kvnl records and arrays from a file descriptor."),
+	.tp_basicsize = sizeof(ReaderObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = Reader_new,
+	.tp_init = (initproc)Reader_init,
+	.tp_dealloc = (destructor)Reader_dealloc,
+	.tp_iter = PyObject_SelfIter,
+	.tp_iternext = (iternextfunc)Reader_iternext,
+	.tp_methods = Reader_methods,
+};
+
+
+/* kvnl.Writer */
+
+typedef struct {
+	PyObject_HEAD
+	PyObject * file;
+	int fd, busy;
+	struct buf spec;
+	struct kvnl_ndview_writer ndview;
+} WriterObject;
+
+static int parse_filters(struct codec * codec, PyObject * arg)
+{
+	Py_ssize_t size;
+	char const * str = PyUnicode_AsUTF8AndSize(arg, &size);
+	if (str == NULL) return -1;
+	for (Py_ssize_t i = 0; i < size; ) {
+		if (str[i] == ' ') {
+			i++;
+			continue;
+		}
+		Py_ssize_t j = i;
+		while (j < size && str[j] != ' ') j++;
+		if (codec_parse_filter(codec, (struct view){ (char *)str + i, j - i })) {
+			PyErr_Format(PyExc_ValueError, "unknown filter %.*s", (int)(j - i), str + i);
+			return -1;
+		}
+		i = j;
+	}
+	return 0;
+}
+
+static int Writer_init(WriterObject * self, PyObject * args, PyObject * kwargs)
+{
+	static char * keywords[] = { "file", "checksum", "align", "dedup", "filters", "threads", NULL };
+	PyObject * file, * checksum = Py_None, * filters = Py_None;
+	Py_ssize_t align = 0, threads = 1;
+	int dedup = 0;
+	if (!PyArg_ParseTupleAndKeywords(
+		args, kwargs, "O|OnpOn:Writer", keywords,
+		&file, &checksum, &align, &dedup, &filters, &threads
+	))
+		return -1;
+	int const fd = PyObject_AsFileDescriptor(file);
+	if (fd < 0) return -1;
+
+	struct codec codec = IDENTITY_CODEC;
+	if (filters != Py_None && parse_filters(&codec, filters)) return -1;
+	enum hash_kind kind = HASH_NONE;
+	if (checksum != Py_None) {
+		Py_ssize_t size;
+		char const * name = PyUnicode_AsUTF8AndSize(checksum, &size);
+		if (name == NULL) return -1;
+		kind = hash_look_up((struct view){ (char *)name, size });
+		if (kind == HASH_NONE || kind == HASH_INVALID) {
+			PyErr_Format(PyExc_ValueError, "unknown checksum %R", checksum);
+			return -1;
+		}
+	}
+	if (align < 0 || align > KVNL_MAX_ALIGN || threads < 1) {
+		PyErr_SetString(PyExc_ValueError, align < 0 || align > KVNL_MAX_ALIGN ? "align out of range" : "threads must be at least 1");
+		return -1;
+	}
+
+	Py_XSETREF(self->file, Py_NewRef(file));
+	self->fd = fd;
+	codec.n_threads = threads;
+	self->ndview.codec = codec;
+	self->ndview.checksum = kind;
+	self->ndview.align = align;
+	self->ndview.dedup = dedup;
+	return 0;
+}
+
+static PyObject * Writer_new(PyTypeObject * type, PyObject * args, PyObject * kwargs)
+{
+	(void)args, (void)kwargs;
+	WriterObject * self = (WriterObject *)type->tp_alloc(type, 0);
+	if (self == NULL) return NULL;
+	self->fd = -1;
+	self->spec = make_buf_grow_only(2.0f);
+	self->ndview = make_kvnl_ndview_writer();
+	return (PyObject *)self;
+}
+
+static void Writer_dealloc(WriterObject * self)
+{
+	buf_free(&self->spec);
+	kvnl_ndview_writer_free(&self->ndview);
+	Py_XDECREF(self->file);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* a str is written as UTF-8, anything else through the buffer protocol */
+static int get_bytes(PyObject * obj, Py_buffer * view)
+{
+	if (!PyUnicode_Check(obj))
+		return PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS);
+	Py_ssize_t size;
+	char const * str = PyUnicode_AsUTF8AndSize(obj, &size);
+	if (str == NULL) return -1;
+	return PyBuffer_FillInfo(view, obj, (void *)str, size, 1, PyBUF_SIMPLE);
+}
+
+static PyObject * Writer_write_line(WriterObject * self, PyObject * args, PyObject * kwargs)
+{
+	static char * keywords[] = { "key", "value", "sized", NULL };
+	PyObject * key_arg, * value_arg, * sized_arg = Py_None;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|O:write_line", keywords, &key_arg, &value_arg, &sized_arg))
+		return NULL;
+	int sized = -1;
+	if (sized_arg != Py_None && (sized = PyObject_IsTrue(sized_arg)) < 0) return NULL;
+
+	/* kvnl_write_line() wants the key terminated */
+	PyObject * key = PyUnicode_Check(key_arg) ? PyUnicode_AsUTF8String(key_arg) : PyBytes_FromObject(key_arg);
+	if (key == NULL) return NULL;
+	if (strlen(PyBytes_AS_STRING(key)) != (size_t)PyBytes_GET_SIZE(key)) {
+		Py_DECREF(key);
+		PyErr_SetString(PyExc_ValueError, "key contains a NUL byte");
+		return NULL;
+	}
+	Py_buffer value;
+	if (get_bytes(value_arg, &value)) {
+		Py_DECREF(key);
+		return NULL;
+	}
+
+	ssize_t r = -1;
+	int error = 0;
+	if (!enter(&self->busy, "writer")) {
+		PyThreadState * state = PyEval_SaveThread();
+		r = kvnl_write_checked_line(
+			self->fd, PyBytes_AS_STRING(key), (struct view){ value.buf, value.len },
+			sized, self->ndview.checksum, NULL, &self->spec
+		);
+		error = errno;
+		PyEval_RestoreThread(state);
+		self->busy = 0;
+	}
+	PyBuffer_Release(&value);
+	Py_DECREF(key);
+	if (PyErr_Occurred()) return NULL;
+	if (r < 0) return raise_write_error(r, error);
+	return PyLong_FromSsize_t(r);
+}
+
+static PyObject * Writer_write_ndview(WriterObject * self, PyObject * args, PyObject * kwargs)
+{
+	static char * keywords[] = { "array", "dtype", NULL };
+	PyObject * array, * dtype_arg = Py_None;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O:write_ndview", keywords, &array, &dtype_arg))
+		return NULL;
+	struct dtype dtype = INVALID_DTYPE;
+	if (dtype_arg != Py_None && parse_dtype_arg(dtype_arg, &dtype)) return NULL;
+
+	Py_buffer view;
+	if (PyObject_GetBuffer(array, &view, PyBUF_RECORDS_RO)) return NULL;
+	if (view.suboffsets != NULL || view.ndim > KVNL_MAX_NDIM) {
+		PyBuffer_Release(&view);
+		PyErr_SetString(PyExc_ValueError, view.suboffsets ? "indirect arrays can't be written" : "too many dimensions");
+		return NULL;
+	}
+	if (!dtype_is_valid(dtype)) {
+		dtype = format_dtype(view.format);
+		if (!dtype_is_valid(dtype)) {
+			PyErr_Format(PyExc_ValueError, "no dtype for buffer format %s", view.format);
+			PyBuffer_Release(&view);
+			return NULL;
+		}
+	}
+	if (dtype.size != (size_t)view.itemsize) {
+		PyErr_Format(PyExc_ValueError, "dtype of %zu bytes for items of %zd", dtype.size, view.itemsize);
+		PyBuffer_Release(&view);
+		return NULL;
+	}
+
+	size_t shape[KVNL_MAX_NDIM];
+	ssize_t strides[KVNL_MAX_NDIM];
+	for (int i = view.ndim - 1; i >= 0; i--) {
+		shape[i] = view.shape[i];
+		strides[i] = view.strides[i];
+	}
+	struct ndview ndview = make_ndview(view.buf, view.ndim, shape, strides);
+
+	ssize_t r = -1;
+	int error = 0;
+	if (!enter(&self->busy, "writer")) {
+		PyThreadState * state = PyEval_SaveThread();
+		r = kvnl_write_typed_ndview(self->fd, &self->ndview, &ndview, dtype, NULL, &self->spec);
+		error = errno;
+		PyEval_RestoreThread(state);
+		self->busy = 0;
+	}
+	PyBuffer_Release(&view);
+	if (PyErr_Occurred()) return NULL;
+	if (r < 0) return raise_write_error(r, error);
+	return PyLong_FromSsize_t(r);
+}
+
+static PyMethodDef Writer_methods[] = {
+	{ "write_line", (PyCFunction)(void (*)(void))Writer_write_line, METH_VARARGS | METH_KEYWORDS,
+		PyDoc_STR("write_line(key, value, sized=None) -> int\n\nWrites a record, value being a str or bytes-like.") },
+	{ "write_ndview", (PyCFunction)(void (*)(void))Writer_write_ndview, METH_VARARGS | METH_KEYWORDS,
+		PyDoc_STR("write_ndview(array, dtype=None) -> int\n\nWrites an array straight from its buffer.") },
+	{ NULL },
+};
+
+static PyTypeObject WriterType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "kvnl.Writer",
+	.tp_doc = PyDoc_STR(
+		"Writer(file, checksum=None, align=0, dedup=False, filters=None, threads=1)\n\n"
+		"Writes kvnl records and arrays to a file descriptor."
+	),
+	.tp_basicsize = sizeof(WriterObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = Writer_new,
+	.tp_init = (initproc)Writer_init,
+	.tp_dealloc = (destructor)Writer_dealloc,
+	.tp_methods = Writer_methods,
+};
+
+
+static struct PyModuleDef kvnl_module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "kvnl",
+	.m_doc = PyDoc_STR("kvnl streams, with bufs and ndviews exported through the buffer protocol."),
+	.m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_kvnl(void)
+{
+	PyTypeObject * types[] = { &BufferType, &NDViewType, &ReaderType, &WriterType };
+	for (size_t i = 0; i < sizeof(types) / sizeof(*types); i++)
+		if (PyType_Ready(types[i]) < 0) return NULL;
+
+	PyObject * module = PyModule_Create(&kvnl_module);
+	if (module == NULL) return NULL;
+	KvnlError = PyErr_NewExceptionWithDoc("kvnl.Error", "A kvnl stream couldn't be read or written.", PyExc_ValueError, NULL);
+	if (KvnlError == NULL || PyModule_AddObjectRef(module, "Error", KvnlError) < 0) goto fail;
+	for (size_t i = 0; i < sizeof(types) / sizeof(*types); i++)
+		if (PyModule_AddType(module, types[i]) < 0) goto fail;
+	return module;
+fail:
+	Py_DECREF(module);
+	return NULL;
+}
@@ -1,9 +1,23 @@
+#define _GNU_SOURCE /* mremap(), O_TMPFILE */
 #include <buf.h>
+#include <instr.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <math.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_FILL 1
+#endif
 
 struct buf const NULL_BUF = {
 	.data = NULL,
@@ -12,6 +26,7 @@ struct buf const NULL_BUF = {
 	.under = 1.0f / 3.0f,
 	.over = 1.5f,
 	.policy = BUF_ALLOC_AUTO,
+	.align = 0,
 };
 
 struct buf const INVALID_BUF = {
@@ -21,6 +36,7 @@ struct buf const INVALID_BUF = {
 	.under = NAN,
 	.over = NAN,
 	.policy = BUF_ALLOC_INVALID,
+	.align = 0,
 };
 
 struct buf make_buf_default(void)
@@ -29,12 +45,17 @@ struct buf make_buf_default(void)
 }
 struct buf make_buf_exact(void)
 {
-	struct buf buf = { NULL, 0, 0, 1.0, 1.0, BUF_ALLOC_EXACT };
+	struct buf buf = NULL_BUF;
+	buf.under = buf.over = 1.0f;
+	buf.policy = BUF_ALLOC_EXACT;
 	return buf;
 }
 struct buf make_buf(float under, float over, enum buf_alloc_policy policy)
 {
-	struct buf buf = { NULL, 0, 0, under, over, policy };
+	struct buf buf = NULL_BUF;
+	buf.under = under;
+	buf.over = over;
+	buf.policy = policy;
 	if (!buf_is_valid(&buf)) { errno = EINVAL; return INVALID_BUF; }
 	return buf;
 }
@@ -46,6 +67,23 @@ struct buf make_buf_grow_only(float over)
 {
 	return make_buf_dynamic(0.0, over);
 }
+struct buf make_buf_adaptive(void)
+{
+	return make_buf(NULL_BUF.under, NULL_BUF.over, BUF_ALLOC_ADAPTIVE);
+}
+struct buf make_buf_aligned(size_t align)
+{
+	struct buf buf = NULL_BUF;
+	buf.align = align;
+	if (!buf_is_valid(&buf)) { errno = EINVAL; return INVALID_BUF; }
+	return buf;
+}
+struct buf make_buf_spill(void)
+{
+	struct buf buf = NULL_BUF;
+	buf.spill = 1;
+	return buf;
+}
 
 int buf_equal(struct buf const * a, struct buf const * b)
 {
@@ -63,7 +101,9 @@ int buf_exactly_equal(struct buf const * a, struct buf const * b)
 		a->capacity == b->capacity &&
 		a->under == b->under &&
 		a->over == b->over &&
-		a->policy == b->policy
+		a->policy == b->policy &&
+		a->align == b->align &&
+		a->spill == b->spill
 	);
 }
 int buf_is_null(struct buf const * buf)
@@ -72,6 +112,7 @@ int buf_is_null(struct buf const * buf)
 }
 int buf_is_valid(struct buf const * buf)
 {
+	if (buf->align & (buf->align - 1)) return 0;
 	if (buf->data == NULL) return buf_is_null(buf);
 	return (
 		0 < buf->capacity &&
@@ -89,6 +130,7 @@ static inline const char * look_up_policy(enum buf_alloc_policy policy)
 	case BUF_ALLOC_WORD: return "WORD";
 	case BUF_ALLOC_PAGE: return "PAGE";
 	case BUF_ALLOC_EXACT: return "EXACT";
+	case BUF_ALLOC_ADAPTIVE: return "ADAPTIVE";
 	case BUF_ALLOC_INVALID: return "INVALID";
 	}
 	errno = EINVAL;
@@ -116,54 +158,211 @@ static inline size_t round_up(size_t n, size_t r) // n must be a power of two
 	return ((n - 1) | (r - 1)) + 1;
 }
 
+static void * realloc_aligned(void * old, size_t old_size, size_t size, size_t align)
+{
+	void * data;
+	int error = posix_memalign(&data, max(align, sizeof(void *)), size);
+	if (error) { errno = error; return NULL; }
+	if (old != NULL) {
+		memcpy(data, old, min(old_size, size));
+		free(old);
+	}
+	return data;
+}
+
 int buf_resize(struct buf * buf, size_t size)
 {
 	return buf_resize_with(buf, size, realloc);
 }
 
+static size_t page_size;
+static int have_avx2;
+
+__attribute__((constructor))
+static void buf_init(void)
+{
+	page_size = sysconf(_SC_PAGESIZE);
+#ifdef HAVE_X86_FILL
+	__builtin_cpu_init();
+	have_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+/* a quarter of a power of two, at least 64 bytes; whole pages from a page on */
+static size_t buf_size_class(size_t size)
+{
+	if (size <= 64) return 64;
+	unsigned const e = 63 - __builtin_clzll(size - 1);
+	size_t const class = round_up(size, (size_t)1 << (e - 2));
+	return class < page_size ? class : round_up(class, page_size);
+}
+
+/* track the high-water mark, decaying by 1/16 per resize, and how long the size has stayed low */
+static int buf_adaptive_wants_shrink(struct buf * buf, size_t size)
+{
+	buf->high_water = max(size, buf->high_water - (buf->high_water >> 4));
+	buf->low_streak = size < buf->capacity / 4 ? buf->low_streak + 1 : 0;
+	return buf->low_streak >= BUF_SHRINK_AFTER && buf_size_class(buf->high_water) <= buf->capacity / 2;
+}
+
+/* what spilling buffers hold on the heap, against the budget */
+static _Atomic size_t buf_budget = SIZE_MAX, buf_in_memory;
+
+int buf_set_memory_budget(size_t budget)
+{
+	atomic_store(&buf_budget, budget);
+	return errno = 0;
+}
+
+size_t buf_memory_in_use(void)
+{
+	return atomic_load(&buf_in_memory);
+}
+
+static int buf_charge(size_t size)
+{
+	size_t in_use = atomic_load(&buf_in_memory);
+	do {
+		if (in_use + size < in_use || in_use + size > atomic_load(&buf_budget)) return -1;
+	} while (!atomic_compare_exchange_weak(&buf_in_memory, &in_use, in_use + size));
+	return 0;
+}
+
+static void buf_uncharge(size_t size)
+{
+	atomic_fetch_sub(&buf_in_memory, size);
+}
+
+/* an anonymous file, where the file system can make one */
+static int buf_spill_file(void)
+{
+	char const * dir = getenv("TMPDIR");
+	if (dir == NULL || *dir == '\0') dir = "/tmp";
+	int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd >= 0) return fd;
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/buf-spill-XXXXXX", dir);
+	fd = mkostemp(path, O_CLOEXEC);
+	if (fd >= 0) unlink(path);
+	return fd;
+}
+
+/* on the heap while the budget allows, in a mapped file from then on; may round up the capacity */
+static void * buf_spill_realloc(struct buf * buf, size_t * capacity, realloc_func realloc)
+{
+	size_t const held = buf->data != NULL ? buf->capacity : 0;
+	if (!buf->mapped && (*capacity <= held || buf_charge(*capacity - held) == 0)) {
+		void * data = buf->align
+			? realloc_aligned(buf->data, buf->size, *capacity, buf->align)
+			: realloc(buf->data, *capacity);
+		if (data == NULL && *capacity > held) buf_uncharge(*capacity - held);
+		if (data != NULL && *capacity < held) buf_uncharge(held - *capacity);
+		return data;
+	}
+
+	*capacity = round_up(*capacity, page_size);
+	int const fd = buf->mapped ? buf->fd : buf_spill_file();
+	if (fd < 0) return NULL;
+	/* a new file has to be reserved from the start, for the heap data to be copied in */
+	int error = !buf->mapped
+		? posix_fallocate(fd, 0, *capacity)
+		: *capacity > held
+		? posix_fallocate(fd, held, *capacity - held)
+		: ftruncate(fd, *capacity) ? errno : 0;
+	void * data = error ? MAP_FAILED : buf->mapped
+		? mremap(buf->data, buf->capacity, *capacity, MREMAP_MAYMOVE)
+		: mmap(NULL, *capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		error = error ? error : errno;
+		if (!buf->mapped) close(fd);
+		errno = error;
+		return NULL;
+	}
+	if (!buf->mapped) {
+		if (buf->data != NULL) {
+			memcpy(data, buf->data, min(buf->size, *capacity));
+			free(buf->data);
+			buf_uncharge(held);
+		}
+		buf->mapped = 1;
+		buf->fd = fd;
+		INSTR_ADD(INSTR_BUF_SPILLS, 1);
+	}
+	return data;
+}
+
 int buf_resize_with(struct buf * buf, size_t size, realloc_func realloc)
 {
+	// the common case: it fits, and there's no reason to shrink
+	if (buf->data != NULL && size <= buf->capacity && size >= buf->shrink_below) {
+		if (buf->policy != BUF_ALLOC_ADAPTIVE || !buf_adaptive_wants_shrink(buf, size)) {
+			buf->size = size;
+			buf->stats.resizes++;
+			return errno = 0;
+		}
+	}
+
 	// validate the buffer
 	if (!buf_is_valid(buf)) return errno = EUCLEAN;
+	if (page_size == 0) buf_init();
 
-	// decide on how to round the buffer capacity
-	size_t const page_size = sysconf(_SC_PAGESIZE);
+	// decide on the capacity
 	size_t const word_size = sizeof(size_t);
-	size_t round;
+	size_t capacity;
 	switch (buf->policy) {
 	case BUF_ALLOC_AUTO:
-		round = size < page_size ? word_size : page_size;
-		break;
 	case BUF_ALLOC_WORD:
-		round = word_size;
-		break;
 	case BUF_ALLOC_PAGE:
-		round = page_size;
+	case BUF_ALLOC_EXACT: {
+		// figure out if we need to reallocate
+		int needs_realloc = buf->data == NULL || buf->capacity < size || size < buf->shrink_below;
+		if (!needs_realloc) {
+			buf->size = size;
+			buf->stats.resizes++;
+			return errno = 0;
+		}
+		size_t const round =
+			buf->policy == BUF_ALLOC_EXACT ? 1 :
+			buf->policy == BUF_ALLOC_WORD || (buf->policy == BUF_ALLOC_AUTO && size < page_size) ? word_size :
+			page_size;
+		capacity = round_up(max(1, (size_t)(buf->over * size)), max(round, buf->align));
 		break;
-	case BUF_ALLOC_EXACT:
-		round = 1;
+	}
+	case BUF_ALLOC_ADAPTIVE:
+		if (buf->data != NULL && size > buf->capacity) buf_adaptive_wants_shrink(buf, size);
+		capacity = round_up(buf_size_class(max(size, buf->high_water)), max(1, buf->align));
 		break;
 	default:
 		return errno = EINVAL;
 	}
 
-	// figure out if we need to reallocate
-	size_t under_capacity = (size_t)(buf->under * buf->capacity);
-	int needs_realloc = buf->capacity < size || size < under_capacity;
-	if (!needs_realloc) {
-		buf->size = size;
-		return errno = 0;
-	}
-
 	// (re)allocate; NOTE: realloc(NULL, x) does malloc(x)
-	size_t capacity = round_up(max(1, (size_t)(buf->over * size)), round);
-	void * data = realloc(buf->data, capacity);
+	void * data = buf->spill
+		? buf_spill_realloc(buf, &capacity, realloc)
+		: buf->align
+		? realloc_aligned(buf->data, buf->size, capacity, buf->align)
+		: realloc(buf->data, capacity);
 	if (data == NULL) return errno;
 
-	// fill in the buffer
+#ifdef INSTRUMENT
+	INSTR_ADD(buf->data ? INSTR_BUF_REALLOCS : INSTR_BUF_ALLOCS, 1);
+	INSTR_ADD(INSTR_BUF_BYTES_ALLOCATED, capacity);
+	if (buf->align || (buf->data != NULL && data != buf->data))
+		INSTR_ADD(INSTR_BUF_BYTES_COPIED, min(buf->size, size));
+#endif
+
+	buf->stats.resizes++;
+	if (buf->data == NULL) buf->stats.allocs++;
+	else if (capacity > buf->capacity) buf->stats.grows++;
+	else buf->stats.shrinks++;
+
+	// fill in the buffer; only the adaptive policy decides on shrinking by itself
 	buf->data = data;
 	buf->size = size;
 	buf->capacity = capacity;
+	buf->shrink_below = buf->policy == BUF_ALLOC_ADAPTIVE ? 0 : (size_t)(buf->under * capacity);
+	buf->high_water = max(buf->high_water, size);
+	buf->low_streak = 0;
 
 	return errno = 0;
 }
@@ -177,11 +376,109 @@ int buf_free_with(struct buf * buf, free_func free)
 {
 	if (buf_is_null(buf)) return errno = EINVAL;
 	if (!buf_is_valid(buf)) return errno = EUCLEAN;
-	free(buf->data);
+	if (buf->mapped) {
+		munmap(buf->data, buf->capacity);
+		close(buf->fd);
+	}
+	else {
+		free(buf->data);
+		if (buf->spill) buf_uncharge(buf->capacity);
+	}
+	INSTR_ADD(INSTR_BUF_FREES, 1);
 	*buf = NULL_BUF;
 	return errno = 0;
 }
 
+/* a frozen buffer, and room for whatever has to live as long as its data */
+struct buf_shared {
+	_Atomic size_t refs;
+	struct buf buf;
+	max_align_t extra[];
+};
+
+struct buf_shared * buf_freeze_with(struct buf * buf, size_t extra)
+{
+	if (!buf_is_valid(buf)) {
+		errno = EUCLEAN;
+		return NULL;
+	}
+	struct buf_shared * shared = malloc(sizeof(*shared) + extra);
+	if (shared == NULL) return NULL;
+	atomic_init(&shared->refs, 1);
+	shared->buf = *buf;
+
+	/* the buffer starts over empty, with the same parameters */
+	struct buf fresh = NULL_BUF;
+	fresh.under = buf->under;
+	fresh.over = buf->over;
+	fresh.policy = buf->policy;
+	fresh.align = buf->align;
+	fresh.spill = buf->spill;
+	*buf = fresh;
+	errno = 0;
+	return shared;
+}
+
+struct buf_shared * buf_freeze(struct buf * buf)
+{
+	return buf_freeze_with(buf, 0);
+}
+
+struct buf_shared * buf_shared_ref(struct buf_shared * shared)
+{
+	atomic_fetch_add_explicit(&shared->refs, 1, memory_order_relaxed);
+	return shared;
+}
+
+int buf_shared_unref(struct buf_shared * shared)
+{
+	if (atomic_fetch_sub_explicit(&shared->refs, 1, memory_order_acq_rel) == 1) {
+		if (!buf_is_null(&shared->buf)) buf_free(&shared->buf);
+		free(shared);
+	}
+	return errno = 0;
+}
+
+size_t buf_shared_refs(struct buf_shared const * shared)
+{
+	return atomic_load_explicit(&shared->refs, memory_order_relaxed);
+}
+
+struct view buf_shared_view(struct buf_shared const * shared)
+{
+	return buf_view(&shared->buf);
+}
+
+void * buf_shared_extra(struct buf_shared * shared)
+{
+	return shared->extra;
+}
+
+struct view_ref view_ref(struct buf_shared * owner, struct view view)
+{
+	char const * const data = owner->buf.data;
+	if (view.size && ((char *)view.data < data || (char *)view.data + view.size > data + owner->buf.size)) {
+		errno = EINVAL;
+		return (struct view_ref){ { NULL, 0 }, NULL };
+	}
+	errno = 0;
+	return (struct view_ref){ view, buf_shared_ref(owner) };
+}
+
+int view_ref_release(struct view_ref * ref)
+{
+	if (ref->owner != NULL) buf_shared_unref(ref->owner);
+	ref->owner = NULL;
+	return errno = 0;
+}
+
+int buf_clear(struct buf * buf)
+{
+	if (!buf_is_valid(buf)) return errno = EUCLEAN;
+	if (buf->data != NULL) buf->size = 0;
+	return errno = 0;
+}
+
 struct view view_partial(struct view view, size_t lower, size_t upper)
 {
 	size_t offset = min(lower, view.size);
@@ -202,27 +499,166 @@ struct view make_view(void * const data, size_t const size)
 	return view;
 }
 
-int view_fill(struct view dst, struct view src)
+/* 32 bytes of the pattern, starting phase bytes into it */
+static void fill_block(unsigned char * block, unsigned char const * pattern, size_t size, size_t phase)
+{
+	for (size_t i = 0; i < 32; i++) block[i] = pattern[(phase + i) % size];
+}
+
+#ifdef HAVE_X86_FILL
+/* the 32-byte aligned middle, with every store the same block */
+__attribute__((target("avx2")))
+static void fill_aligned_avx2(unsigned char * d, size_t n, unsigned char const * block, int stream)
+{
+	__m256i const v = _mm256_loadu_si256((__m256i const *)block);
+	if (stream) {
+		for (size_t i = 0; i < n; i += 32) _mm256_stream_si256((__m256i *)(d + i), v);
+		_mm_sfence();
+	}
+	else {
+		for (size_t i = 0; i < n; i += 32) _mm256_store_si256((__m256i *)(d + i), v);
+	}
+}
+
+static void fill_aligned_sse2(unsigned char * d, size_t n, unsigned char const * block, int stream)
+{
+	__m128i const lo = _mm_loadu_si128((__m128i const *)block);
+	__m128i const hi = _mm_loadu_si128((__m128i const *)(block + 16));
+	if (stream) {
+		for (size_t i = 0; i < n; i += 32) {
+			_mm_stream_si128((__m128i *)(d + i), lo);
+			_mm_stream_si128((__m128i *)(d + i + 16), hi);
+		}
+		_mm_sfence();
+	}
+	else {
+		for (size_t i = 0; i < n; i += 32) {
+			_mm_store_si128((__m128i *)(d + i), lo);
+			_mm_store_si128((__m128i *)(d + i + 16), hi);
+		}
+	}
+}
+#endif
+
+/* patterns that divide 32 bytes: whole vectors of them, aligned stores in the middle */
+static void fill_broadcast(unsigned char * d, size_t n, unsigned char const * pattern, size_t size, int stream)
+{
+	unsigned char block[32];
+	fill_block(block, pattern, size, 0);
+	if (n < 64) {
+		for (size_t i = 0; i < n; i += 32) memcpy(d + i, block, min(32, n - i));
+		return;
+	}
+	/* the ends are unaligned stores of the block as it is, as n and 32 are multiples of size */
+	memcpy(d, block, 32);
+	memcpy(d + n - 32, block, 32);
+	size_t const head = -(uintptr_t)d & 31, middle = (n - head) & ~(size_t)31;
+	unsigned char aligned[32];
+	fill_block(aligned, pattern, size, head % size);
+#ifdef HAVE_X86_FILL
+	if (have_avx2) fill_aligned_avx2(d + head, middle, aligned, stream);
+	else fill_aligned_sse2(d + head, middle, aligned, stream);
+#else
+	(void)stream;
+	for (size_t i = 0; i < middle; i += 32) memcpy(d + head + i, aligned, 32);
+#endif
+}
+
+/* other patterns: copy it once, double what is filled up to a block that stays in the cache, then copy that */
+static void fill_doubling(unsigned char * d, size_t n, void const * pattern, size_t size)
+{
+	memmove(d, pattern, size);
+	size_t filled = size;
+	size_t const block = VIEW_FILL_BLOCK > size ? VIEW_FILL_BLOCK / size * size : size;
+	for (; filled < n && filled < block; filled *= 2)
+		memcpy(d + filled, d, min(filled, n - filled));
+	filled = min(filled, n);
+	size_t const repeat = min(filled, block);
+	for (; filled < n; filled += repeat)
+		memcpy(d + filled, d, min(repeat, n - filled));
+}
+
+static void fill(void * dst, size_t n, void const * pattern, size_t size, int stream)
+{
+	if (n == size) memmove(dst, pattern, size);
+	else if (32 % size == 0) fill_broadcast(dst, n, pattern, size, stream);
+	else fill_doubling(dst, n, pattern, size);
+}
+
+struct fill_part {
+	void * dst;
+	size_t size;
+	void const * pattern;
+	size_t pattern_size;
+	int stream;
+};
+
+static void * fill_run(void * arg)
+{
+	struct fill_part const * part = arg;
+	fill(part->dst, part->size, part->pattern, part->pattern_size, part->stream);
+	return NULL;
+}
+
+int view_fill_threads(struct view dst, struct view src, size_t n_threads)
 {
 	if (src.size == 0 || dst.size % src.size != 0) return errno = EINVAL;
+	if (dst.size == 0) return errno = 0;
+	int const stream = dst.size >= VIEW_FILL_STREAM;
+
+	/* the threads read the pattern while the others write, so it must be out of the way */
+	unsigned char const * d = dst.data, * s = src.data;
+	if (s < d + dst.size && d < s + src.size) n_threads = 1;
+	n_threads = max(1, min(n_threads, dst.size / VIEW_FILL_THREAD_CHUNK));
+	if (n_threads == 1) {
+		fill(dst.data, dst.size, src.data, src.size, stream);
+		return errno = 0;
+	}
 
-	for (size_t i = 0; i < dst.size; i += src.size)
-		memmove(dst.data + i, src.data, src.size);
+	/* parts start at a whole pattern, and on a cache line when it fits */
+	size_t const unit = src.size % 64 == 0 || 64 % src.size == 0 ? max(64, src.size) : src.size;
+	size_t const part_size = dst.size / n_threads / unit * unit;
+	struct fill_part parts[n_threads];
+	pthread_t threads[n_threads];
+	size_t started = 0;
+	for (size_t t = 0; t < n_threads; t++) {
+		size_t const offset = t * part_size;
+		parts[t] = (struct fill_part){
+			dst.data + offset, t + 1 < n_threads ? part_size : dst.size - offset,
+			src.data, src.size, stream,
+		};
+	}
+	/* whatever part doesn't get a thread is filled here */
+	for (; started + 1 < n_threads; started++)
+		if (pthread_create(&threads[started], NULL, fill_run, &parts[started])) break;
+	for (size_t t = started; t < n_threads; t++) fill_run(&parts[t]);
+	for (size_t t = 0; t < started; t++) pthread_join(threads[t], NULL);
 	return errno = 0;
 }
 
+int view_fill(struct view dst, struct view src)
+{
+	return view_fill_threads(dst, src, 1);
+}
+
 int view_copy(struct view dst, struct view src)
 {
 	if (dst.size != src.size) return errno = EINVAL;
 	return view_fill(dst, src);
 }
 
+int buf_grow(struct buf * buf, size_t capacity)
+{
+	if (buf->data != NULL && capacity <= buf->capacity) return errno = 0;
+	size_t const size = buf->size;
+	if (buf_resize(buf, capacity)) return errno;
+	buf->size = size;
+	return errno = 0;
+}
+
 int buf_append(struct buf * buf, struct view view)
 {
-	size_t orig_size = buf->size;
-	if (buf_resize(buf, orig_size + view.size)) return errno;
-	struct view buf_append_view = view_partial(buf_view(buf), orig_size, buf->size);
-	return view_copy(buf_append_view, view);
+	return buf_push(buf, view) ? errno : (errno = 0);
 }
 
 struct view view_str(char * str) { return (struct view){ str, strlen(str) }; }
@@ -289,3 +725,248 @@ finish:
 	va_end(args2);
 	return retval;
 }
+
+int buf_vappendf(struct buf * buf, char const * fmt, va_list args)
+{
+	va_list again;
+	va_copy(again, args);
+	size_t const room = buf->capacity - buf->size;
+	int n = vsnprintf(buf->data == NULL ? NULL : (char *)buf->data + buf->size, room, fmt, args);
+	/* one more byte for the NUL, which vsnprintf() always writes */
+	if (n >= 0 && (size_t)n >= room)
+		n = buf_grow(buf, buf->size + n + 1) ? -1 : vsnprintf((char *)buf->data + buf->size, n + 1, fmt, again);
+	va_end(again);
+	if (n < 0) return -1;
+	buf->size += n;
+	return n;
+}
+
+int buf_appendf(struct buf * buf, char const * fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	int const n = buf_vappendf(buf, fmt, args);
+	va_end(args);
+	return n;
+}
+
+static char const digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/* the digits of n, ending at end, two at a time; returns where they start */
+static char * format_uint(char * end, unsigned long long n)
+{
+	while (n >= 100) {
+		end -= 2;
+		memcpy(end, digit_pairs + n % 100 * 2, 2);
+		n /= 100;
+	}
+	if (n >= 10) {
+		end -= 2;
+		memcpy(end, digit_pairs + n * 2, 2);
+	} else {
+		*--end = '0' + n;
+	}
+	return end;
+}
+
+int buf_append_uint(struct buf * buf, unsigned long long n)
+{
+	char text[24], * end = text + sizeof(text);
+	char * start = format_uint(end, n);
+	return buf_append(buf, (struct view){ start, end - start });
+}
+
+int buf_append_int(struct buf * buf, long long n)
+{
+	char text[24], * end = text + sizeof(text);
+	char * start = format_uint(end, n < 0 ? -(unsigned long long)n : (unsigned long long)n);
+	if (n < 0) *--start = '-';
+	return buf_append(buf, (struct view){ start, end - start });
+}
+
+/*
+ * Shortest round-trip doubles, with Schubfach (R. Giulietti, "The Schubfach
+ * way to render doubles"): pow10_g[k - POW10_K_MIN] is g = floor(10^-k 2^-r) + 1
+ * with r = flog2pow10(-k) - 125, a 126-bit approximation of 10^-k from above,
+ * worked out exactly with long arithmetic at load time.
+ */
+#define POW10_K_MIN (-324)
+#define POW10_K_MAX 292
+#define POW10_LIMBS 36
+#define POW10_ONE_SHIFT 1100
+
+static unsigned __int128 pow10_g[POW10_K_MAX - POW10_K_MIN + 1];
+
+static inline int flog10pow2(int e) { return (int)(((int64_t)e * 661971961083LL) >> 41); }
+static inline int flog10threequarterspow2(int e) { return (int)(((int64_t)e * 661971961083LL - 274743187321LL) >> 41); }
+static inline int flog2pow10(int e) { return (int)(((int64_t)e * 913124641741LL) >> 38); }
+
+/* bits [shift, shift + 128) of a number of POW10_LIMBS 32-bit limbs, least significant first */
+static unsigned __int128 limbs_bits(uint32_t const * limbs, unsigned shift)
+{
+	unsigned __int128 bits = 0;
+	for (unsigned i = 0; i < 5 && shift / 32 + i < POW10_LIMBS; i++) {
+		unsigned __int128 const limb = limbs[shift / 32 + i];
+		int const at = 32 * i - shift % 32;
+		bits |= at < 0 ? limb >> -at : at < 128 ? limb << at : 0;
+	}
+	return bits;
+}
+
+/* one by one, each a tenth of the last, floor(x / 10^m) is floor(floor(x / 10^(m - 1)) / 10) */
+__attribute__((constructor))
+static void pow10_init(void)
+{
+	uint32_t up[POW10_LIMBS] = { 1 }, down[POW10_LIMBS] = { 0 };
+	down[POW10_ONE_SHIFT / 32] = 1u << POW10_ONE_SHIFT % 32;
+	for (int m = 0; m <= -POW10_K_MIN; m++) {
+		/* up is 10^m, which has e + 1 bits */
+		int const e = flog2pow10(m);
+		pow10_g[-m - POW10_K_MIN] = (e <= 125 ? limbs_bits(up, 0) << (125 - e) : limbs_bits(up, e - 125)) + 1;
+		if (m >= 1 && m <= POW10_K_MAX)
+			pow10_g[m - POW10_K_MIN] = limbs_bits(down, POW10_ONE_SHIFT - 125 + flog2pow10(-m)) + 1;
+
+		uint64_t carry = 0;
+		for (int i = 0; i < POW10_LIMBS; i++) {
+			carry += (uint64_t)up[i] * 10;
+			up[i] = carry;
+			carry >>= 32;
+		}
+		uint64_t rest = 0;
+		for (int i = POW10_LIMBS - 1; i >= 0; i--) {
+			rest = rest << 32 | down[i];
+			down[i] = rest / 10;
+			rest %= 10;
+		}
+	}
+}
+
+/* cp g 2^-127, rounded to odd, leaving out the bits far below the point as the paper does */
+static inline uint64_t round_to_odd(unsigned __int128 g, uint64_t cp)
+{
+	uint64_t const mask = ((uint64_t)1 << 63) - 1;
+	uint64_t const x1 = ((unsigned __int128)cp * (uint64_t)(g & mask)) >> 64;
+	unsigned __int128 const y = (unsigned __int128)cp * (uint64_t)(g >> 63);
+	uint64_t const z = ((uint64_t)y >> 1) + x1;
+	return ((uint64_t)(y >> 64) + (z >> 63)) | ((z & mask) != 0);
+}
+
+/* the shortest digits * 10^exponent that rounds to c 2^q */
+static uint64_t double_digits(int q, uint64_t c, int dk, int * exponent)
+{
+	int const out = c & 1;
+	uint64_t const cb = c << 2, cbr = cb + 2;
+	uint64_t cbl;
+	int k;
+	if (c != (uint64_t)1 << 52 || q == -1074) {
+		cbl = cb - 2;
+		k = flog10pow2(q);
+	} else {
+		cbl = cb - 1;
+		k = flog10threequarterspow2(q);
+	}
+	int const h = q + flog2pow10(-k) + 2;
+	unsigned __int128 const g = pow10_g[k - POW10_K_MIN];
+	uint64_t const vb = round_to_odd(g, cb << h), vbl = round_to_odd(g, cbl << h), vbr = round_to_odd(g, cbr << h);
+
+	uint64_t const s = vb >> 2;
+	*exponent = k + dk;
+	/* fewer digits: the multiples of 10, 100, ... closest to vb that still round to c */
+	uint64_t shorter = 0;
+	for (uint64_t p = 10; p <= s; p *= 10) {
+		uint64_t const sp = s / p * p, tp = sp + p;
+		int const upin = vbl + out <= sp << 2, wpin = (tp << 2) + out <= vbr;
+		if (!upin && !wpin) break;
+		int64_t const cmp = vb - ((sp + tp) << 1);
+		shorter = !wpin || (upin && (cmp < 0 || (cmp == 0 && !(sp / p & 1)))) ? sp : tp;
+		if (p > UINT64_MAX / 10) break;
+	}
+	if (shorter) return shorter;
+	uint64_t const t = s + 1;
+	int const uin = vbl + out <= s << 2, win = (t << 2) + out <= vbr;
+	if (uin != win) return uin ? s : t;
+	int64_t const cmp = vb - ((s + t) << 1);
+	return cmp < 0 || (cmp == 0 && !(s & 1)) ? s : t;
+}
+
+/* like repr() in Python: plain up to 16 digits before the point and 3 zeros after it */
+static size_t format_double(char * text, double x)
+{
+	uint64_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	char * p = text;
+	int const biased = bits >> 52 & 0x7ff;
+	uint64_t const fraction = bits & (((uint64_t)1 << 52) - 1);
+	if (biased == 0x7ff) {
+		char const * const name = fraction ? "nan" : bits >> 63 ? "-inf" : "inf";
+		memcpy(p, name, 4);
+		return strlen(name);
+	}
+	if (bits >> 63) *p++ = '-';
+	if (biased == 0 && fraction == 0) {
+		memcpy(p, "0.0", 3);
+		return p + 3 - text;
+	}
+
+	uint64_t digits;
+	int exponent = 0;
+	if (biased) {
+		uint64_t const c = (uint64_t)1 << 52 | fraction;
+		int const mq = 1075 - biased;
+		/* integers need no search */
+		if (mq > 0 && mq < 53 && (c >> mq) << mq == c) digits = c >> mq;
+		else digits = double_digits(-mq, c, 0, &exponent);
+	} else {
+		digits = fraction < 3 ? double_digits(-1074, 10 * fraction, -1, &exponent) : double_digits(-1074, fraction, 0, &exponent);
+	}
+	while (digits % 10 == 0) {
+		digits /= 10;
+		exponent++;
+	}
+
+	char number[24], * end = number + sizeof(number);
+	char const * start = format_uint(end, digits);
+	int const n = end - start, point = n + exponent;
+	if (point <= -4 || point > 16) {
+		*p++ = *start;
+		if (n > 1) {
+			*p++ = '.';
+			memcpy(p, start + 1, n - 1);
+			p += n - 1;
+		}
+		*p++ = 'e';
+		*p++ = point - 1 < 0 ? '-' : '+';
+		unsigned const e = abs(point - 1);
+		if (e < 10) *p++ = '0';
+		char * const e_start = format_uint(end, e);
+		memcpy(p, e_start, end - e_start);
+		p += end - e_start;
+	} else if (point <= 0) {
+		memcpy(p, "0.000", 2 - point);
+		p += 2 - point;
+		memcpy(p, start, n);
+		p += n;
+	} else if (point >= n) {
+		memcpy(p, start, n);
+		p += n;
+		memset(p, '0', point - n);
+		p += point - n;
+		memcpy(p, ".0", 2);
+		p += 2;
+	} else {
+		memcpy(p, start, point);
+		p[point] = '.';
+		memcpy(p + point + 1, start + point, n - point);
+		p += n + 1;
+	}
+	return p - text;
+}
+
+int buf_append_double(struct buf * buf, double x)
+{
+	char text[32];
+	return buf_append(buf, (struct view){ text, format_double(text, x) });
+}
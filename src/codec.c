@@ -0,0 +1,472 @@
+#include <codec.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+struct codec const IDENTITY_CODEC = {
+	.delta = 0,
+	.shuffle = CODEC_SHUFFLE_NONE,
+	.lz = 0,
+	.elem_size = 1,
+	.chunk_size = CODEC_DEFAULT_CHUNK_SIZE,
+	.n_threads = 1,
+};
+
+typedef uint16_t u16u __attribute__((aligned(1), may_alias));
+typedef uint32_t u32u __attribute__((aligned(1), may_alias));
+typedef uint64_t u64u __attribute__((aligned(1), may_alias));
+
+static inline size_t min(size_t a, size_t b) { return a < b ? a : b; }
+static inline uint64_t load64(void const * p) { return *(u64u const *)p; }
+
+int codec_is_identity(struct codec const * codec)
+{
+	return !codec->delta && codec->shuffle == CODEC_SHUFFLE_NONE && !codec->lz;
+}
+
+size_t codec_chunk_rows(struct codec const * codec, size_t row_size)
+{
+	size_t rows = row_size ? codec->chunk_size / row_size : 1;
+	return rows ? rows : 1;
+}
+
+size_t codec_n_chunks(struct codec const * codec, size_t size, size_t row_size)
+{
+	if (size == 0) return 0;
+	size_t chunk = codec_chunk_rows(codec, row_size) * row_size;
+	return (size + chunk - 1) / chunk;
+}
+
+
+/* delta along the leading axis; the first row is kept as it is */
+#define DELTA_ENCODE(T) \
+	for (size_t i = 0; i < n / sizeof(T); i++) \
+		((T *)dst)[i] = ((T const *)src)[i] - ((T const *)prev)[i]
+#define DELTA_DECODE(T) \
+	for (size_t i = 0; i < n / sizeof(T); i++) \
+		((T *)row)[i] += ((T const *)prev)[i]
+
+static void delta_encode(unsigned char * dst, unsigned char const * src, size_t size, size_t row_size, size_t elem_size)
+{
+	size_t const head = min(row_size, size), n = size - head;
+	memcpy(dst, src, head);
+	unsigned char const * prev = src;
+	src += head, dst += head;
+	switch (elem_size) {
+	case 2: DELTA_ENCODE(u16u); break;
+	case 4: DELTA_ENCODE(u32u); break;
+	case 8: DELTA_ENCODE(u64u); break;
+	default: DELTA_ENCODE(uint8_t);
+	}
+}
+
+static void delta_decode(unsigned char * data, size_t size, size_t row_size, size_t elem_size)
+{
+	size_t const head = min(row_size, size), n = size - head;
+	unsigned char * row = data + head, * prev = data;
+	switch (elem_size) {
+	case 2: DELTA_DECODE(u16u); break;
+	case 4: DELTA_DECODE(u32u); break;
+	case 8: DELTA_DECODE(u64u); break;
+	default: DELTA_DECODE(uint8_t);
+	}
+}
+
+
+/* elem_size is a constant in every call, so the inner loops get unrolled */
+static inline void shuffle_n(unsigned char * dst, unsigned char const * src, size_t n_elems, size_t elem_size)
+{
+	for (size_t i = 0; i < n_elems; i++)
+		for (size_t b = 0; b < elem_size; b++)
+			dst[b * n_elems + i] = src[i * elem_size + b];
+}
+
+static inline void unshuffle_n(unsigned char * dst, unsigned char const * src, size_t n_elems, size_t elem_size)
+{
+	for (size_t i = 0; i < n_elems; i++)
+		for (size_t b = 0; b < elem_size; b++)
+			dst[i * elem_size + b] = src[b * n_elems + i];
+}
+
+#define SHUFFLE(n) (inverse ? unshuffle_n(dst, src, n_elems, (n)) : shuffle_n(dst, src, n_elems, (n)))
+
+static void shuffle_bytes(unsigned char * dst, unsigned char const * src, size_t size, size_t elem_size, int inverse)
+{
+	size_t const n_elems = size / elem_size, tail = n_elems * elem_size;
+	switch (elem_size) {
+	case 2: SHUFFLE(2); break;
+	case 4: SHUFFLE(4); break;
+	case 8: SHUFFLE(8); break;
+	default: SHUFFLE(elem_size);
+	}
+	memcpy(dst + tail, src + tail, size - tail);
+}
+
+/* transposes an 8x8 bit matrix stored one row per byte; its own inverse */
+static inline uint64_t transpose8(uint64_t x)
+{
+	uint64_t t;
+	t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+	x = x ^ t ^ (t << 28);
+	return x;
+}
+
+/* groups the k-th bit of every byte of each byte plane (one plane per byte of the element) */
+static void shuffle_bits(unsigned char * dst, unsigned char const * src, size_t size, size_t elem_size, int inverse)
+{
+	size_t const plane = size / elem_size, groups = plane / 8;
+	for (size_t p = 0; p < elem_size; p++) {
+		unsigned char * d = dst + p * plane;
+		unsigned char const * s = src + p * plane;
+		for (size_t g = 0; g < groups; g++) {
+			uint64_t x = 0;
+			if (inverse) {
+				for (int b = 0; b < 8; b++) x |= (uint64_t)s[b * groups + g] << (8 * b);
+				x = transpose8(x);
+				memcpy(d + 8 * g, &x, 8);
+			}
+			else {
+				x = transpose8(load64(s + 8 * g));
+				for (int b = 0; b < 8; b++) d[b * groups + g] = x >> (8 * b);
+			}
+		}
+		memcpy(d + 8 * groups, s + 8 * groups, plane - 8 * groups);
+	}
+	memcpy(dst + plane * elem_size, src + plane * elem_size, size - plane * elem_size);
+}
+
+
+/* LZ4 block format: the last 5 bytes are literals, the last match starts at least 12 bytes before the end */
+#define LZ_HASH_LOG 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+#define LZ_MAX_OFFSET 65535
+
+size_t lz_bound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+static inline unsigned char * lz_put_length(unsigned char * op, size_t length)
+{
+	for (; length >= 255; length -= 255) *op++ = 255;
+	*op++ = length;
+	return op;
+}
+
+static unsigned char * lz_put_sequence(
+	unsigned char * op,
+	unsigned char const * literals, size_t n_literals,
+	size_t offset, size_t match_length
+)
+{
+	size_t const ml = match_length ? match_length - LZ_MIN_MATCH : 0;
+	unsigned char * token = op++;
+	*token = (n_literals < 15 ? n_literals : 15) << 4 | (ml < 15 ? ml : 15);
+	if (n_literals >= 15) op = lz_put_length(op, n_literals - 15);
+	memcpy(op, literals, n_literals);
+	op += n_literals;
+	if (match_length == 0) return op;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	if (ml >= 15) op = lz_put_length(op, ml - 15);
+	return op;
+}
+
+static inline uint32_t lz_hash(uint32_t sequence)
+{
+	return (sequence * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+size_t lz_compress(struct view dst, struct view src)
+{
+	if (dst.size < lz_bound(src.size)) { errno = ENOBUFS; return 0; }
+
+	unsigned char const * const in = src.data;
+	unsigned char * op = dst.data;
+	size_t const n = src.size;
+	size_t anchor = 0;
+
+	if (n > LZ_MATCH_LIMIT) {
+		size_t table[1 << LZ_HASH_LOG] = { 0 };
+		size_t const limit = n - LZ_MATCH_LIMIT, end = n - LZ_LAST_LITERALS;
+		for (size_t i = 1; i <= limit; ) {
+			uint32_t sequence;
+			memcpy(&sequence, in + i, 4);
+			uint32_t const h = lz_hash(sequence);
+			size_t candidate = table[h];
+			table[h] = i;
+			if (i - candidate > LZ_MAX_OFFSET || memcmp(in + candidate, &sequence, 4) != 0) {
+				i += 1 + ((i - anchor) >> 6);  /* skip faster through incompressible data */
+				continue;
+			}
+			size_t length = LZ_MIN_MATCH;
+			while (i + length < end && in[candidate + length] == in[i + length]) length++;
+			while (i > anchor && candidate > 0 && in[i - 1] == in[candidate - 1]) i--, candidate--, length++;
+			op = lz_put_sequence(op, in + anchor, i - anchor, i - candidate, length);
+			i += length;
+			anchor = i;
+		}
+	}
+	op = lz_put_sequence(op, in + anchor, n - anchor, 0, 0);
+	return op - (unsigned char *)dst.data;
+}
+
+static inline int lz_get_length(unsigned char const ** ip, unsigned char const * end, size_t * length)
+{
+	unsigned char b;
+	do {
+		if (*ip >= end) return -1;
+		b = *(*ip)++;
+		*length += b;
+	} while (b == 255);
+	return 0;
+}
+
+ssize_t lz_decompress(struct view dst, struct view src)
+{
+	unsigned char const * ip = src.data, * const iend = ip + src.size;
+	unsigned char * op = dst.data, * const ostart = op, * const oend = op + dst.size;
+
+	while (ip < iend) {
+		unsigned const token = *ip++;
+		size_t n_literals = token >> 4;
+		if (n_literals == 15 && lz_get_length(&ip, iend, &n_literals)) return -1;
+		if (n_literals > (size_t)(iend - ip) || n_literals > (size_t)(oend - op)) return -1;
+		memcpy(op, ip, n_literals);
+		op += n_literals, ip += n_literals;
+		if (ip == iend) break;  /* the last sequence has no match */
+
+		if (iend - ip < 2) return -1;
+		size_t const offset = ip[0] | (size_t)ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - ostart)) return -1;
+		size_t length = token & 15;
+		if (length == 15 && lz_get_length(&ip, iend, &length)) return -1;
+		length += LZ_MIN_MATCH;
+		if (length > (size_t)(oend - op)) return -1;
+
+		unsigned char const * match = op - offset;
+		if (offset >= length) memcpy(op, match, length);
+		else for (size_t i = 0; i < length; i++) op[i] = match[i];  /* overlapping repeats */
+		op += length;
+	}
+	return op - ostart;
+}
+
+
+struct codec_job {
+	struct codec const * codec;
+	unsigned char const * src;
+	unsigned char * dst;
+	size_t size, row_size, chunk, n_chunks;
+	size_t * chunk_sizes;
+	size_t * offsets;    /* where each chunk starts in the encoded data */
+	atomic_size_t next;
+	atomic_int error;
+};
+
+static inline unsigned char * other(unsigned char const * cur, unsigned char * a, unsigned char * b)
+{
+	return cur == a ? b : a;
+}
+
+static int encode_chunk(struct codec_job * job, size_t i, unsigned char * a, unsigned char * b)
+{
+	struct codec const * codec = job->codec;
+	size_t const n = min(job->chunk, job->size - i * job->chunk);
+	unsigned char const * cur = job->src + i * job->chunk;
+	unsigned char * out = job->dst + job->offsets[i];
+	int stages = !!codec->delta + (codec->shuffle != CODEC_SHUFFLE_NONE) + (codec->shuffle == CODEC_SHUFFLE_BIT) + !!codec->lz;
+
+	if (codec->delta) {
+		unsigned char * next = --stages ? other(cur, a, b) : out;
+		delta_encode(next, cur, n, job->row_size, codec->elem_size);
+		cur = next;
+	}
+	if (codec->shuffle != CODEC_SHUFFLE_NONE) {
+		unsigned char * next = --stages ? other(cur, a, b) : out;
+		shuffle_bytes(next, cur, n, codec->elem_size, 0);
+		cur = next;
+	}
+	if (codec->shuffle == CODEC_SHUFFLE_BIT) {
+		unsigned char * next = --stages ? other(cur, a, b) : out;
+		shuffle_bits(next, cur, n, codec->elem_size, 0);
+		cur = next;
+	}
+	if (codec->lz) {
+		size_t m = lz_compress((struct view){ out, lz_bound(n) }, (struct view){ (void *)cur, n });
+		if (m == 0) return errno;
+		job->chunk_sizes[i] = m;
+		return 0;
+	}
+	if (cur != out) memcpy(out, cur, n);
+	job->chunk_sizes[i] = n;
+	return 0;
+}
+
+static int decode_chunk(struct codec_job * job, size_t i, unsigned char * a, unsigned char * b)
+{
+	struct codec const * codec = job->codec;
+	size_t const n = min(job->chunk, job->size - i * job->chunk);
+	unsigned char const * cur = job->src + job->offsets[i];
+	unsigned char * out = job->dst + i * job->chunk;
+	int stages = (codec->shuffle != CODEC_SHUFFLE_NONE) + (codec->shuffle == CODEC_SHUFFLE_BIT) + !!codec->lz;
+
+	if (codec->lz) {
+		unsigned char * next = --stages ? other(cur, a, b) : out;
+		ssize_t m = lz_decompress((struct view){ next, n }, (struct view){ (void *)cur, job->chunk_sizes[i] });
+		if (m != (ssize_t)n) return EILSEQ;
+		cur = next;
+	}
+	else if (job->chunk_sizes[i] != n) {
+		return EILSEQ;
+	}
+	if (codec->shuffle == CODEC_SHUFFLE_BIT) {
+		unsigned char * next = --stages ? other(cur, a, b) : out;
+		shuffle_bits(next, cur, n, codec->elem_size, 1);
+		cur = next;
+	}
+	if (codec->shuffle != CODEC_SHUFFLE_NONE) {
+		shuffle_bytes(out, cur, n, codec->elem_size, 1);
+		cur = out;
+	}
+	if (cur != out) memcpy(out, cur, n);
+	if (codec->delta) delta_decode(out, n, job->row_size, codec->elem_size);
+	return 0;
+}
+
+static void * run_job(struct codec_job * job, int (*process)(struct codec_job *, size_t, unsigned char *, unsigned char *))
+{
+	unsigned char * scratch = malloc(2 * job->chunk);
+	if (scratch == NULL) { atomic_store(&job->error, ENOMEM); return NULL; }
+	for (size_t i; (i = atomic_fetch_add(&job->next, 1)) < job->n_chunks && !atomic_load(&job->error); ) {
+		int r = process(job, i, scratch, scratch + job->chunk);
+		if (r) atomic_store(&job->error, r);
+	}
+	free(scratch);
+	return NULL;
+}
+
+static void * run_encode(void * job) { return run_job(job, encode_chunk); }
+static void * run_decode(void * job) { return run_job(job, decode_chunk); }
+
+static int run_threads(struct codec_job * job, void * (*run)(void *))
+{
+	if (job->n_chunks == 0) return 0;
+	size_t n_threads = min(job->codec->n_threads ? job->codec->n_threads : 1, job->n_chunks);
+	pthread_t threads[n_threads];
+	size_t started = 0;
+	for (; started + 1 < n_threads; started++)
+		if (pthread_create(&threads[started], NULL, run, job)) break;
+	run(job);
+	for (size_t t = 0; t < started; t++) pthread_join(threads[t], NULL);
+	return atomic_load(&job->error);
+}
+
+int codec_encode(
+	struct codec const * codec,
+	struct view src,
+	size_t row_size,
+	struct buf * dst,
+	struct buf * chunk_sizes
+)
+{
+	if (codec->elem_size == 0 || (row_size && src.size % row_size)) return errno = EINVAL;
+
+	struct codec_job job = {
+		.codec = codec,
+		.src = src.data,
+		.size = src.size,
+		.row_size = row_size,
+		.chunk = codec_chunk_rows(codec, row_size) * row_size,
+		.n_chunks = codec_n_chunks(codec, src.size, row_size),
+	};
+	size_t const stride = codec->lz ? lz_bound(job.chunk) : job.chunk;
+
+	if (buf_resize(chunk_sizes, job.n_chunks * sizeof(size_t))) return errno;
+	if (buf_resize(dst, job.n_chunks * stride)) return errno;
+	job.offsets = malloc((job.n_chunks + 1) * sizeof(size_t));
+	if (job.offsets == NULL) return errno;
+	for (size_t i = 0; i <= job.n_chunks; i++) job.offsets[i] = i * stride;
+	job.dst = dst->data;
+	job.chunk_sizes = chunk_sizes->data;
+
+	int r = run_threads(&job, run_encode);
+	if (r == 0) {
+		/* chunks were encoded with room to spare, close the gaps */
+		size_t offset = 0;
+		for (size_t i = 0; i < job.n_chunks; i++) {
+			memmove(dst->data + offset, dst->data + job.offsets[i], job.chunk_sizes[i]);
+			offset += job.chunk_sizes[i];
+		}
+		r = buf_resize(dst, offset);
+	}
+	free(job.offsets);
+	return errno = r;
+}
+
+int codec_decode(
+	struct codec const * codec,
+	struct view src,
+	size_t const * chunk_sizes,
+	size_t n_chunks,
+	size_t row_size,
+	struct view dst
+)
+{
+	if (codec->elem_size == 0 || (row_size && dst.size % row_size)) return errno = EINVAL;
+
+	struct codec_job job = {
+		.codec = codec,
+		.src = src.data,
+		.dst = dst.data,
+		.size = dst.size,
+		.row_size = row_size,
+		.chunk = codec_chunk_rows(codec, row_size) * row_size,
+		.n_chunks = n_chunks,
+		.chunk_sizes = (size_t *)chunk_sizes,
+	};
+	if (n_chunks != codec_n_chunks(codec, dst.size, row_size)) return errno = EINVAL;
+
+	job.offsets = malloc((n_chunks + 1) * sizeof(size_t));
+	if (job.offsets == NULL) return errno;
+	job.offsets[0] = 0;
+	int r = 0;
+	/* every chunk has to fit in what is left of src, which also keeps the sum from wrapping around */
+	for (size_t i = 0; i < n_chunks && !r; i++) {
+		if (chunk_sizes[i] > src.size - job.offsets[i]) r = EINVAL;
+		else job.offsets[i + 1] = job.offsets[i] + chunk_sizes[i];
+	}
+
+	if (!r) r = job.offsets[n_chunks] == src.size ? run_threads(&job, run_decode) : EINVAL;
+	free(job.offsets);
+	return errno = r;
+}
+
+
+int codec_parse_filter(struct codec * codec, struct view name)
+{
+	if (view_equals(name, view_str("delta"))) codec->delta = 1;
+	else if (view_equals(name, view_str("shuffle"))) codec->shuffle = CODEC_SHUFFLE_BYTE;
+	else if (view_equals(name, view_str("bitshuffle"))) codec->shuffle = CODEC_SHUFFLE_BIT;
+	else if (view_equals(name, view_str("lz"))) codec->lz = 1;
+	else return errno = EINVAL;
+	return errno = 0;
+}
+
+int codec_snprint_filters(struct codec const * codec, char * str, size_t size)
+{
+	return snprintf(
+		str, size, "%s%s%s",
+		codec->delta ? " delta" : "",
+		codec->shuffle == CODEC_SHUFFLE_BIT ? " bitshuffle" :
+		codec->shuffle == CODEC_SHUFFLE_BYTE ? " shuffle" : "",
+		codec->lz ? " lz" : ""
+	);
+}
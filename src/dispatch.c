@@ -0,0 +1,270 @@
+#include <dispatch.h>
+#include <errno.h>
+#include <string.h>
+
+struct kvnl_dispatch make_kvnl_dispatch(kvnl_handler fallback, void * fallback_ctx)
+{
+	return (struct kvnl_dispatch){
+		.fallback = fallback,
+		.fallback_ctx = fallback_ctx,
+		.keys = make_buf_grow_only(2.0f),
+		.entries = make_buf_grow_only(2.0f),
+		.slots = make_buf_grow_only(2.0f),
+		.displacements = make_buf_grow_only(2.0f),
+		.n_keys = 0,
+		.seed = 0,
+		.built = 0,
+	};
+}
+
+int kvnl_dispatch_free(struct kvnl_dispatch * table)
+{
+	if (!buf_is_null(&table->keys)) buf_free(&table->keys);
+	if (!buf_is_null(&table->entries)) buf_free(&table->entries);
+	if (!buf_is_null(&table->slots)) buf_free(&table->slots);
+	if (!buf_is_null(&table->displacements)) buf_free(&table->displacements);
+	table->n_keys = 0;
+	table->built = 0;
+	return errno = 0;
+}
+
+static inline struct kvnl_dispatch_entry * dispatch_entries(struct kvnl_dispatch const * table)
+{
+	return table->entries.data;
+}
+
+static inline struct view dispatch_key(struct kvnl_dispatch const * table, struct kvnl_dispatch_entry const * entry)
+{
+	return (struct view){ (char *)table->keys.data + entry->key_offset, entry->key_size };
+}
+
+/* keys are short, and a few multiplies hash them faster than xxh64() gets going */
+static inline uint64_t dispatch_hash(struct view key, uint64_t seed)
+{
+	unsigned char const * p = key.data;
+	size_t n = key.size;
+	uint64_t h = seed ^ n * 0x9e3779b97f4a7c15ull, word;
+	for (; n >= 8; p += 8, n -= 8) {
+		memcpy(&word, p, 8);
+		h = (h ^ word) * 0xff51afd7ed558ccdull;
+		h ^= h >> 32;
+	}
+	word = 0;
+	if (n) memcpy(&word, p, n);
+	h = (h ^ word) * 0xc4ceb9fe1a85ec53ull;
+	return h ^ h >> 29;
+}
+
+/* the bucket comes from all the bits of the hash, the slot from both halves and the displacement */
+static inline size_t dispatch_bucket(uint64_t hash, size_t n_buckets)
+{
+	return (hash * 0x9e3779b97f4a7c15ull) >> 32 & (n_buckets - 1);
+}
+
+static inline size_t dispatch_slot(uint64_t hash, uint32_t displacement, size_t n_slots)
+{
+	return ((uint32_t)hash + (uint64_t)displacement * (hash >> 32 | 1)) & (n_slots - 1);
+}
+
+static size_t dispatch_pow2(size_t n)
+{
+	size_t p = 1;
+	while (p < n) p <<= 1;
+	return p;
+}
+
+/* until the table is built, slots is an open addressing index of the keys, which finds the ones added twice */
+static int32_t * dispatch_probe(struct kvnl_dispatch const * table, uint64_t hash, struct view key)
+{
+	int32_t * const slots = table->slots.data;
+	struct kvnl_dispatch_entry const * entries = dispatch_entries(table);
+	for (size_t s = hash & (table->n_slots - 1); ; s = (s + 1) & (table->n_slots - 1))
+		if (slots[s] < 0 || (entries[slots[s]].hash == hash && view_equals(dispatch_key(table, &entries[slots[s]]), key)))
+			return &slots[s];
+}
+
+static int dispatch_index(struct kvnl_dispatch * table, size_t n_slots)
+{
+	if (buf_resize(&table->slots, n_slots * sizeof(int32_t))) return -1;
+	table->n_slots = n_slots;
+	table->built = 0;
+	int32_t * const slots = table->slots.data;
+	for (size_t s = 0; s < n_slots; s++) slots[s] = -1;
+	struct kvnl_dispatch_entry const * entries = dispatch_entries(table);
+	for (size_t i = 0; i < table->n_keys; i++)
+		*dispatch_probe(table, entries[i].hash, dispatch_key(table, &entries[i])) = i;
+	return 0;
+}
+
+int kvnl_dispatch_add(struct kvnl_dispatch * table, char const * key, kvnl_handler handler, void * ctx)
+{
+	if (table->n_keys >= INT32_MAX) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	struct view const name = { (char *)key, strlen(key) };
+	/* a key that is there already leaves a built table as it is */
+	if (table->built > 0 && kvnl_dispatch_id(table, name) >= 0) {
+		errno = EEXIST;
+		return -1;
+	}
+	if ((table->built || 2 * (table->n_keys + 1) > table->n_slots)
+		&& dispatch_index(table, dispatch_pow2(4 * (table->n_keys + 1))))
+		return -1;
+
+	uint64_t const hash = dispatch_hash(name, table->seed);
+	int32_t * const slot = dispatch_probe(table, hash, name);
+	if (*slot >= 0) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	struct kvnl_dispatch_entry const entry = { table->keys.size, name.size, hash, handler, ctx };
+	size_t const keys_size = table->keys.size;
+	if (buf_push(&table->keys, name) || buf_push_value(&table->entries, entry)) {
+		buf_resize(&table->keys, keys_size);
+		return -1;
+	}
+	*slot = table->n_keys;
+	errno = 0;
+	return table->n_keys++;
+}
+
+struct dispatch_bucket { size_t size, first; };
+
+static int dispatch_bucket_order(void const * a, void const * b)
+{
+	size_t const x = ((struct dispatch_bucket const *)a)->size, y = ((struct dispatch_bucket const *)b)->size;
+	return (x < y) - (x > y);
+}
+
+/* one try at placing every key with the current seed and table sizes, largest buckets first */
+static int dispatch_place(struct kvnl_dispatch * table, struct dispatch_bucket * buckets, size_t * by_bucket)
+{
+	struct kvnl_dispatch_entry const * entries = dispatch_entries(table);
+	int32_t * const slots = table->slots.data;
+	uint32_t * const displacements = table->displacements.data;
+	size_t const n_keys = table->n_keys, n_buckets = table->n_buckets, n_slots = table->n_slots;
+
+	/* group the keys by bucket */
+	memset(buckets, 0, n_buckets * sizeof(*buckets));
+	for (size_t i = 0; i < n_keys; i++) buckets[dispatch_bucket(entries[i].hash, n_buckets)].size++;
+	for (size_t b = 0, first = 0; b < n_buckets; first += buckets[b++].size) buckets[b].first = first;
+	for (size_t i = 0; i < n_keys; i++) {
+		struct dispatch_bucket * bucket = &buckets[dispatch_bucket(entries[i].hash, n_buckets)];
+		by_bucket[bucket->first++] = i;
+	}
+	for (size_t b = 0; b < n_buckets; b++) {
+		buckets[b].first -= buckets[b].size;
+		displacements[b] = 0;
+	}
+	for (size_t s = 0; s < n_slots; s++) slots[s] = -1;
+
+	/* keep the bucket of every entry through the sort */
+	struct dispatch_bucket * order = buckets + n_buckets;
+	memcpy(order, buckets, n_buckets * sizeof(*buckets));
+	qsort(order, n_buckets, sizeof(*order), dispatch_bucket_order);
+
+	for (size_t o = 0; o < n_buckets && order[o].size; o++) {
+		size_t const * const keys = by_bucket + order[o].first;
+		size_t const size = order[o].size;
+		size_t const b = dispatch_bucket(entries[keys[0]].hash, n_buckets);
+		uint32_t d;
+		for (d = 0; d < KVNL_DISPATCH_TRIES; d++) {
+			size_t placed = 0;
+			for (; placed < size; placed++) {
+				size_t const slot = dispatch_slot(entries[keys[placed]].hash, d, n_slots);
+				if (slots[slot] >= 0) break;
+				slots[slot] = keys[placed];
+			}
+			if (placed == size) break;
+			while (placed--) slots[dispatch_slot(entries[keys[placed]].hash, d, n_slots)] = -1;
+		}
+		if (d == KVNL_DISPATCH_TRIES) return -1;
+		displacements[b] = d;
+	}
+	return 0;
+}
+
+int kvnl_dispatch_build(struct kvnl_dispatch * table)
+{
+	size_t const n_keys = table->n_keys;
+	table->n_buckets = dispatch_pow2((n_keys + KVNL_DISPATCH_BUCKET - 1) / KVNL_DISPATCH_BUCKET);
+	table->n_slots = dispatch_pow2(n_keys + n_keys / 4);
+	struct dispatch_bucket * buckets = malloc(2 * table->n_buckets * sizeof(*buckets) + n_keys * sizeof(size_t) + 1);
+	if (buckets == NULL) return errno;
+	size_t * by_bucket = (size_t *)(buckets + 2 * table->n_buckets);
+
+	/* a table that is too full, or keys that collide, take another seed, and now and then more slots */
+	int r = 0;
+	for (unsigned attempt = 0; ; attempt++) {
+		if (attempt) {
+			table->seed = (table->seed + 1) * 0x9e3779b97f4a7c15ull;
+			struct kvnl_dispatch_entry * entries = dispatch_entries(table);
+			for (size_t i = 0; i < n_keys; i++) entries[i].hash = dispatch_hash(dispatch_key(table, &entries[i]), table->seed);
+			if (attempt % 8 == 0) table->n_slots *= 2;
+		}
+		if (buf_resize(&table->slots, table->n_slots * sizeof(int32_t))
+			|| buf_resize(&table->displacements, table->n_buckets * sizeof(uint32_t))) {
+			r = errno;
+			break;
+		}
+		if (dispatch_place(table, buckets, by_bucket) == 0) break;
+		if (attempt == 64) {
+			r = errno = EAGAIN;
+			break;
+		}
+	}
+	free(buckets);
+	/* slots are neither an index nor a perfect hash then, and the next add indexes them again */
+	table->built = r ? -1 : 1;
+	return r ? r : (errno = 0);
+}
+
+int kvnl_dispatch_id(struct kvnl_dispatch const * table, struct view key)
+{
+	if (table->built <= 0) return -1;
+	uint64_t const hash = dispatch_hash(key, table->seed);
+	uint32_t const displacement = ((uint32_t const *)table->displacements.data)[dispatch_bucket(hash, table->n_buckets)];
+	int32_t const id = ((int32_t const *)table->slots.data)[dispatch_slot(hash, displacement, table->n_slots)];
+	if (id < 0) return -1;
+	struct kvnl_dispatch_entry const * entry = &dispatch_entries(table)[id];
+	return entry->hash == hash && view_equals(dispatch_key(table, entry), key) ? id : -1;
+}
+
+static kvnl_line dispatch_record(int fd, struct kvnl_dispatch const * table, kvnl_specification spec, struct buf * buf, kvnl_hash * hash)
+{
+	int const id = kvnl_dispatch_id(table, spec.key);
+	struct kvnl_dispatch_entry const * entry = id < 0 ? NULL : &dispatch_entries(table)[id];
+	if (entry != NULL && entry->handler != NULL) return entry->handler(entry->ctx, id, fd, spec, buf, hash);
+	if (table->fallback != NULL) return table->fallback(table->fallback_ctx, id, fd, spec, buf, hash);
+	return kvnl_skip_value(fd, spec, buf, hash);
+}
+
+kvnl_line kvnl_dispatch_line(int fd, struct kvnl_dispatch * table, struct buf * buf, kvnl_hash * hash)
+{
+	if (table->built <= 0 && kvnl_dispatch_build(table))
+		return (kvnl_line){ .error = "kvnl_dispatch_build() failed, consult errno" };
+	size_t const initial_size = buf->size;
+	kvnl_specification spec = kvnl_read_specification(fd, buf, hash);
+	if (spec.error || (spec.key.size == 1 && *(char *)spec.key.data == '\n'))
+		return kvnl_read_value(fd, spec, buf, hash);
+	if (spec.size >= 0 || !view_equals(spec.key, view_str(KVNL_CHECKSUM_KEY)))
+		return dispatch_record(fd, table, spec, buf, hash);
+
+	/* the checksum covers the record after it, which is dispatched as usual */
+	kvnl_line checksum = kvnl_read_value(fd, spec, buf, hash);
+	if (checksum.error) return checksum;
+	struct kvnl_check check;
+	const char * error = kvnl_check_start(&check, checksum.value, hash);
+	if (error)
+		return (kvnl_line){ .key = checksum.key, .size = -1, .value = checksum.value, .error = error };
+
+	buf_resize(buf, initial_size);
+	kvnl_specification covered = kvnl_read_specification(fd, buf, &check.hash);
+	if (covered.error || (covered.key.size == 1 && *(char *)covered.key.data == '\n'))
+		return kvnl_read_value(fd, covered, buf, &check.hash);
+	kvnl_line line = dispatch_record(fd, table, covered, buf, &check.hash);
+	if (line.error == NULL) line.error = kvnl_check_finish(&check);
+	return line;
+}
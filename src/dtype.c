@@ -0,0 +1,341 @@
+#include <dtype.h>
+#include <errno.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+struct dtype const INVALID_DTYPE = {
+	.kind = DTYPE_INVALID,
+	.size = 0,
+	.endian = DTYPE_NOT_APPLICABLE,
+};
+
+static int have_avx2, have_ssse3;
+
+__attribute__((constructor))
+static void dtype_init(void)
+{
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	have_avx2 = __builtin_cpu_supports("avx2");
+	have_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+static inline size_t min(size_t a, size_t b) { return a < b ? a : b; }
+
+int dtype_is_valid(struct dtype dtype)
+{
+	size_t const s = dtype.size;
+	int size_ok;
+	switch (dtype.kind) {
+	case DTYPE_BOOL: size_ok = s == 1; break;
+	case DTYPE_INT:
+	case DTYPE_UINT: size_ok = s == 1 || s == 2 || s == 4 || s == 8; break;
+	case DTYPE_FLOAT: size_ok = s == 2 || s == 4 || s == 8; break;
+	case DTYPE_COMPLEX: size_ok = s == 8 || s == 16; break;
+	default: return 0;
+	}
+	if (!size_ok) return 0;
+	if (s == 1) return dtype.endian == DTYPE_NOT_APPLICABLE;
+	return dtype.endian == DTYPE_LITTLE || dtype.endian == DTYPE_BIG;
+}
+
+int dtype_is_native(struct dtype dtype)
+{
+	return dtype.endian != (DTYPE_NATIVE == DTYPE_LITTLE ? DTYPE_BIG : DTYPE_LITTLE);
+}
+
+int dtype_equal(struct dtype a, struct dtype b)
+{
+	return a.kind == b.kind && a.size == b.size && a.endian == b.endian;
+}
+
+struct dtype make_dtype(enum dtype_kind kind, size_t size)
+{
+	struct dtype dtype = { kind, size, size == 1 ? DTYPE_NOT_APPLICABLE : DTYPE_NATIVE };
+	if (!dtype_is_valid(dtype)) { errno = EINVAL; return INVALID_DTYPE; }
+	return dtype;
+}
+
+static struct {
+	char const * name;
+	enum dtype_kind kind;
+	size_t size;
+} const DTYPE_NAMES[] = {
+	{ "bool", DTYPE_BOOL, 1 },
+	{ "int8", DTYPE_INT, 1 }, { "int16", DTYPE_INT, 2 }, { "int32", DTYPE_INT, 4 }, { "int64", DTYPE_INT, 8 },
+	{ "uint8", DTYPE_UINT, 1 }, { "uint16", DTYPE_UINT, 2 }, { "uint32", DTYPE_UINT, 4 }, { "uint64", DTYPE_UINT, 8 },
+	{ "float16", DTYPE_FLOAT, 2 }, { "float32", DTYPE_FLOAT, 4 }, { "float64", DTYPE_FLOAT, 8 },
+	{ "complex64", DTYPE_COMPLEX, 8 }, { "complex128", DTYPE_COMPLEX, 16 },
+};
+
+static char const DTYPE_KIND_CHARS[] = "?biufc";
+
+struct dtype dtype_parse(struct view str)
+{
+	for (size_t i = 0; i < sizeof(DTYPE_NAMES) / sizeof(*DTYPE_NAMES); i++)
+		if (view_equals(str, view_str((char *)DTYPE_NAMES[i].name)))
+			return make_dtype(DTYPE_NAMES[i].kind, DTYPE_NAMES[i].size);
+
+	char const * p = str.data, * const end = p + str.size;
+	char order = '=';
+	/* strchr() finds the terminating NUL too */
+	if (p < end && *p && strchr("<>=|", *p) != NULL) order = *p++;
+	if (p == end) goto invalid;
+	char const * kind = memchr(DTYPE_KIND_CHARS + 1, *p++, sizeof(DTYPE_KIND_CHARS) - 2);
+	if (kind == NULL || p == end) goto invalid;
+
+	size_t size = 0;
+	for (; p < end; p++) {
+		if (*p < '0' || *p > '9' || size > 16) goto invalid;
+		size = 10 * size + (*p - '0');
+	}
+
+	struct dtype dtype = { kind - DTYPE_KIND_CHARS, size, DTYPE_NATIVE };
+	if (size == 1) dtype.endian = DTYPE_NOT_APPLICABLE;
+	else if (order == '<' || order == '>') dtype.endian = order;
+	if (dtype_is_valid(dtype)) return dtype;
+invalid:
+	errno = EINVAL;
+	return INVALID_DTYPE;
+}
+
+int dtype_snprint(struct dtype dtype, char * str, size_t size)
+{
+	if (!dtype_is_valid(dtype)) return snprintf(str, size, "invalid");
+	return snprintf(str, size, "%c%c%zu", dtype.endian, DTYPE_KIND_CHARS[dtype.kind], dtype.size);
+}
+
+
+static void byteswap_scalar(unsigned char * d, unsigned char const * s, size_t n_words, size_t w)
+{
+	switch (w) {
+	case 2:
+		for (size_t i = 0; i < n_words; i++) {
+			uint16_t x;
+			memcpy(&x, s + 2 * i, 2);
+			x = __builtin_bswap16(x);
+			memcpy(d + 2 * i, &x, 2);
+		}
+		break;
+	case 4:
+		for (size_t i = 0; i < n_words; i++) {
+			uint32_t x;
+			memcpy(&x, s + 4 * i, 4);
+			x = __builtin_bswap32(x);
+			memcpy(d + 4 * i, &x, 4);
+		}
+		break;
+	case 8:
+		for (size_t i = 0; i < n_words; i++) {
+			uint64_t x;
+			memcpy(&x, s + 8 * i, 8);
+			x = __builtin_bswap64(x);
+			memcpy(d + 8 * i, &x, 8);
+		}
+		break;
+	default:
+		for (size_t i = 0; i < n_words; i++, s += w, d += w)
+			for (size_t b = 0; b < (w + 1) / 2; b++) {
+				unsigned char lo = s[b], hi = s[w - 1 - b];
+				d[b] = hi;
+				d[w - 1 - b] = lo;
+			}
+	}
+}
+
+#ifdef HAVE_X86_KERNELS
+/* the mask swaps every w-byte word within 16 bytes, so it works per 128-bit lane as well */
+__attribute__((target("ssse3")))
+static __m128i byteswap_mask(size_t w)
+{
+	unsigned char m[16];
+	for (size_t j = 0; j < 16; j++) m[j] = (j / w) * w + (w - 1 - j % w);
+	return _mm_loadu_si128((__m128i const *)m);
+}
+
+__attribute__((target("ssse3")))
+static size_t byteswap_ssse3(unsigned char * d, unsigned char const * s, size_t n, size_t w)
+{
+	__m128i const mask = byteswap_mask(w);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((__m128i const *)(s + i));
+		_mm_storeu_si128((__m128i *)(d + i), _mm_shuffle_epi8(x, mask));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t byteswap_avx2(unsigned char * d, unsigned char const * s, size_t n, size_t w)
+{
+	__m256i const mask = _mm256_broadcastsi128_si256(byteswap_mask(w));
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((__m256i const *)(s + i));
+		_mm256_storeu_si256((__m256i *)(d + i), _mm256_shuffle_epi8(x, mask));
+	}
+	return i;
+}
+#endif
+
+int dtype_byteswap(struct view dst, struct view src, size_t word_size)
+{
+	if (dst.size != src.size || word_size == 0 || src.size % word_size) return errno = EINVAL;
+	if (word_size == 1) {
+		memmove(dst.data, src.data, src.size);
+		return errno = 0;
+	}
+	size_t done = 0;
+#ifdef HAVE_X86_KERNELS
+	if (word_size == 2 || word_size == 4 || word_size == 8 || word_size == 16) {
+		if (have_avx2) done = byteswap_avx2(dst.data, src.data, src.size, word_size);
+		else if (have_ssse3) done = byteswap_ssse3(dst.data, src.data, src.size, word_size);
+	}
+#endif
+	byteswap_scalar(dst.data + done, src.data + done, (src.size - done) / word_size, word_size);
+	return errno = 0;
+}
+
+
+/* every pair of these gets a cast kernel; the index of a type is its position here */
+#define CAST_TYPES_A(X, ...) \
+	X(__VA_ARGS__, i8, int8_t) X(__VA_ARGS__, i16, int16_t) \
+	X(__VA_ARGS__, i32, int32_t) X(__VA_ARGS__, i64, int64_t) \
+	X(__VA_ARGS__, u8, uint8_t) X(__VA_ARGS__, u16, uint16_t) \
+	X(__VA_ARGS__, u32, uint32_t) X(__VA_ARGS__, u64, uint64_t) \
+	X(__VA_ARGS__, f32, float) X(__VA_ARGS__, f64, double)
+#define CAST_TYPES_B(X, ...) \
+	X(__VA_ARGS__, i8, int8_t) X(__VA_ARGS__, i16, int16_t) \
+	X(__VA_ARGS__, i32, int32_t) X(__VA_ARGS__, i64, int64_t) \
+	X(__VA_ARGS__, u8, uint8_t) X(__VA_ARGS__, u16, uint16_t) \
+	X(__VA_ARGS__, u32, uint32_t) X(__VA_ARGS__, u64, uint64_t) \
+	X(__VA_ARGS__, f32, float) X(__VA_ARGS__, f64, double)
+#define CAST_N_TYPES 10
+
+static int cast_index(struct dtype dtype)
+{
+	int const log2_size = dtype.size == 1 ? 0 : dtype.size == 2 ? 1 : dtype.size == 4 ? 2 : 3;
+	switch (dtype.kind) {
+	case DTYPE_BOOL: return 4;
+	case DTYPE_INT: return log2_size;
+	case DTYPE_UINT: return 4 + log2_size;
+	case DTYPE_FLOAT: return dtype.size == 4 ? 8 : dtype.size == 8 ? 9 : -1;
+	default: return -1;
+	}
+}
+
+typedef void (*cast_func)(void *, void const *, size_t);
+
+/* the vector extension lets the compiler pick the conversion instructions of each target */
+#define CAST_LANES 8
+#define CAST_KERNEL(ISA, ATTR, S, ST, D, DT) \
+	ATTR static void cast_##ISA##_##S##_##D(void * dst, void const * src, size_t n) \
+	{ \
+		typedef ST vs __attribute__((vector_size(CAST_LANES * sizeof(ST)))); \
+		typedef DT vd __attribute__((vector_size(CAST_LANES * sizeof(DT)))); \
+		size_t i = 0; \
+		for (; i + CAST_LANES <= n; i += CAST_LANES) { \
+			vs s; \
+			memcpy(&s, (ST const *)src + i, sizeof(s)); \
+			vd d = __builtin_convertvector(s, vd); \
+			memcpy((DT *)dst + i, &d, sizeof(d)); \
+		} \
+		for (; i < n; i++) ((DT *)dst)[i] = ((ST const *)src)[i]; \
+	}
+#define CAST_KERNELS_FROM(ISA, ATTR, S, ST) CAST_TYPES_B(CAST_KERNEL, ISA, ATTR, S, ST)
+#define CAST_ENTRY(ISA, S, ST, D, DT) cast_##ISA##_##S##_##D,
+#define CAST_ROW(ISA, S, ST) { CAST_TYPES_B(CAST_ENTRY, ISA, S, ST) },
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+CAST_TYPES_A(CAST_KERNELS_FROM, base, )
+static cast_func const CAST_BASE[CAST_N_TYPES][CAST_N_TYPES] = { CAST_TYPES_A(CAST_ROW, base) };
+#ifdef HAVE_X86_KERNELS
+CAST_TYPES_A(CAST_KERNELS_FROM, avx2, __attribute__((target("avx2"))))
+static cast_func const CAST_AVX2[CAST_N_TYPES][CAST_N_TYPES] = { CAST_TYPES_A(CAST_ROW, avx2) };
+#endif
+#pragma GCC diagnostic pop
+
+#define TO_BOOL(_, S, ST) \
+	static void to_bool_##S(void * dst, void const * src, size_t n) \
+	{ \
+		for (size_t i = 0; i < n; i++) ((uint8_t *)dst)[i] = ((ST const *)src)[i] != 0; \
+	}
+#define TO_BOOL_ENTRY(_, S, ST) to_bool_##S,
+CAST_TYPES_A(TO_BOOL, )
+static cast_func const TO_BOOL[CAST_N_TYPES] = { CAST_TYPES_A(TO_BOOL_ENTRY, ) };
+
+/* elements per pass; small enough that a swapped source block stays in L1 */
+#define DTYPE_BLOCK 1024
+
+static int is_half(struct dtype dtype) { return dtype.kind == DTYPE_FLOAT && dtype.size == 2; }
+
+/* float16 goes through double, which holds every half exactly and rounds to one correctly */
+static int convert_half(struct view dst, struct dtype dst_dtype, struct view src, struct dtype src_dtype, size_t n)
+{
+	struct dtype const f64 = make_dtype(DTYPE_FLOAT, 8);
+	size_t const ss = src_dtype.size, ds = dst_dtype.size;
+	double values[DTYPE_BLOCK];
+	_Float16 halves[DTYPE_BLOCK];
+	for (size_t i = 0; i < n; i += DTYPE_BLOCK) {
+		size_t const m = min(DTYPE_BLOCK, n - i);
+		struct view const s = { src.data + i * ss, m * ss }, d = { dst.data + i * ds, m * ds };
+		if (is_half(src_dtype)) {
+			if (dtype_is_native(src_dtype)) memcpy(halves, s.data, s.size);
+			else dtype_byteswap((struct view){ halves, s.size }, s, 2);
+			for (size_t j = 0; j < m; j++) values[j] = halves[j];
+			if (dtype_convert(d, dst_dtype, (struct view){ values, m * sizeof(double) }, f64)) return errno;
+		}
+		else {
+			if (dtype_convert((struct view){ values, m * sizeof(double) }, f64, s, src_dtype)) return errno;
+			for (size_t j = 0; j < m; j++) halves[j] = (_Float16)values[j];
+			if (dtype_is_native(dst_dtype)) memcpy(d.data, halves, d.size);
+			else dtype_byteswap(d, (struct view){ halves, d.size }, 2);
+		}
+	}
+	return errno = 0;
+}
+
+int dtype_convert(struct view dst, struct dtype dst_dtype, struct view src, struct dtype src_dtype)
+{
+	if (!dtype_is_valid(dst_dtype) || !dtype_is_valid(src_dtype)) return errno = EINVAL;
+	size_t const ss = src_dtype.size, ds = dst_dtype.size, n = src.size / ss;
+	if (src.size % ss || dst.size != n * ds) return errno = EINVAL;
+
+	/* the same kind of element, perhaps in a different byte order */
+	if (src_dtype.kind == dst_dtype.kind && ss == ds) {
+		if (src_dtype.endian == dst_dtype.endian) {
+			memmove(dst.data, src.data, src.size);
+			return errno = 0;
+		}
+		return dtype_byteswap(dst, src, src_dtype.kind == DTYPE_COMPLEX ? ss / 2 : ss);
+	}
+
+	if (is_half(src_dtype) || is_half(dst_dtype)) return convert_half(dst, dst_dtype, src, src_dtype, n);
+	int const si = cast_index(src_dtype), di = cast_index(dst_dtype);
+	if (si < 0 || di < 0) return errno = EINVAL;
+	cast_func cast = CAST_BASE[si][di];
+#ifdef HAVE_X86_KERNELS
+	if (have_avx2) cast = CAST_AVX2[si][di];
+#endif
+	if (dst_dtype.kind == DTYPE_BOOL) cast = TO_BOOL[si];
+
+	int const swap_src = !dtype_is_native(src_dtype), swap_dst = !dtype_is_native(dst_dtype);
+	uint64_t swapped[DTYPE_BLOCK];
+	for (size_t i = 0; i < n; i += DTYPE_BLOCK) {
+		size_t const m = min(DTYPE_BLOCK, n - i);
+		void const * s = src.data + i * ss;
+		void * d = dst.data + i * ds;
+		if (swap_src) {
+			dtype_byteswap((struct view){ swapped, m * ss }, (struct view){ (void *)s, m * ss }, ss);
+			s = swapped;
+		}
+		cast(d, s, m);
+		if (swap_dst) dtype_byteswap((struct view){ d, m * ds }, (struct view){ d, m * ds }, ds);
+	}
+	return errno = 0;
+}
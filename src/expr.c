@@ -0,0 +1,564 @@
+#include <expr.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline size_t min(size_t a, size_t b) { return a < b ? a : b; }
+
+/* the bytes of one node's block of values */
+#define EXPR_TEMP (EXPR_BLOCK * 8)
+
+static struct dtype bool_type(void) { return make_dtype(DTYPE_BOOL, 1); }
+static struct dtype int_type(void) { return make_dtype(DTYPE_INT, 8); }
+static struct dtype float_type(void) { return make_dtype(DTYPE_FLOAT, 8); }
+static struct dtype float32_type(void) { return make_dtype(DTYPE_FLOAT, 4); }
+
+/* what dtype_convert() converts to and from, in the native order or not */
+static int dtype_supported(struct dtype dtype)
+{
+	return dtype_is_valid(dtype) && dtype.kind != DTYPE_COMPLEX && (dtype.kind != DTYPE_FLOAT || dtype.size >= 4);
+}
+
+static struct dtype compute_type(struct dtype dtype)
+{
+	if (dtype.kind == DTYPE_FLOAT) return dtype.size == 4 ? float32_type() : float_type();
+	return dtype.kind == DTYPE_BOOL ? bool_type() : int_type();
+}
+
+static size_t n_args(enum expr_op op)
+{
+	return op <= EXPR_CONSTANT ? 0 : op <= EXPR_NOT ? 1 : op < EXPR_SELECT ? 2 : 3;
+}
+
+struct expr make_expr(void)
+{
+	return (struct expr){ .n_nodes = 0 };
+}
+
+static int add_node(struct expr * expr, struct expr_node node)
+{
+	if (expr->n_nodes == EXPR_MAX_NODES) {
+		errno = E2BIG;
+		return -1;
+	}
+	expr->nodes[expr->n_nodes] = node;
+	return expr->n_nodes++;
+}
+
+/* a failed argument keeps its errno */
+static int check_arg(struct expr const * expr, int a)
+{
+	if (a >= 0 && (size_t)a >= expr->n_nodes) errno = EINVAL;
+	return a >= 0 && (size_t)a < expr->n_nodes;
+}
+
+static int add_op(struct expr * expr, enum expr_op op, struct dtype type, int a, int b, int c)
+{
+	return add_node(expr, (struct expr_node){ .op = op, .type = type, .args = { a, b, c }, .dtype = type });
+}
+
+/* constants are made again of the type rather than cast every block */
+static int to_type(struct expr * expr, int a, struct dtype type)
+{
+	if (a < 0 || dtype_equal(expr->nodes[a].type, type)) return a;
+	if (expr->nodes[a].op == EXPR_CONSTANT) {
+		struct expr_node constant = expr->nodes[a];
+		constant.type = type;
+		return add_node(expr, constant);
+	}
+	return add_op(expr, EXPR_CAST, type, a, -1, -1);
+}
+
+static int keeps_float32(struct expr_node const * node)
+{
+	return node->op == EXPR_CONSTANT || node->type.kind == DTYPE_BOOL || dtype_equal(node->type, float32_type());
+}
+
+/* booleans count as integers, and float32 stays float32 next to booleans and constants */
+static struct dtype arithmetic_type(struct expr const * expr, int a, int b, int is_float)
+{
+	struct expr_node const * x = &expr->nodes[a], * y = &expr->nodes[b < 0 ? a : b];
+	int const float32 = dtype_equal(x->type, float32_type()) || dtype_equal(y->type, float32_type());
+	if (!is_float && x->type.kind != DTYPE_FLOAT && y->type.kind != DTYPE_FLOAT) return int_type();
+	return float32 && keeps_float32(x) && keeps_float32(y) ? float32_type() : float_type();
+}
+
+int expr_input(struct expr * expr, struct ndview const * view, struct dtype dtype)
+{
+	if (view == NULL || view->ndim > EXPR_MAX_NDIM || !dtype_supported(dtype)) {
+		errno = EINVAL;
+		return -1;
+	}
+	return add_node(expr, (struct expr_node){
+		.op = EXPR_INPUT, .type = compute_type(dtype), .args = { -1, -1, -1 }, .dtype = dtype, .input = *view
+	});
+}
+
+int expr_float(struct expr * expr, double value)
+{
+	return add_node(expr, (struct expr_node){
+		.op = EXPR_CONSTANT, .type = float_type(), .args = { -1, -1, -1 }, .dtype = float_type(), .number = value
+	});
+}
+
+int expr_int(struct expr * expr, int64_t value)
+{
+	return add_node(expr, (struct expr_node){
+		.op = EXPR_CONSTANT, .type = int_type(), .args = { -1, -1, -1 }, .dtype = int_type(), .integer = value
+	});
+}
+
+int expr_cast(struct expr * expr, int a, struct dtype dtype)
+{
+	if (!check_arg(expr, a)) return -1;
+	if (!dtype_supported(dtype)) {
+		errno = EINVAL;
+		return -1;
+	}
+	return add_node(expr, (struct expr_node){
+		.op = EXPR_CAST, .type = compute_type(dtype), .args = { a, -1, -1 }, .dtype = dtype
+	});
+}
+
+int expr_unary(struct expr * expr, enum expr_op op, int a)
+{
+	if (!check_arg(expr, a)) return -1;
+	struct dtype type;
+	switch (op) {
+	case EXPR_NEG:
+	case EXPR_ABS: type = arithmetic_type(expr, a, -1, 0); break;
+	case EXPR_SQRT: type = arithmetic_type(expr, a, -1, 1); break;
+	case EXPR_NOT: type = bool_type(); break;
+	default: errno = EINVAL; return -1;
+	}
+	a = to_type(expr, a, type);
+	return a < 0 ? -1 : add_op(expr, op, type, a, -1, -1);
+}
+
+int expr_binary(struct expr * expr, enum expr_op op, int a, int b)
+{
+	if (!check_arg(expr, a) || !check_arg(expr, b)) return -1;
+	struct dtype args = arithmetic_type(expr, a, b, op == EXPR_DIV), type = args;
+	switch (op) {
+	case EXPR_ADD:
+	case EXPR_SUB:
+	case EXPR_MUL:
+	case EXPR_MIN:
+	case EXPR_MAX: break;
+	case EXPR_DIV: break;
+	case EXPR_LT:
+	case EXPR_LE:
+	case EXPR_GT:
+	case EXPR_GE:
+	case EXPR_EQ:
+	case EXPR_NE: type = bool_type(); break;
+	case EXPR_AND:
+	case EXPR_OR: args = type = bool_type(); break;
+	default: errno = EINVAL; return -1;
+	}
+	a = to_type(expr, a, args);
+	b = to_type(expr, b, args);
+	return a < 0 || b < 0 ? -1 : add_op(expr, op, type, a, b, -1);
+}
+
+int expr_select(struct expr * expr, int cond, int a, int b)
+{
+	if (!check_arg(expr, cond) || !check_arg(expr, a) || !check_arg(expr, b)) return -1;
+	int const both_bool = expr->nodes[a].type.kind == DTYPE_BOOL && expr->nodes[b].type.kind == DTYPE_BOOL;
+	struct dtype const type = both_bool ? bool_type() : arithmetic_type(expr, a, b, 0);
+	cond = to_type(expr, cond, bool_type());
+	a = to_type(expr, a, type);
+	b = to_type(expr, b, type);
+	return cond < 0 || a < 0 || b < 0 ? -1 : add_op(expr, EXPR_SELECT, type, cond, a, b);
+}
+
+
+/*
+ * the loops over a block: EXPR_LANES elements at a time through the vector
+ * extension, like the casts of dtype.c, then the rest one at a time, and what
+ * has no vector operator one at a time throughout; comparisons narrow their
+ * masks to bytes. Integers wrap around (computed as uint64), and NaN wins min
+ * and max like in NumPy.
+ */
+#define EXPR_LANES 8
+#define SAME(E, R) (E)
+#define NARROW(E, R) __builtin_convertvector((E) & 1, R)
+
+#define VECTOR_LOOP(T, R, EXPR, TO_R) do { \
+	typedef T vt __attribute__((vector_size(EXPR_LANES * sizeof(T)))); \
+	typedef R vr __attribute__((vector_size(EXPR_LANES * sizeof(R)))); \
+	size_t i = 0; \
+	for (; i + EXPR_LANES <= n; i += EXPR_LANES) { \
+		vt x, y; \
+		memcpy(&x, (T const *)a + i, sizeof(x)); \
+		memcpy(&y, (T const *)b + i, sizeof(y)); \
+		vr const z = TO_R(EXPR, vr); \
+		memcpy((R *)dst + i, &z, sizeof(z)); \
+	} \
+	for (; i < n; i++) { \
+		T const x = ((T const *)a)[i], y = ((T const *)b)[i]; \
+		(void)y; \
+		((R *)dst)[i] = (EXPR); \
+	} \
+} while (0)
+
+#define LOOP(T, R, EXPR) do { \
+	T const * x = a, * y = b; \
+	R * z = dst; \
+	(void)y; \
+	for (size_t i = 0; i < n; i++) z[i] = (EXPR); \
+} while (0)
+
+#define FLOAT_OPS(T, FABS, SQRT) switch (op) { \
+	case EXPR_NEG: VECTOR_LOOP(T, T, -x, SAME); return; \
+	case EXPR_ABS: LOOP(T, T, FABS(x[i])); return; \
+	case EXPR_SQRT: LOOP(T, T, SQRT(x[i])); return; \
+	case EXPR_ADD: VECTOR_LOOP(T, T, x + y, SAME); return; \
+	case EXPR_SUB: VECTOR_LOOP(T, T, x - y, SAME); return; \
+	case EXPR_MUL: VECTOR_LOOP(T, T, x * y, SAME); return; \
+	case EXPR_DIV: VECTOR_LOOP(T, T, x / y, SAME); return; \
+	case EXPR_MIN: LOOP(T, T, x[i] != x[i] || x[i] < y[i] ? x[i] : y[i]); return; \
+	case EXPR_MAX: LOOP(T, T, x[i] != x[i] || x[i] > y[i] ? x[i] : y[i]); return; \
+	case EXPR_LT: VECTOR_LOOP(T, uint8_t, x < y, NARROW); return; \
+	case EXPR_LE: VECTOR_LOOP(T, uint8_t, x <= y, NARROW); return; \
+	case EXPR_GT: VECTOR_LOOP(T, uint8_t, x > y, NARROW); return; \
+	case EXPR_GE: VECTOR_LOOP(T, uint8_t, x >= y, NARROW); return; \
+	case EXPR_EQ: VECTOR_LOOP(T, uint8_t, x == y, NARROW); return; \
+	case EXPR_NE: VECTOR_LOOP(T, uint8_t, x != y, NARROW); return; \
+	default: return; \
+}
+
+/* type is that of the operands; b is a for unary operators */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+static void compute(enum expr_op op, struct dtype type, void * dst, void const * a, void const * b, size_t n)
+{
+	if (type.kind == DTYPE_FLOAT && type.size == 4) FLOAT_OPS(float, __builtin_fabsf, __builtin_sqrtf)
+	if (type.kind == DTYPE_FLOAT) FLOAT_OPS(double, __builtin_fabs, __builtin_sqrt)
+	if (type.kind == DTYPE_INT) switch (op) {
+	case EXPR_NEG: VECTOR_LOOP(uint64_t, uint64_t, -x, SAME); return;
+	case EXPR_ABS: LOOP(int64_t, int64_t, x[i] < 0 ? (int64_t)(0 - (uint64_t)x[i]) : x[i]); return;
+	case EXPR_ADD: VECTOR_LOOP(uint64_t, uint64_t, x + y, SAME); return;
+	case EXPR_SUB: VECTOR_LOOP(uint64_t, uint64_t, x - y, SAME); return;
+	case EXPR_MUL: VECTOR_LOOP(uint64_t, uint64_t, x * y, SAME); return;
+	case EXPR_MIN: LOOP(int64_t, int64_t, x[i] < y[i] ? x[i] : y[i]); return;
+	case EXPR_MAX: LOOP(int64_t, int64_t, x[i] > y[i] ? x[i] : y[i]); return;
+	case EXPR_LT: VECTOR_LOOP(int64_t, uint8_t, x < y, NARROW); return;
+	case EXPR_LE: VECTOR_LOOP(int64_t, uint8_t, x <= y, NARROW); return;
+	case EXPR_GT: VECTOR_LOOP(int64_t, uint8_t, x > y, NARROW); return;
+	case EXPR_GE: VECTOR_LOOP(int64_t, uint8_t, x >= y, NARROW); return;
+	case EXPR_EQ: VECTOR_LOOP(int64_t, uint8_t, x == y, NARROW); return;
+	case EXPR_NE: VECTOR_LOOP(int64_t, uint8_t, x != y, NARROW); return;
+	default: return;
+	}
+	switch (op) {
+	case EXPR_NOT: VECTOR_LOOP(uint8_t, uint8_t, x == 0, NARROW); return;
+	case EXPR_AND: VECTOR_LOOP(uint8_t, uint8_t, (x != 0) & (y != 0), NARROW); return;
+	case EXPR_OR: VECTOR_LOOP(uint8_t, uint8_t, (x != 0) | (y != 0), NARROW); return;
+	default: return;
+	}
+}
+
+/* the condition widened to a mask of the values */
+#define SELECT_LOOP(T) do { \
+	typedef uint8_t vc __attribute__((vector_size(EXPR_LANES))); \
+	typedef T vt __attribute__((vector_size(EXPR_LANES * sizeof(T)))); \
+	size_t i = 0; \
+	for (; i + EXPR_LANES <= n; i += EXPR_LANES) { \
+		vc c; \
+		vt x, y; \
+		memcpy(&c, cond + i, sizeof(c)); \
+		memcpy(&x, (T const *)a + i, sizeof(x)); \
+		memcpy(&y, (T const *)b + i, sizeof(y)); \
+		vt const mask = __builtin_convertvector(c != 0, vt); \
+		vt const z = (x & mask) | (y & ~mask); \
+		memcpy((T *)dst + i, &z, sizeof(z)); \
+	} \
+	for (; i < n; i++) ((T *)dst)[i] = cond[i] ? ((T const *)a)[i] : ((T const *)b)[i]; \
+} while (0)
+
+static void select_values(size_t size, void * dst, uint8_t const * cond, void const * a, void const * b, size_t n)
+{
+	if (size == 8) SELECT_LOOP(uint64_t);
+	else if (size == 4) SELECT_LOOP(uint32_t);
+	else SELECT_LOOP(uint8_t);
+}
+#pragma GCC diagnostic pop
+
+/* strided elements to and from a dense block */
+#define GATHER(T) for (size_t i = 0; i < n; i++) memcpy((T *)dst + i, src + (ssize_t)i * stride, sizeof(T))
+#define SCATTER(T) for (size_t i = 0; i < n; i++) memcpy(dst + (ssize_t)i * stride, (T const *)src + i, sizeof(T))
+
+static void gather(void * dst, char const * src, ssize_t stride, size_t size, size_t n)
+{
+	switch (size) {
+	case 1: GATHER(uint8_t); break;
+	case 2: GATHER(uint16_t); break;
+	case 4: GATHER(uint32_t); break;
+	default: GATHER(uint64_t); break;
+	}
+}
+
+static void scatter(char * dst, ssize_t stride, void const * src, size_t size, size_t n)
+{
+	switch (size) {
+	case 1: SCATTER(uint8_t); break;
+	case 2: SCATTER(uint16_t); break;
+	case 4: SCATTER(uint32_t); break;
+	default: SCATTER(uint64_t); break;
+	}
+}
+
+static void convert(void * dst, struct dtype dst_dtype, void const * src, struct dtype src_dtype, size_t n)
+{
+	dtype_convert(
+		(struct view){ dst, n * dst_dtype.size }, dst_dtype,
+		(struct view){ (void *)src, n * src_dtype.size }, src_dtype
+	);
+}
+
+/* operand 0 is out, the others are the inputs the root needs, along the merged dimensions */
+struct expr_job {
+	struct expr const * expr;
+	int root;
+	unsigned char needed[EXPR_MAX_NODES];
+	size_t operand[EXPR_MAX_NODES];
+	struct dtype dtype;
+	int direct;
+	size_t ndim, n_ops;
+	size_t shape[EXPR_MAX_NDIM];
+	char * data[EXPR_MAX_NODES + 1];
+	ssize_t strides[EXPR_MAX_NODES + 1][EXPR_MAX_NDIM];
+	size_t size, n_tasks;
+	atomic_size_t next;
+	atomic_int error;
+};
+
+/* dense values of the compute type are used where they are */
+static void const * load(struct expr_node const * node, char const * p, ssize_t stride, size_t n, void * temp, void * staging)
+{
+	size_t const size = node->dtype.size;
+	if (stride == (ssize_t)size || n == 1) {
+		if (dtype_equal(node->dtype, node->type) && (uintptr_t)p % size == 0) return p;
+	}
+	else {
+		gather(staging, p, stride, size, n);
+		p = staging;
+	}
+	convert(temp, node->type, p, node->dtype, n);
+	return temp;
+}
+
+static void store(char * p, ssize_t stride, struct dtype dtype, void const * values, struct dtype type, size_t n, void * staging)
+{
+	int const dense = stride == (ssize_t)dtype.size || n == 1;
+	convert(dense ? p : staging, dtype, values, type, n);
+	if (!dense) scatter(p, stride, staging, dtype.size, n);
+}
+
+static void eval_block(struct expr_job const * job, char * const * ptr, size_t n, unsigned char * scratch, void const ** values)
+{
+	struct expr_node const * nodes = job->expr->nodes;
+	size_t const inner = job->ndim - 1;
+	unsigned char * staging = scratch + (job->root + 1) * EXPR_TEMP;
+	/* an operator at the root writes straight into dense out of its type */
+	ssize_t const stride = job->strides[0][inner];
+	size_t const size = job->dtype.size;
+	int const direct = job->direct && (stride == (ssize_t)size || n == 1) && (uintptr_t)ptr[0] % size == 0;
+
+	for (int i = 0; i <= job->root; i++) {
+		if (!job->needed[i]) continue;
+		struct expr_node const * node = &nodes[i];
+		int const * args = node->args;
+		void * temp = direct && i == job->root ? (void *)ptr[0] : scratch + i * EXPR_TEMP;
+		switch (node->op) {
+		case EXPR_INPUT: {
+			size_t const k = job->operand[i];
+			values[i] = load(node, ptr[k], job->strides[k][inner], n, temp, staging);
+			break;
+		}
+		case EXPR_CONSTANT:
+			break;
+		case EXPR_CAST: {
+			struct dtype const from = nodes[args[0]].type;
+			if (!dtype_equal(node->dtype, node->type)) {
+				convert(staging, node->dtype, values[args[0]], from, n);
+				convert(temp, node->type, staging, node->dtype, n);
+				values[i] = temp;
+			}
+			else if (!dtype_equal(from, node->type)) {
+				convert(temp, node->type, values[args[0]], from, n);
+				values[i] = temp;
+			}
+			else {
+				values[i] = values[args[0]];
+			}
+			break;
+		}
+		case EXPR_NEG:
+		case EXPR_ABS:
+		case EXPR_SQRT:
+		case EXPR_NOT:
+			compute(node->op, node->type, temp, values[args[0]], values[args[0]], n);
+			values[i] = temp;
+			break;
+		case EXPR_SELECT:
+			select_values(node->type.size, temp, values[args[0]], values[args[1]], values[args[2]], n);
+			values[i] = temp;
+			break;
+		default:
+			compute(node->op, nodes[args[0]].type, temp, values[args[0]], values[args[1]], n);
+			values[i] = temp;
+			break;
+		}
+	}
+	if (!direct) store(ptr[0], stride, job->dtype, values[job->root], nodes[job->root].type, n, staging);
+}
+
+/* elements start to end in the order of out, a run of the inner dimension at a time */
+static void eval_task(struct expr_job const * job, size_t start, size_t end, unsigned char * scratch, void const ** values)
+{
+	size_t const inner = job->ndim - 1;
+	size_t index[EXPR_MAX_NDIM];
+	size_t rest = start;
+	for (size_t d = job->ndim; d-- > 0; ) {
+		index[d] = rest % job->shape[d];
+		rest /= job->shape[d];
+	}
+
+	char * ptr[EXPR_MAX_NODES + 1];
+	while (start < end) {
+		for (size_t k = 0; k < job->n_ops; k++) {
+			ptr[k] = job->data[k];
+			for (size_t d = 0; d < job->ndim; d++) ptr[k] += (ssize_t)index[d] * job->strides[k][d];
+		}
+		size_t const run = min(job->shape[inner] - index[inner], end - start);
+		for (size_t j = 0; j < run; j += EXPR_BLOCK) {
+			eval_block(job, ptr, min(EXPR_BLOCK, run - j), scratch, values);
+			for (size_t k = 0; k < job->n_ops; k++) ptr[k] += EXPR_BLOCK * job->strides[k][inner];
+		}
+		start += run;
+		index[inner] += run;
+		for (size_t d = inner; d > 0 && index[d] == job->shape[d]; d--) {
+			index[d] = 0;
+			index[d - 1]++;
+		}
+	}
+}
+
+static void * run_eval(void * arg)
+{
+	struct expr_job * job = arg;
+	struct expr_node const * nodes = job->expr->nodes;
+	unsigned char * scratch = malloc((job->root + 2) * EXPR_TEMP);
+	if (scratch == NULL) { atomic_store(&job->error, ENOMEM); return NULL; }
+	void const * values[EXPR_MAX_NODES];
+
+	/* constants are the same for every block, made of their value by dtype_convert() */
+	for (int i = 0; i <= job->root; i++) {
+		if (!job->needed[i] || nodes[i].op != EXPR_CONSTANT) continue;
+		unsigned char * temp = scratch + i * EXPR_TEMP;
+		size_t const size = nodes[i].type.size;
+		convert(temp, nodes[i].type, nodes[i].dtype.kind == DTYPE_FLOAT ? (void const *)&nodes[i].number : &nodes[i].integer, nodes[i].dtype, 1);
+		for (size_t j = 1; j < EXPR_BLOCK; j++) memcpy(temp + j * size, temp, size);
+		values[i] = temp;
+	}
+	for (size_t t; (t = atomic_fetch_add(&job->next, 1)) < job->n_tasks && !atomic_load(&job->error); )
+		eval_task(job, t * EXPR_TASK, min(job->size, (t + 1) * EXPR_TASK), scratch, values);
+	free(scratch);
+	return NULL;
+}
+
+/* the nodes the root needs, each only after its arguments */
+static int mark_needed(struct expr const * expr, int root, unsigned char * needed)
+{
+	memset(needed, 0, EXPR_MAX_NODES);
+	needed[root] = 1;
+	for (int i = root; i >= 0; i--) {
+		if (!needed[i]) continue;
+		struct expr_node const * node = &expr->nodes[i];
+		if (node->op > EXPR_SELECT) return EINVAL;
+		if (node->op == EXPR_INPUT && (!dtype_supported(node->dtype) || node->input.ndim > EXPR_MAX_NDIM)) return EINVAL;
+		for (size_t a = 0; a < n_args(node->op); a++) {
+			if (node->args[a] < 0 || node->args[a] >= i) return EINVAL;
+			needed[node->args[a]] = 1;
+		}
+	}
+	return 0;
+}
+
+/* the strides of an input along the dimensions of out, 0 where it broadcasts */
+static int broadcast(struct ndview const * out, struct ndview const * input, ssize_t * strides)
+{
+	if (input->ndim > out->ndim) return EINVAL;
+	size_t const skip = out->ndim - input->ndim;
+	for (size_t d = 0; d < out->ndim; d++) {
+		if (d < skip || (input->shape[d - skip] == 1 && out->shape[d] != 1)) strides[d] = 0;
+		else if (input->shape[d - skip] == out->shape[d]) strides[d] = input->strides[d - skip];
+		else return EINVAL;
+	}
+	return 0;
+}
+
+/* drops dimensions of size 1, and merges those that every operand walks through as one */
+static void coalesce(struct expr_job * job, struct ndview const * out, ssize_t (*strides)[EXPR_MAX_NDIM])
+{
+	job->ndim = 0;
+	for (size_t d = 0; d < out->ndim; d++) {
+		if (out->shape[d] == 1) continue;
+		size_t const last = job->ndim - 1;
+		int merge = job->ndim > 0;
+		for (size_t k = 0; merge && k < job->n_ops; k++)
+			merge = job->strides[k][last] == strides[k][d] * (ssize_t)out->shape[d];
+		if (merge) {
+			job->shape[last] *= out->shape[d];
+			for (size_t k = 0; k < job->n_ops; k++) job->strides[k][last] = strides[k][d];
+			continue;
+		}
+		job->shape[job->ndim] = out->shape[d];
+		for (size_t k = 0; k < job->n_ops; k++) job->strides[k][job->ndim] = strides[k][d];
+		job->ndim++;
+	}
+	if (job->ndim == 0) {
+		job->shape[0] = 1;
+		for (size_t k = 0; k < job->n_ops; k++) job->strides[k][0] = 0;
+		job->ndim = 1;
+	}
+}
+
+int expr_eval(struct expr const * expr, int root, struct ndview const * out, struct dtype dtype, size_t n_threads)
+{
+	if (root < 0 || (size_t)root >= expr->n_nodes || out->ndim > EXPR_MAX_NDIM || !dtype_supported(dtype))
+		return errno = EINVAL;
+	struct expr_job job = { .expr = expr, .root = root, .dtype = dtype, .n_ops = 1, .size = 1 };
+	if (mark_needed(expr, root, job.needed)) return errno = EINVAL;
+	job.direct = expr->nodes[root].op >= EXPR_NEG && dtype_equal(dtype, expr->nodes[root].type);
+	for (size_t d = 0; d < out->ndim; d++)
+		if (__builtin_mul_overflow(job.size, out->shape[d], &job.size)) return errno = EINVAL;
+
+	ssize_t strides[EXPR_MAX_NODES + 1][EXPR_MAX_NDIM];
+	for (size_t d = 0; d < out->ndim; d++) strides[0][d] = out->strides[d];
+	job.data[0] = out->data;
+	for (int i = 0; i <= root; i++) {
+		if (!job.needed[i] || expr->nodes[i].op != EXPR_INPUT) continue;
+		if (broadcast(out, &expr->nodes[i].input, strides[job.n_ops])) return errno = EINVAL;
+		job.data[job.n_ops] = expr->nodes[i].input.data;
+		job.operand[i] = job.n_ops++;
+	}
+	if (job.size == 0) return errno = 0;
+	coalesce(&job, out, strides);
+
+	job.n_tasks = (job.size + EXPR_TASK - 1) / EXPR_TASK;
+	atomic_init(&job.next, 0);
+	atomic_init(&job.error, 0);
+	n_threads = min(n_threads ? n_threads : 1, job.n_tasks);
+	pthread_t threads[n_threads];
+	size_t started = 0;
+	for (; started + 1 < n_threads; started++)
+		if (pthread_create(&threads[started], NULL, run_eval, &job)) break;
+	run_eval(&job);
+	for (size_t t = 0; t < started; t++) pthread_join(threads[t], NULL);
+	return errno = atomic_load(&job.error);
+}
@@ -0,0 +1,281 @@
+#include <hash.h>
+#include <errno.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_KERNEL 1
+#endif
+
+static uint32_t crc32c_table[8][256];
+static int have_sse42;
+
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t crc = n;
+		for (int k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+		crc32c_table[0][n] = crc;
+	}
+	for (uint32_t n = 0; n < 256; n++)
+		for (int k = 1; k < 8; k++) {
+			uint32_t crc = crc32c_table[k - 1][n];
+			crc32c_table[k][n] = (crc >> 8) ^ crc32c_table[0][crc & 0xff];
+		}
+#ifdef HAVE_SSE42_KERNEL
+	__builtin_cpu_init();
+	have_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static inline uint64_t load64(void const * p) { uint64_t x; memcpy(&x, p, 8); return x; }
+static inline uint32_t load32(void const * p) { uint32_t x; memcpy(&x, p, 4); return x; }
+
+/* these work on the inverted crc; callers do the pre- and post-conditioning */
+static uint32_t crc32c_table_kernel(uint32_t crc, unsigned char const * p, size_t n)
+{
+	for (; n >= 8; n -= 8, p += 8) {
+		uint64_t x = load64(p) ^ crc;
+		crc = crc32c_table[7][x & 0xff] ^
+		      crc32c_table[6][(x >> 8) & 0xff] ^
+		      crc32c_table[5][(x >> 16) & 0xff] ^
+		      crc32c_table[4][(x >> 24) & 0xff] ^
+		      crc32c_table[3][(x >> 32) & 0xff] ^
+		      crc32c_table[2][(x >> 40) & 0xff] ^
+		      crc32c_table[1][(x >> 48) & 0xff] ^
+		      crc32c_table[0][x >> 56];
+	}
+	while (n--) crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#ifdef HAVE_SSE42_KERNEL
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42_kernel(uint32_t crc, unsigned char const * p, size_t n)
+{
+	uint64_t crc64 = crc;
+	for (; n >= 8; n -= 8, p += 8) crc64 = _mm_crc32_u64(crc64, load64(p));
+	crc = crc64;
+	while (n--) crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42_copy(uint32_t crc, unsigned char * d, unsigned char const * s, size_t n)
+{
+	uint64_t crc64 = crc;
+	for (; n >= 8; n -= 8, s += 8, d += 8) {
+		uint64_t x = load64(s);
+		crc64 = _mm_crc32_u64(crc64, x);
+		memcpy(d, &x, 8);
+	}
+	crc = crc64;
+	for (; n; n--, d++) crc = _mm_crc32_u8(crc, *d = *s++);
+	return crc;
+}
+#endif
+
+uint32_t crc32c_update(uint32_t crc, void const * data, size_t size)
+{
+#ifdef HAVE_SSE42_KERNEL
+	if (have_sse42) return ~crc32c_sse42_kernel(~crc, data, size);
+#endif
+	return ~crc32c_table_kernel(~crc, data, size);
+}
+
+uint32_t crc32c(struct view view)
+{
+	return crc32c_update(0, view.data, view.size);
+}
+
+
+#define XXH_P1 0x9e3779b185ebca87ULL
+#define XXH_P2 0xc2b2ae3d27d4eb4fULL
+#define XXH_P3 0x165667b19e3779f9ULL
+#define XXH_P4 0x85ebca77c2b2ae63ULL
+#define XXH_P5 0x27d4eb2f165667c5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_P2;
+	acc = rotl64(acc, 31);
+	return acc * XXH_P1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * XXH_P1 + XXH_P4;
+}
+
+static inline unsigned char const * xxh64_stripes(uint64_t acc[4], unsigned char const * p, size_t n)
+{
+	for (; n >= 32; n -= 32, p += 32) {
+		acc[0] = xxh64_round(acc[0], load64(p));
+		acc[1] = xxh64_round(acc[1], load64(p + 8));
+		acc[2] = xxh64_round(acc[2], load64(p + 16));
+		acc[3] = xxh64_round(acc[3], load64(p + 24));
+	}
+	return p;
+}
+
+static uint64_t xxh64_finish(uint64_t h, unsigned char const * p, size_t n)
+{
+	for (; n >= 8; n -= 8, p += 8) {
+		h ^= xxh64_round(0, load64(p));
+		h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+	}
+	if (n >= 4) {
+		h ^= (uint64_t)load32(p) * XXH_P1;
+		h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+		n -= 4, p += 4;
+	}
+	for (; n; n--, p++) {
+		h ^= *p * XXH_P5;
+		h = rotl64(h, 11) * XXH_P1;
+	}
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t xxh64_converge(uint64_t const acc[4])
+{
+	uint64_t h = rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) + rotl64(acc[3], 18);
+	for (int i = 0; i < 4; i++) h = xxh64_merge_round(h, acc[i]);
+	return h;
+}
+
+static void xxh64_reset(struct hash * hash, uint64_t seed)
+{
+	hash->xxh64.acc[0] = seed + XXH_P1 + XXH_P2;
+	hash->xxh64.acc[1] = seed + XXH_P2;
+	hash->xxh64.acc[2] = seed;
+	hash->xxh64.acc[3] = seed - XXH_P1;
+	hash->xxh64.seed = seed;
+	hash->xxh64.total = 0;
+	hash->xxh64.stripe_size = 0;
+}
+
+uint64_t xxh64(struct view view, uint64_t seed)
+{
+	struct hash hash = make_hash_seeded(HASH_XXH64, seed);
+	hash_update(&hash, view);
+	return hash_digest(&hash);
+}
+
+static void xxh64_update(struct hash * hash, unsigned char const * p, size_t n)
+{
+	size_t const fill = hash->xxh64.stripe_size;
+	hash->xxh64.total += n;
+
+	if (fill + n < 32) {
+		memcpy(hash->xxh64.stripe + fill, p, n);
+		hash->xxh64.stripe_size += n;
+		return;
+	}
+	if (fill) {
+		memcpy(hash->xxh64.stripe + fill, p, 32 - fill);
+		xxh64_stripes(hash->xxh64.acc, hash->xxh64.stripe, 32);
+		p += 32 - fill, n -= 32 - fill;
+	}
+	unsigned char const * rest = xxh64_stripes(hash->xxh64.acc, p, n);
+	hash->xxh64.stripe_size = n - (rest - p);
+	memcpy(hash->xxh64.stripe, rest, hash->xxh64.stripe_size);
+}
+
+static uint64_t xxh64_digest(struct hash const * hash)
+{
+	uint64_t h = hash->xxh64.total >= 32
+		? xxh64_converge(hash->xxh64.acc)
+		: hash->xxh64.seed + XXH_P5;
+	h += hash->xxh64.total;
+	return xxh64_finish(h, hash->xxh64.stripe, hash->xxh64.stripe_size);
+}
+
+
+struct hash make_hash(enum hash_kind kind)
+{
+	return make_hash_seeded(kind, 0);
+}
+
+struct hash make_hash_seeded(enum hash_kind kind, uint64_t seed)
+{
+	struct hash hash = { .kind = kind };
+	switch (kind) {
+	case HASH_NONE: break;
+	case HASH_CRC32C: hash.crc32c = (uint32_t)seed; break;
+	case HASH_XXH64: xxh64_reset(&hash, seed); break;
+	default: errno = EINVAL; hash.kind = HASH_INVALID;
+	}
+	return hash;
+}
+
+int hash_update(struct hash * hash, struct view view)
+{
+	switch (hash->kind) {
+	case HASH_NONE: break;
+	case HASH_CRC32C: hash->crc32c = crc32c_update(hash->crc32c, view.data, view.size); break;
+	case HASH_XXH64: xxh64_update(hash, view.data, view.size); break;
+	default: return errno = EINVAL;
+	}
+	return errno = 0;
+}
+
+uint64_t hash_digest(struct hash const * hash)
+{
+	switch (hash->kind) {
+	case HASH_CRC32C: return hash->crc32c;
+	case HASH_XXH64: return xxh64_digest(hash);
+	default: return 0;
+	}
+}
+
+/* large enough to amortize the call, small enough to stay in L1 */
+#define HASH_COPY_BLOCK 4096
+
+int hash_copy(struct hash * hash, struct view dst, struct view src)
+{
+	if (dst.size != src.size) return errno = EINVAL;
+#ifdef HAVE_SSE42_KERNEL
+	if (hash->kind == HASH_CRC32C && have_sse42) {
+		hash->crc32c = ~crc32c_sse42_copy(~hash->crc32c, dst.data, src.data, src.size);
+		return errno = 0;
+	}
+#endif
+	for (size_t i = 0; i < src.size; i += HASH_COPY_BLOCK) {
+		struct view block = view_partial(dst, i, i + HASH_COPY_BLOCK);
+		memcpy(block.data, src.data + i, block.size);
+		if (hash_update(hash, block)) return errno;
+	}
+	return errno = 0;
+}
+
+int hash_update_func(void * hash, struct view view)
+{
+	return hash_update(hash, view);
+}
+
+char const * hash_name(enum hash_kind kind)
+{
+	switch (kind) {
+	case HASH_NONE: return "none";
+	case HASH_CRC32C: return "crc32c";
+	case HASH_XXH64: return "xxh64";
+	default: return "invalid";
+	}
+}
+
+enum hash_kind hash_look_up(struct view name)
+{
+	for (enum hash_kind kind = HASH_NONE; kind < HASH_INVALID; kind++)
+		if (view_equals(name, view_str((char *)hash_name(kind))))
+			return kind;
+	return HASH_INVALID;
+}
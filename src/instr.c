@@ -0,0 +1,170 @@
+#include <instr.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+char const * INSTR_COUNTER_NAMES[INSTR_NUMBER_OF_COUNTERS] = {
+	"buf.allocs",
+	"buf.reallocs",
+	"buf.frees",
+	"buf.bytes_allocated",
+	"buf.bytes_copied",
+	"buf.spills",
+	"sys.read_calls",
+	"sys.read_bytes",
+	"sys.write_calls",
+	"sys.write_bytes",
+	"sys.seek_calls",
+	"sys.kernel_bytes",
+	"kvnl.records_read",
+	"kvnl.bytes_parsed",
+	"kvnl.records_written",
+	"kvnl.bytes_written",
+};
+
+char const * INSTR_OP_NAMES[INSTR_NUMBER_OF_OPS] = {
+	"kvnl_read_line",
+	"kvnl_read_value",
+	"kvnl_read_block",
+	"kvnl_read_ndview",
+	"kvnl_write_line",
+	"kvnl_write_ndview",
+};
+
+__thread struct instr_thread * instr_self;
+
+/* live threads, and the sums of the ones that have exited */
+static pthread_mutex_t instr_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct instr_thread * instr_threads;
+static struct instr_thread instr_retired;
+static pthread_key_t instr_key;
+static pthread_once_t instr_once = PTHREAD_ONCE_INIT;
+
+static void instr_add_thread(struct instr_thread * dst, struct instr_thread const * src)
+{
+	for (size_t i = 0; i < INSTR_NUMBER_OF_COUNTERS; i++)
+		dst->counters[i] += __atomic_load_n(&src->counters[i], __ATOMIC_RELAXED);
+	for (size_t op = 0; op < INSTR_NUMBER_OF_OPS; op++) {
+		struct instr_histogram * d = &dst->histograms[op];
+		struct instr_histogram const * s = &src->histograms[op];
+		d->count += __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+		d->total_ns += __atomic_load_n(&s->total_ns, __ATOMIC_RELAXED);
+		for (size_t i = 0; i < INSTR_BUCKETS; i++)
+			d->buckets[i] += __atomic_load_n(&s->buckets[i], __ATOMIC_RELAXED);
+	}
+}
+
+static void instr_retire_thread(void * arg)
+{
+	struct instr_thread * self = arg;
+	pthread_mutex_lock(&instr_lock);
+	instr_add_thread(&instr_retired, self);
+	for (struct instr_thread ** p = &instr_threads; *p != NULL; p = &(*p)->next) {
+		if (*p == self) {
+			*p = self->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&instr_lock);
+	instr_self = NULL;
+	free(self);
+}
+
+static void instr_init(void)
+{
+	pthread_key_create(&instr_key, instr_retire_thread);
+}
+
+struct instr_thread * instr_register_thread(void)
+{
+	pthread_once(&instr_once, instr_init);
+	struct instr_thread * self = calloc(1, sizeof(*self));
+	if (self == NULL) return NULL;
+	pthread_mutex_lock(&instr_lock);
+	self->next = instr_threads;
+	instr_threads = self;
+	pthread_mutex_unlock(&instr_lock);
+	pthread_setspecific(instr_key, self);
+	return instr_self = self;
+}
+
+int instr_snapshot(struct instr_snapshot * snapshot)
+{
+	struct instr_thread sum;
+	pthread_mutex_lock(&instr_lock);
+	memcpy(&sum, &instr_retired, sizeof(sum));
+	for (struct instr_thread * t = instr_threads; t != NULL; t = t->next) instr_add_thread(&sum, t);
+	pthread_mutex_unlock(&instr_lock);
+	memcpy(snapshot->counters, sum.counters, sizeof(snapshot->counters));
+	memcpy(snapshot->histograms, sum.histograms, sizeof(snapshot->histograms));
+	return errno = 0;
+}
+
+int instr_snapshot_diff(struct instr_snapshot const * after, struct instr_snapshot const * before, struct instr_snapshot * diff)
+{
+	for (size_t i = 0; i < INSTR_NUMBER_OF_COUNTERS; i++)
+		diff->counters[i] = after->counters[i] - before->counters[i];
+	for (size_t op = 0; op < INSTR_NUMBER_OF_OPS; op++) {
+		struct instr_histogram const * a = &after->histograms[op], * b = &before->histograms[op];
+		struct instr_histogram * d = &diff->histograms[op];
+		d->count = a->count - b->count;
+		d->total_ns = a->total_ns - b->total_ns;
+		for (size_t i = 0; i < INSTR_BUCKETS; i++) d->buckets[i] = a->buckets[i] - b->buckets[i];
+	}
+	return errno = 0;
+}
+
+static uint64_t instr_bucket_upper(size_t bucket)
+{
+	if (bucket < (1u << INSTR_SUB_BITS)) return bucket;
+	unsigned const e = (bucket >> INSTR_SUB_BITS) + INSTR_SUB_BITS - 1;
+	uint64_t const sub = bucket & ((1u << INSTR_SUB_BITS) - 1);
+	uint64_t const lower = (1ull << e) | (sub << (e - INSTR_SUB_BITS));
+	return lower + (1ull << (e - INSTR_SUB_BITS)) - 1;
+}
+
+uint64_t instr_histogram_percentile(struct instr_histogram const * histogram, double p)
+{
+	uint64_t total = 0;
+	for (size_t i = 0; i < INSTR_BUCKETS; i++) total += histogram->buckets[i];
+	if (total == 0) return 0;
+	uint64_t rank = (uint64_t)(p / 100.0 * total + 0.999999), seen = 0;
+	if (rank < 1) rank = 1;
+	for (size_t i = 0; i < INSTR_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= rank) return instr_bucket_upper(i);
+	}
+	return instr_bucket_upper(INSTR_BUCKETS - 1);
+}
+
+int instr_dump(struct instr_snapshot const * snapshot, struct buf * buf)
+{
+	char line[256];
+	int n;
+	for (size_t i = 0; i < INSTR_NUMBER_OF_COUNTERS; i++) {
+		n = snprintf(line, sizeof(line), "%s %" PRIu64 "\n", INSTR_COUNTER_NAMES[i], snapshot->counters[i]);
+		if (buf_append(buf, (struct view){ line, n })) return errno;
+	}
+	for (size_t op = 0; op < INSTR_NUMBER_OF_OPS; op++) {
+		struct instr_histogram const * h = &snapshot->histograms[op];
+		if (h->count == 0) continue;
+		n = snprintf(
+			line, sizeof(line),
+			"%s count=%" PRIu64 " mean_ns=%" PRIu64 " p50_ns=%" PRIu64 " p90_ns=%" PRIu64 " p99_ns=%" PRIu64 " max_ns=%" PRIu64 "\n",
+			INSTR_OP_NAMES[op], h->count, h->total_ns / h->count,
+			instr_histogram_percentile(h, 50), instr_histogram_percentile(h, 90),
+			instr_histogram_percentile(h, 99), instr_histogram_percentile(h, 100)
+		);
+		if (buf_append(buf, (struct view){ line, n })) return errno;
+	}
+	return errno = 0;
+}
+
+int instr_fdump(struct instr_snapshot const * snapshot, FILE * stream)
+{
+	struct buf buf = NULL_BUF;
+	int r = instr_dump(snapshot, &buf);
+	if (r == 0 && buf.size && fwrite(buf.data, 1, buf.size, stream) != buf.size) r = errno ? errno : EIO;
+	if (!buf_is_null(&buf)) buf_free(&buf);
+	return errno = r;
+}
@@ -1,7 +1,16 @@
+#define _GNU_SOURCE /* O_DIRECT */
 #include <kvnl.h>
+#include <uring.h>
+#include <instr.h>
 #include <stdio.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 
 
 char const * KVNL_ERROR_MESSAGES[KVNL_NUMBER_OF_ERRORS] = {
@@ -13,6 +22,7 @@ char const * KVNL_ERROR_MESSAGES[KVNL_NUMBER_OF_ERRORS] = {
 	"writing a size (an integer) failed (likely due to a memory error)",
 	"reading needs to either be specified by a terminating character or a size",
 	"expected a newline",
+	"checksum verification failed",
 };
 
 
@@ -21,8 +31,8 @@ char const * kvnl_look_up_error(int error)
 	if (error < 0) error = -error;
 	if (error < 0x1000) return "no such error";
 	error -= 0x1000;
-	if (error > KVNL_NUMBER_OF_ERRORS) return "no such error";
-	return KVNL_ERROR_MESSAGES[error - 0x1000];
+	if (error >= KVNL_NUMBER_OF_ERRORS) return "no such error";
+	return KVNL_ERROR_MESSAGES[error];
 }
 
 
@@ -32,14 +42,48 @@ struct kvnl_specification kvnl_specification_from_string(char * key, ssize_t siz
 }
 
 
-ssize_t kvnl_write_some(int fd, struct view view, kvnl_update_func hash)
+static inline void kvnl_hash_update(kvnl_hash * hash, struct view view)
+{
+	if (hash != NULL && view.size != 0) hash->update(hash->ctx, view);
+}
+
+/* writev() until everything is out, or fail */
+static ssize_t write_all(int fd, struct iovec * iov, int count)
+{
+	ssize_t total = 0;
+	while (count > 0) {
+		ssize_t n = writev(fd, iov, count);
+		INSTR_ADD(INSTR_WRITE_CALLS, 1);
+		if (n < 0) return n;
+		INSTR_ADD(INSTR_WRITE_BYTES, n);
+		total += n;
+		for (; count > 0 && (size_t)n >= iov->iov_len; iov++, count--)
+			n -= iov->iov_len;
+		if (count > 0) {
+			iov->iov_base += n;
+			iov->iov_len -= n;
+		}
+	}
+	return total;
+}
+
+static ssize_t kvnl_write_views(int fd, struct view * views, int count, kvnl_hash * hash)
+{
+	struct iovec iov[count];
+	for (int i = 0; i < count; i++) {
+		kvnl_hash_update(hash, views[i]);
+		iov[i] = (struct iovec){ views[i].data, views[i].size };
+	}
+	return write_all(fd, iov, count);
+}
+
+ssize_t kvnl_write_some(int fd, struct view view, kvnl_hash * hash)
 {
 	if (view.size == 0) return 0;
-	if (hash != NULL) hash(view);
-	return write(fd, view.data, view.size);
+	return kvnl_write_views(fd, &view, 1, hash);
 }
 
-ssize_t kvnl_write_newline(int fd, kvnl_update_func hash)
+ssize_t kvnl_write_newline(int fd, kvnl_hash * hash)
 {
 	return kvnl_write_some(fd, (struct view){ "\n", 1 }, hash);
 }
@@ -54,7 +98,7 @@ size_t n_digits(size_t n) {
 }
 
 
-ssize_t kvnl_write_sizes(int fd, ssize_t * sizes, size_t count, kvnl_update_func hash, struct buf * fmt_buf)
+ssize_t kvnl_write_sizes(int fd, ssize_t * sizes, size_t count, kvnl_hash * hash, struct buf * fmt_buf)
 {
 	struct buf _buf, * buf;
 	if (fmt_buf == NULL) {
@@ -65,52 +109,42 @@ ssize_t kvnl_write_sizes(int fd, ssize_t * sizes, size_t count, kvnl_update_func
 		buf = fmt_buf;
 	}
 
-	ssize_t r, total = 0;
+	ssize_t r;
 
+	/* format everything first so that the sizes go out in one write */
+	if (buf_resize(buf, count * 21 + 1)) { r = -KVNL_WRITE_SIZES_FAILED; goto cleanup; }
+	size_t offset = 0;
 	for (size_t d = 0; d < count; d++) {
-		ssize_t size = sizes[d];
-		size_t s = n_digits(size);
-
-		if (buf_resize(buf, s + 1)) r = -KVNL_WRITE_SIZES_FAILED;
-		if (r < 0) goto cleanup;
-
-		ssize_t m = sprintf(buf->data, "%ld%s", size, d == count - 1 ? "" : " ");
-		if (m < 0) r = -KVNL_WRITE_SIZES_FAILED;
-		if (r < 0) goto cleanup;
-
-		r = kvnl_write_some(fd, (struct view){ buf->data, m }, hash);
-		if (r < 0) goto cleanup;
-		total += r;
+		int m = sprintf(buf->data + offset, "%ld%s", sizes[d], d == count - 1 ? "" : " ");
+		if (m < 0) { r = -KVNL_WRITE_SIZES_FAILED; goto cleanup; }
+		offset += m;
 	}
-	r = total;
+	r = kvnl_write_some(fd, (struct view){ buf->data, offset }, hash);
 cleanup:
 	if (fmt_buf == NULL) buf_free(buf);
 	return r;
 }
 
-ssize_t kvnl_write_specification(int fd, struct view spec, kvnl_update_func hash)
+static int kvnl_specification_is_valid(struct view spec)
+{
+	return !view_contains(spec, view_str("=")) && !view_contains(spec, view_str("\n"));
+}
+
+ssize_t kvnl_write_specification(int fd, struct view spec, kvnl_hash * hash)
 {
 	if (view_equals(spec, view_str("\n"))) return kvnl_write_some(fd, spec, hash);
 
-	if (view_contains(spec, view_str("=")) || view_contains(spec, view_str("\n")))
+	if (!kvnl_specification_is_valid(spec))
 		return -KVNL_MALFORMED_SPECIFICATION;
 
-	ssize_t m = kvnl_write_some(fd, spec, hash);
-	if (m < 0) return m;
-
-	ssize_t n = kvnl_write_some(fd, (struct view){ "=", 1 }, hash);
-	if (n < 0) return n;
-
-	return m + n;
+	struct view views[] = { spec, { "=", 1 } };
+	return kvnl_write_views(fd, views, 2, hash);
 }
 
-ssize_t kvnl_write_value(int fd, struct view value, kvnl_update_func hash)
+ssize_t kvnl_write_value(int fd, struct view value, kvnl_hash * hash)
 {
-	ssize_t m = kvnl_write_some(fd, value, hash);
-	if (m < 0) return m;
-	ssize_t n = kvnl_write_newline(fd, hash);
-	if (n < 0) return n;
-	return m + n;
+	struct view views[] = { value, { "\n", 1 } };
+	return kvnl_write_views(fd, views, 2, hash);
 }
 
 
@@ -133,8 +167,19 @@ ssize_t kvnl_encode_specification(char * key, ssize_t size, struct buf * dest)
 	return KVNL_SUCCESS;
 }
 
-ssize_t kvnl_write_line(int fd, char * key, struct view value, int sized, kvnl_update_func hash, struct buf * fmt_buf)
+ssize_t kvnl_write_line(int fd, char * key, struct view value, int sized, kvnl_hash * hash, struct buf * fmt_buf)
+{
+	return kvnl_write_checked_line(fd, key, value, sized, HASH_NONE, hash, fmt_buf);
+}
+
+static int kvnl_checksum_digits(enum hash_kind kind)
+{
+	return kind == HASH_CRC32C ? 8 : 16;
+}
+
+ssize_t kvnl_write_checked_line(int fd, char * key, struct view value, int sized, enum hash_kind checksum, kvnl_hash * hash, struct buf * fmt_buf)
 {
+	INSTR_SCOPE(INSTR_KVNL_WRITE_LINE);
 	struct buf _buf, * buf;
 	if (fmt_buf == NULL) {
 		_buf = make_buf_grow_only(2.0f);
@@ -145,21 +190,178 @@ ssize_t kvnl_write_line(int fd, char * key, struct view value, int sized, kvnl_u
 	}
 	if (sized < 0) sized = value.size > 1024 || view_contains(value, view_str("\n"));
 
-	ssize_t r, total = 0;
+	ssize_t r;
 	r = kvnl_encode_specification(key, sized ? (ssize_t)value.size : -1L, buf);
 	if (r < 0) goto cleanup;
-	r = kvnl_write_specification(fd, buf_view(buf), hash);
-	if (r < 0) goto cleanup; else total += r;
-	r = kvnl_write_value(fd, value, hash);
-	if (r < 0) goto cleanup; else total += r;
-	r = total;
+	if (!kvnl_specification_is_valid(buf_view(buf))) { r = -KVNL_MALFORMED_SPECIFICATION; goto cleanup; }
+
+	/* the record goes out in one write, preceded by its checksum if requested */
+	struct view record_views[] = { buf_view(buf), { "=", 1 }, value, { "\n", 1 } };
+	char line[sizeof(KVNL_CHECKSUM_KEY) + 32];
+	int n = 0;
+	if (checksum != HASH_NONE) {
+		struct hash record = make_hash(checksum);
+		for (int i = 0; i < 4; i++) hash_update(&record, record_views[i]);
+		n = snprintf(
+			line, sizeof(line), "%s=%s %0*" PRIx64 "\n",
+			KVNL_CHECKSUM_KEY, hash_name(checksum),
+			kvnl_checksum_digits(checksum), hash_digest(&record)
+		);
+		if (n < 0 || (size_t)n >= sizeof(line)) { r = -KVNL_ENCODING_FAILED; goto cleanup; }
+	}
+	struct view views[] = { { line, n }, record_views[0], record_views[1], record_views[2], record_views[3] };
+	r = kvnl_write_views(fd, views + (n == 0), 5 - (n == 0), hash);
+	if (r >= 0) {
+		INSTR_ADD(INSTR_RECORDS_WRITTEN, 1 + (n != 0));
+		INSTR_ADD(INSTR_BYTES_WRITTEN, r);
+	}
 cleanup:
 	if (fmt_buf == NULL) buf_free(buf);
 	return r;
 }
 
-ssize_t kvnl_write_ndview(int fd, struct ndview * ndview, char * dtype, size_t item_size, kvnl_update_func hash, struct buf * fmt_buf)
+struct kvnl_ndview_writer make_kvnl_ndview_writer(void)
+{
+	return (struct kvnl_ndview_writer){
+		.codec = IDENTITY_CODEC,
+		.checksum = HASH_NONE,
+		.align = 0,
+		.offset = -1,
+		.dedup = 0,
+		.layout = NULL,
+		.header = NULL_BUF,
+		.last_header = NULL_BUF,
+		.dense = NULL_BUF,
+		.encoded = NULL_BUF,
+		.chunk_sizes = NULL_BUF,
+	};
+}
+
+static void buf_free_if_allocated(struct buf * buf)
+{
+	if (!buf_is_null(buf)) buf_free(buf);
+}
+
+int kvnl_ndview_writer_free(struct kvnl_ndview_writer * writer)
+{
+	buf_free_if_allocated(&writer->dense);
+	buf_free_if_allocated(&writer->encoded);
+	buf_free_if_allocated(&writer->chunk_sizes);
+	buf_free_if_allocated(&writer->header);
+	buf_free_if_allocated(&writer->last_header);
+	return errno = 0;
+}
+
+ssize_t kvnl_write_ndview(int fd, struct ndview * ndview, char * dtype, size_t item_size, kvnl_hash * hash, struct buf * fmt_buf)
+{
+	struct kvnl_ndview_writer writer = make_kvnl_ndview_writer();
+	ssize_t r = kvnl_write_ndview_with(fd, &writer, ndview, dtype, item_size, hash, fmt_buf);
+	kvnl_ndview_writer_free(&writer);
+	return r;
+}
+
+ssize_t kvnl_write_typed_ndview(int fd, struct kvnl_ndview_writer * writer, struct ndview * ndview, struct dtype dtype, kvnl_hash * hash, struct buf * fmt_buf)
+{
+	char descr[32];
+	if (!dtype_is_valid(dtype)) return -KVNL_ENCODING_FAILED;
+	dtype_snprint(dtype, descr, sizeof(descr));
+	return kvnl_write_ndview_with(fd, writer, ndview, descr, dtype.size, hash, fmt_buf);
+}
+
+static ssize_t kvnl_write_sizes_line(int fd, char * key, ssize_t * sizes, size_t count, kvnl_hash * hash, struct buf * buf)
+{
+	ssize_t r, total = 0;
+	r = kvnl_write_specification(fd, view_str(key), hash);
+	if (r < 0) return r; else total += r;
+	r = kvnl_write_sizes(fd, sizes, count, hash, buf);
+	if (r < 0) return r; else total += r;
+	r = kvnl_write_newline(fd, hash);
+	if (r < 0) return r; else total += r;
+	return total;
+}
+
+static size_t kvnl_n_digits(size_t n)
+{
+	size_t digits = 1;
+	for (; n >= 10; n /= 10) digits++;
+	return digits;
+}
+
+/* a padding record that makes whatever starts `following` bytes after it start at a multiple of align */
+static ssize_t kvnl_write_padding(int fd, off_t offset, size_t align, size_t following, kvnl_hash * hash, struct buf * buf)
+{
+	size_t size = 0;
+	for (size_t digits = 1; ; digits++) {
+		size_t const end = offset + strlen(KVNL_PAD_KEY ":=\n") + digits + following;
+		for (size = (align - end % align) % align; kvnl_n_digits(size) < digits; size += align);
+		if (kvnl_n_digits(size) == digits) break;
+	}
+	char padding[size + 1];
+	memset(padding, ' ', size);
+	return kvnl_write_line(fd, KVNL_PAD_KEY, (struct view){ padding, size }, 1, hash, buf);
+}
+
+static int kvnl_append_sizes(struct buf * dst, char const * key, ssize_t const * sizes, size_t count)
+{
+	if (buf_push(dst, view_str((char *)key)) || buf_push_byte(dst, '=')) return -1;
+	for (size_t d = 0; d < count; d++)
+		if ((d && buf_push_byte(dst, ' ')) || buf_append_int(dst, sizes[d])) return -1;
+	return buf_push_byte(dst, '\n') ? -1 : 0;
+}
+
+/* the layout, dtype, shape and strides records, formatted to go out in one write */
+static int kvnl_format_header(struct buf * dst, char const * layout, struct view dtype, struct ndview const * view)
+{
+	char spec[32] = "dtype=";
+	if (dtype.size > 1024 || view_contains(dtype, view_str("\n")))
+		snprintf(spec, sizeof(spec), "dtype:%zu=", dtype.size);
+	if (buf_clear(dst)) return -1;
+	if (layout != NULL)
+		if (buf_push(dst, view_str("layout=")) || buf_push(dst, view_str((char *)layout)) || buf_push_byte(dst, '\n'))
+			return -1;
+	if (buf_push(dst, view_str(spec)) || buf_push(dst, dtype) || buf_push_byte(dst, '\n'))
+		return -1;
+	if (kvnl_append_sizes(dst, "shape", (ssize_t const *)view->shape, view->ndim)) return -1;
+	return kvnl_append_sizes(dst, "strides", view->strides, view->ndim);
+}
+
+static void kvnl_find_offset(int fd, struct kvnl_ndview_writer * writer)
+{
+	if (writer->align > 1 && writer->offset < 0) {
+		off_t const here = lseek(fd, 0, SEEK_CUR);
+		INSTR_ADD(INSTR_SEEK_CALLS, 1);
+		writer->offset = here < 0 ? 0 : here;
+	}
+}
+
+/* the header records, unless they are the same as last time and the writer leaves those out */
+static ssize_t kvnl_write_header(int fd, struct kvnl_ndview_writer * writer, struct view dtype, struct ndview const * view, kvnl_hash * hash, struct buf * buf)
+{
+	struct buf * header = writer->dedup ? &writer->header : buf;
+	if (kvnl_format_header(header, writer->layout, dtype, view)) return -KVNL_ENCODING_FAILED;
+	if (writer->dedup && view_equals(buf_view(header), buf_view(&writer->last_header))) return 0;
+	ssize_t const r = kvnl_write_some(fd, buf_view(header), hash);
+	if (r < 0) return r;
+	INSTR_ADD(INSTR_RECORDS_WRITTEN, 3 + (writer->layout != NULL));
+	INSTR_ADD(INSTR_BYTES_WRITTEN, r);
+	if (writer->dedup) {
+		struct buf const last = writer->last_header;
+		writer->last_header = writer->header;
+		writer->header = last;
+	}
+	return r;
+}
+
+/* the codec's rows run along the leading axis of the memory: the first one in row-major order, the last in column-major */
+static size_t kvnl_codec_row_size(struct ndview const * dense, size_t size, int column_major)
 {
+	size_t const rows = dense->ndim ? dense->shape[column_major ? dense->ndim - 1 : 0] : 0;
+	return rows ? size / rows : size;
+}
+
+ssize_t kvnl_write_ndview_with(int fd, struct kvnl_ndview_writer * writer, struct ndview * ndview, char * dtype, size_t item_size, kvnl_hash * hash, struct buf * fmt_buf)
+{
+	INSTR_SCOPE(INSTR_KVNL_WRITE_NDVIEW);
 	struct buf _buf, * buf;
 	if (fmt_buf == NULL) {
 		_buf = make_buf_grow_only(2.0f);
@@ -168,32 +370,117 @@ ssize_t kvnl_write_ndview(int fd, struct ndview * ndview, char * dtype, size_t i
 	else {
 		buf = fmt_buf;
 	}
+	if (ndview->ndim > KVNL_MAX_NDIM || writer->align > KVNL_MAX_ALIGN) return -KVNL_ENCODING_FAILED;
+	kvnl_find_offset(fd, writer);
+
+	struct codec codec = writer->codec;
+	codec.elem_size = item_size;
+	size_t const size = ndview_size(ndview) * item_size;
+	/* empty arrays have no rows to chunk */
+	int const encode = size && !codec_is_identity(&codec);
+
+	/* the codec works on whole rows of dense data: column-major data keeps its order, anything else becomes row-major */
+	ssize_t dense_strides[ndview->ndim ? ndview->ndim : 1];
+	struct ndview dense = make_ndview(ndview->data, ndview->ndim, ndview->shape, dense_strides);
+	ndview_set_strides_row_major(&dense, item_size);
+	int column_major = 0;
+	if (!encode) {
+		dense = *ndview;
+	}
+	else if (memcmp(dense.strides, ndview->strides, ndview->ndim * sizeof(ssize_t)) != 0) {
+		ndview_set_strides_column_major(&dense, item_size);
+		column_major = memcmp(dense.strides, ndview->strides, ndview->ndim * sizeof(ssize_t)) == 0;
+		if (!column_major) {
+			ndview_set_strides_row_major(&dense, item_size);
+			if (buf_resize(&writer->dense, size)) return -KVNL_ENCODING_FAILED;
+			dense.data = writer->dense.data;
+			if (ndview_copy(&dense, ndview, item_size)) return -KVNL_ENCODING_FAILED;
+		}
+	}
+
 	ssize_t r, total = 0;
-	r = kvnl_write_line(fd, "dtype", view_str(dtype), -1, hash, buf);
+	r = kvnl_write_header(fd, writer, view_str(dtype), &dense, hash, buf);
 	if (r < 0) goto cleanup; else total += r;
 
-	r = kvnl_write_specification(fd, view_str("shape"), hash);
-	if (r < 0) goto cleanup; else total += r;
-	r = kvnl_write_sizes(fd, (ssize_t *)ndview->shape, ndview->ndim, hash, buf);
-	if (r < 0) goto cleanup; else total += r;
-	r = kvnl_write_newline(fd, hash);
+	struct view const memory = ndview_memory(&dense, item_size);
+	if (encode) {
+		size_t const row_size = kvnl_codec_row_size(&dense, size, column_major);
+		if (codec_encode(&codec, memory, row_size, &writer->encoded, &writer->chunk_sizes)) {
+			r = -KVNL_ENCODING_FAILED;
+			goto cleanup;
+		}
 
-	r = kvnl_write_specification(fd, view_str("strides"), hash);
-	if (r < 0) goto cleanup; else total += r;
-	r = kvnl_write_sizes(fd, ndview->strides, ndview->ndim, hash, buf);
+		char spec[128];
+		int n = snprintf(spec, sizeof(spec), "%zu %zu", item_size, codec_chunk_rows(&codec, row_size) * row_size);
+		codec_snprint_filters(&codec, spec + n, sizeof(spec) - n);
+		r = kvnl_write_line(fd, "codec", view_str(spec), 0, hash, buf);
+		if (r < 0) goto cleanup; else total += r;
+		size_t const n_chunks = writer->chunk_sizes.size / sizeof(size_t);
+		r = kvnl_write_sizes_line(fd, "chunks", writer->chunk_sizes.data, n_chunks, hash, buf);
+		if (r < 0) goto cleanup; else total += r;
+		INSTR_ADD(INSTR_RECORDS_WRITTEN, 1);
+		INSTR_ADD(INSTR_BYTES_WRITTEN, r);
+	}
+
+	struct view const value = encode ? buf_view(&writer->encoded) : memory;
+	if (writer->align > 1) {
+		size_t following = snprintf(NULL, 0, "data:%zu=", value.size);
+		if (writer->checksum != HASH_NONE)
+			following += snprintf(NULL, 0, "%s=%s \n", KVNL_CHECKSUM_KEY, hash_name(writer->checksum))
+				+ kvnl_checksum_digits(writer->checksum);
+		r = kvnl_write_padding(fd, writer->offset + total, writer->align, following, hash, buf);
+		if (r < 0) goto cleanup; else total += r;
+	}
+	r = kvnl_write_checked_line(fd, "data", value, 1, writer->checksum, hash, buf);
 	if (r < 0) goto cleanup; else total += r;
-	r = kvnl_write_newline(fd, hash);
 
-	struct view value = ndview_memory(ndview, item_size);
-	r = kvnl_encode_specification("data", value.size, buf);
+	r = total;
+cleanup:
+	if (r >= 0 && writer->offset >= 0) writer->offset += r;
+	if (fmt_buf == NULL) buf_free(buf);
+	return r;
+}
+
+ssize_t kvnl_write_ndview_header(int fd, struct kvnl_ndview_writer * writer, struct ndview const * ndview, struct dtype dtype, kvnl_hash * hash, struct buf * fmt_buf)
+{
+	INSTR_SCOPE(INSTR_KVNL_WRITE_NDVIEW);
+	if (!dtype_is_valid(dtype) || ndview->ndim > KVNL_MAX_NDIM || writer->align > KVNL_MAX_ALIGN)
+		return -KVNL_ENCODING_FAILED;
+	/* both need the whole payload before it goes out */
+	if (!codec_is_identity(&writer->codec) || writer->checksum != HASH_NONE)
+		return -KVNL_ENCODING_FAILED;
+	struct buf _buf, * buf;
+	if (fmt_buf == NULL) {
+		_buf = make_buf_grow_only(2.0f);
+		buf = &_buf;
+	}
+	else {
+		buf = fmt_buf;
+	}
+	kvnl_find_offset(fd, writer);
+
+	char descr[32];
+	dtype_snprint(dtype, descr, sizeof(descr));
+	struct extent const extent = ndview_extent(ndview, dtype.size);
+	size_t const size = ndview_size(ndview) ? extent.upper - extent.lower : 0;
+	ssize_t r, total = 0;
+	r = kvnl_write_header(fd, writer, view_str(descr), ndview, hash, buf);
+	if (r < 0) goto cleanup; else total += r;
+	if (writer->align > 1) {
+		r = kvnl_write_padding(fd, writer->offset + total, writer->align, snprintf(NULL, 0, "data:%zu=", size), hash, buf);
+		if (r < 0) goto cleanup; else total += r;
+	}
+	r = kvnl_encode_specification("data", size, buf);
 	if (r < 0) goto cleanup;
 	r = kvnl_write_specification(fd, buf_view(buf), hash);
 	if (r < 0) goto cleanup; else total += r;
-	r = kvnl_write_value(fd, value, hash);
-	if (r < 0) goto cleanup; else total += r;
+	INSTR_ADD(INSTR_RECORDS_WRITTEN, 1);
+	INSTR_ADD(INSTR_BYTES_WRITTEN, r + size + 1);
 
 	r = total;
 cleanup:
+	/* the caller writes the rest of the record */
+	if (r >= 0 && writer->offset >= 0) writer->offset += r + size + 1;
 	if (fmt_buf == NULL) buf_free(buf);
 	return r;
 }
@@ -205,14 +492,73 @@ ssize_t read_into(int fd, struct view view)
 	size_t offset;
 	for (n_read = 0, offset = 0; offset < view.size; offset += n_read) {
 		n_read = read(fd, view.data + offset, view.size - offset);
+		INSTR_ADD(INSTR_READ_CALLS, 1);
 		if (n_read < 0) return n_read;
+		INSTR_ADD(INSTR_READ_BYTES, n_read);
 		if (n_read == 0) break;  /* EOF */
 	}
 	return offset;
 }
 
+/* hash in pieces small enough to still be in the cache right after the read */
+#define KVNL_HASH_CHUNK (64 * 1024)
+
+static ssize_t read_into_hashed(int fd, struct view view, kvnl_hash * hash)
+{
+	if (hash == NULL) return read_into(fd, view);
+
+	size_t offset = 0;
+	while (offset < view.size) {
+		struct view chunk = view_partial(view, offset, offset + KVNL_HASH_CHUNK);
+		ssize_t n_read = read_into(fd, chunk);
+		if (n_read < 0) return n_read;
+		kvnl_hash_update(hash, (struct view){ chunk.data, n_read });
+		offset += n_read;
+		if ((size_t)n_read < chunk.size) break;  /* EOF */
+	}
+	return offset;
+}
+
+
+#define KVNL_READ_AHEAD 256
 
-kvnl_some kvnl_read_some(int fd, ssize_t size, char * delim, struct buf * buf, kvnl_update_func hash)
+/*
+ * a regular file is read a chunk at a time, and its offset put back right past
+ * the delimiter; 0 if fd can't be read that way, as pipes and sockets can't
+ */
+static int kvnl_read_delimited_ahead(int fd, ssize_t size, char const * delim, struct buf * buf, const char ** error)
+{
+	struct stat st;
+	if (fstat(fd, &st) || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))) return 0;
+
+	size_t const end = size < 0 ? SIZE_MAX : buf->size + size;
+	for (size_t chunk = KVNL_READ_AHEAD; buf->size < end; chunk *= 2) {
+		size_t const room = end - buf->size < chunk ? end - buf->size : chunk;
+		if (buf_reserve(buf, room)) {
+			*error = "buf_resize() failed, consult errno";
+			return 1;
+		}
+		char * const start = (char *)buf->data + buf->size;
+		ssize_t const n_read = read(fd, start, room);
+		INSTR_ADD(INSTR_READ_CALLS, 1);
+		INSTR_ADD(INSTR_READ_BYTES, n_read > 0 ? n_read : 0);
+		if (n_read <= 0) {
+			*error = n_read == 0 ? "EOF" : "read() failed, consult errno";
+			return 1;
+		}
+		for (ssize_t i = 0; i < n_read; i++) {
+			if (start[i] == '\0' || strchr(delim, start[i]) == NULL) continue;
+			buf->size += i + 1;
+			if (i + 1 < n_read && lseek(fd, i + 1 - n_read, SEEK_CUR) < 0)
+				*error = "lseek() failed, consult errno";
+			return 1;
+		}
+		buf->size += n_read;
+	}
+	return 1;
+}
+
+kvnl_some kvnl_read_some(int fd, ssize_t size, char * delim, struct buf * buf, kvnl_hash * hash)
 {
 	if (delim == NULL) delim = "";
 
@@ -223,9 +569,9 @@ kvnl_some kvnl_read_some(int fd, ssize_t size, char * delim, struct buf * buf, k
 	size_t initial_size = buf->size;
 
 	if (delim[0] == '\0') {
-		buf_resize(buf, initial_size + size);
-		//ssize_t n_read = read(fd, buf->data + buf->size - size, size);
-		ssize_t n_read = read_into(fd, (struct view){ buf->data + buf->size - size, size });
+		if (buf_resize(buf, initial_size + size))
+			return (kvnl_some){ .error = "buf_resize() failed, consult errno" };
+		ssize_t n_read = read_into_hashed(fd, (struct view){ buf->data + initial_size, size }, hash);
 		if (n_read < 0) {
 			buf_resize(buf, initial_size);
 			return (kvnl_some){ .error = "read() failed, consult errno" };
@@ -235,19 +581,25 @@ kvnl_some kvnl_read_some(int fd, ssize_t size, char * delim, struct buf * buf, k
 			.view = { buf->data + initial_size, n_read },
 			.error = n_read < size ? "EOF" : NULL
 		};
-		if (hash != NULL && result.error == NULL) hash(result.view);
 		return result;
 	}
 
+	/* regular files are read ahead, anything else a byte at a time, not to read past the delimiter */
 	const char * error = NULL;
-	while (size < 0 || buf->size < initial_size + size) {
+	int const read_ahead = kvnl_read_delimited_ahead(fd, size, delim, buf, &error);
+	while (!read_ahead && (size < 0 || buf->size < initial_size + size)) {
 		char c;
 		ssize_t n_read = read(fd, &c, 1);
+		INSTR_ADD(INSTR_READ_CALLS, 1);
+		INSTR_ADD(INSTR_READ_BYTES, n_read > 0);
 		if (n_read <= 0) {
 			error = n_read == 0 ? "EOF" : "read() failed, consult errno";
 			break;
 		}
-		buf_append(buf, (struct view){ &c, 1 });
+		if (buf_push_byte(buf, c)) {
+			error = "buf_resize() failed, consult errno";
+			break;
+		}
 		if (c != '\0' && strchr(delim, c) != NULL) /* a delimiter was found */
 			break;
 	}
@@ -256,12 +608,12 @@ kvnl_some kvnl_read_some(int fd, ssize_t size, char * delim, struct buf * buf, k
 		.view = { buf->data + initial_size, buf->size - initial_size },
 		.error = error
 	};
-	if (hash != NULL && result.error == NULL) hash(result.view);
+	if (result.error == NULL) kvnl_hash_update(hash, result.view);
 
 	return result;
 }
 
-kvnl_specification kvnl_read_specification(int fd, struct buf * buf, kvnl_update_func hash)
+kvnl_specification kvnl_read_specification(int fd, struct buf * buf, kvnl_hash * hash)
 {
 	kvnl_some some = kvnl_read_some(fd, -1, "=\n", buf, hash);
 	if (some.error)
@@ -276,7 +628,7 @@ kvnl_specification kvnl_read_specification(int fd, struct buf * buf, kvnl_update
 		return (kvnl_specification){ .key = some.view, .error = n ? "malformed specification" : NULL };
 
 	ssize_t m;
-	for (m = n - 1; spec[m] != ':' && m >= 0; m--);
+	for (m = n - 1; m >= 0 && spec[m] != ':'; m--);
 
 	/* if there was no size specification, return everything but the trailing = */
 	if (m < 0)
@@ -293,23 +645,30 @@ kvnl_specification kvnl_read_specification(int fd, struct buf * buf, kvnl_update
 	return (kvnl_specification){ .key = { spec, m }, .size = size };
 }
 
-kvnl_line kvnl_read_line(int fd, struct buf * buf, kvnl_update_func hash)
+/* realloc may move the buffer, so a key (or value) that lives in it is tracked by its offset */
+static inline struct view kvnl_key_in(struct buf const * buf, ptrdiff_t offset, struct view key)
+{
+	return offset < 0 ? key : (struct view){ buf->data + offset, key.size };
+}
+
+static kvnl_line kvnl_read_value_in(int fd, kvnl_specification spec, struct buf * buf, kvnl_hash * hash)
 {
-	kvnl_specification spec = kvnl_read_specification(fd, buf, hash);
 	/* forward any errors */
 	if (spec.error)
 		return (kvnl_line){ .key = spec.key, .error = spec.error };
 	/* empty lines are easy */
 	if (spec.key.size == 1 && *(char *)spec.key.data == '\n')
 		return (kvnl_line){ .key = spec.key };
-	
-	void * const pre_value_data = buf->data; // realloc may move buffer, invalidating spec.key.data
+
+	ptrdiff_t const key_offset = buf->data != NULL && spec.key.data >= buf->data && spec.key.data < buf->data + buf->size
+		? spec.key.data - buf->data
+		: -1;
 
 	/* without a size specification, read until newline */
 	if (spec.size < 0) {
 		kvnl_some value = kvnl_read_some(fd, -1, "\n", buf, hash);
 		return (kvnl_line){
-			.key = { spec.key.data + (buf->data - pre_value_data), spec.key.size },
+			.key = kvnl_key_in(buf, key_offset, spec.key),
 			.size = spec.size,
 			.value = value.error ? value.view : (struct view){ value.view.data, value.view.size - 1 },
 			.error = value.error
@@ -320,7 +679,7 @@ kvnl_line kvnl_read_line(int fd, struct buf * buf, kvnl_update_func hash)
 	kvnl_some value = kvnl_read_some(fd, spec.size, "", buf, hash);
 	if (value.error)
 		return (kvnl_line){
-			.key = { spec.key.data + (buf->data - pre_value_data), spec.key.size },
+			.key = kvnl_key_in(buf, key_offset, spec.key),
 			.size = spec.size,
 			.value = value.view,
 			.error = value.error
@@ -332,7 +691,7 @@ kvnl_line kvnl_read_line(int fd, struct buf * buf, kvnl_update_func hash)
 	/* if we failed to read the trailing newline */
 	if (trail.error)
 		return (kvnl_line){
-			.key = { spec.key.data + (buf->data - pre_value_data), spec.key.size },
+			.key = kvnl_key_in(buf, key_offset, spec.key),
 			.size = spec.size,
 			.value = trail.view,
 			.error = trail.error
@@ -341,15 +700,799 @@ kvnl_line kvnl_read_line(int fd, struct buf * buf, kvnl_update_func hash)
 	/* if we read something other than the trailing newline */
 	if (trail.view.size != 1)
 		return (kvnl_line){
-			.key = { spec.key.data + (buf->data - pre_value_data), spec.key.size },
+			.key = kvnl_key_in(buf, key_offset, spec.key),
 			.size = spec.size,
 			.value = trail.view,
 			.error = "expected only a trailing newline"
 		};
 
 	return (kvnl_line){
-		.key = { spec.key.data + (buf->data - pre_value_data), spec.key.size },
+		.key = kvnl_key_in(buf, key_offset, spec.key),
 		.size = spec.size,
 		.value = { value.view.data + (buf->data - pre_newline_data), value.view.size },
 	};
 }
+
+kvnl_line kvnl_read_value(int fd, kvnl_specification spec, struct buf * buf, kvnl_hash * hash)
+{
+	INSTR_SCOPE(INSTR_KVNL_READ_VALUE);
+	kvnl_line line = kvnl_read_value_in(fd, spec, buf, hash);
+	if (line.error == NULL) {
+		INSTR_ADD(INSTR_RECORDS_READ, 1);
+		INSTR_ADD(INSTR_BYTES_PARSED, line.key.size + line.value.size);
+	}
+	return line;
+}
+
+/* like kvnl_read_value(), but sized values are seeked over, or read in pieces and dropped */
+kvnl_line kvnl_skip_value(int fd, kvnl_specification spec, struct buf * buf, kvnl_hash * hash)
+{
+	if (spec.error || spec.size < 0 || (spec.key.size == 1 && *(char *)spec.key.data == '\n'))
+		return kvnl_read_value(fd, spec, buf, hash);
+
+	ptrdiff_t const key_offset = buf->data != NULL && spec.key.data >= buf->data && spec.key.data < buf->data + buf->size
+		? spec.key.data - buf->data
+		: -1;
+	size_t const initial_size = buf->size;
+	if (hash == NULL && lseek(fd, spec.size, SEEK_CUR) >= 0) {
+		INSTR_ADD(INSTR_SEEK_CALLS, 1);
+	}
+	else {
+		for (size_t left = spec.size; left > 0; ) {
+			kvnl_some piece = kvnl_read_some(fd, left < KVNL_HASH_CHUNK ? left : KVNL_HASH_CHUNK, "", buf, hash);
+			size_t const n_read = piece.view.size;
+			buf_resize(buf, initial_size);
+			if (piece.error)
+				return (kvnl_line){ .key = kvnl_key_in(buf, key_offset, spec.key), .size = spec.size, .error = piece.error };
+			left -= n_read;
+		}
+	}
+
+	kvnl_some trail = kvnl_read_some(fd, -1, "\n", buf, hash);
+	if (trail.error || trail.view.size != 1)
+		return (kvnl_line){
+			.key = kvnl_key_in(buf, key_offset, spec.key),
+			.size = spec.size,
+			.value = trail.view,
+			.error = trail.error ? trail.error : "expected only a trailing newline"
+		};
+	INSTR_ADD(INSTR_RECORDS_READ, 1);
+	return (kvnl_line){ .key = kvnl_key_in(buf, key_offset, spec.key), .size = spec.size };
+}
+
+struct kvnl_value_reader make_kvnl_value_reader(kvnl_pick_func pick, void * ctx)
+{
+	return (struct kvnl_value_reader){
+		.pick = pick,
+		.ctx = ctx,
+		.direct = 0,
+		.direct_fd = -1,
+		.bounce = NULL_BUF,
+	};
+}
+
+int kvnl_value_reader_free(struct kvnl_value_reader * reader)
+{
+	if (reader->direct_fd >= 0) close(reader->direct_fd);
+	reader->direct_fd = -1;
+	buf_free_if_allocated(&reader->bounce);
+	return errno = 0;
+}
+
+/* a descriptor reading the file behind fd past the page cache, opened once per file; negative if there can't be one */
+static int kvnl_direct_fd(struct kvnl_value_reader * reader, int fd, struct stat const * st)
+{
+	if (reader->direct_fd != -1 && reader->direct_dev == st->st_dev && reader->direct_ino == st->st_ino)
+		return reader->direct_fd;
+	if (reader->direct_fd >= 0) close(reader->direct_fd);
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	int direct_fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+	reader->direct_fd = direct_fd < 0 ? -2 : direct_fd;
+	reader->direct_dev = st->st_dev;
+	reader->direct_ino = st->st_ino;
+	return direct_fd;
+}
+
+/*
+ * O_DIRECT needs the file offset, the size and the memory to be aligned: the
+ * aligned middle of the value is read straight into place when dst lines up
+ * with the file (as it does for aligned payloads read into aligned buffers),
+ * everything else goes through the bounce buffer
+ */
+static ssize_t kvnl_read_direct(struct kvnl_value_reader * reader, int direct_fd, off_t offset, struct view dst)
+{
+	size_t const align = KVNL_MAX_ALIGN;
+	if (buf_is_null(&reader->bounce)) reader->bounce = make_buf_aligned(align);
+	if (buf_resize(&reader->bounce, KVNL_DIRECT_CHUNK)) return -1;
+
+	size_t done = 0;
+	while (done < dst.size) {
+		char * const to = (char *)dst.data + done;
+		size_t const left = dst.size - done;
+		ssize_t n;
+		if (offset % align == 0 && (uintptr_t)to % align == 0 && left >= align) {
+			n = pread(direct_fd, to, left / align * align, offset);
+		}
+		else {
+			size_t const skip = offset % align;
+			size_t want = (skip + left + align - 1) / align * align;
+			if (want > KVNL_DIRECT_CHUNK) want = KVNL_DIRECT_CHUNK;
+			n = pread(direct_fd, reader->bounce.data, want, offset - skip);
+			if (n > 0) {
+				n = (size_t)n > skip ? n - (ssize_t)skip : 0;
+				if ((size_t)n > left) n = left;
+				memcpy(to, (char *)reader->bounce.data + skip, n);
+			}
+		}
+		INSTR_ADD(INSTR_READ_CALLS, 1);
+		if (n < 0) return n;
+		INSTR_ADD(INSTR_READ_BYTES, n);
+		if (n == 0) break;  /* EOF */
+		done += n;
+		offset += n;
+	}
+	return done;
+}
+
+/* reads a value of dst.size bytes into dst, past the page cache if it's large */
+static ssize_t kvnl_read_value_into(int fd, struct kvnl_value_reader * reader, struct view dst, kvnl_hash * hash)
+{
+	struct stat st;
+	off_t offset;
+	if (reader->direct == 0 || dst.size < reader->direct || fstat(fd, &st) || !S_ISREG(st.st_mode)
+		|| (offset = lseek(fd, 0, SEEK_CUR)) < 0)
+		return read_into_hashed(fd, dst, hash);
+	INSTR_ADD(INSTR_SEEK_CALLS, 1);
+
+	int const direct_fd = kvnl_direct_fd(reader, fd, &st);
+	ssize_t n_read;
+	if (direct_fd >= 0) {
+		n_read = kvnl_read_direct(reader, direct_fd, offset, dst);
+		if (n_read < 0) return n_read;
+		if (lseek(fd, offset + n_read, SEEK_SET) < 0) return -1;
+		INSTR_ADD(INSTR_SEEK_CALLS, 1);
+		kvnl_hash_update(hash, (struct view){ dst.data, n_read });
+	}
+	else {
+		n_read = read_into_hashed(fd, dst, hash);
+		if (n_read > 0) posix_fadvise(fd, offset, n_read, POSIX_FADV_DONTNEED);
+	}
+	return n_read;
+}
+
+/* like kvnl_read_value(), with the values of sized records going where the reader says */
+static kvnl_line kvnl_read_plain_line(int fd, struct kvnl_value_reader * reader, struct buf * buf, kvnl_hash * hash)
+{
+	kvnl_specification spec = kvnl_read_specification(fd, buf, hash);
+	if (reader == NULL || spec.error || spec.size < 0)
+		return kvnl_read_value(fd, spec, buf, hash);
+
+	struct view const picked = reader->pick ? reader->pick(reader->ctx, spec.key, spec.size) : (struct view){ NULL, 0 };
+	int const in_buf = picked.data == NULL;
+	if (in_buf && (reader->direct == 0 || (size_t)spec.size < reader->direct))
+		return kvnl_read_value(fd, spec, buf, hash);
+	if (!in_buf && picked.size < (size_t)spec.size)
+		return (kvnl_line){ .key = spec.key, .size = spec.size, .error = "the picked memory is too small" };
+
+	INSTR_SCOPE(INSTR_KVNL_READ_VALUE);
+	/* the key lives in buf, and so does the value if nothing was picked, and buf may move */
+	ptrdiff_t const key_offset = (char *)spec.key.data - (char *)buf->data;
+	size_t const value_offset = buf->size;
+	if (in_buf && buf_resize(buf, value_offset + spec.size))
+		return (kvnl_line){ .key = spec.key, .size = spec.size, .error = "buf_resize() failed, consult errno" };
+	ptrdiff_t const value_in_buf = in_buf ? (ptrdiff_t)value_offset : -1;
+
+	ssize_t n_read = kvnl_read_value_into(fd, reader, kvnl_key_in(buf, value_in_buf, (struct view){ picked.data, spec.size }), hash);
+	if (n_read < (ssize_t)spec.size) {
+		if (in_buf) buf_resize(buf, value_offset + (n_read < 0 ? 0 : n_read));
+		return (kvnl_line){
+			.key = kvnl_key_in(buf, key_offset, spec.key),
+			.size = spec.size,
+			.value = kvnl_key_in(buf, value_in_buf, (struct view){ picked.data, n_read < 0 ? 0 : n_read }),
+			.error = n_read < 0 ? "read() failed, consult errno" : "EOF"
+		};
+	}
+
+	kvnl_some trail = kvnl_read_some(fd, -1, "\n", buf, hash);
+	if (trail.error || trail.view.size != 1)
+		return (kvnl_line){
+			.key = kvnl_key_in(buf, key_offset, spec.key),
+			.size = spec.size,
+			.value = trail.view,
+			.error = trail.error ? trail.error : "expected only a trailing newline"
+		};
+
+	INSTR_ADD(INSTR_RECORDS_READ, 1);
+	INSTR_ADD(INSTR_BYTES_PARSED, spec.key.size + spec.size);
+	return (kvnl_line){
+		.key = kvnl_key_in(buf, key_offset, spec.key),
+		.size = spec.size,
+		.value = kvnl_key_in(buf, value_in_buf, (struct view){ picked.data, spec.size })
+	};
+}
+
+static int kvnl_check_update(void * ctx, struct view view)
+{
+	struct kvnl_check * check = ctx;
+	kvnl_hash_update(check->stream, view);
+	return hash_update(&check->record, view);
+}
+
+/* a checksum record is "<algorithm> <hex digest>" and covers the record after it */
+int kvnl_parse_checksum(struct view value, enum hash_kind * kind, uint64_t * expected)
+{
+	char * data = value.data, * space = memchr(data, ' ', value.size), * end;
+	if (space == NULL) return -1;
+	*kind = hash_look_up((struct view){ data, space - data });
+	*expected = strtoull(space + 1, &end, 16);
+	if (*kind == HASH_INVALID || *kind == HASH_NONE || end != data + value.size) return -1;
+	return 0;
+}
+
+const char * kvnl_check_start(struct kvnl_check * check, struct view checksum, kvnl_hash * stream)
+{
+	enum hash_kind kind;
+	if (kvnl_parse_checksum(checksum, &kind, &check->expected)) return "malformed checksum";
+	check->record = make_hash(kind);
+	check->stream = stream;
+	check->hash = (kvnl_hash){ kvnl_check_update, check };
+	return NULL;
+}
+
+const char * kvnl_check_finish(struct kvnl_check const * check)
+{
+	return hash_digest(&check->record) != check->expected ? "checksum mismatch" : NULL;
+}
+
+kvnl_line kvnl_read_line(int fd, struct buf * buf, kvnl_hash * hash)
+{
+	return kvnl_read_line_with(fd, NULL, buf, hash);
+}
+
+kvnl_line kvnl_read_line_with(int fd, struct kvnl_value_reader * reader, struct buf * buf, kvnl_hash * hash)
+{
+	INSTR_SCOPE(INSTR_KVNL_READ_LINE);
+	size_t const initial_size = buf->size;
+	kvnl_line line = kvnl_read_plain_line(fd, reader, buf, hash);
+	if (line.error || line.size >= 0 || !view_equals(line.key, view_str(KVNL_CHECKSUM_KEY)))
+		return line;
+
+	struct kvnl_check check;
+	const char * error = kvnl_check_start(&check, line.value, hash);
+	if (error) return (kvnl_line){ .key = line.key, .size = -1, .value = line.value, .error = error };
+
+	buf_resize(buf, initial_size);
+	kvnl_line checked = kvnl_read_plain_line(fd, reader, buf, &check.hash);
+	if (checked.error == NULL) checked.error = kvnl_check_finish(&check);
+	return checked;
+}
+
+
+/* the memory twins of kvnl_read_plain_line() and kvnl_read_line() */
+static kvnl_line kvnl_parse_plain_line(struct view input, size_t * consumed)
+{
+	char * const data = input.data;
+	size_t n = 0;
+	*consumed = 0;
+	while (n < input.size && data[n] != '=' && data[n] != '\n') n++;
+	if (n == input.size)
+		return (kvnl_line){ .key = input, .error = "EOF" };
+	if (data[n] == '\n') {
+		if (n) return (kvnl_line){ .key = { data, n + 1 }, .error = "malformed specification" };
+		*consumed = 1;
+		return (kvnl_line){ .key = { data, 1 } };
+	}
+
+	size_t m = n;
+	while (m > 0 && data[m - 1] != ':') m--;
+	char * const value = data + n + 1;
+	size_t const available = input.size - n - 1;
+
+	/* without a size specification, the value ends at the newline */
+	if (m == 0) {
+		char * newline = memchr(value, '\n', available);
+		if (newline == NULL)
+			return (kvnl_line){ .key = { data, n }, .size = -1, .error = "EOF" };
+		*consumed = newline + 1 - data;
+		return (kvnl_line){ .key = { data, n }, .size = -1, .value = { value, newline - value } };
+	}
+
+	size_t size = 0;
+	for (size_t i = m; i < n; i++) {
+		if (data[i] < '0' || data[i] > '9' || size > (SSIZE_MAX - 9) / 10)
+			return (kvnl_line){ .key = { data, n + 1 }, .error = "malformed size specification" };
+		size = size * 10 + (data[i] - '0');
+	}
+	if (m == n)
+		return (kvnl_line){ .key = { data, n + 1 }, .error = "malformed size specification" };
+
+	struct view const key = { data, m - 1 };
+	if (size >= available)
+		return (kvnl_line){ .key = key, .size = size, .value = { value, available }, .error = "EOF" };
+	if (value[size] != '\n')
+		return (kvnl_line){ .key = key, .size = size, .value = { value + size, 1 }, .error = "expected only a trailing newline" };
+	*consumed = value + size + 1 - data;
+	return (kvnl_line){ .key = key, .size = size, .value = { value, size } };
+}
+
+static kvnl_line kvnl_count_parsed(kvnl_line line)
+{
+	if (line.error == NULL) {
+		INSTR_ADD(INSTR_RECORDS_READ, 1);
+		INSTR_ADD(INSTR_BYTES_PARSED, line.key.size + line.value.size);
+	}
+	return line;
+}
+
+kvnl_line kvnl_parse_line(struct view input, size_t * consumed)
+{
+	kvnl_line line = kvnl_parse_plain_line(input, consumed);
+	if (line.error || line.size >= 0 || !view_equals(line.key, view_str(KVNL_CHECKSUM_KEY)))
+		return kvnl_count_parsed(line);
+
+	enum hash_kind kind;
+	uint64_t expected;
+	if (kvnl_parse_checksum(line.value, &kind, &expected)) {
+		*consumed = 0;
+		return (kvnl_line){ .key = line.key, .size = -1, .value = line.value, .error = "malformed checksum" };
+	}
+
+	size_t const skipped = *consumed;
+	struct view const rest = { (char *)input.data + skipped, input.size - skipped };
+	kvnl_line checked = kvnl_parse_plain_line(rest, consumed);
+	if (checked.error) return checked;
+	struct hash record = make_hash(kind);
+	hash_update(&record, (struct view){ rest.data, *consumed });
+	if (hash_digest(&record) != expected) {
+		*consumed = 0;
+		checked.error = "checksum mismatch";
+		return checked;
+	}
+	*consumed += skipped;
+	return kvnl_count_parsed(checked);
+}
+
+struct kvnl_block_reader make_kvnl_block_reader(size_t max_lines, size_t max_bytes)
+{
+	return (struct kvnl_block_reader){
+		.max_lines = max_lines,
+		.max_bytes = max_bytes,
+		.data = make_buf_grow_only(2.0f),
+		.lines = make_buf_grow_only(2.0f),
+		.start = 0,
+		.eof = 0,
+		.uring = NULL,
+	};
+}
+
+int kvnl_block_reader_free(struct kvnl_block_reader * reader)
+{
+	buf_free_if_allocated(&reader->data);
+	buf_free_if_allocated(&reader->lines);
+	reader->start = 0;
+	return errno = 0;
+}
+
+/* a single read() of up to room bytes past what's buffered, or what an engine has of them */
+static ssize_t kvnl_read_more(int fd, struct kvnl_uring * uring, struct buf * data, size_t room)
+{
+	size_t const size = data->size;
+	if (buf_reserve(data, room)) return -1;
+	if (uring != NULL) {
+		if (uring->fd != fd) { errno = EINVAL; return -1; }
+		ssize_t const n_read = kvnl_uring_read(uring, (char *)data->data + size, room);
+		if (n_read <= 0) return n_read;
+		return buf_resize(data, size + n_read) ? -1 : n_read;
+	}
+	ssize_t n_read;
+	do {
+		n_read = read(fd, (char *)data->data + size, room);
+		INSTR_ADD(INSTR_READ_CALLS, 1);
+	} while (n_read < 0 && errno == EINTR);
+	if (n_read <= 0) return n_read;
+	INSTR_ADD(INSTR_READ_BYTES, n_read);
+	return buf_resize(data, size + n_read) ? -1 : n_read;
+}
+
+/* a failed line ends the block, and the next one starts with it again; there's always room for it */
+static kvnl_block kvnl_block_failed(struct buf * lines, size_t n, kvnl_line line)
+{
+	buf_push_value(lines, line);
+	return (kvnl_block){ n + 1, lines->data };
+}
+
+kvnl_block kvnl_read_block(int fd, struct kvnl_block_reader * reader, kvnl_hash * hash)
+{
+	INSTR_SCOPE(INSTR_KVNL_READ_BLOCK);
+	struct buf * const data = &reader->data, * const lines = &reader->lines;
+	size_t const max_lines = reader->max_lines ? reader->max_lines : KVNL_BLOCK_LINES;
+	size_t const max_bytes = reader->max_bytes ? reader->max_bytes : KVNL_BLOCK_BYTES;
+
+	/* what the last block read past its records goes to the front */
+	size_t const left = data->size - reader->start;
+	if (left && reader->start) memmove(data->data, (char *)data->data + reader->start, left);
+	reader->start = 0;
+	if (buf_clear(lines) || buf_reserve(lines, sizeof(kvnl_line)))
+		return (kvnl_block){ .n_lines = -1 };
+	if (buf_resize(data, left))
+		return kvnl_block_failed(lines, 0, (kvnl_line){ .error = "buf_resize() failed, consult errno" });
+
+	size_t n = 0;
+	while (n < max_lines) {
+		size_t const offset = reader->start;
+		size_t consumed;
+		kvnl_line const line = kvnl_parse_line((struct view){ (char *)data->data + offset, data->size - offset }, &consumed);
+
+		/* a record cut short comes with the next block, unless there's nothing in this one yet */
+		if (line.error != NULL && !strcmp(line.error, "EOF") && !reader->eof) {
+			if (n) break;
+			size_t room = data->size < max_bytes ? max_bytes - data->size : max_bytes;
+			if (line.size >= 0 && (size_t)line.size >= room) room = line.size + 1;
+			ssize_t const n_read = kvnl_read_more(fd, reader->uring, data, room);
+			if (n_read < 0)
+				return kvnl_block_failed(lines, n, (kvnl_line){ .error = "read() failed, consult errno" });
+			reader->eof = n_read == 0;
+			continue;
+		}
+		if (line.error != NULL)
+			return kvnl_block_failed(lines, n, line);
+
+		if (n && offset + consumed > max_bytes) break;
+		if (buf_reserve(lines, 2 * sizeof(kvnl_line)))
+			return kvnl_block_failed(lines, n, (kvnl_line){ .error = "buf_resize() failed, consult errno" });
+		buf_push_value(lines, line);
+		kvnl_hash_update(hash, (struct view){ (char *)data->data + offset, consumed });
+		reader->start += consumed;
+		n++;
+	}
+	return (kvnl_block){ n, lines->data };
+}
+
+
+struct kvnl_ndview_reader make_kvnl_ndview_reader(void)
+{
+	return (struct kvnl_ndview_reader){
+		.line = NULL_BUF,
+		.layout = NULL_BUF,
+		.dtype = NULL_BUF,
+		.shape_line = NULL_BUF,
+		.strides_line = NULL_BUF,
+		.ndim = 0,
+		.type = INVALID_DTYPE,
+		.codec = IDENTITY_CODEC,
+		.chunk_sizes = NULL_BUF,
+		.encoded = NULL_BUF,
+		.decoded = NULL_BUF,
+		.remaining = -1,
+	};
+}
+
+int kvnl_ndview_reader_free(struct kvnl_ndview_reader * reader)
+{
+	buf_free_if_allocated(&reader->line);
+	buf_free_if_allocated(&reader->layout);
+	buf_free_if_allocated(&reader->dtype);
+	buf_free_if_allocated(&reader->shape_line);
+	buf_free_if_allocated(&reader->strides_line);
+	buf_free_if_allocated(&reader->chunk_sizes);
+	buf_free_if_allocated(&reader->encoded);
+	buf_free_if_allocated(&reader->decoded);
+	return errno = 0;
+}
+
+/* space-separated integers, negative ones only where allowed; the value is always followed by its newline in the buffer, which stops strtol() */
+static ssize_t kvnl_parse_sizes(struct view value, ssize_t * sizes, size_t max, int negative)
+{
+	char * p = value.data, * const end = p + value.size;
+	size_t count = 0;
+	while (p < end) {
+		if (*p == ' ') { p++; continue; }
+		if (count == max) return -1;
+		char * next;
+		sizes[count++] = strtol(p, &next, 10);
+		if (next == p || next > end || (!negative && sizes[count - 1] < 0)) return -1;
+		p = next;
+	}
+	return count;
+}
+
+static int kvnl_parse_codec(struct codec * codec, struct view value)
+{
+	ssize_t sizes[2];
+	char * p = value.data, * const end = p + value.size;
+	for (int i = 0; i < 2; i++) {
+		char * next;
+		sizes[i] = strtol(p, &next, 10);
+		if (next == p || next > end || sizes[i] <= 0) return -1;
+		p = next;
+	}
+	codec->elem_size = sizes[0];
+	codec->chunk_size = sizes[1];
+	while (p < end) {
+		if (*p == ' ') { p++; continue; }
+		char * space = memchr(p, ' ', end - p);
+		char * next = space ? space : end;
+		if (codec_parse_filter(codec, (struct view){ p, next - p })) return -1;
+		p = next;
+	}
+	return 0;
+}
+
+static void kvnl_reset_codec(struct codec * codec)
+{
+	codec->delta = 0;
+	codec->shuffle = CODEC_SHUFFLE_NONE;
+	codec->lz = 0;
+}
+
+static int kvnl_store_line(struct buf * dst, struct view value)
+{
+	/* keep a terminating NUL so that the copy can be used as a string */
+	if (buf_resize(dst, value.size + 1)) return -1;
+	memcpy(dst->data, value.data, value.size);
+	((char *)dst->data)[value.size] = '\0';
+	return buf_resize(dst, value.size) ? -1 : 0;
+}
+
+/* stride i of view, in elements of src_size, scaled to elements of dst_size */
+static int kvnl_scale_strides(struct ndview * view, size_t src_size, size_t dst_size, ssize_t * strides)
+{
+	for (size_t i = 0; i < view->ndim; i++) {
+		if (view->strides[i] % (ssize_t)src_size) return -1;
+		strides[i] = view->strides[i] / (ssize_t)src_size * (ssize_t)dst_size;
+	}
+	view->strides = strides;
+	return 0;
+}
+
+/* read a raw payload piece by piece, converting each piece while it is still in the cache */
+static const char * kvnl_read_converted(
+	int fd, struct kvnl_ndview_reader * reader, size_t size, struct dtype as, struct buf * data, kvnl_hash * hash
+)
+{
+	size_t const src_size = reader->type.size, piece = KVNL_HASH_CHUNK / src_size * src_size;
+	if (size % src_size) return "the data is not a whole number of elements";
+	if (buf_resize(data, size / src_size * as.size)) return "buf_resize() failed, consult errno";
+	for (size_t offset = 0; offset < size; offset += piece) {
+		size_t const n = size - offset < piece ? size - offset : piece;
+		if (buf_clear(&reader->encoded)) return "buf_clear() failed, consult errno";
+		kvnl_some value = kvnl_read_some(fd, n, "", &reader->encoded, hash);
+		if (value.error) return value.error;
+		struct view dst = { data->data + offset / src_size * as.size, n / src_size * as.size };
+		if (dtype_convert(dst, as, value.view, reader->type)) return "converting the data failed";
+	}
+	return NULL;
+}
+
+/* the stream hash, teed into the checksum of the record being read if there is one */
+static kvnl_hash * kvnl_record_hash(struct kvnl_ndview_reader * reader, kvnl_hash * hash)
+{
+	if (!reader->checked) return hash;
+	/* the stream hash can differ from call to call, and the reader may have moved since */
+	reader->check.stream = hash;
+	reader->check.hash = (kvnl_hash){ kvnl_check_update, &reader->check };
+	return &reader->check.hash;
+}
+
+/* the newline after the payload, and the checksum of the data record */
+static const char * kvnl_finish_data(int fd, struct kvnl_ndview_reader * reader, kvnl_hash * hash)
+{
+	reader->remaining = -1;
+	kvnl_some trail = kvnl_read_some(fd, -1, "\n", &reader->line, hash);
+	if (trail.error) return trail.error;
+	if (trail.view.size != 1) return "expected only a trailing newline";
+	if (reader->checked && kvnl_check_finish(&reader->check)) return "checksum mismatch";
+	INSTR_ADD(INSTR_RECORDS_READ, 1);
+	return NULL;
+}
+
+static kvnl_ndview kvnl_read_ndview_data_as(
+	int fd, struct kvnl_ndview_reader * reader, kvnl_specification spec, struct dtype const * as,
+	struct buf * data, kvnl_hash * stream_hash
+)
+{
+	kvnl_hash * const hash = kvnl_record_hash(reader, stream_hash);
+	if (as != NULL && dtype_equal(*as, reader->type)) as = NULL;
+	if (as != NULL && !dtype_is_valid(reader->type))
+		return (kvnl_ndview){ .error = "the dtype of the data is unknown" };
+
+	int const encoded = !codec_is_identity(&reader->codec);
+	struct buf * target = encoded ? &reader->encoded : data;
+	if (buf_clear(target))
+		return (kvnl_ndview){ .error = "buf_clear() failed, consult errno" };
+
+	if (as != NULL && !encoded) {
+		const char * error = kvnl_read_converted(fd, reader, spec.size, *as, data, hash);
+		if (error) return (kvnl_ndview){ .error = error };
+	}
+	else {
+		kvnl_some value = kvnl_read_some(fd, spec.size, "", target, hash);
+		if (value.error) return (kvnl_ndview){ .error = value.error };
+	}
+	const char * error = kvnl_finish_data(fd, reader, hash);
+	if (error) return (kvnl_ndview){ .error = error };
+	INSTR_ADD(INSTR_BYTES_PARSED, spec.key.size + spec.size);
+
+	struct ndview view = { NULL, reader->ndim, reader->shape, reader->strides };
+	size_t const n_items = ndview_size(&view);
+
+	if (!encoded) {
+		/* the data starts at the lowest address, which negative strides move away from the origin */
+		if (n_items && !dtype_is_valid(reader->type))
+			return (kvnl_ndview){ .error = "the dtype of the data is unknown" };
+		struct extent extent = ndview_extent(&view, reader->type.size);
+		if (n_items && extent.upper - extent.lower > spec.size)
+			return (kvnl_ndview){ .error = "the data is too small for the shape and strides" };
+		ssize_t lower = extent.lower;
+		if (as != NULL) {
+			if (kvnl_scale_strides(&view, reader->type.size, as->size, reader->converted_strides))
+				return (kvnl_ndview){ .error = "the strides are not a whole number of elements" };
+			lower = lower / (ssize_t)reader->type.size * (ssize_t)as->size;
+		}
+		view.data = data->data - lower;
+		return (kvnl_ndview){ .view = view };
+	}
+
+	size_t const item_size = reader->codec.elem_size, size = n_items * item_size;
+	ssize_t dense_strides[KVNL_MAX_NDIM];
+	struct ndview dense = { NULL, view.ndim, view.shape, dense_strides };
+	ndview_set_strides_row_major(&dense, item_size);
+	int column_major = 0;
+	if (memcmp(dense_strides, reader->strides, view.ndim * sizeof(ssize_t)) != 0) {
+		ndview_set_strides_column_major(&dense, item_size);
+		column_major = 1;
+		if (memcmp(dense_strides, reader->strides, view.ndim * sizeof(ssize_t)) != 0)
+			return (kvnl_ndview){ .error = "encoded data must be dense, in row-major or column-major order" };
+	}
+	if (as != NULL && item_size != reader->type.size)
+		return (kvnl_ndview){ .error = "the codec and the dtype disagree on the element size" };
+
+	/* converting needs the decoded data in one piece first, as chunks need not be whole elements */
+	struct buf * decoded = as != NULL ? &reader->decoded : data;
+	if (buf_resize(decoded, size))
+		return (kvnl_ndview){ .error = "buf_resize() failed, consult errno" };
+
+	size_t const row_size = kvnl_codec_row_size(&view, size, column_major);
+	if (codec_decode(
+		&reader->codec, buf_view(&reader->encoded),
+		reader->chunk_sizes.data, reader->chunk_sizes.size / sizeof(size_t),
+		row_size, buf_view(decoded)
+	))
+		return (kvnl_ndview){ .error = "decoding the data failed" };
+
+	if (as != NULL) {
+		if (buf_resize(data, n_items * as->size))
+			return (kvnl_ndview){ .error = "buf_resize() failed, consult errno" };
+		if (dtype_convert(buf_view(data), *as, buf_view(decoded), reader->type))
+			return (kvnl_ndview){ .error = "converting the data failed" };
+		kvnl_scale_strides(&view, item_size, as->size, reader->converted_strides);
+	}
+	view.data = data->data;
+	return (kvnl_ndview){ .view = view };
+}
+
+kvnl_specification kvnl_read_ndview_header(int fd, struct kvnl_ndview_reader * reader, kvnl_hash * hash)
+{
+	reader->checked = 0;
+	reader->remaining = -1;
+	int layout = 0;
+
+	for (;;) {
+		kvnl_hash * line_hash = kvnl_record_hash(reader, hash);
+		if (buf_clear(&reader->line))
+			return (kvnl_specification){ .error = "buf_clear() failed, consult errno" };
+		kvnl_specification spec = kvnl_read_specification(fd, &reader->line, line_hash);
+		if (spec.error) return spec;
+
+		if (spec.size >= 0 && view_equals(spec.key, view_str("data"))) {
+			reader->remaining = spec.size;
+			return spec;
+		}
+
+		kvnl_line line = kvnl_read_value(fd, spec, &reader->line, line_hash);
+		if (line.error) return (kvnl_specification){ .key = line.key, .error = line.error };
+		if (reader->checked && kvnl_check_finish(&reader->check))
+			return (kvnl_specification){ .error = "checksum mismatch" };
+		reader->checked = 0;
+
+		if (view_equals(line.key, view_str(KVNL_CHECKSUM_KEY))) {
+			const char * error = kvnl_check_start(&reader->check, line.value, NULL);
+			if (error) return (kvnl_specification){ .error = error };
+			reader->checked = 1;
+		}
+		else if (view_equals(line.key, view_str("layout"))) {
+			if (kvnl_store_line(&reader->layout, line.value))
+				return (kvnl_specification){ .error = "buf_resize() failed, consult errno" };
+			layout = 1;
+		}
+		/* repeated header records are the same text, which is cheaper to compare than to parse */
+		else if (view_equals(line.key, view_str("dtype"))) {
+			/* a header without a layout record is a plain array */
+			if (!layout) buf_clear(&reader->layout);
+			if (view_equals(line.value, buf_view(&reader->dtype))) continue;
+			if (kvnl_store_line(&reader->dtype, line.value))
+				return (kvnl_specification){ .error = "buf_resize() failed, consult errno" };
+			/* free-form dtypes are still fine for encoded data, as long as nothing needs converting */
+			reader->type = dtype_parse(line.value);
+		}
+		else if (view_equals(line.key, view_str("shape"))) {
+			if (view_equals(line.value, buf_view(&reader->shape_line))) continue;
+			buf_clear(&reader->shape_line);
+			buf_clear(&reader->strides_line);
+			ssize_t ndim = kvnl_parse_sizes(line.value, (ssize_t *)reader->shape, KVNL_MAX_NDIM, 0);
+			if (ndim < 0) return (kvnl_specification){ .error = "malformed shape" };
+			reader->ndim = ndim;
+			if (kvnl_store_line(&reader->shape_line, line.value))
+				return (kvnl_specification){ .error = "buf_resize() failed, consult errno" };
+		}
+		else if (view_equals(line.key, view_str("strides"))) {
+			if (view_equals(line.value, buf_view(&reader->strides_line))) continue;
+			buf_clear(&reader->strides_line);
+			ssize_t ndim = kvnl_parse_sizes(line.value, reader->strides, KVNL_MAX_NDIM, 1);
+			if (ndim < 0 || (size_t)ndim != reader->ndim) return (kvnl_specification){ .error = "malformed strides" };
+			if (kvnl_store_line(&reader->strides_line, line.value))
+				return (kvnl_specification){ .error = "buf_resize() failed, consult errno" };
+		}
+		else if (view_equals(line.key, view_str("codec"))) {
+			if (kvnl_parse_codec(&reader->codec, line.value))
+				return (kvnl_specification){ .error = "malformed or unknown codec" };
+		}
+		else if (view_equals(line.key, view_str("chunks"))) {
+			/* every size takes at least two characters, except perhaps the last one */
+			size_t const max = line.value.size / 2 + 1;
+			if (buf_resize(&reader->chunk_sizes, max * sizeof(size_t)))
+				return (kvnl_specification){ .error = "buf_resize() failed, consult errno" };
+			ssize_t n = kvnl_parse_sizes(line.value, reader->chunk_sizes.data, max, 0);
+			if (n < 0) return (kvnl_specification){ .error = "malformed chunks" };
+			buf_resize(&reader->chunk_sizes, n * sizeof(size_t));
+		}
+		/* anything else, like blank lines, is not part of the array */
+	}
+}
+
+kvnl_ndview kvnl_read_ndview_data(int fd, struct kvnl_ndview_reader * reader, kvnl_specification spec, struct buf * data, kvnl_hash * hash)
+{
+	kvnl_ndview result = kvnl_read_ndview_data_as(fd, reader, spec, NULL, data, hash);
+	kvnl_reset_codec(&reader->codec);
+	return result;
+}
+
+kvnl_some kvnl_read_ndview_piece(int fd, struct kvnl_ndview_reader * reader, size_t size, struct buf * buf, kvnl_hash * stream_hash)
+{
+	if (reader->remaining < 0) return (kvnl_some){ .error = "no data record is being read" };
+	kvnl_hash * const hash = kvnl_record_hash(reader, stream_hash);
+	if (reader->remaining == 0) {
+		kvnl_reset_codec(&reader->codec);
+		const char * error = kvnl_finish_data(fd, reader, hash);
+		return (kvnl_some){ .view = { buf->data + buf->size, 0 }, .error = error };
+	}
+	size_t const n = size && size < (size_t)reader->remaining ? size : (size_t)reader->remaining;
+	kvnl_some piece = kvnl_read_some(fd, n, "", buf, hash);
+	reader->remaining -= piece.view.size;
+	INSTR_ADD(INSTR_BYTES_PARSED, piece.view.size);
+	return piece;
+}
+
+static kvnl_ndview kvnl_read_ndview_into(
+	int fd, struct kvnl_ndview_reader * reader, struct dtype const * as, struct buf * data, kvnl_hash * hash
+)
+{
+	INSTR_SCOPE(INSTR_KVNL_READ_NDVIEW);
+	kvnl_specification spec = kvnl_read_ndview_header(fd, reader, hash);
+	if (spec.error) return (kvnl_ndview){ .error = spec.error };
+	kvnl_ndview result = kvnl_read_ndview_data_as(fd, reader, spec, as, data, hash);
+	kvnl_reset_codec(&reader->codec);
+	return result;
+}
+
+kvnl_ndview kvnl_read_ndview(int fd, struct kvnl_ndview_reader * reader, struct buf * data, kvnl_hash * hash)
+{
+	return kvnl_read_ndview_into(fd, reader, NULL, data, hash);
+}
+
+kvnl_ndview kvnl_read_ndview_as(int fd, struct kvnl_ndview_reader * reader, struct dtype dtype, struct buf * data, kvnl_hash * hash)
+{
+	if (!dtype_is_valid(dtype)) return (kvnl_ndview){ .error = "invalid dtype" };
+	return kvnl_read_ndview_into(fd, reader, &dtype, data, hash);
+}
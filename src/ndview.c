@@ -1,6 +1,7 @@
 #include <ndview.h>
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
@@ -145,6 +146,16 @@ int ndview_set_strides_row_major(struct ndview * ndview, size_t elem_size)
 	return errno = 0;
 }
 
+int ndview_set_strides_column_major(struct ndview * ndview, size_t elem_size)
+{
+	long stride = elem_size;
+	for (size_t i = 0; i < ndview->ndim; i++) {
+		ndview->strides[i] = stride;
+		stride *= ndview->shape[i];
+	}
+	return errno = 0;
+}
+
 
 int ndview_fprint_rec(
 	struct ndview const * ndview,
@@ -210,3 +221,306 @@ struct view ndview_memory(struct ndview const * ndview, size_t item_size)
 	struct extent extent = ndview_extent(ndview, item_size);
 	return (struct view){ ndview->data + extent.lower, extent.upper - extent.lower };
 }
+
+size_t ndview_size(struct ndview const * ndview)
+{
+	size_t size = 1;
+	for (size_t d = 0; d < ndview->ndim; ++d) size *= ndview->shape[d];
+	return size;
+}
+
+/* the number of bytes if the trailing ndim dimensions are dense and row-major, otherwise 0 */
+static size_t dense_size(size_t ndim, size_t const * shape, ssize_t const * strides, size_t item_size)
+{
+	ssize_t size = item_size;
+	for (long d = ndim - 1; d >= 0; d--) {
+		if (strides[d] != size && shape[d] != 1) return 0;
+		size *= shape[d];
+	}
+	return size;
+}
+
+static void ndview_copy_rec(
+	void * dst, ssize_t const * dst_strides,
+	void const * src, ssize_t const * src_strides,
+	size_t ndim, size_t const * shape, size_t item_size
+)
+{
+	size_t size = dense_size(ndim, shape, dst_strides, item_size);
+	if (size && size == dense_size(ndim, shape, src_strides, item_size)) {
+		memcpy(dst, src, size);
+		return;
+	}
+	for (size_t i = 0; i < shape[0]; i++)
+		ndview_copy_rec(
+			dst + i * dst_strides[0], dst_strides + 1,
+			src + i * src_strides[0], src_strides + 1,
+			ndim - 1, shape + 1, item_size
+		);
+}
+
+int ndview_copy(struct ndview const * dst, struct ndview const * src, size_t item_size)
+{
+	if (dst->ndim != src->ndim) return errno = EINVAL;
+	for (size_t d = 0; d < dst->ndim; ++d)
+		if (dst->shape[d] != src->shape[d]) return errno = EINVAL;
+	if (ndview_size(dst) == 0) return errno = 0;
+	ndview_copy_rec(dst->data, dst->strides, src->data, src->strides, dst->ndim, dst->shape, item_size);
+	return errno = 0;
+}
+
+/* slices along an axis: the axis moved to the front, and what the trailing dimensions take to copy */
+struct ndview_slices {
+	char * dst;
+	char const * src;
+	size_t ndim;
+	size_t * shape;
+	ssize_t * dst_strides, * src_strides;
+	size_t item_size;
+	size_t dense;
+	int contiguous;
+};
+
+static void ndview_axis_first(struct ndview const * view, size_t axis, size_t * shape, ssize_t * strides)
+{
+	shape[0] = view->shape[axis];
+	strides[0] = view->strides[axis];
+	for (size_t d = 0, k = 1; d < view->ndim; d++)
+		if (d != axis) {
+			shape[k] = view->shape[d];
+			strides[k++] = view->strides[d];
+		}
+}
+
+/* the same shape but along axis */
+static int ndview_check_slices(struct ndview const * dst, struct ndview const * src, size_t axis)
+{
+	if (dst->ndim != src->ndim || axis >= dst->ndim) return -1;
+	for (size_t d = 0; d < dst->ndim; d++)
+		if (d != axis && dst->shape[d] != src->shape[d]) return -1;
+	return 0;
+}
+
+static void ndview_init_slices(
+	struct ndview_slices * s, struct ndview const * dst, struct ndview const * src, size_t axis, size_t item_size
+)
+{
+	ndview_axis_first(dst, axis, s->shape, s->dst_strides);
+	/* the shape is the same past the front, which is all that is used of it */
+	size_t src_shape[src->ndim];
+	ndview_axis_first(src, axis, src_shape, s->src_strides);
+	s->dst = dst->data;
+	s->src = src->data;
+	s->ndim = dst->ndim;
+	s->item_size = item_size;
+	size_t const dense = dense_size(s->ndim - 1, s->shape + 1, s->dst_strides + 1, item_size);
+	s->dense = dense == dense_size(s->ndim - 1, s->shape + 1, s->src_strides + 1, item_size) ? dense : 0;
+	/* runs of consecutive slices are then one piece of memory on both sides */
+	s->contiguous = s->dense && s->dst_strides[0] == (ssize_t)s->dense && s->src_strides[0] == (ssize_t)s->dense;
+}
+
+/* slices of a few bytes: nothing but the copies, so that the loads of many of them are in flight at once */
+#define NDVIEW_MOVE_SMALL(size) do { \
+	ssize_t const ds = s->dst_strides[0], ss = s->src_strides[0]; \
+	if (scatter) \
+		for (size_t i = begin; i < end; i++) { \
+			if (i + NDVIEW_PREFETCH < end) __builtin_prefetch(s->dst + (ssize_t)indices[i + NDVIEW_PREFETCH] * ds, 1); \
+			memcpy(s->dst + (ssize_t)indices[i] * ds, s->src + (ssize_t)i * ss, (size)); \
+		} \
+	else \
+		for (size_t i = begin; i < end; i++) { \
+			if (i + NDVIEW_PREFETCH < end) __builtin_prefetch(s->src + (ssize_t)indices[i + NDVIEW_PREFETCH] * ss, 0); \
+			memcpy(s->dst + (ssize_t)i * ds, s->src + (ssize_t)indices[i] * ss, (size)); \
+		} \
+} while (0)
+
+/*
+ * slices indices[begin..end) of src to slices begin..end of dst (gathering), or
+ * the other way around (scattering), prefetching the slices a few indices ahead
+ */
+static void ndview_move_slices(struct ndview_slices const * s, size_t const * indices, size_t begin, size_t end, int scatter)
+{
+	switch (s->dense) {
+	case 1: NDVIEW_MOVE_SMALL(1); return;
+	case 2: NDVIEW_MOVE_SMALL(2); return;
+	case 4: NDVIEW_MOVE_SMALL(4); return;
+	case 8: NDVIEW_MOVE_SMALL(8); return;
+	case 16: NDVIEW_MOVE_SMALL(16); return;
+	}
+	ssize_t const indexed_stride = scatter ? s->dst_strides[0] : s->src_strides[0];
+	char const * const indexed = scatter ? s->dst : s->src;
+	size_t const prefetch_lines = s->dense ? (s->dense + 63) / 64 : 1;
+	for (size_t i = begin, run; i < end; i += run) {
+		size_t const at = indices[i];
+		run = 1;
+		if (s->contiguous)
+			while (i + run < end && indices[i + run] == at + run) run++;
+		if (i + NDVIEW_PREFETCH < end && prefetch_lines <= NDVIEW_PREFETCH_LINES) {
+			char const * ahead = indexed + (ssize_t)indices[i + NDVIEW_PREFETCH] * indexed_stride;
+			for (size_t l = 0; l < prefetch_lines; l++) {
+				if (scatter) __builtin_prefetch(ahead + l * 64, 1);
+				else         __builtin_prefetch(ahead + l * 64, 0);
+			}
+		}
+
+		char * d = s->dst + (ssize_t)(scatter ? at : i) * s->dst_strides[0];
+		char const * src = s->src + (ssize_t)(scatter ? i : at) * s->src_strides[0];
+		if (s->dense) memcpy(d, src, run * s->dense);
+		else ndview_copy_rec(d, s->dst_strides + 1, src, s->src_strides + 1, s->ndim - 1, s->shape + 1, s->item_size);
+	}
+}
+
+struct ndview_slices_job {
+	struct ndview_slices const * slices;
+	size_t const * indices;
+	size_t begin, end;
+	int scatter;
+};
+
+static void * ndview_run_slices(void * arg)
+{
+	struct ndview_slices_job const * job = arg;
+	ndview_move_slices(job->slices, job->indices, job->begin, job->end, job->scatter);
+	return NULL;
+}
+
+static void ndview_move_slices_threads(
+	struct ndview_slices const * s, size_t const * indices, size_t n, int scatter, size_t n_threads
+)
+{
+	n_threads = n_threads ? n_threads : 1;
+	if (n_threads > n / NDVIEW_THREAD_INDICES) n_threads = n / NDVIEW_THREAD_INDICES;
+	if (n_threads <= 1) {
+		ndview_move_slices(s, indices, 0, n, scatter);
+		return;
+	}
+	struct ndview_slices_job jobs[n_threads];
+	pthread_t threads[n_threads];
+	for (size_t t = 0; t < n_threads; t++)
+		jobs[t] = (struct ndview_slices_job){ s, indices, n * t / n_threads, n * (t + 1) / n_threads, scatter };
+	/* whatever range doesn't get a thread is done here */
+	size_t started = 0;
+	for (; started + 1 < n_threads; started++)
+		if (pthread_create(&threads[started], NULL, ndview_run_slices, &jobs[started])) break;
+	for (size_t t = started; t < n_threads; t++) ndview_run_slices(&jobs[t]);
+	for (size_t t = 0; t < started; t++) pthread_join(threads[t], NULL);
+}
+
+static int ndview_take_put(
+	struct ndview const * dst, struct ndview const * src, size_t axis, size_t const * indices,
+	size_t item_size, size_t n_threads, int scatter
+)
+{
+	if (ndview_check_slices(dst, src, axis)) return errno = EINVAL;
+	struct ndview const * indexed = scatter ? dst : src;
+	size_t const n = (scatter ? src : dst)->shape[axis];
+	for (size_t i = 0; i < n; i++)
+		if (indices[i] >= indexed->shape[axis]) return errno = EINVAL;
+	if (ndview_size(dst) == 0 || ndview_size(src) == 0) return errno = 0;
+
+	size_t shape[dst->ndim];
+	ssize_t dst_strides[dst->ndim], src_strides[dst->ndim];
+	struct ndview_slices s = { .shape = shape, .dst_strides = dst_strides, .src_strides = src_strides };
+	ndview_init_slices(&s, dst, src, axis, item_size);
+	ndview_move_slices_threads(&s, indices, n, scatter, n_threads);
+	return errno = 0;
+}
+
+int ndview_take(struct ndview const * dst, struct ndview const * src, size_t axis, size_t const * indices, size_t item_size, size_t n_threads)
+{
+	return ndview_take_put(dst, src, axis, indices, item_size, n_threads, 0);
+}
+
+int ndview_put(struct ndview const * dst, struct ndview const * src, size_t axis, size_t const * indices, size_t item_size, size_t n_threads)
+{
+	return ndview_take_put(dst, src, axis, indices, item_size, n_threads, 1);
+}
+
+size_t ndview_mask_count(unsigned char const * mask, size_t n)
+{
+	size_t count = 0;
+	for (size_t i = 0; i < n; i++) count += mask[i] != 0;
+	return count;
+}
+
+/* the masked slices go through as batches of indices */
+static int ndview_compress_expand(
+	struct ndview const * dst, struct ndview const * src, size_t axis, unsigned char const * mask,
+	size_t item_size, int scatter
+)
+{
+	if (ndview_check_slices(dst, src, axis)) return errno = EINVAL;
+	size_t const n = (scatter ? dst : src)->shape[axis];
+	if ((scatter ? src : dst)->shape[axis] != ndview_mask_count(mask, n)) return errno = EINVAL;
+	if (ndview_size(dst) == 0 || ndview_size(src) == 0) return errno = 0;
+
+	size_t shape[dst->ndim];
+	ssize_t dst_strides[dst->ndim], src_strides[dst->ndim];
+	struct ndview_slices s = { .shape = shape, .dst_strides = dst_strides, .src_strides = src_strides };
+	ndview_init_slices(&s, dst, src, axis, item_size);
+	ssize_t const packed_stride = scatter ? s.src_strides[0] : s.dst_strides[0];
+	char * const packed_data = scatter ? (char *)s.src : s.dst;
+
+	size_t batch[NDVIEW_MASK_BATCH];
+	size_t done = 0, n_batch = 0;
+	for (size_t i = 0; i <= n; i++) {
+		if (i < n && mask[i]) batch[n_batch++] = i;
+		if (n_batch == NDVIEW_MASK_BATCH || (i == n && n_batch)) {
+			/* the packed side of this batch starts where the last one ended */
+			char * const at = packed_data + (ssize_t)done * packed_stride;
+			if (scatter) s.src = at;
+			else s.dst = at;
+			ndview_move_slices(&s, batch, 0, n_batch, scatter);
+			done += n_batch;
+			n_batch = 0;
+		}
+	}
+	return errno = 0;
+}
+
+int ndview_compress(struct ndview const * dst, struct ndview const * src, size_t axis, unsigned char const * mask, size_t item_size)
+{
+	return ndview_compress_expand(dst, src, axis, mask, item_size, 0);
+}
+
+int ndview_expand(struct ndview const * dst, struct ndview const * src, size_t axis, unsigned char const * mask, size_t item_size)
+{
+	return ndview_compress_expand(dst, src, axis, mask, item_size, 1);
+}
+
+struct ndview_ref ndview_freeze(struct buf * buf, struct ndview const * view)
+{
+	if ((char *)view->data < (char *)buf->data || (char *)view->data >= (char *)buf->data + buf->capacity) {
+		errno = EINVAL;
+		return (struct ndview_ref){ INVALID_NDVIEW, NULL };
+	}
+	size_t const ndim = view->ndim;
+	struct buf_shared * owner = buf_freeze_with(buf, ndim * (sizeof(size_t) + sizeof(ssize_t)));
+	if (owner == NULL) return (struct ndview_ref){ INVALID_NDVIEW, NULL };
+
+	/* the shape and strides live alongside the data, so copies of the ref stay valid */
+	ssize_t * strides = buf_shared_extra(owner);
+	size_t * shape = (size_t *)(strides + ndim);
+	memcpy(strides, view->strides, ndim * sizeof(*strides));
+	memcpy(shape, view->shape, ndim * sizeof(*shape));
+	return (struct ndview_ref){ { view->data, ndim, shape, strides }, owner };
+}
+
+struct ndview_ref ndview_ref_share(struct ndview_ref const * ref)
+{
+	return (struct ndview_ref){ ref->view, ref->owner ? buf_shared_ref(ref->owner) : NULL };
+}
+
+struct ndview_ref ndview_ref_at(struct ndview_ref const * ref, size_t idx)
+{
+	struct ndview const view = ndview_at(&ref->view, idx);
+	if (view.data == NULL || ref->owner == NULL) return (struct ndview_ref){ view, NULL };
+	return (struct ndview_ref){ view, buf_shared_ref(ref->owner) };
+}
+
+int ndview_ref_release(struct ndview_ref * ref)
+{
+	if (ref->owner != NULL) buf_shared_unref(ref->owner);
+	ref->owner = NULL;
+	return errno = 0;
+}
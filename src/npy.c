@@ -0,0 +1,420 @@
+#include <npy.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NPY_MAGIC "\x93NUMPY"
+#define NPY_MAGIC_SIZE 6
+
+/* the header dict, without Python: strings, True/False, and tuples of integers */
+struct npy_cursor { char const * p, * end; };
+
+static void npy_skip_space(struct npy_cursor * c)
+{
+	while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\n' || *c->p == '\r')) c->p++;
+}
+
+static int npy_accept(struct npy_cursor * c, char ch)
+{
+	npy_skip_space(c);
+	if (c->p == c->end || *c->p != ch) return 0;
+	c->p++;
+	return 1;
+}
+
+static int npy_accept_word(struct npy_cursor * c, char const * word)
+{
+	size_t const n = strlen(word);
+	npy_skip_space(c);
+	if ((size_t)(c->end - c->p) < n || memcmp(c->p, word, n) != 0) return 0;
+	c->p += n;
+	return 1;
+}
+
+/* a quoted string, or NULL data */
+static struct view npy_string(struct npy_cursor * c)
+{
+	npy_skip_space(c);
+	if (c->p == c->end || (*c->p != '\'' && *c->p != '"')) return (struct view){ NULL, 0 };
+	char const quote = *c->p++;
+	char const * close = memchr(c->p, quote, c->end - c->p);
+	if (close == NULL) return (struct view){ NULL, 0 };
+	char const * start = c->p;
+	c->p = close + 1;
+	return (struct view){ (char *)start, close - start };
+}
+
+static int npy_integer(struct npy_cursor * c, size_t * value)
+{
+	npy_skip_space(c);
+	if (c->p == c->end || *c->p < '0' || *c->p > '9') return -1;
+	size_t n = 0;
+	for (; c->p < c->end && *c->p >= '0' && *c->p <= '9'; c->p++)
+		if (__builtin_mul_overflow(n, 10, &n) || __builtin_add_overflow(n, *c->p - '0', &n)) return -1;
+	/* Python 2 wrote longs */
+	if (c->p < c->end && *c->p == 'L') c->p++;
+	*value = n;
+	return 0;
+}
+
+static int npy_shape(struct npy_cursor * c, struct npy_header * header)
+{
+	if (!npy_accept(c, '(')) return EINVAL;
+	header->ndim = 0;
+	while (!npy_accept(c, ')')) {
+		if (header->ndim == NPY_MAX_NDIM) return ENOTSUP;
+		if (npy_integer(c, &header->shape[header->ndim++])) return EINVAL;
+		if (!npy_accept(c, ',') && !(c->p < c->end && *c->p == ')')) return EINVAL;
+	}
+	return 0;
+}
+
+static int npy_set_strides(struct npy_header * header)
+{
+	size_t stride = header->dtype.size;
+	for (size_t i = 0; i < header->ndim; i++) {
+		size_t const d = header->fortran_order ? i : header->ndim - 1 - i;
+		header->strides[d] = stride;
+		if (__builtin_mul_overflow(stride, header->shape[d], &stride) || stride > SSIZE_MAX) return EINVAL;
+	}
+	header->data_size = stride;
+	return 0;
+}
+
+static int npy_parse_dict(struct npy_cursor * c, struct npy_header * header)
+{
+	int seen = 0;
+	if (!npy_accept(c, '{')) return EINVAL;
+	while (!npy_accept(c, '}')) {
+		struct view const key = npy_string(c);
+		if (key.data == NULL || !npy_accept(c, ':')) return EINVAL;
+		if (view_equals(key, view_str("descr"))) {
+			struct view const descr = npy_string(c);
+			/* structured dtypes are lists */
+			if (descr.data == NULL) return npy_accept(c, '[') ? ENOTSUP : EINVAL;
+			header->dtype = dtype_parse(descr);
+			if (!dtype_is_valid(header->dtype)) return ENOTSUP;
+			seen |= 1;
+		}
+		else if (view_equals(key, view_str("fortran_order"))) {
+			if (npy_accept_word(c, "True")) header->fortran_order = 1;
+			else if (npy_accept_word(c, "False")) header->fortran_order = 0;
+			else return EINVAL;
+			seen |= 2;
+		}
+		else if (view_equals(key, view_str("shape"))) {
+			int const r = npy_shape(c, header);
+			if (r) return r;
+			seen |= 4;
+		}
+		else return EINVAL;
+		if (!npy_accept(c, ',') && !(c->p < c->end && *c->p == '}')) return EINVAL;
+	}
+	return seen == 7 ? 0 : EINVAL;
+}
+
+/* the size of everything up to the header dict, from the magic string and the version */
+static size_t npy_prefix_size(unsigned char const * bytes)
+{
+	return bytes[6] == 1 ? NPY_MAGIC_SIZE + 4 : NPY_MAGIC_SIZE + 6;
+}
+
+/* 0 if input starts like a .npy file, as far as it goes */
+static int npy_check_magic(struct view input)
+{
+	size_t const n = input.size < NPY_MAGIC_SIZE ? input.size : NPY_MAGIC_SIZE;
+	if (memcmp(input.data, NPY_MAGIC, n)) return EINVAL;
+	if (input.size <= NPY_MAGIC_SIZE) return 0;
+	unsigned char const major = ((unsigned char const *)input.data)[NPY_MAGIC_SIZE];
+	return major < 1 || major > 3 ? ENOTSUP : 0;
+}
+
+static size_t npy_dict_size(unsigned char const * bytes)
+{
+	size_t size = bytes[8] | (size_t)bytes[9] << 8;
+	if (bytes[6] > 1) size |= (size_t)bytes[10] << 16 | (size_t)bytes[11] << 24;
+	return size;
+}
+
+int npy_parse_header(struct view input, struct npy_header * header)
+{
+	int r = npy_check_magic(input);
+	if (r) return errno = r;
+	if (input.size < NPY_MAGIC_SIZE + 4 || input.size < npy_prefix_size(input.data)) return errno = ENODATA;
+	size_t const prefix = npy_prefix_size(input.data), size = npy_dict_size(input.data);
+	if (input.size - prefix < size) return errno = ENODATA;
+
+	struct npy_cursor c = { (char *)input.data + prefix, (char *)input.data + prefix + size };
+	*header = (struct npy_header){ .header_size = prefix + size };
+	r = npy_parse_dict(&c, header);
+	if (r == 0) r = npy_set_strides(header);
+	return errno = r;
+}
+
+/* size more bytes onto buf: 0, ENODATA at EOF, or errno */
+static int npy_read_more(int fd, size_t size, struct buf * buf)
+{
+	kvnl_some more = kvnl_read_some(fd, size, "", buf, NULL);
+	if (more.error == NULL) return 0;
+	return strcmp(more.error, "EOF") == 0 ? ENODATA : errno;
+}
+
+int npy_read_header(int fd, struct npy_header * header, struct buf * buf)
+{
+	if (buf_clear(buf)) return errno;
+	int r = npy_read_more(fd, NPY_MAGIC_SIZE + 4, buf);
+	if (r == 0 && (r = npy_check_magic(buf_view(buf))) == 0) {
+		r = npy_read_more(fd, npy_prefix_size(buf->data) - buf->size, buf);
+		if (r == 0) r = npy_read_more(fd, npy_dict_size(buf->data), buf);
+	}
+	if (r) return errno = r;
+	return npy_parse_header(buf_view(buf), header);
+}
+
+struct ndview npy_ndview(struct npy_header * header, void * data)
+{
+	/* NULL data only describes the array, which make_ndview() doesn't allow */
+	return (struct ndview){ data, header->ndim, header->shape, header->strides };
+}
+
+/* dense in the given order, where dimensions of one element don't count */
+static int npy_is_dense(struct ndview const * view, size_t item_size, int fortran_order)
+{
+	if (ndview_size(view) == 0) return 1;
+	ssize_t stride = item_size;
+	for (size_t i = 0; i < view->ndim; i++) {
+		size_t const d = fortran_order ? i : view->ndim - 1 - i;
+		if (view->shape[d] == 1) continue;
+		if (view->strides[d] != stride) return 0;
+		stride *= view->shape[d];
+	}
+	return 1;
+}
+
+int npy_make_header(struct npy_header * header, struct ndview const * view, struct dtype dtype)
+{
+	if (!dtype_is_valid(dtype) || view->ndim > NPY_MAX_NDIM) return errno = EINVAL;
+	*header = (struct npy_header){
+		.dtype = dtype,
+		.fortran_order = !npy_is_dense(view, dtype.size, 0) && npy_is_dense(view, dtype.size, 1),
+		.ndim = view->ndim,
+	};
+	memcpy(header->shape, view->shape, view->ndim * sizeof(*view->shape));
+	return errno = npy_set_strides(header);
+}
+
+int npy_format_header(struct buf * buf, struct npy_header * header)
+{
+	char descr[32], dict[128 + NPY_MAX_NDIM * 24];
+	dtype_snprint(header->dtype, descr, sizeof(descr));
+	size_t n = snprintf(
+		dict, sizeof(dict), "{'descr': '%s', 'fortran_order': %s, 'shape': (",
+		descr, header->fortran_order ? "True" : "False"
+	);
+	for (size_t i = 0; i < header->ndim; i++)
+		n += snprintf(dict + n, sizeof(dict) - n, i ? " %zu," : "%zu,", header->shape[i]);
+	/* only 1-tuples keep the trailing comma */
+	if (header->ndim > 1) n--;
+	n += snprintf(dict + n, sizeof(dict) - n, "), }");
+
+	/* padded with spaces and a newline up to the alignment of the data */
+	size_t const prefix = NPY_MAGIC_SIZE + 4;
+	size_t const padding = NPY_ALIGN - 1 - (prefix + n) % NPY_ALIGN;
+	size_t const size = n + padding + 1;
+	unsigned char const version[] = { 1, 0, size & 0xff, size >> 8 };
+	if (buf_reserve(buf, prefix + size)) return errno;
+	buf_push(buf, (struct view){ NPY_MAGIC, NPY_MAGIC_SIZE });
+	buf_push(buf, (struct view){ (char *)version, sizeof(version) });
+	buf_push(buf, (struct view){ dict, n });
+	memset((char *)buf->data + buf->size, ' ', padding);
+	buf->size += padding;
+	buf_push_byte(buf, '\n');
+	header->header_size = prefix + size;
+	return errno = 0;
+}
+
+ssize_t npy_write_ndview(int fd, struct ndview const * view, struct dtype dtype, struct buf * buf)
+{
+	struct npy_header header;
+	if (npy_make_header(&header, view, dtype) || buf_clear(buf) || npy_format_header(buf, &header)) return -1;
+	ssize_t r, total = 0;
+	r = kvnl_write_some(fd, buf_view(buf), NULL);
+	if (r < 0) return r; else total += r;
+	if (header.data_size == 0) return total;
+
+	if (npy_is_dense(view, dtype.size, header.fortran_order)) {
+		r = kvnl_write_some(fd, ndview_memory(view, dtype.size), NULL);
+		return r < 0 ? r : total + r;
+	}
+
+	/* anything else goes out in C order, a few rows at a time */
+	size_t const row_size = header.data_size / view->shape[0];
+	size_t const rows = row_size < NPY_CHUNK ? NPY_CHUNK / row_size : 1;
+	size_t shape[NPY_MAX_NDIM];
+	ssize_t strides[NPY_MAX_NDIM];
+	memcpy(shape, view->shape, view->ndim * sizeof(*shape));
+	for (size_t i = 0; i < view->shape[0]; i += rows) {
+		shape[0] = view->shape[0] - i < rows ? view->shape[0] - i : rows;
+		if (buf_resize(buf, shape[0] * row_size)) return -1;
+		struct ndview src = make_ndview((char *)view->data + i * view->strides[0], view->ndim, shape, view->strides);
+		struct ndview dst = make_ndview(buf->data, view->ndim, shape, strides);
+		ndview_set_strides_row_major(&dst, dtype.size);
+		if (ndview_copy(&dst, &src, dtype.size)) return -1;
+		r = kvnl_write_some(fd, buf_view(buf), NULL);
+		if (r < 0) return r; else total += r;
+	}
+	return total;
+}
+
+int npy_map(struct npy_map * map, int fd, int writable)
+{
+	struct stat st;
+	if (fstat(fd, &st)) return errno;
+	if (st.st_size == 0) return errno = ENODATA;
+	void * data = mmap(
+		NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+		writable ? MAP_SHARED : MAP_PRIVATE, fd, 0
+	);
+	if (data == MAP_FAILED) return errno;
+
+	int r = npy_parse_header((struct view){ data, st.st_size }, &map->header);
+	if (r == 0 && (size_t)st.st_size - map->header.header_size < map->header.data_size) r = ENODATA;
+	if (r) {
+		munmap(data, st.st_size);
+		return errno = r;
+	}
+	map->data = data;
+	map->size = st.st_size;
+	map->view = npy_ndview(&map->header, (char *)data + map->header.header_size);
+	return errno = 0;
+}
+
+int npy_unmap(struct npy_map * map)
+{
+	if (map->data != NULL && munmap(map->data, map->size)) return errno;
+	map->data = NULL;
+	map->size = 0;
+	map->view = INVALID_NDVIEW;
+	return errno = 0;
+}
+
+
+static const char * npy_header_error(int error)
+{
+	switch (error) {
+	case ENODATA: return "EOF";
+	case EINVAL: return "malformed .npy header";
+	case ENOTSUP: return "unsupported .npy version or dtype";
+	default: errno = error; return "reading the .npy header failed, consult errno";
+	}
+}
+
+static const char * npy_kvnl_error(ssize_t r)
+{
+	return r == -1 ? "write() failed, consult errno" : kvnl_look_up_error(r);
+}
+
+/* the whole array at once, for writers with a codec or a checksum: mapped if it can be */
+static const char * npy_to_kvnl_whole(
+	int npy_fd, int kvnl_fd, struct kvnl_ndview_writer * writer, struct npy_header * header, kvnl_hash * hash, struct buf * buf
+)
+{
+	struct ndview view = npy_ndview(header, NULL);
+	struct stat st;
+	off_t const offset = lseek(npy_fd, 0, SEEK_CUR);
+	if (header->data_size && offset >= 0 && fstat(npy_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		if (st.st_size - offset < (off_t)header->data_size) return "EOF";
+		off_t const base = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+		size_t const size = offset - base + header->data_size;
+		char * data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, npy_fd, base);
+		if (data != MAP_FAILED) {
+			madvise(data, size, MADV_SEQUENTIAL);
+			view.data = data + (offset - base);
+			ssize_t const r = kvnl_write_typed_ndview(kvnl_fd, writer, &view, header->dtype, hash, buf);
+			munmap(data, size);
+			if (r < 0) return npy_kvnl_error(r);
+			if (lseek(npy_fd, offset + header->data_size, SEEK_SET) < 0) return "lseek() failed, consult errno";
+			return NULL;
+		}
+	}
+
+	if (buf_clear(buf)) return "buf_clear() failed, consult errno";
+	kvnl_some data = kvnl_read_some(npy_fd, header->data_size, "", buf, NULL);
+	if (data.error) return data.error;
+	view.data = buf->data;
+	struct buf fmt_buf = make_buf_grow_only(2.0f);
+	ssize_t const r = kvnl_write_typed_ndview(kvnl_fd, writer, &view, header->dtype, hash, &fmt_buf);
+	buf_free(&fmt_buf);
+	return r < 0 ? npy_kvnl_error(r) : NULL;
+}
+
+const char * npy_to_kvnl(int npy_fd, int kvnl_fd, struct kvnl_ndview_writer * writer, kvnl_hash * hash, struct buf * buf)
+{
+	struct npy_header header;
+	int const error = npy_read_header(npy_fd, &header, buf);
+	if (error) return npy_header_error(error);
+	if (!codec_is_identity(&writer->codec) || writer->checksum != HASH_NONE)
+		return npy_to_kvnl_whole(npy_fd, kvnl_fd, writer, &header, hash, buf);
+
+	/* the payload is the data as it is in the file, with the strides of its order */
+	struct ndview view = npy_ndview(&header, NULL);
+	ssize_t const r = kvnl_write_ndview_header(kvnl_fd, writer, &view, header.dtype, hash, buf);
+	if (r < 0) return npy_kvnl_error(r);
+	for (size_t done = 0; done < header.data_size; ) {
+		size_t const n = header.data_size - done < NPY_CHUNK ? header.data_size - done : NPY_CHUNK;
+		if (buf_clear(buf)) return "buf_clear() failed, consult errno";
+		kvnl_some piece = kvnl_read_some(npy_fd, n, "", buf, NULL);
+		if (piece.error) return piece.error;
+		if (kvnl_write_some(kvnl_fd, piece.view, hash) < 0) return "write() failed, consult errno";
+		done += n;
+	}
+	return kvnl_write_newline(kvnl_fd, hash) < 0 ? "write() failed, consult errno" : NULL;
+}
+
+/* the rest of a payload that can't be converted, so that the stream goes on at the next record */
+static const char * npy_skip_payload(int kvnl_fd, struct kvnl_ndview_reader * reader, kvnl_hash * hash, struct buf * buf, const char * error)
+{
+	for (;;) {
+		if (buf_clear(buf)) return "buf_clear() failed, consult errno";
+		kvnl_some piece = kvnl_read_ndview_piece(kvnl_fd, reader, NPY_CHUNK, buf, hash);
+		if (piece.error) return piece.error;
+		if (piece.view.size == 0) return error;
+	}
+}
+
+const char * kvnl_to_npy(int kvnl_fd, int npy_fd, struct kvnl_ndview_reader * reader, kvnl_hash * hash, struct buf * buf)
+{
+	kvnl_specification spec = kvnl_read_ndview_header(kvnl_fd, reader, hash);
+	if (spec.error) return spec.error;
+	struct ndview view = { NULL, reader->ndim, reader->shape, reader->strides };
+	struct npy_header header;
+	if (!dtype_is_valid(reader->type) || npy_make_header(&header, &view, reader->type))
+		return npy_skip_payload(kvnl_fd, reader, hash, buf, "the array has no .npy dtype");
+
+	/* raw dense payloads are already laid out like the data of the .npy file */
+	if (
+		codec_is_identity(&reader->codec) && (size_t)spec.size == header.data_size &&
+		npy_is_dense(&view, header.dtype.size, header.fortran_order)
+	) {
+		if (buf_clear(buf) || npy_format_header(buf, &header)) return "formatting the .npy header failed, consult errno";
+		if (kvnl_write_some(npy_fd, buf_view(buf), NULL) < 0) return "write() failed, consult errno";
+		for (;;) {
+			if (buf_clear(buf)) return "buf_clear() failed, consult errno";
+			kvnl_some piece = kvnl_read_ndview_piece(kvnl_fd, reader, NPY_CHUNK, buf, hash);
+			if (piece.error) return piece.error;
+			if (piece.view.size == 0) return NULL;
+			if (kvnl_write_some(npy_fd, piece.view, NULL) < 0) return "write() failed, consult errno";
+		}
+	}
+
+	kvnl_ndview array = kvnl_read_ndview_data(kvnl_fd, reader, spec, buf, hash);
+	if (array.error) return array.error;
+	struct buf scratch = make_buf_grow_only(2.0f);
+	ssize_t const r = npy_write_ndview(npy_fd, &array.view, header.dtype, &scratch);
+	buf_free(&scratch);
+	return r < 0 ? "write() failed, consult errno" : NULL;
+}
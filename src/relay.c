@@ -0,0 +1,245 @@
+#define _GNU_SOURCE /* splice(), copy_file_range() */
+#include <relay.h>
+#include <instr.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+struct kvnl_relay make_kvnl_relay(int (*route)(void * ctx, kvnl_line const * line), void * ctx)
+{
+	return (struct kvnl_relay){
+		.route = route,
+		.ctx = ctx,
+		.inspect = KVNL_RELAY_INSPECT,
+		.verify = 0,
+		.buf = NULL_BUF,
+		.bounce = NULL_BUF,
+		.pipe = { -1, -1 },
+		.null_fd = -1,
+	};
+}
+
+static void relay_close_pipe(struct kvnl_relay * relay)
+{
+	if (relay->pipe[0] >= 0) close(relay->pipe[0]);
+	if (relay->pipe[1] >= 0) close(relay->pipe[1]);
+	relay->pipe[0] = relay->pipe[1] = -1;
+}
+
+int kvnl_relay_free(struct kvnl_relay * relay)
+{
+	if (!buf_is_null(&relay->buf)) buf_free(&relay->buf);
+	if (!buf_is_null(&relay->bounce)) buf_free(&relay->bounce);
+	relay_close_pipe(relay);
+	if (relay->null_fd >= 0) close(relay->null_fd);
+	relay->null_fd = -1;
+	return errno = 0;
+}
+
+/* the kernel can't move data between these descriptors this way, but another way may do */
+static int relay_unsupported(int error)
+{
+	return error == EINVAL || error == ENOSYS || error == EXDEV || error == EOPNOTSUPP || error == EBADF || error == ESPIPE;
+}
+
+static ssize_t move_copy_file_range(int in, int out, size_t size) { return copy_file_range(in, NULL, out, NULL, size, 0); }
+static ssize_t move_splice(int in, int out, size_t size) { return splice(in, NULL, out, NULL, size, SPLICE_F_MOVE); }
+static ssize_t move_sendfile(int in, int out, size_t size) { return sendfile(out, in, NULL, size); }
+
+/* up to size bytes with one kind of syscall; fewer at EOF (errno is 0 then) or on failure */
+static size_t relay_move(ssize_t (*move)(int, int, size_t), int in, int out, size_t size)
+{
+	size_t done = 0;
+	while (done < size) {
+		ssize_t n = move(in, out, size - done);
+		INSTR_ADD(INSTR_WRITE_CALLS, 1);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			if (n == 0) errno = 0;
+			break;
+		}
+		INSTR_ADD(INSTR_KERNEL_BYTES, n);
+		done += n;
+	}
+	return done;
+}
+
+/* through memory, for hashing or when the kernel won't; out < 0 only reads */
+static size_t relay_copy(struct kvnl_relay * relay, int in, int out, size_t size, kvnl_hash * hash)
+{
+	if (buf_resize(&relay->bounce, KVNL_RELAY_CHUNK)) return 0;
+	size_t done = 0;
+	while (done < size) {
+		size_t const want = size - done < KVNL_RELAY_CHUNK ? size - done : KVNL_RELAY_CHUNK;
+		ssize_t n = read(in, relay->bounce.data, want);
+		INSTR_ADD(INSTR_READ_CALLS, 1);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			if (n == 0) errno = 0;
+			break;
+		}
+		INSTR_ADD(INSTR_READ_BYTES, n);
+		struct view piece = { relay->bounce.data, n };
+		if (hash != NULL) hash->update(hash->ctx, piece);
+		if (out >= 0 && kvnl_write_some(out, piece, NULL) < 0) break;
+		done += n;
+	}
+	return done;
+}
+
+/* splice() needs a pipe on one end, so two other descriptors get one in between */
+static size_t relay_splice_through(struct kvnl_relay * relay, int in, int out, size_t size)
+{
+	if (relay->pipe[0] < 0 && pipe2(relay->pipe, O_CLOEXEC)) return 0;
+	size_t done = 0;
+	while (done < size) {
+		size_t const want = size - done < KVNL_RELAY_CHUNK ? size - done : KVNL_RELAY_CHUNK;
+		size_t const n = relay_move(move_splice, in, relay->pipe[1], want);
+		int const error = errno;
+		size_t m = relay_move(move_splice, relay->pipe[0], out, n);
+		if (m < n) m += relay_copy(relay, relay->pipe[0], out, n - m, NULL);
+		if (m < n) {
+			/* what's left in the pipe is lost */
+			relay_close_pipe(relay);
+			errno = errno ? errno : EIO;
+			return done + m;
+		}
+		done += n;
+		if (n < want) {
+			errno = error;
+			break;
+		}
+	}
+	return done;
+}
+
+/* size bytes from in to out, fewer at EOF, -1 on failure */
+static ssize_t relay_forward(struct kvnl_relay * relay, int in, int out, size_t size, kvnl_hash * hash)
+{
+	size_t done = 0;
+	struct stat in_st, out_st;
+	errno = EINVAL; /* anything the kernel skips goes through memory */
+	if (hash == NULL && fstat(in, &in_st) == 0 && fstat(out, &out_st) == 0) {
+		int const in_file = S_ISREG(in_st.st_mode), out_file = S_ISREG(out_st.st_mode);
+		int const pipes = S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode);
+		if (in_file && out_file)
+			done += relay_move(move_copy_file_range, in, out, size);
+		if (done < size && relay_unsupported(errno)) {
+			if (pipes) done += relay_move(move_splice, in, out, size - done);
+			else if (in_file) done += relay_move(move_sendfile, in, out, size - done);
+			else done += relay_splice_through(relay, in, out, size - done);
+		}
+	}
+	if (done < size && relay_unsupported(errno))
+		done += relay_copy(relay, in, out, size - done, hash);
+	return done < size && errno ? -1 : (ssize_t)done;
+}
+
+/* dropped values are seeked over, or thrown into /dev/null */
+static ssize_t relay_skip(struct kvnl_relay * relay, int in, size_t size, kvnl_hash * hash)
+{
+	struct stat st;
+	off_t offset;
+	if (hash == NULL && fstat(in, &st) == 0 && S_ISREG(st.st_mode) && (offset = lseek(in, 0, SEEK_CUR)) >= 0) {
+		INSTR_ADD(INSTR_SEEK_CALLS, 1);
+		size_t const left = offset < st.st_size ? st.st_size - offset : 0;
+		size_t const n = size < left ? size : left;
+		if (lseek(in, n, SEEK_CUR) < 0) return -1;
+		INSTR_ADD(INSTR_SEEK_CALLS, 1);
+		return n;
+	}
+	if (hash == NULL && relay->null_fd < 0) relay->null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (hash == NULL && relay->null_fd >= 0) return relay_forward(relay, in, relay->null_fd, size, NULL);
+	size_t const done = relay_copy(relay, in, -1, size, hash);
+	return done < size && errno ? -1 : (ssize_t)done;
+}
+
+static kvnl_line relay_error(struct buf const * buf, ptrdiff_t key_offset, kvnl_specification spec, const char * error)
+{
+	return (kvnl_line){ .key = { (char *)buf->data + key_offset, spec.key.size }, .size = spec.size, .error = error };
+}
+
+/* the rest of a record after its specification; check is the checksum to verify it against, if any */
+static kvnl_line relay_record(int fd, struct kvnl_relay * relay, kvnl_specification spec, kvnl_hash * hash, struct kvnl_check const * check)
+{
+	struct buf * const buf = &relay->buf;
+
+	/* small values come along, and go out in one write with the rest of the record */
+	if (spec.size < 0 || (size_t)spec.size <= relay->inspect) {
+		kvnl_line line = kvnl_read_value(fd, spec, buf, hash);
+		if (line.error) return line;
+		const char * error = check != NULL ? kvnl_check_finish(check) : NULL;
+		if (error)
+			return (kvnl_line){ .key = line.key, .size = line.size, .value = line.value, .error = error };
+		int const out = relay->route ? relay->route(relay->ctx, &line) : KVNL_RELAY_DROP;
+		if (out >= 0) {
+			if (kvnl_write_some(out, buf_view(buf), NULL) < 0)
+				return (kvnl_line){ .key = line.key, .size = line.size, .value = line.value, .error = "write() failed, consult errno" };
+			INSTR_ADD(INSTR_RECORDS_WRITTEN, 1);
+		}
+		return line;
+	}
+
+	/* large ones go from descriptor to descriptor */
+	ptrdiff_t const key_offset = (char *)spec.key.data - (char *)buf->data;
+	int const out = relay->route ? relay->route(relay->ctx, &(kvnl_line){ .key = spec.key, .size = spec.size }) : KVNL_RELAY_DROP;
+	if (out >= 0 && kvnl_write_some(out, buf_view(buf), NULL) < 0)
+		return relay_error(buf, key_offset, spec, "write() failed, consult errno");
+	ssize_t const moved = out >= 0
+		? relay_forward(relay, fd, out, spec.size, hash)
+		: relay_skip(relay, fd, spec.size, hash);
+	if (moved < 0)
+		return relay_error(buf, key_offset, spec, "relaying the value failed, consult errno");
+	if (moved < spec.size)
+		return relay_error(buf, key_offset, spec, "EOF");
+	INSTR_ADD(INSTR_RECORDS_READ, 1);
+
+	kvnl_some trail = kvnl_read_some(fd, -1, "\n", buf, hash);
+	if (trail.error)
+		return relay_error(buf, key_offset, spec, trail.error);
+	if (trail.view.size != 1)
+		return relay_error(buf, key_offset, spec, "expected only a trailing newline");
+	if (out >= 0) {
+		if (kvnl_write_some(out, (struct view){ "\n", 1 }, NULL) < 0)
+			return relay_error(buf, key_offset, spec, "write() failed, consult errno");
+		INSTR_ADD(INSTR_RECORDS_WRITTEN, 1);
+	}
+	const char * error = check != NULL ? kvnl_check_finish(check) : NULL;
+	if (error)
+		return relay_error(buf, key_offset, spec, error);
+	return (kvnl_line){ .key = { (char *)buf->data + key_offset, spec.key.size }, .size = spec.size };
+}
+
+kvnl_line kvnl_relay_line(int fd, struct kvnl_relay * relay, kvnl_hash * hash)
+{
+	struct buf * const buf = &relay->buf;
+	if (buf_clear(buf))
+		return (kvnl_line){ .error = "buf_clear() failed, consult errno" };
+	kvnl_specification spec = kvnl_read_specification(fd, buf, hash);
+	if (spec.error)
+		return (kvnl_line){ .key = spec.key, .error = spec.error };
+	if (spec.size >= 0 || !view_equals(spec.key, view_str(KVNL_CHECKSUM_KEY)))
+		return relay_record(fd, relay, spec, hash, NULL);
+
+	/* a checksum record goes wherever the record it covers goes, and is verified on the way if asked to */
+	kvnl_line checksum = kvnl_read_value(fd, spec, buf, hash);
+	if (checksum.error) return checksum;
+	if (!relay->verify) {
+		kvnl_specification covered = kvnl_read_specification(fd, buf, hash);
+		if (covered.error)
+			return (kvnl_line){ .key = covered.key, .error = covered.error };
+		return relay_record(fd, relay, covered, hash, NULL);
+	}
+
+	struct kvnl_check check;
+	const char * error = kvnl_check_start(&check, checksum.value, hash);
+	if (error)
+		return (kvnl_line){ .key = checksum.key, .size = -1, .value = checksum.value, .error = error };
+	kvnl_specification covered = kvnl_read_specification(fd, buf, &check.hash);
+	if (covered.error)
+		return (kvnl_line){ .key = covered.key, .error = covered.error };
+	return relay_record(fd, relay, covered, &check.hash, &check);
+}
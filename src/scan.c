@@ -0,0 +1,233 @@
+#include <scan.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct scan_chunk {
+	void * state;
+	off_t from, to;
+	off_t first, end; /* where its records start (-1 without a guess) and end */
+	size_t n_records;
+	const char * error;
+	int done;
+};
+
+struct scan_job {
+	struct kvnl_scanner const * scanner;
+	char * data;
+	size_t size, chunk_size, n_chunks, window;
+	struct scan_chunk * chunks; /* chunk i is in slot i % window */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t next, merged;
+	int merging;
+	atomic_int stop;
+	/* the merged records so far */
+	size_t n_records;
+	off_t end;
+	const char * error;
+};
+
+static void scan_stop(struct scan_job * job, const char * error)
+{
+	pthread_mutex_lock(&job->lock);
+	if (job->error == NULL) job->error = error;
+	atomic_store(&job->stop, 1);
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+}
+
+/* delivers the records starting in [offset, chunk->to), up to the first malformed one */
+static void scan_records(struct scan_job * job, struct scan_chunk * chunk, off_t offset)
+{
+	struct kvnl_scanner const * scanner = job->scanner;
+	while (offset < chunk->to && !atomic_load_explicit(&job->stop, memory_order_relaxed)) {
+		size_t consumed;
+		kvnl_line line = kvnl_parse_line((struct view){ job->data + offset, job->size - offset }, &consumed);
+		if (line.error) {
+			chunk->error = strcmp(line.error, "EOF") ? line.error : "record cut short by the end of the file";
+			break;
+		}
+		/* records of a chunk that guessed wrong aren't real, so failing on one only counts once it is merged */
+		if (scanner->record && scanner->record(chunk->state, &line, offset)) {
+			chunk->error = "record callback failed";
+			break;
+		}
+		chunk->n_records++;
+		offset += consumed;
+	}
+	chunk->end = offset;
+}
+
+static int scan_probe(struct scan_job const * job, off_t offset)
+{
+	for (int i = 0; i < KVNL_SCAN_PROBE && (size_t)offset < job->size; i++) {
+		size_t consumed;
+		if (kvnl_parse_line((struct view){ job->data + offset, job->size - offset }, &consumed).error) return 0;
+		offset += consumed;
+	}
+	return 1;
+}
+
+/* the first line start in [from, to) that records can be parsed from */
+static off_t scan_guess(struct scan_job const * job, off_t from, off_t to)
+{
+	for (off_t offset = from; offset < to; offset++) {
+		if (job->data[offset - 1] != '\n') {
+			char * newline = memchr(job->data + offset, '\n', to - offset);
+			if (newline == NULL) break;
+			offset = newline + 1 - job->data;
+			if (offset >= to) break;
+		}
+		if (scan_probe(job, offset)) return offset;
+	}
+	return -1;
+}
+
+static void scan_chunk(struct scan_job * job, struct scan_chunk * chunk)
+{
+	/* ask for the whole chunk up front, page faults alone read ahead too little */
+	size_t const page = sysconf(_SC_PAGESIZE);
+	size_t const start = chunk->from / page * page;
+	madvise(job->data + start, chunk->to - start, MADV_WILLNEED);
+
+	chunk->first = chunk->from == 0 ? 0 : scan_guess(job, chunk->from, chunk->to);
+	if (chunk->first < 0) chunk->end = -1;
+	else scan_records(job, chunk, chunk->first);
+}
+
+/* a chunk has the right records if it starts where the merged ones end, otherwise it's parsed again */
+static int scan_merge(struct scan_job * job, struct scan_chunk * chunk)
+{
+	struct kvnl_scanner const * scanner = job->scanner;
+	if (chunk->first != job->end) {
+		if (chunk->n_records && scanner->reset) scanner->reset(chunk->state);
+		chunk->n_records = 0;
+		chunk->error = NULL;
+		chunk->first = job->end;
+		if (job->end < chunk->to) scan_records(job, chunk, job->end);
+		else chunk->end = job->end;
+		if (atomic_load(&job->stop)) return -1;
+	}
+
+	job->n_records += chunk->n_records;
+	job->end = chunk->end;
+	void * const state = chunk->state;
+	chunk->state = NULL;
+	if (scanner->merge && scanner->merge(scanner->ctx, state)) {
+		scan_stop(job, "merge callback failed");
+		return -1;
+	}
+	if (chunk->error) {
+		scan_stop(job, chunk->error);
+		return -1;
+	}
+	return 0;
+}
+
+/* called with the lock held, by whichever thread finds the next chunk to merge done */
+static void scan_merge_ready(struct scan_job * job)
+{
+	while (!job->merging && !atomic_load(&job->stop) && job->merged < job->n_chunks) {
+		struct scan_chunk * chunk = &job->chunks[job->merged % job->window];
+		if (!chunk->done) break;
+		job->merging = 1;
+		pthread_mutex_unlock(&job->lock);
+		int r = scan_merge(job, chunk);
+		pthread_mutex_lock(&job->lock);
+		job->merging = 0;
+		if (r) break;
+		chunk->done = 0;
+		job->merged++;
+		pthread_cond_broadcast(&job->cond);
+	}
+}
+
+static void * scan_run(void * arg)
+{
+	struct scan_job * job = arg;
+	struct kvnl_scanner const * scanner = job->scanner;
+	pthread_mutex_lock(&job->lock);
+	for (;;) {
+		while (!atomic_load(&job->stop) && job->next < job->n_chunks && job->next >= job->merged + job->window)
+			pthread_cond_wait(&job->cond, &job->lock);
+		if (atomic_load(&job->stop) || job->next >= job->n_chunks) break;
+		size_t const i = job->next++;
+		struct scan_chunk * chunk = &job->chunks[i % job->window];
+		pthread_mutex_unlock(&job->lock);
+
+		/* everything but done, which the merging thread reads under the lock */
+		off_t const from = i * job->chunk_size;
+		chunk->state = NULL;
+		chunk->from = from;
+		chunk->to = job->size - from < job->chunk_size ? (off_t)job->size : from + (off_t)job->chunk_size;
+		chunk->first = chunk->end = 0;
+		chunk->n_records = 0;
+		chunk->error = NULL;
+		if (scanner->begin && (chunk->state = scanner->begin(scanner->ctx, i)) == NULL)
+			scan_stop(job, "begin callback failed");
+		else
+			scan_chunk(job, chunk);
+
+		pthread_mutex_lock(&job->lock);
+		chunk->done = 1;
+		scan_merge_ready(job);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+kvnl_scan_result kvnl_scan(int fd, struct kvnl_scanner const * scanner)
+{
+	struct stat st;
+	if (fstat(fd, &st))
+		return (kvnl_scan_result){ .error = "fstat() failed, consult errno" };
+	if (!S_ISREG(st.st_mode))
+		return (kvnl_scan_result){ .error = "not a regular file" };
+	if (st.st_size == 0)
+		return (kvnl_scan_result){ 0 };
+
+	char * data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return (kvnl_scan_result){ .error = "mmap() failed, consult errno" };
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	struct scan_job job = {
+		.scanner = scanner,
+		.data = data,
+		.size = st.st_size,
+		.chunk_size = scanner->chunk_size ? scanner->chunk_size : KVNL_SCAN_CHUNK_SIZE,
+	};
+	job.n_chunks = (job.size + job.chunk_size - 1) / job.chunk_size;
+	size_t n_threads = scanner->n_threads ? scanner->n_threads : 1;
+	if (n_threads > job.n_chunks) n_threads = job.n_chunks;
+	job.window = 2 * n_threads;
+	job.chunks = calloc(job.window, sizeof(*job.chunks));
+	if (job.chunks == NULL) {
+		munmap(data, job.size);
+		return (kvnl_scan_result){ .error = "calloc() failed, consult errno" };
+	}
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+
+	pthread_t threads[n_threads];
+	size_t started = 0;
+	for (; started + 1 < n_threads; started++)
+		if (pthread_create(&threads[started], NULL, scan_run, &job)) break;
+	scan_run(&job);
+	for (size_t t = 0; t < started; t++) pthread_join(threads[t], NULL);
+
+	for (size_t i = job.merged; i < job.next; i++) {
+		struct scan_chunk * chunk = &job.chunks[i % job.window];
+		if (chunk->state != NULL && scanner->discard) scanner->discard(scanner->ctx, chunk->state);
+	}
+
+	pthread_cond_destroy(&job.cond);
+	pthread_mutex_destroy(&job.lock);
+	free(job.chunks);
+	munmap(data, job.size);
+	return (kvnl_scan_result){ job.n_records, job.end, job.error };
+}
@@ -0,0 +1,286 @@
+#include <tile.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int tile_make_layout(struct tile_layout * layout, size_t ndim, size_t const * shape, size_t const * tile, size_t item_size, int morton)
+{
+	if (ndim == 0 || ndim > TILE_MAX_NDIM || item_size == 0) return errno = EINVAL;
+	struct tile_layout l = { .ndim = ndim, .item_size = item_size, .morton = morton != 0 };
+	size_t tile_size = item_size, size;
+	for (size_t d = 0; d < ndim; d++) {
+		if (tile[d] == 0 || (morton && (tile[d] & (tile[d] - 1)))) return errno = EINVAL;
+		if (__builtin_mul_overflow(tile_size, tile[d], &tile_size)) return errno = EINVAL;
+		l.shape[d] = shape[d];
+		l.tile[d] = tile[d];
+		l.grid[d] = shape[d] / tile[d] + (shape[d] % tile[d] != 0);
+	}
+	l.tile_size = size = tile_size;
+	for (size_t d = 0; d < ndim; d++)
+		if (__builtin_mul_overflow(size, l.grid[d], &size)) return errno = EINVAL;
+	if (size > SSIZE_MAX) return errno = EINVAL;
+	*layout = l;
+	return errno = 0;
+}
+
+int tile_default_shape(size_t ndim, size_t item_size, size_t * tile)
+{
+	if (ndim == 0 || ndim > TILE_MAX_NDIM || item_size == 0) return errno = EINVAL;
+	size_t edge = 1;
+	for (;;) {
+		size_t size = item_size;
+		for (size_t d = 0; d < ndim; d++) size *= edge * 2;
+		if (size > TILE_BYTES) break;
+		edge *= 2;
+	}
+	for (size_t d = 0; d < ndim; d++) tile[d] = edge;
+	return errno = 0;
+}
+
+size_t tile_count(struct tile_layout const * layout)
+{
+	size_t count = 1;
+	for (size_t d = 0; d < layout->ndim; d++) count *= layout->grid[d];
+	return count;
+}
+
+size_t tile_layout_size(struct tile_layout const * layout)
+{
+	return tile_count(layout) * layout->tile_size;
+}
+
+/* the bits of the Morton index of an element of a tile that come from its index coord along dimension d */
+static size_t tile_morton_bits(struct tile_layout const * layout, size_t d, size_t coord)
+{
+	size_t index = 0, bit = 0;
+	for (size_t level = 0; ; level++) {
+		int more = 0;
+		/* the last dimension takes the lowest bit, like x in a Z curve */
+		for (long e = layout->ndim - 1; e >= 0; e--) {
+			if (layout->tile[e] >> level <= 1) continue;
+			more = 1;
+			if ((size_t)e == d) index |= ((coord >> level) & 1) << bit;
+			bit++;
+		}
+		if (!more) return index;
+	}
+}
+
+size_t tile_offset(struct tile_layout const * layout, size_t const * index)
+{
+	size_t tile = 0, element = 0;
+	for (size_t d = 0; d < layout->ndim; d++) {
+		tile = tile * layout->grid[d] + index[d] / layout->tile[d];
+		size_t const within = index[d] % layout->tile[d];
+		element = layout->morton
+			? element | tile_morton_bits(layout, d, within)
+			: element * layout->tile[d] + within;
+	}
+	return tile * layout->tile_size + element * layout->item_size;
+}
+
+int tile_seek(struct tile_layout const * layout, void * tiled, size_t index, struct tile * tile)
+{
+	if (index >= tile_count(layout)) return errno = ERANGE;
+	tile->index = index;
+	ssize_t stride = layout->item_size;
+	for (long d = layout->ndim - 1, rest = index; d >= 0; d--) {
+		tile->origin[d] = rest % layout->grid[d] * layout->tile[d];
+		rest /= layout->grid[d];
+		size_t const left = layout->shape[d] - tile->origin[d];
+		tile->shape[d] = left < layout->tile[d] ? left : layout->tile[d];
+		tile->strides[d] = stride;
+		stride *= layout->tile[d];
+	}
+	tile->data = (char *)tiled + index * layout->tile_size;
+	tile->view = layout->morton
+		? INVALID_NDVIEW
+		: (struct ndview){ tile->data, layout->ndim, tile->shape, tile->strides };
+	return errno = 0;
+}
+
+/* the part of a strided array that a tile holds */
+static struct ndview tile_part(struct ndview const * array, struct tile * tile)
+{
+	char * data = array->data;
+	for (size_t d = 0; d < array->ndim; d++) data += (ssize_t)tile->origin[d] * array->strides[d];
+	return (struct ndview){ data, array->ndim, tile->shape, array->strides };
+}
+
+static inline void tile_copy_item(void * dst, void const * src, size_t size)
+{
+	/* constant sizes make single loads and stores */
+	switch (size) {
+	case 1: memcpy(dst, src, 1); break;
+	case 2: memcpy(dst, src, 2); break;
+	case 4: memcpy(dst, src, 4); break;
+	case 8: memcpy(dst, src, 8); break;
+	case 16: memcpy(dst, src, 16); break;
+	default: memcpy(dst, src, size);
+	}
+}
+
+/* between a tile in Morton order and its part of a strided array, as three dimensions with leading ones of size 1 */
+static void tile_copy_morton(
+	struct tile_layout const * layout, struct tile const * tile, struct ndview const * part,
+	size_t * const * bits, int pack
+)
+{
+	static size_t const none[1] = { 0 };
+	size_t shape[3] = { 1, 1, 1 };
+	ssize_t strides[3] = { 0, 0, 0 };
+	size_t const * b[3] = { none, none, none };
+	size_t const lead = 3 - layout->ndim, item_size = layout->item_size;
+	for (size_t d = 0; d < layout->ndim; d++) {
+		shape[lead + d] = part->shape[d];
+		strides[lead + d] = part->strides[d];
+		b[lead + d] = bits[d];
+	}
+	for (size_t i = 0; i < shape[0]; i++)
+		for (size_t j = 0; j < shape[1]; j++) {
+			char * row = (char *)part->data + i * strides[0] + j * strides[1];
+			size_t const base = b[0][i] | b[1][j];
+			for (size_t k = 0; k < shape[2]; k++) {
+				char * element = row + k * strides[2];
+				char * in_tile = (char *)tile->data + (base | b[2][k]) * item_size;
+				if (pack) tile_copy_item(in_tile, element, item_size);
+				else      tile_copy_item(element, in_tile, item_size);
+			}
+		}
+}
+
+static int tile_copy(struct tile_layout const * layout, void * tiled, struct ndview const * array, int pack)
+{
+	if (array->ndim != layout->ndim) return errno = EINVAL;
+	for (size_t d = 0; d < layout->ndim; d++)
+		if (array->shape[d] != layout->shape[d]) return errno = EINVAL;
+
+	/* the Morton bits of every index within a tile, looked up rather than worked out per element */
+	size_t * bits[TILE_MAX_NDIM] = { NULL }, * table = NULL;
+	if (layout->morton) {
+		size_t n = 0;
+		for (size_t d = 0; d < layout->ndim; d++) n += layout->tile[d];
+		table = malloc(n * sizeof(size_t));
+		if (table == NULL) return errno = ENOMEM;
+		for (size_t d = 0, at = 0; d < layout->ndim; at += layout->tile[d++]) {
+			bits[d] = table + at;
+			for (size_t c = 0; c < layout->tile[d]; c++) bits[d][c] = tile_morton_bits(layout, d, c);
+		}
+	}
+
+	for tile_iter(layout, tiled, tile) {
+		struct ndview const part = tile_part(array, &tile);
+		if (pack && memcmp(tile.shape, layout->tile, layout->ndim * sizeof(size_t)) != 0)
+			memset(tile.data, 0, layout->tile_size);
+		if (layout->morton) tile_copy_morton(layout, &tile, &part, bits, pack);
+		else if (pack)      ndview_copy(&tile.view, &part, layout->item_size);
+		else                ndview_copy(&part, &tile.view, layout->item_size);
+	}
+	free(table);
+	return errno = 0;
+}
+
+int tile_pack(struct tile_layout const * layout, void * tiled, struct ndview const * src)
+{
+	return tile_copy(layout, tiled, src, 1);
+}
+
+int tile_unpack(struct tile_layout const * layout, struct ndview const * dst, void const * tiled)
+{
+	return tile_copy(layout, (void *)tiled, dst, 0);
+}
+
+int tile_snprint_layout(struct tile_layout const * layout, char * str, size_t size)
+{
+	char text[16 + 2 * TILE_MAX_NDIM * 21];
+	int n = snprintf(text, sizeof(text), "tiled");
+	for (size_t d = 0; d < layout->ndim; d++) n += snprintf(text + n, sizeof(text) - n, " %zu", layout->shape[d]);
+	for (size_t d = 0; d < layout->ndim; d++) n += snprintf(text + n, sizeof(text) - n, " %zu", layout->tile[d]);
+	if (layout->morton) snprintf(text + n, sizeof(text) - n, " morton");
+	return snprintf(str, size, "%s", text);
+}
+
+int tile_parse_layout(struct tile_layout * layout, struct view text, size_t item_size)
+{
+	char copy[64 + 2 * TILE_MAX_NDIM * 21];
+	if (text.size >= sizeof(copy)) return errno = EINVAL;
+	memcpy(copy, text.data, text.size);
+	copy[text.size] = '\0';
+
+	char * p = copy;
+	if (strncmp(p, "tiled", 5) != 0) return errno = EINVAL;
+	p += 5;
+	size_t sizes[2 * TILE_MAX_NDIM], n = 0;
+	int morton = 0;
+	while (*p) {
+		if (*p == ' ') { p++; continue; }
+		if (morton) return errno = EINVAL;
+		if (strncmp(p, "morton", 6) == 0 && (p[6] == ' ' || p[6] == '\0')) {
+			morton = 1;
+			p += 6;
+			continue;
+		}
+		if (*p < '0' || *p > '9' || n == 2 * TILE_MAX_NDIM) return errno = EINVAL;
+		char * next;
+		errno = 0;
+		sizes[n++] = strtoul(p, &next, 10);
+		if (errno || (*next != ' ' && *next != '\0')) return errno = EINVAL;
+		p = next;
+	}
+	if (n == 0 || n % 2) return errno = EINVAL;
+	return tile_make_layout(layout, n / 2, sizes, sizes + n / 2, item_size, morton);
+}
+
+/* the tiled array as a plain one: the grid, then the tile (or its number of elements, in Morton order) */
+static size_t tile_record_shape(struct tile_layout const * layout, size_t * shape)
+{
+	size_t ndim = 0, elements = 1;
+	for (size_t d = 0; d < layout->ndim; d++) shape[ndim++] = layout->grid[d];
+	for (size_t d = 0; d < layout->ndim; d++) {
+		if (layout->morton) elements *= layout->tile[d];
+		else shape[ndim++] = layout->tile[d];
+	}
+	if (layout->morton) shape[ndim++] = elements;
+	return ndim;
+}
+
+ssize_t tile_write(int fd, struct kvnl_ndview_writer * writer, struct tile_layout const * layout, void const * tiled, struct dtype dtype, kvnl_hash * hash, struct buf * fmt_buf)
+{
+	if (dtype.size != layout->item_size) return -KVNL_ENCODING_FAILED;
+	char text[64 + 2 * TILE_MAX_NDIM * 21];
+	tile_snprint_layout(layout, text, sizeof(text));
+
+	size_t shape[2 * TILE_MAX_NDIM];
+	ssize_t strides[2 * TILE_MAX_NDIM];
+	struct ndview view = { (void *)tiled, tile_record_shape(layout, shape), shape, strides };
+	ndview_set_strides_row_major(&view, layout->item_size);
+
+	char const * const previous = writer->layout;
+	writer->layout = text;
+	ssize_t const r = kvnl_write_typed_ndview(fd, writer, &view, dtype, hash, fmt_buf);
+	writer->layout = previous;
+	return r;
+}
+
+const char * tile_read(int fd, struct kvnl_ndview_reader * reader, struct tile_layout * layout, struct buf * data, kvnl_hash * hash)
+{
+	kvnl_ndview result = kvnl_read_ndview(fd, reader, data, hash);
+	if (result.error) return result.error;
+	struct ndview const * view = &result.view;
+	if (reader->layout.size == 0) return "the array is not tiled";
+	/* the record is row-major, so its last stride is the element size */
+	if (view->ndim == 0 || view->strides[view->ndim - 1] <= 0) return "the array doesn't match its layout";
+	if (tile_parse_layout(layout, buf_view(&reader->layout), view->strides[view->ndim - 1]))
+		return "malformed or unknown layout";
+
+	size_t shape[2 * TILE_MAX_NDIM];
+	size_t const ndim = tile_record_shape(layout, shape);
+	if (
+		view->ndim != ndim || memcmp(view->shape, shape, ndim * sizeof(size_t)) != 0 ||
+		!ndview_is_dense_row_major(view) || view->data != data->data
+	)
+		return "the array doesn't match its layout";
+	return NULL;
+}
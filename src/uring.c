@@ -0,0 +1,435 @@
+#include <uring.h>
+#include <instr.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* the user_data of cancellations, which no slot has */
+#define URING_CANCEL UINT64_MAX
+
+static inline size_t min(size_t a, size_t b) { return a < b ? a : b; }
+static inline size_t max(size_t a, size_t b) { return a > b ? a : b; }
+
+struct kvnl_uring make_kvnl_uring(int fd, size_t depth, size_t block_size)
+{
+	return (struct kvnl_uring){
+		.fd = fd,
+		.depth = depth ? min(depth, KVNL_URING_MAX_DEPTH) : KVNL_URING_DEPTH,
+		.block_size = block_size ? block_size : KVNL_URING_BLOCK,
+		.mode = KVNL_URING_UNUSED,
+		.fallback = 0,
+		.fixed = 0,
+		.seekable = 0,
+		.error = 0,
+		.offset = -1,
+		.head = 0,
+		.tail = 0,
+		.used = 0,
+		.cancelling = 0,
+		.blocks = make_buf_aligned(4096),
+		.ring_fd = -1,
+	};
+}
+
+static void uring_unmap(struct kvnl_uring * uring)
+{
+	if (uring->sqes != NULL) munmap(uring->sqes, uring->sqes_size);
+	if (uring->cq_ring != NULL && uring->cq_ring != uring->sq_ring) munmap(uring->cq_ring, uring->cq_ring_size);
+	if (uring->sq_ring != NULL) munmap(uring->sq_ring, uring->sq_ring_size);
+	if (uring->ring_fd >= 0) close(uring->ring_fd);
+	uring->sqes = uring->cq_ring = uring->sq_ring = NULL;
+	uring->ring_fd = -1;
+}
+
+static void * uring_mmap(struct kvnl_uring * uring, size_t size, off_t offset)
+{
+	void * const ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, offset);
+	return ring == MAP_FAILED ? NULL : ring;
+}
+
+static int uring_map(struct kvnl_uring * uring)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	uring->ring_fd = syscall(__NR_io_uring_setup, uring->depth, &params);
+	if (uring->ring_fd < 0) return errno;
+	/* pipes and sockets are read and written at offset -1, the current position */
+	if (!uring->seekable && !(params.features & IORING_FEAT_RW_CUR_POS)) return errno = EINVAL;
+
+	uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	int const single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single) uring->sq_ring_size = uring->cq_ring_size = max(uring->sq_ring_size, uring->cq_ring_size);
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	if ((uring->sq_ring = uring_mmap(uring, uring->sq_ring_size, IORING_OFF_SQ_RING)) == NULL) return errno;
+	uring->cq_ring = single ? uring->sq_ring : uring_mmap(uring, uring->cq_ring_size, IORING_OFF_CQ_RING);
+	if (uring->cq_ring == NULL) return errno;
+	if ((uring->sqes = uring_mmap(uring, uring->sqes_size, IORING_OFF_SQES)) == NULL) return errno;
+
+	char * const sq = uring->sq_ring, * const cq = uring->cq_ring;
+	uring->sq_head = (unsigned *)(sq + params.sq_off.head);
+	uring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	uring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	uring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	uring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	uring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	uring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	uring->cqes = cq + params.cq_off.cqes;
+	return errno = 0;
+}
+
+/* the ring and the blocks, or a single block for plain read() and write() if there can't be a ring */
+static int uring_setup(struct kvnl_uring * uring, enum kvnl_uring_mode mode)
+{
+	struct stat st;
+	int const flags = fcntl(uring->fd, F_GETFL);
+	if (flags < 0 || fstat(uring->fd, &st)) return errno;
+	uring->offset = S_ISREG(st.st_mode) || S_ISBLK(st.st_mode) ? lseek(uring->fd, 0, SEEK_CUR) : -1;
+	uring->seekable = uring->offset >= 0 && !(mode == KVNL_URING_WRITING && (flags & O_APPEND));
+	if (!uring->seekable) uring->offset = -1;
+
+	size_t size;
+	if (__builtin_mul_overflow(uring->depth, uring->block_size, &size)) return errno = EINVAL;
+	if (uring_map(uring)) {
+		uring_unmap(uring);
+		uring->fallback = 1;
+		uring->seekable = 0;
+		uring->offset = -1;
+		size = uring->block_size;
+	}
+	if (buf_resize(&uring->blocks, size)) {
+		uring_unmap(uring);
+		return errno;
+	}
+	if (!uring->fallback) {
+		struct iovec const iov = { uring->blocks.data, size };
+		uring->fixed = syscall(__NR_io_uring_register, uring->ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+	}
+	uring->mode = mode;
+	return errno = 0;
+}
+
+static inline char * uring_block(struct kvnl_uring * uring, size_t index)
+{
+	return (char *)uring->blocks.data + index * uring->block_size;
+}
+
+/* queues the rest of the transfer of a slot, which the next io_uring_enter() submits */
+static void uring_prepare(struct kvnl_uring * uring, size_t index)
+{
+	struct kvnl_uring_slot * const slot = &uring->slots[index];
+	unsigned const tail = *uring->sq_tail, sq_index = tail & uring->sq_mask;
+	struct io_uring_sqe * const sqe = (struct io_uring_sqe *)uring->sqes + sq_index;
+	int const writing = uring->mode == KVNL_URING_WRITING;
+	char * const data = uring_block(uring, index) + slot->done;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = uring->fd;
+	sqe->off = slot->offset < 0 ? (uint64_t)-1 : (uint64_t)(slot->offset + slot->done);
+	sqe->user_data = index;
+	if (uring->fixed) {
+		sqe->opcode = writing ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr = (uintptr_t)data;
+		sqe->len = slot->size - slot->done;
+		sqe->buf_index = 0;
+	} else {
+		slot->iov = (struct iovec){ data, slot->size - slot->done };
+		sqe->opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (uintptr_t)&slot->iov;
+		sqe->len = 1;
+	}
+	uring->sq_array[sq_index] = sq_index;
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	slot->busy = 1;
+	slot->error = 0;
+}
+
+/* submits what's queued, and waits for a completion if asked to; interruptions count as done */
+static int uring_enter(struct kvnl_uring * uring, int wait)
+{
+	unsigned const queued = *uring->sq_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+	if (queued == 0 && !wait) return 0;
+	int const r = syscall(__NR_io_uring_enter, uring->ring_fd, queued, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	INSTR_ADD(uring->mode == KVNL_URING_WRITING ? INSTR_WRITE_CALLS : INSTR_READ_CALLS, 1);
+	return r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY ? errno : 0;
+}
+
+static void uring_complete(struct kvnl_uring * uring, size_t index, int res)
+{
+	struct kvnl_uring_slot * const slot = &uring->slots[index];
+	slot->busy = 0;
+	if ((res == -EINTR || res == -EAGAIN) && !uring->cancelling) {
+		uring_prepare(uring, index);
+		return;
+	}
+	if (uring->mode == KVNL_URING_READING) {
+		if (res < 0) slot->error = -res;
+		else slot->done = res;
+		if (res > 0) INSTR_ADD(INSTR_READ_BYTES, res);
+		return;
+	}
+	if (res > 0) INSTR_ADD(INSTR_WRITE_BYTES, res);
+	/* short writes go on from where they stopped */
+	if (res > 0 && slot->done + res < slot->size) {
+		slot->done += res;
+		uring_prepare(uring, index);
+		return;
+	}
+	if (res <= 0) {
+		slot->error = res < 0 ? -res : EIO;
+		if (!uring->error) uring->error = slot->error;
+	}
+	slot->size = slot->done = 0;
+}
+
+static void uring_reap(struct kvnl_uring * uring)
+{
+	unsigned head = *uring->cq_head;
+	unsigned const tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe const * const cqe = (struct io_uring_cqe *)uring->cqes + (head & uring->cq_mask);
+		if (cqe->user_data != URING_CANCEL) uring_complete(uring, cqe->user_data, cqe->res);
+	}
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int uring_wait(struct kvnl_uring * uring, struct kvnl_uring_slot const * slot)
+{
+	uring_reap(uring);
+	while (slot->busy) {
+		int const error = uring_enter(uring, 1);
+		if (error) return error;
+		uring_reap(uring);
+	}
+	return 0;
+}
+
+static int uring_wait_all(struct kvnl_uring * uring)
+{
+	for (size_t i = 0; i < uring->depth; i++) {
+		int const error = uring_wait(uring, &uring->slots[i]);
+		if (error) return error;
+	}
+	return 0;
+}
+
+/*
+ * cancels the reads in flight rather than waiting for them, as a pipe or a
+ * socket may never have anything more to say; reads that the kernel is already
+ * done with, or can't stop, complete as usual, and their data is dropped
+ */
+static int uring_cancel_reads(struct kvnl_uring * uring)
+{
+	int error = uring_enter(uring, 0);
+	uring_reap(uring);
+	uring->cancelling = 1;
+	for (;;) {
+		size_t busy = 0;
+		for (size_t i = 0; i < uring->depth; i++) {
+			if (!uring->slots[i].busy) continue;
+			unsigned const tail = *uring->sq_tail, sq_index = tail & uring->sq_mask;
+			struct io_uring_sqe * const sqe = (struct io_uring_sqe *)uring->sqes + sq_index;
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->addr = i;
+			sqe->user_data = URING_CANCEL;
+			uring->sq_array[sq_index] = sq_index;
+			__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+			busy++;
+		}
+		if (busy == 0 || error) break;
+		error = uring_enter(uring, 1);
+		uring_reap(uring);
+	}
+	uring->cancelling = 0;
+	return error;
+}
+
+int kvnl_uring_free(struct kvnl_uring * uring)
+{
+	if (uring->ring_fd >= 0) {
+		/* writes in flight still go out, but nobody is waiting for reads any more */
+		if (uring->mode == KVNL_URING_READING) uring_cancel_reads(uring);
+		else uring_wait_all(uring);
+		uring_unmap(uring);
+	}
+	if (uring->blocks.data != NULL) buf_free(&uring->blocks);
+	*uring = make_kvnl_uring(uring->fd, uring->depth, uring->block_size);
+	return errno = 0;
+}
+
+static int uring_use(struct kvnl_uring * uring, enum kvnl_uring_mode mode)
+{
+	if (uring->mode == KVNL_URING_UNUSED && uring_setup(uring, mode)) return errno;
+	return uring->mode == mode ? 0 : (errno = EINVAL);
+}
+
+/* blocks up to depth ahead of the reader, or the next one of a stream once the last one is read */
+static int uring_read_ahead(struct kvnl_uring * uring)
+{
+	while (uring->tail - uring->head < uring->depth && (uring->seekable || uring->tail == uring->head)) {
+		size_t const index = uring->tail % uring->depth;
+		struct kvnl_uring_slot * const slot = &uring->slots[index];
+		slot->offset = uring->offset;
+		slot->size = uring->block_size;
+		slot->done = 0;
+		uring_prepare(uring, index);
+		if (uring->seekable) uring->offset += uring->block_size;
+		uring->tail++;
+	}
+	return uring_enter(uring, 0);
+}
+
+/* forgets the read-ahead, so that reading starts over at offset */
+static void uring_drop_read_ahead(struct kvnl_uring * uring, off_t offset)
+{
+	uring_cancel_reads(uring);
+	uring->head = uring->tail;
+	uring->used = 0;
+	if (uring->seekable) uring->offset = offset;
+}
+
+ssize_t kvnl_uring_read(struct kvnl_uring * uring, void * dst, size_t size)
+{
+	if (uring_use(uring, KVNL_URING_READING)) return -1;
+	if (uring->fallback) {
+		ssize_t n_read;
+		do {
+			n_read = read(uring->fd, dst, size);
+			INSTR_ADD(INSTR_READ_CALLS, 1);
+		} while (n_read < 0 && errno == EINTR);
+		if (n_read > 0) INSTR_ADD(INSTR_READ_BYTES, n_read);
+		return n_read;
+	}
+
+	size_t total = 0;
+	int error = uring_read_ahead(uring), end = 0;
+	while (!error && !end && total < size && uring->head < uring->tail) {
+		struct kvnl_uring_slot * const slot = &uring->slots[uring->head % uring->depth];
+		/* what's in already goes out without waiting for more */
+		if (slot->busy) {
+			if (total) break;
+			error = uring_wait(uring, slot);
+			continue;
+		}
+		if (slot->error || slot->done == 0) {
+			error = slot->error;
+			end = 1;
+			uring_drop_read_ahead(uring, slot->offset);
+			break;
+		}
+		size_t const n = min(size - total, slot->done - uring->used);
+		memcpy((char *)dst + total, uring_block(uring, uring->head % uring->depth) + uring->used, n);
+		total += n;
+		uring->used += n;
+		if (uring->used == slot->done) {
+			uring->head++;
+			uring->used = 0;
+			if (slot->done < slot->size && uring->seekable) uring_drop_read_ahead(uring, slot->offset + slot->done);
+		}
+	}
+	/* a stream only gets a read when the caller waits for one, as the data may never come */
+	if (!error && !end && uring->seekable) error = uring_read_ahead(uring);
+	if (total) return total;
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/* sends the block being filled, and moves on to the next one */
+static int uring_send(struct kvnl_uring * uring)
+{
+	size_t const index = uring->tail % uring->depth;
+	struct kvnl_uring_slot * const slot = &uring->slots[index];
+	if (uring->fallback) {
+		for (slot->done = 0; slot->done < slot->size;) {
+			ssize_t const n = write(uring->fd, uring_block(uring, index) + slot->done, slot->size - slot->done);
+			INSTR_ADD(INSTR_WRITE_CALLS, 1);
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0) return errno;
+			INSTR_ADD(INSTR_WRITE_BYTES, n);
+			slot->done += n;
+		}
+		slot->size = slot->done = 0;
+		return 0;
+	}
+	/* streams take one block at a time, in order */
+	if (!uring->seekable) {
+		int const error = uring_wait_all(uring);
+		if (error) return error;
+	}
+	slot->offset = uring->offset;
+	slot->done = 0;
+	if (uring->seekable) uring->offset += slot->size;
+	uring_prepare(uring, index);
+	uring->tail++;
+	return uring_enter(uring, 0);
+}
+
+ssize_t kvnl_uring_write(struct kvnl_uring * uring, struct view view)
+{
+	if (uring_use(uring, KVNL_URING_WRITING)) return -1;
+	size_t written = 0;
+	while (written < view.size) {
+		struct kvnl_uring_slot * const slot = &uring->slots[uring->tail % uring->depth];
+		if (!uring->error && slot->busy) uring->error = uring_wait(uring, slot);
+		if (uring->error) {
+			errno = uring->error;
+			return -1;
+		}
+		size_t const n = min(view.size - written, uring->block_size - slot->size);
+		memcpy(uring_block(uring, uring->tail % uring->depth) + slot->size, (char *)view.data + written, n);
+		slot->size += n;
+		written += n;
+		if (slot->size == uring->block_size) uring->error = uring_send(uring);
+	}
+	return written;
+}
+
+ssize_t kvnl_uring_write_line(struct kvnl_uring * uring, char * key, struct view value, int sized, kvnl_hash * hash, struct buf * spec_buf)
+{
+	struct buf _buf = make_buf_grow_only(2.0f), * const buf = spec_buf != NULL ? spec_buf : &_buf;
+	if (sized < 0) sized = value.size > 1024 || view_contains(value, view_str("\n"));
+	ssize_t r = kvnl_encode_specification(key, sized ? (ssize_t)value.size : -1L, buf);
+	if (r >= 0 && (view_contains(buf_view(buf), view_str("=")) || view_contains(buf_view(buf), view_str("\n"))))
+		r = -KVNL_MALFORMED_SPECIFICATION;
+	if (r < 0) goto cleanup;
+
+	struct view const views[] = { buf_view(buf), { "=", 1 }, value, { "\n", 1 } };
+	r = 0;
+	for (int i = 0; i < 4 && r >= 0; i++) {
+		if (hash != NULL && views[i].size != 0) hash->update(hash->ctx, views[i]);
+		ssize_t const n = kvnl_uring_write(uring, views[i]);
+		r = n < 0 ? n : r + n;
+	}
+	if (r >= 0) {
+		INSTR_ADD(INSTR_RECORDS_WRITTEN, 1);
+		INSTR_ADD(INSTR_BYTES_WRITTEN, r);
+	}
+cleanup:
+	if (spec_buf == NULL && !buf_is_null(&_buf)) buf_free(&_buf);
+	return r;
+}
+
+int kvnl_uring_flush(struct kvnl_uring * uring)
+{
+	if (uring->mode == KVNL_URING_UNUSED) return errno = 0;
+	if (uring->mode != KVNL_URING_WRITING) return errno = EINVAL;
+	struct kvnl_uring_slot const * const slot = &uring->slots[uring->tail % uring->depth];
+	if (!uring->error && !slot->busy && slot->size) uring->error = uring_send(uring);
+	if (!uring->fallback) {
+		int const error = uring_wait_all(uring);
+		if (!uring->error) uring->error = error;
+	}
+	if (uring->error) return errno = uring->error;
+	if (uring->seekable && lseek(uring->fd, uring->offset, SEEK_SET) < 0) return errno;
+	return errno = 0;
+}
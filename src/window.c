@@ -0,0 +1,183 @@
+#define _GNU_SOURCE /* memfd_create() */
+#include <window.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static inline size_t min(size_t a, size_t b) { return a < b ? a : b; }
+static inline size_t max(size_t a, size_t b) { return a > b ? a : b; }
+
+struct kvnl_window make_kvnl_window(size_t size, size_t hop, size_t capacity)
+{
+	return (struct kvnl_window){
+		.size = size,
+		.hop = hop,
+		.capacity = capacity ? capacity : KVNL_WINDOW_ROWS,
+		.dtype = INVALID_DTYPE,
+		.ndim = 0,
+		.row_size = 0,
+		.end = 0,
+		.next = 0,
+		.ring = NULL,
+		.ring_size = 0,
+	};
+}
+
+int kvnl_window_free(struct kvnl_window * window)
+{
+	if (window->ring != NULL && munmap(window->ring, 2 * window->ring_size)) return errno;
+	window->ring = NULL;
+	window->ring_size = 0;
+	return errno = 0;
+}
+
+static size_t gcd(size_t a, size_t b)
+{
+	while (b) {
+		size_t const r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+/* the same memory twice in a row, so that whatever wraps around the end goes on past it */
+static char * window_map(size_t size)
+{
+	int fd = memfd_create("kvnl_window", MFD_CLOEXEC);
+	if (fd < 0) return NULL;
+	char * ring = ftruncate(fd, size) ? MAP_FAILED : mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring != MAP_FAILED && (
+		mmap(ring, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+		mmap(ring + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+	)) {
+		int const error = errno;
+		munmap(ring, 2 * size);
+		errno = error;
+		ring = MAP_FAILED;
+	}
+	int const error = errno;
+	close(fd);
+	errno = error;
+	return ring == MAP_FAILED ? NULL : ring;
+}
+
+/* a ring of at least rows rows, a whole number of pages, holding the rows from next on */
+static int window_grow(struct kvnl_window * window, size_t rows)
+{
+	size_t const page = sysconf(_SC_PAGESIZE), unit = page / gcd(page, window->row_size);
+	size_t capacity, size;
+	if (__builtin_add_overflow(rows, unit - 1, &capacity)) return errno = ENOMEM;
+	capacity = capacity / unit * unit;
+	if (__builtin_mul_overflow(capacity, window->row_size, &size) || size > SIZE_MAX / 2) return errno = ENOMEM;
+	char * ring = window_map(size);
+	if (ring == NULL) return errno;
+
+	if (window->ring != NULL) {
+		if (window->next < window->end)
+			memcpy(
+				ring + window->next % capacity * window->row_size,
+				window->ring + window->next % window->capacity * window->row_size,
+				(window->end - window->next) * window->row_size
+			);
+		munmap(window->ring, 2 * window->ring_size);
+	}
+	window->ring = ring;
+	window->ring_size = size;
+	window->capacity = capacity;
+	return errno = 0;
+}
+
+/* the first array decides what a row is; shape[2..] and strides[2..] are a dense row */
+static int window_set_row(struct kvnl_window * window, struct ndview const * rows, struct dtype dtype)
+{
+	window->dtype = dtype;
+	window->ndim = rows->ndim;
+	ssize_t stride = dtype.size;
+	for (size_t d = rows->ndim - 1; d > 0; d--) {
+		window->shape[d + 1] = rows->shape[d];
+		window->strides[d + 1] = stride;
+		stride *= rows->shape[d];
+	}
+	window->row_size = stride;
+	return stride == 0 ? EINVAL : 0;
+}
+
+static int window_fits_row(struct kvnl_window const * window, struct ndview const * rows, struct dtype dtype)
+{
+	if (!dtype_equal(dtype, window->dtype) || rows->ndim != window->ndim) return 0;
+	for (size_t d = 1; d < rows->ndim; d++)
+		if (rows->shape[d] != window->shape[d + 1]) return 0;
+	return 1;
+}
+
+int kvnl_window_push(struct kvnl_window * window, struct ndview const * rows, struct dtype dtype)
+{
+	if (window->size == 0 || window->hop == 0 || rows->ndim == 0 || rows->ndim > KVNL_MAX_NDIM || dtype.size == 0)
+		return errno = EINVAL;
+	if (window->ring == NULL ? window_set_row(window, rows, dtype) : !window_fits_row(window, rows, dtype))
+		return errno = EINVAL;
+
+	/* the rows from next on have to stay, and rows before next never will */
+	size_t const n = rows->shape[0];
+	size_t const skip = window->next > window->end ? min(n, window->next - window->end) : 0;
+	size_t const needed = window->end + n > window->next ? window->end + n - window->next : 0;
+	if (window->ring == NULL || needed > window->capacity) {
+		size_t const rows_wanted = max(max(needed, window->capacity), window->size + window->hop);
+		if (window_grow(window, window->ring == NULL ? rows_wanted : max(needed, 2 * window->capacity)))
+			return errno;
+	}
+
+	if (skip < n) {
+		size_t shape[rows->ndim];
+		ssize_t strides[rows->ndim];
+		memcpy(shape, rows->shape, sizeof(shape));
+		shape[0] = n - skip;
+		strides[0] = window->row_size;
+		memcpy(strides + 1, window->strides + 2, (rows->ndim - 1) * sizeof(ssize_t));
+		struct ndview const src = { (char *)rows->data + (ssize_t)skip * rows->strides[0], rows->ndim, shape, rows->strides };
+		struct ndview const dst = {
+			window->ring + (window->end + skip) % window->capacity * window->row_size, rows->ndim, shape, strides
+		};
+		if (ndview_copy(&dst, &src, dtype.size)) return errno;
+	}
+	window->end += n;
+	return errno = 0;
+}
+
+const char * kvnl_window_read(int fd, struct kvnl_window * window, struct kvnl_ndview_reader * reader, struct buf * data, kvnl_hash * hash)
+{
+	kvnl_ndview array = kvnl_read_ndview(fd, reader, data, hash);
+	if (array.error) return array.error;
+	if (!dtype_is_valid(reader->type)) return "the dtype of the data is unknown";
+	int const r = kvnl_window_push(window, &array.view, reader->type);
+	if (r == EINVAL) return "the array doesn't fit the window";
+	return r ? "kvnl_window_push() failed, consult errno" : NULL;
+}
+
+int kvnl_window_batch(struct kvnl_window * window, size_t max, struct ndview * view)
+{
+	if (window->ring == NULL || max == 0 || window->end < window->next + window->size) return errno = EAGAIN;
+	/* every window of the batch has to be in the ring at once */
+	size_t n = (window->end - window->next - window->size) / window->hop + 1;
+	n = min(min(n, max), (window->capacity - window->size) / window->hop + 1);
+
+	window->shape[0] = n;
+	window->shape[1] = window->size;
+	window->strides[0] = window->hop * window->row_size;
+	window->strides[1] = window->row_size;
+	*view = (struct ndview){
+		window->ring + window->next % window->capacity * window->row_size,
+		window->ndim + 1, window->shape, window->strides
+	};
+	window->next += n * window->hop;
+	return errno = 0;
+}
+
+int kvnl_window_next(struct kvnl_window * window, struct ndview * view)
+{
+	if (kvnl_window_batch(window, 1, view)) return errno;
+	*view = (struct ndview){ view->data, window->ndim, window->shape + 1, window->strides + 1 };
+	return errno = 0;
+}
@@ -1,12 +1,161 @@
+#define _GNU_SOURCE /* memmem() */
 #include <stdio.h>
 #include <buf.h>
 #include <ndview.h>
 #include <kvnl.h>
+#include <scan.h>
+#include <npy.h>
+#include <uring.h>
+#include <dtype.h>
+#include <relay.h>
+#include <dispatch.h>
+#include <expr.h>
+#include <math.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define NL fputc('\n', stderr);
 
 #define STREAM 1 /* stdout */
 
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+		return 1; \
+	} \
+} while (0)
+
+
+/* every third value is sized, and full of newlines and things that look like records */
+#define SCAN_RECORDS 2000
+
+static void scan_value(size_t i, char * key, char * value, int * sized)
+{
+	sprintf(key, "k%zu", i);
+	*sized = i % 3 == 0 ? 1 : -1;
+	if (*sized < 0) sprintf(value, "v%zu", i);
+	else {
+		/* enough records that parse for a chunk to guess it starts among them */
+		strcpy(value, "\n#2 x=\nk1=\nfake\n\n");
+		for (size_t j = 0, n = i % 7 + KVNL_SCAN_PROBE; j < n; j++) strcat(value, "k9=5\n");
+	}
+}
+
+struct scan_test {
+	size_t next;
+	int failed;
+};
+
+static void * scan_begin(void * ctx, size_t chunk)
+{
+	(void)ctx, (void)chunk;
+	struct buf * indices = malloc(sizeof(struct buf));
+	if (indices != NULL) *indices = make_buf_default();
+	return indices;
+}
+
+/* the index of a record, or SIZE_MAX if it isn't one that was written */
+static size_t scan_index(kvnl_line const * line)
+{
+	char key[32], value[128];
+	int sized;
+	size_t i = strtoul((char *)line->key.data + 1, NULL, 10);
+	if (i >= SCAN_RECORDS) return SIZE_MAX;
+	scan_value(i, key, value, &sized);
+	return view_equals(line->key, view_str(key)) && view_equals(line->value, view_str(value)) ? i : SIZE_MAX;
+}
+
+static int scan_record(void * state, kvnl_line const * line, off_t offset)
+{
+	(void)offset;
+	return buf_push_value((struct buf *)state, scan_index(line));
+}
+
+/* a validating callback, which fails on the fake records and on record SCAN_FAIL */
+#define SCAN_FAIL 1500
+
+static int scan_record_strict(void * state, kvnl_line const * line, off_t offset)
+{
+	size_t const i = scan_index(line);
+	if (i == SIZE_MAX || i == SCAN_FAIL) return -1;
+	return scan_record(state, line, offset);
+}
+
+static void scan_reset(void * state)
+{
+	((struct buf *)state)->size = 0;
+}
+
+static void scan_discard(void * ctx, void * state)
+{
+	(void)ctx;
+	buf_free(state);
+	free(state);
+}
+
+static int scan_merge(void * ctx, void * state)
+{
+	struct scan_test * test = ctx;
+	struct view indices = buf_view(state);
+	for (size_t * i = indices.data; (void *)i < indices.data + indices.size; i++)
+		if (*i != test->next++) test->failed = 1;
+	scan_discard(ctx, state);
+	return 0;
+}
+
+/* records split across tiny chunks, sized values that hold fake records, a truncated tail */
+static int test_scan(void)
+{
+	FILE * file = tmpfile();
+	CHECK(file != NULL);
+	int fd = fileno(file);
+	struct buf spec = make_buf_default();
+	char key[32], value[128];
+	int sized;
+	off_t last = 0, fail = 0;
+	for (size_t i = 0; i < SCAN_RECORDS; i++) {
+		scan_value(i, key, value, &sized);
+		last = lseek(fd, 0, SEEK_CUR);
+		if (i == SCAN_FAIL) fail = last;
+		CHECK(kvnl_write_line(fd, key, view_str(value), sized, NULL, &spec) > 0);
+	}
+	buf_free(&spec);
+	off_t const size = lseek(fd, 0, SEEK_CUR);
+
+	for (size_t chunk_size = 7; chunk_size < 100000; chunk_size *= 13) {
+		struct scan_test test = { 0, 0 };
+		struct kvnl_scanner scanner = {
+			4, chunk_size, &test, scan_begin, scan_record, scan_reset, scan_merge, scan_discard
+		};
+		kvnl_scan_result result = kvnl_scan(fd, &scanner);
+		CHECK(result.error == NULL);
+		CHECK(result.n_records == SCAN_RECORDS && test.next == SCAN_RECORDS && !test.failed);
+		CHECK(result.offset == size);
+
+		/* fake records only fail chunks that guessed wrong, and those are parsed again */
+		struct scan_test strict = { 0, 0 };
+		scanner.ctx = &strict;
+		scanner.record = scan_record_strict;
+		result = kvnl_scan(fd, &scanner);
+		CHECK(result.error != NULL && strcmp(result.error, "record callback failed") == 0);
+		CHECK(result.n_records == SCAN_FAIL && strict.next == SCAN_FAIL && !strict.failed);
+		CHECK(result.offset == fail);
+	}
+
+	CHECK(ftruncate(fd, size - 3) == 0);
+	struct scan_test test = { 0, 0 };
+	struct kvnl_scanner scanner = { 3, 64, &test, scan_begin, scan_record, scan_reset, scan_merge, scan_discard };
+	kvnl_scan_result result = kvnl_scan(fd, &scanner);
+	CHECK(result.error != NULL && strcmp(result.error, "record cut short by the end of the file") == 0);
+	CHECK(result.n_records == SCAN_RECORDS - 1 && test.next == SCAN_RECORDS - 1 && !test.failed);
+	CHECK(result.offset == last);
+	fclose(file);
+	return 0;
+}
+
 
 // def address_offsets(shape, strides, itemsize):
 //     beg_addr = sum(  # relative beginning of the data
@@ -22,8 +171,862 @@
 //     return beg_addr, end_addr + itemsize
 
 
+/* heap buffers that cross the memory budget move to a file with their contents, and give the memory back */
+static int test_spill(void)
+{
+	CHECK(buf_set_memory_budget(64 * 1024) == 0);
+	struct buf bufs[2] = { make_buf_spill(), make_buf_spill() };
+	bufs[1].align = 64;
+	for (size_t i = 0; i < 2; i++) {
+		struct buf * buf = &bufs[i];
+		for (uint32_t n = 0; n < 64 * 1024; n++) {
+			CHECK(buf_push_value(buf, n) == 0);
+			CHECK(buf->mapped || buf_memory_in_use() <= 64 * 1024);
+		}
+		CHECK(buf->mapped);
+		struct view values = buf_view(buf);
+		CHECK(values.size == 64 * 1024 * sizeof(uint32_t));
+		for (uint32_t n = 0; n < 64 * 1024; n++) CHECK(((uint32_t *)values.data)[n] == n);
+	}
+	struct buf small = make_buf_spill();
+	CHECK(buf_push_value(&small, 1.0) == 0 && !small.mapped && buf_memory_in_use() > 0);
+	CHECK(buf_free(&small) == 0);
+	for (size_t i = 0; i < 2; i++) CHECK(buf_free(&bufs[i]) == 0);
+	CHECK(buf_memory_in_use() == 0);
+	CHECK(buf_set_memory_budget(SIZE_MAX) == 0);
+	return 0;
+}
+
+/* a big-endian Fortran-order array through an encoded kvnl record and back */
+static int test_npy_fortran(void)
+{
+	size_t shape[3] = { 2, 3, 4 };
+	ssize_t strides[3];
+	int64_t values[24], swapped[24];
+	for (size_t i = 0; i < 2; i++) for (size_t j = 0; j < 3; j++) for (size_t k = 0; k < 4; k++)
+		values[i + 2 * j + 6 * k] = -100 * (int64_t)i - 10 * j - k;
+	struct dtype const big = dtype_parse(view_str(">i8"));
+	CHECK(dtype_convert(make_view(swapped, sizeof(swapped)), big, make_view(values, sizeof(values)), make_dtype(DTYPE_INT, 8)) == 0);
+	struct ndview view = make_ndview(swapped, 3, shape, strides);
+	ndview_set_strides_column_major(&view, 8);
+
+	FILE * npy = tmpfile(), * kvnl = tmpfile(), * back = tmpfile();
+	CHECK(npy != NULL && kvnl != NULL && back != NULL);
+	struct buf buf = make_buf_default();
+	CHECK(npy_write_ndview(fileno(npy), &view, big, &buf) > 0);
+	CHECK(lseek(fileno(npy), 0, SEEK_SET) == 0);
+	struct kvnl_ndview_writer writer = make_kvnl_ndview_writer();
+	CHECK(codec_parse_filter(&writer.codec, view_str("lz")) == 0);
+	CHECK(npy_to_kvnl(fileno(npy), fileno(kvnl), &writer, NULL, &buf) == NULL);
+	CHECK(lseek(fileno(kvnl), 0, SEEK_SET) == 0);
+	struct kvnl_ndview_reader reader = make_kvnl_ndview_reader();
+	CHECK(kvnl_to_npy(fileno(kvnl), fileno(back), &reader, NULL, &buf) == NULL);
+
+	struct npy_map map;
+	CHECK(npy_map(&map, fileno(back), 0) == 0);
+	CHECK(map.header.fortran_order && map.header.dtype.endian == DTYPE_BIG && map.header.ndim == 3);
+	CHECK(memcmp(map.header.shape, shape, sizeof(shape)) == 0);
+	CHECK(memcmp(map.view.data, swapped, sizeof(swapped)) == 0);
+	CHECK(npy_unmap(&map) == 0);
+	kvnl_ndview_writer_free(&writer);
+	kvnl_ndview_reader_free(&reader);
+	buf_free(&buf);
+	fclose(npy), fclose(kvnl), fclose(back);
+	return 0;
+}
+
+/* records through the engine both ways, and a reader freed while its pipe has nothing to say */
+static int test_uring(void)
+{
+	FILE * file = tmpfile();
+	CHECK(file != NULL);
+	struct kvnl_uring writer = make_kvnl_uring(fileno(file), 4, 4096);
+	char key[32], value[64];
+	for (int i = 0; i < 5000; i++) {
+		snprintf(key, sizeof(key), "k%d", i);
+		snprintf(value, sizeof(value), "%d", i * 7);
+		CHECK(kvnl_uring_write_line(&writer, key, view_str(value), -1, NULL, NULL) > 0);
+	}
+	CHECK(kvnl_uring_flush(&writer) == 0);
+	off_t const size = lseek(fileno(file), 0, SEEK_CUR);
+	CHECK(kvnl_uring_free(&writer) == 0);
+
+	CHECK(lseek(fileno(file), 0, SEEK_SET) == 0);
+	struct kvnl_uring reader = make_kvnl_uring(fileno(file), 4, 4096);
+	struct buf data = make_buf_default();
+	CHECK(buf_resize(&data, size + 1) == 0);
+	size_t total = 0;
+	for (ssize_t n; (n = kvnl_uring_read(&reader, (char *)data.data + total, 1000)) > 0; ) total += n;
+	CHECK(total == (size_t)size);
+	CHECK(kvnl_uring_free(&reader) == 0);
+	size_t offset = 0;
+	for (int i = 0; i < 5000; i++) {
+		size_t consumed;
+		kvnl_line line = kvnl_parse_line((struct view){ (char *)data.data + offset, total - offset }, &consumed);
+		snprintf(key, sizeof(key), "k%d", i);
+		snprintf(value, sizeof(value), "%d", i * 7);
+		CHECK(line.error == NULL && view_equals(line.key, view_str(key)) && view_equals(line.value, view_str(value)));
+		offset += consumed;
+	}
+	CHECK(offset == total);
+	buf_free(&data);
+	fclose(file);
+
+	/* the writer end stays open, and quiet */
+	int fds[2];
+	CHECK(pipe(fds) == 0);
+	CHECK(write(fds[1], "k=v\n", 4) == 4);
+	reader = make_kvnl_uring(fds[0], 0, 0);
+	CHECK(kvnl_uring_read(&reader, value, 4) == 4 && memcmp(value, "k=v\n", 4) == 0);
+	CHECK(kvnl_uring_free(&reader) == 0);
+	CHECK(write(fds[1], "k=w\n", 4) == 4);
+	CHECK(read(fds[0], value, 4) == 4 && memcmp(value, "k=w\n", 4) == 0);
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+}
+
+/* the error of reading an array record from text */
+static const char * read_ndview_text(struct view text)
+{
+	FILE * file = tmpfile();
+	if (file == NULL || kvnl_write_some(fileno(file), text, NULL) < 0 || lseek(fileno(file), 0, SEEK_SET)) return "tmpfile";
+	struct kvnl_ndview_reader reader = make_kvnl_ndview_reader();
+	struct buf data = make_buf_default();
+	kvnl_ndview array = kvnl_read_ndview(fileno(file), &reader, &data, NULL);
+	kvnl_ndview_reader_free(&reader);
+	buf_free(&data);
+	fclose(file);
+	return array.error;
+}
+
+/* headers that don't add up are errors, and nothing is read outside the record */
+static int test_kvnl_corrupt(void)
+{
+	char text[256];
+	CHECK(read_ndview_text(view_str("dtype=<f8\nshape=-4\nstrides=8\ndata:32=........................................\n")) != NULL);
+	CHECK(read_ndview_text(view_str("dtype=<f8\nshape=4\nstrides=8\ndata:32=................................\n")) == NULL);
+	CHECK(read_ndview_text(view_str("dtype=<f8\nshape=4\nstrides=8\ndata:25=.........................\n")) != NULL);
+	CHECK(read_ndview_text(view_str("dtype=blob\nshape=4\nstrides=8\ndata:32=................................\n")) != NULL);
+
+	/* a valid encoded record, whose chunks line is then replaced */
+	double values[32];
+	size_t shape[1] = { 32 };
+	ssize_t strides[1] = { 8 };
+	for (int i = 0; i < 32; i++) values[i] = i;
+	struct ndview view = make_ndview(values, 1, shape, strides);
+	FILE * file = tmpfile();
+	CHECK(file != NULL);
+	struct kvnl_ndview_writer writer = make_kvnl_ndview_writer();
+	writer.codec.lz = 1;
+	writer.codec.chunk_size = 64;
+	CHECK(kvnl_write_typed_ndview(fileno(file), &writer, &view, make_dtype(DTYPE_FLOAT, 8), NULL, NULL) > 0);
+	kvnl_ndview_writer_free(&writer);
+	struct buf record = make_buf_default();
+	CHECK(buf_resize(&record, lseek(fileno(file), 0, SEEK_CUR)) == 0);
+	CHECK(pread(fileno(file), record.data, record.size, 0) == (ssize_t)record.size);
+	fclose(file);
+	CHECK(read_ndview_text(buf_view(&record)) == NULL);
+
+	char * const chunks = memmem(record.data, record.size, "chunks=", 7);
+	CHECK(chunks != NULL);
+	char * const end = memchr(chunks, '\n', (char *)record.data + record.size - chunks);
+	size_t sizes[4], total = 0;
+	CHECK(sscanf(chunks, "chunks=%zu %zu %zu %zu", &sizes[0], &sizes[1], &sizes[2], &sizes[3]) == 4);
+	for (int i = 0; i < 4; i++) total += sizes[i];
+	/* a negative size that the others make up for, and sizes past the payload */
+	char const * const corrupt[] = { "chunks=-16 %zu %zu %zu", "chunks=%zu 1 1 1" };
+	for (int i = 0; i < 2; i++) {
+		struct buf text_buf = make_buf_default();
+		int const n = i == 0
+			? snprintf(text, sizeof(text), corrupt[i], sizes[1], sizes[2], sizes[0] + sizes[3] + 16)
+			: snprintf(text, sizeof(text), corrupt[i], total + 1);
+		CHECK(buf_push(&text_buf, (struct view){ record.data, chunks - (char *)record.data }) == 0);
+		CHECK(buf_push(&text_buf, (struct view){ text, n }) == 0);
+		CHECK(buf_push(&text_buf, (struct view){ end, (char *)record.data + record.size - end }) == 0);
+		CHECK(read_ndview_text(buf_view(&text_buf)) != NULL);
+		buf_free(&text_buf);
+	}
+
+	/* chunk sizes whose sum wraps around to the size of src */
+	struct codec codec = IDENTITY_CODEC;
+	codec.lz = 1;
+	codec.elem_size = 8;
+	codec.chunk_size = 64;
+	char src[16] = { 0 }, dst[128];
+	size_t const wrapping[2] = { SIZE_MAX - 3, sizeof(src) + 4 };
+	CHECK(codec_decode(&codec, make_view(src, sizeof(src)), wrapping, 2, 8, make_view(dst, sizeof(dst))) == EINVAL);
+	buf_free(&record);
+	return 0;
+}
+
+/* descriptors, casts and byte swaps over lengths that end in every part of a vector, and float16 */
+static int test_dtype(void)
+{
+	CHECK(dtype_equal(dtype_parse(view_str("<f8")), (struct dtype){ DTYPE_FLOAT, 8, DTYPE_LITTLE }));
+	CHECK(dtype_equal(dtype_parse(view_str(">i2")), (struct dtype){ DTYPE_INT, 2, DTYPE_BIG }));
+	CHECK(dtype_equal(dtype_parse(view_str("|u1")), make_dtype(DTYPE_UINT, 1)));
+	CHECK(dtype_equal(dtype_parse(view_str("float16")), make_dtype(DTYPE_FLOAT, 2)));
+	char const * const invalid[] = { "", "<", "f", "<f3", "<x4", "i4 ", "c4" };
+	for (size_t i = 0; i < sizeof(invalid) / sizeof(*invalid); i++)
+		CHECK(!dtype_is_valid(dtype_parse(view_str((char *)invalid[i]))));
+	CHECK(!dtype_is_valid(dtype_parse((struct view){ "\0i4", 3 })));
+
+	enum { N = 67 };
+	int32_t ints[N], back[N];
+	int64_t wide[N];
+	uint8_t bytes[N];
+	double doubles[N];
+	for (int n = 1; n <= N; n++) {
+		for (int i = 0; i < n; i++) ints[i] = (i - 20) * 77777 + i;
+		struct view const iv = make_view(ints, n * 4), wv = make_view(wide, n * 8);
+		struct dtype const i4 = make_dtype(DTYPE_INT, 4), big_i8 = dtype_parse(view_str(">i8"));
+		CHECK(dtype_convert(wv, big_i8, iv, i4) == 0);
+		CHECK(dtype_convert(make_view(back, n * 4), i4, wv, big_i8) == 0);
+		CHECK(memcmp(back, ints, n * 4) == 0);
+		CHECK(dtype_convert(make_view(bytes, n), make_dtype(DTYPE_UINT, 1), iv, i4) == 0);
+		CHECK(dtype_convert(make_view(doubles, n * 8), make_dtype(DTYPE_FLOAT, 8), iv, i4) == 0);
+		for (int i = 0; i < n; i++) CHECK(bytes[i] == (uint8_t)ints[i] && doubles[i] == ints[i]);
+
+		/* in place, against the builtins */
+		int64_t before[N];
+		memcpy(before, wide, n * 8);
+		CHECK(dtype_byteswap(wv, wv, 8) == 0);
+		for (int i = 0; i < n; i++) CHECK((uint64_t)wide[i] == __builtin_bswap64(before[i]));
+		uint16_t halves[N], swapped[N];
+		for (int i = 0; i < n; i++) halves[i] = 0x0102 * i;
+		CHECK(dtype_byteswap(make_view(swapped, n * 2), make_view(halves, n * 2), 2) == 0);
+		for (int i = 0; i < n; i++) CHECK(swapped[i] == __builtin_bswap16(halves[i]));
+	}
+
+	double const values[] = { -3.7, 0.5, 300, -0.0, 1e9 };
+	int16_t shorts[5];
+	CHECK(dtype_convert(make_view(shorts, sizeof(shorts)), make_dtype(DTYPE_INT, 2), make_view((void *)values, 4 * 8), make_dtype(DTYPE_FLOAT, 8)) == EINVAL);
+	CHECK(dtype_convert(make_view(shorts, 4 * 2), make_dtype(DTYPE_INT, 2), make_view((void *)values, 4 * 8), make_dtype(DTYPE_FLOAT, 8)) == 0);
+	CHECK(shorts[0] == -3 && shorts[1] == 0 && shorts[2] == 300 && shorts[3] == 0);
+	uint8_t flags[4];
+	CHECK(dtype_convert(make_view(flags, 4), make_dtype(DTYPE_BOOL, 1), make_view((void *)values, 4 * 8), make_dtype(DTYPE_FLOAT, 8)) == 0);
+	CHECK(flags[0] == 1 && flags[1] == 1 && flags[2] == 1 && flags[3] == 0);
+
+	/* float16: exact values, ties to even, overflow, subnormals, NaN, and the other byte order */
+	double const halfs[] = { 1.5, -65504, 2049, 2051, 1e6, -1e6, 0x1p-24, 0x1p-26, -0.0, NAN };
+	double const rounded[] = { 1.5, -65504, 2048, 2052, INFINITY, -INFINITY, 0x1p-24, 0, -0.0, NAN };
+	size_t const n_halfs = sizeof(halfs) / sizeof(*halfs);
+	uint16_t h16[10];
+	double out[10];
+	struct dtype const f8 = make_dtype(DTYPE_FLOAT, 8);
+	for (int endian = 0; endian < 2; endian++) {
+		struct dtype const f2 = dtype_parse(view_str(endian ? ">f2" : "<f2"));
+		CHECK(dtype_convert(make_view(h16, n_halfs * 2), f2, make_view((void *)halfs, n_halfs * 8), f8) == 0);
+		CHECK(dtype_convert(make_view(out, n_halfs * 8), f8, make_view(h16, n_halfs * 2), f2) == 0);
+		for (size_t i = 0; i < n_halfs; i++)
+			CHECK(isnan(rounded[i]) ? isnan(out[i]) : out[i] == rounded[i] && signbit(out[i]) == signbit(rounded[i]));
+	}
+	CHECK(dtype_convert(make_view(h16, 2), dtype_parse(view_str("<f2")), make_view((int32_t[]){ -7 }, 4), make_dtype(DTYPE_INT, 4)) == 0);
+	CHECK(h16[0] == (DTYPE_NATIVE == DTYPE_LITTLE ? 0xc700 : 0x00c7));
+	return 0;
+}
+
+/* keys and unsized values of a regular file are read ahead, and fd is put back right past them */
+static int test_read_delimited(void)
+{
+	FILE * file = tmpfile();
+	CHECK(file != NULL);
+	int const fd = fileno(file);
+	char key[600], value[1000];
+	memset(key, 'k', sizeof(key) - 1), key[sizeof(key) - 1] = '\0';
+	memset(value, 'v', sizeof(value) - 1), value[sizeof(value) - 1] = '\0';
+	struct buf buf = make_buf_default();
+	CHECK(kvnl_write_line(fd, key, view_str(value), 0, NULL, &buf) > 0);
+	off_t const first = lseek(fd, 0, SEEK_CUR);
+	CHECK(kvnl_write_line(fd, "short", view_str("x"), 0, NULL, &buf) > 0);
+	CHECK(kvnl_write_some(fd, view_str("RAW!k=y\nunterminated"), NULL) > 0);
+	CHECK(lseek(fd, 0, SEEK_SET) == 0);
+
+	/* delimiters well past the first chunk */
+	kvnl_line const line = kvnl_read_line(fd, &buf, NULL);
+	CHECK(line.error == NULL && view_equals(line.key, view_str(key)) && view_equals(line.value, view_str(value)));
+	CHECK(lseek(fd, 0, SEEK_CUR) == first);
+
+	/* plain read() in between gets exactly what follows the record */
+	buf_clear(&buf);
+	kvnl_line const short_line = kvnl_read_line(fd, &buf, NULL);
+	CHECK(short_line.error == NULL && view_equals(short_line.key, view_str("short")) && view_equals(short_line.value, view_str("x")));
+	char raw[4];
+	CHECK(read(fd, raw, 4) == 4 && memcmp(raw, "RAW!", 4) == 0);
+	buf_clear(&buf);
+	kvnl_line const after_raw = kvnl_read_line(fd, &buf, NULL);
+	CHECK(after_raw.error == NULL && view_equals(after_raw.key, view_str("k")) && view_equals(after_raw.value, view_str("y")));
+
+	/* a size limit stops short of the delimiter, and the offset with it */
+	off_t const tail = lseek(fd, 0, SEEK_CUR);
+	buf_clear(&buf);
+	kvnl_some const limited = kvnl_read_some(fd, 5, "\n", &buf, NULL);
+	CHECK(limited.error == NULL && limited.view.size == 5 && memcmp(limited.view.data, "unter", 5) == 0);
+	CHECK(lseek(fd, 0, SEEK_CUR) == tail + 5);
+
+	/* the end of the file in the middle of a chunk */
+	buf_clear(&buf);
+	kvnl_some const cut = kvnl_read_some(fd, -1, "\n", &buf, NULL);
+	CHECK(cut.error != NULL && strcmp(cut.error, "EOF") == 0);
+	CHECK(buf.size == 7 && memcmp(buf.data, "minated", 7) == 0);
+	buf_free(&buf);
+	fclose(file);
+	return 0;
+}
+
+/* small, large, dropped and checksummed records; the dropped ones are left out if not all */
+static int relay_stream(int fd, int all, struct buf * spec_buf)
+{
+	static char large[3][20000];
+	for (int i = 0; i < 3; i++)
+		for (size_t j = 0; j < sizeof(large[i]); j++) large[i][j] = j % 61 == 60 ? '\n' : 'a' + (i * 7 + j) % 26;
+	if (kvnl_write_line(fd, "small", view_str("x"), 0, NULL, spec_buf) < 0) return -1;
+	if (kvnl_write_line(fd, "large", (struct view){ large[0], 10000 }, 1, NULL, spec_buf) < 0) return -1;
+	if (all && kvnl_write_line(fd, "drop", view_str("gone"), 0, NULL, spec_buf) < 0) return -1;
+	if (all && kvnl_write_line(fd, "drop", (struct view){ large[1], 8000 }, 1, NULL, spec_buf) < 0) return -1;
+	if (kvnl_write_checked_line(fd, "checked", view_str("small"), 0, HASH_CRC32C, NULL, spec_buf) < 0) return -1;
+	if (all && kvnl_write_checked_line(fd, "drop", (struct view){ large[2], 5000 }, 1, HASH_XXH64, NULL, spec_buf) < 0) return -1;
+	if (kvnl_write_checked_line(fd, "checked", (struct view){ large[2], 20000 }, 1, HASH_XXH64, NULL, spec_buf) < 0) return -1;
+	if (kvnl_write_line(fd, "sized", view_str("y"), 1, NULL, spec_buf) < 0) return -1;
+	return 0;
+}
+
+static int relay_route(void * ctx, kvnl_line const * line)
+{
+	return view_equals(line->key, view_str("drop")) ? KVNL_RELAY_DROP : *(int *)ctx;
+}
+
+/* everything from fd's offset on */
+static int read_rest(int fd, struct buf * buf)
+{
+	buf_clear(buf);
+	for (;;) {
+		if (buf_reserve(buf, 4096)) return -1;
+		ssize_t n = read(fd, buf->data + buf->size, 4096);
+		if (n < 0) return -1;
+		if (n == 0) return 0;
+		buf_resize(buf, buf->size + n);
+	}
+}
+
+static int relay_all(int in, int out, int verify, kvnl_hash * hash, int * n_records)
+{
+	struct kvnl_relay relay = make_kvnl_relay(relay_route, &out);
+	relay.verify = verify;
+	*n_records = 0;
+	CHECK(lseek(in, 0, SEEK_SET) == 0);
+	for (;;) {
+		kvnl_line line = kvnl_relay_line(in, &relay, hash);
+		if (line.error) {
+			CHECK(strcmp(line.error, "EOF") == 0);
+			break;
+		}
+		++*n_records;
+	}
+	kvnl_relay_free(&relay);
+	return 0;
+}
+
+static int test_relay(void)
+{
+	FILE * file = tmpfile(), * expected_file = tmpfile(), * out_file = tmpfile();
+	CHECK(file != NULL && expected_file != NULL && out_file != NULL);
+	int const in = fileno(file), out = fileno(out_file);
+	struct buf buf = make_buf_default(), expected = make_buf_default();
+	CHECK(relay_stream(in, 1, &buf) == 0 && relay_stream(fileno(expected_file), 0, &buf) == 0);
+	CHECK(lseek(fileno(expected_file), 0, SEEK_SET) == 0 && read_rest(fileno(expected_file), &expected) == 0);
+
+	/* to a file, with checksums verified on the way */
+	int n_records;
+	CHECK(relay_all(in, out, 1, NULL, &n_records) == 0);
+	CHECK(n_records == 8);
+	CHECK(lseek(out, 0, SEEK_SET) == 0 && read_rest(out, &buf) == 0);
+	CHECK(view_equals(buf_view(&buf), buf_view(&expected)));
+
+	/* to a pipe, with a stream hash, which takes values through memory */
+	int fds[2];
+	CHECK(pipe(fds) == 0);
+	CHECK((size_t)fcntl(fds[1], F_SETPIPE_SZ, 2 * expected.size) >= expected.size);
+	struct hash stream = make_hash(HASH_XXH64), input = make_hash(HASH_XXH64);
+	CHECK(relay_all(in, fds[1], 1, &make_kvnl_hash(&stream), &n_records) == 0);
+	close(fds[1]);
+	CHECK(read_rest(fds[0], &buf) == 0);
+	close(fds[0]);
+	CHECK(view_equals(buf_view(&buf), buf_view(&expected)));
+	CHECK(lseek(in, 0, SEEK_SET) == 0 && read_rest(in, &buf) == 0);
+	hash_update(&input, buf_view(&buf));
+	CHECK(hash_digest(&stream) == hash_digest(&input));
+
+	/* and again without a stream hash, which splices into the pipe */
+	CHECK(pipe(fds) == 0);
+	CHECK((size_t)fcntl(fds[1], F_SETPIPE_SZ, 2 * expected.size) >= expected.size);
+	CHECK(relay_all(in, fds[1], 0, NULL, &n_records) == 0);
+	close(fds[1]);
+	CHECK(read_rest(fds[0], &buf) == 0);
+	close(fds[0]);
+	CHECK(view_equals(buf_view(&buf), buf_view(&expected)));
+
+	/* a corrupt checked value is caught, small or large */
+	for (int large = 0; large < 2; large++) {
+		CHECK(lseek(in, 0, SEEK_SET) == 0 && read_rest(in, &buf) == 0);
+		const char * record = large ? "checked:20000=" : "checked=small";
+		char * value = memmem(buf.data, buf.size, record, strlen(record));
+		CHECK(value != NULL);
+		value[large ? 14 : 8] ^= 1;
+		FILE * corrupt = tmpfile(), * sink = tmpfile();
+		CHECK(corrupt != NULL && sink != NULL);
+		CHECK(kvnl_write_some(fileno(corrupt), buf_view(&buf), NULL) >= 0 && lseek(fileno(corrupt), 0, SEEK_SET) == 0);
+		struct kvnl_relay relay = make_kvnl_relay(relay_route, &(int){ fileno(sink) });
+		relay.verify = 1;
+		const char * error = NULL;
+		while (error == NULL) error = kvnl_relay_line(fileno(corrupt), &relay, NULL).error;
+		CHECK(strcmp(error, "checksum mismatch") == 0);
+		kvnl_relay_free(&relay);
+		fclose(corrupt);
+		fclose(sink);
+	}
+
+	buf_free(&buf);
+	buf_free(&expected);
+	fclose(file);
+	fclose(expected_file);
+	fclose(out_file);
+	return 0;
+}
+
+/* what the last handler saw */
+struct dispatch_seen { int id, fallback; char value[64]; };
+
+static kvnl_line dispatch_handler(void * ctx, int id, int fd, kvnl_specification spec, struct buf * buf, kvnl_hash * hash)
+{
+	struct dispatch_seen * seen = ctx;
+	kvnl_line line = kvnl_read_value(fd, spec, buf, hash);
+	seen->id = id;
+	seen->fallback = 0;
+	snprintf(seen->value, sizeof(seen->value), "%.*s", (int)line.value.size, (char *)line.value.data);
+	return line;
+}
+
+static kvnl_line dispatch_fallback(void * ctx, int id, int fd, kvnl_specification spec, struct buf * buf, kvnl_hash * hash)
+{
+	kvnl_line line = dispatch_handler(ctx, id, fd, spec, buf, hash);
+	((struct dispatch_seen *)ctx)->fallback = 1;
+	return line;
+}
+
+static int test_dispatch(void)
+{
+	struct dispatch_seen seen;
+	struct kvnl_dispatch table = make_kvnl_dispatch(dispatch_fallback, &seen);
+	char key[16];
+
+	/* ids are the order of adding, also for keys added after a build */
+	for (int i = 0; i < 40; i++) {
+		if (i == 20) CHECK(kvnl_dispatch_build(&table) == 0);
+		snprintf(key, sizeof(key), "key%d", i);
+		CHECK(kvnl_dispatch_add(&table, key, i == 7 ? NULL : dispatch_handler, &seen) == i);
+	}
+	CHECK(kvnl_dispatch_add(&table, "key3", dispatch_handler, &seen) == -1 && errno == EEXIST);
+	CHECK(kvnl_dispatch_add(&table, "key33", dispatch_handler, &seen) == -1 && errno == EEXIST);
+	CHECK(kvnl_dispatch_build(&table) == 0);
+	CHECK(kvnl_dispatch_add(&table, "key0", dispatch_handler, &seen) == -1 && errno == EEXIST);
+	for (int i = 0; i < 40; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		CHECK(kvnl_dispatch_id(&table, view_str(key)) == i);
+	}
+	CHECK(kvnl_dispatch_id(&table, view_str("key40")) == -1 && kvnl_dispatch_id(&table, view_str("key")) == -1);
+
+	/* a key added after the build is found once kvnl_dispatch_line() builds again */
+	CHECK(kvnl_dispatch_add(&table, "late", dispatch_handler, &seen) == 40);
+	FILE * file = tmpfile();
+	CHECK(file != NULL);
+	int const fd = fileno(file);
+	struct buf buf = make_buf_default();
+	CHECK(kvnl_write_line(fd, "late", view_str("l"), 0, NULL, &buf) >= 0);
+	CHECK(kvnl_write_line(fd, "key12", view_str("twelve"), 1, NULL, &buf) >= 0);
+	CHECK(kvnl_write_line(fd, "key7", view_str("interned"), 0, NULL, &buf) >= 0);
+	CHECK(kvnl_write_line(fd, "unknown", view_str("u"), 0, NULL, &buf) >= 0);
+	CHECK(kvnl_write_checked_line(fd, "key25", view_str("checked"), 0, HASH_CRC32C, NULL, &buf) >= 0);
+	off_t const corrupt = lseek(fd, 0, SEEK_CUR);
+	CHECK(kvnl_write_checked_line(fd, "key26", view_str("checked"), 1, HASH_XXH64, NULL, &buf) >= 0);
+	CHECK(lseek(fd, 0, SEEK_SET) == 0);
+
+	struct { const char * value; int id, fallback; } const expected[] = {
+		{ "l", 40, 0 }, { "twelve", 12, 0 }, { "interned", 7, 1 }, { "u", -1, 1 }, { "checked", 25, 0 }, { "checked", 26, 0 },
+	};
+	for (size_t i = 0; i < sizeof(expected) / sizeof(*expected); i++) {
+		buf_clear(&buf);
+		seen = (struct dispatch_seen){ .id = -2 };
+		kvnl_line line = kvnl_dispatch_line(fd, &table, &buf, NULL);
+		CHECK(line.error == NULL);
+		CHECK(seen.id == expected[i].id && seen.fallback == expected[i].fallback && strcmp(seen.value, expected[i].value) == 0);
+	}
+	buf_clear(&buf);
+	CHECK(strcmp(kvnl_dispatch_line(fd, &table, &buf, NULL).error, "EOF") == 0);
+
+	/* a corrupt checked record still reaches its handler, and then fails */
+	char * data = malloc(4096);
+	CHECK(data != NULL);
+	CHECK(lseek(fd, corrupt, SEEK_SET) == corrupt);
+	ssize_t const n = read(fd, data, 4096);
+	char * value = memmem(data, n, "checked", 7);
+	CHECK(n > 0 && value != NULL);
+	value[0] = 'C';
+	CHECK(pwrite(fd, data, n, corrupt) == n && lseek(fd, corrupt, SEEK_SET) == corrupt);
+	free(data);
+	buf_clear(&buf);
+	seen = (struct dispatch_seen){ .id = -2 };
+	kvnl_line const line = kvnl_dispatch_line(fd, &table, &buf, NULL);
+	CHECK(line.error != NULL && strcmp(line.error, "checksum mismatch") == 0);
+	CHECK(seen.id == 26 && strcmp(seen.value, "Checked") == 0);
+
+	buf_free(&buf);
+	kvnl_dispatch_free(&table);
+	fclose(file);
+	return 0;
+}
+
+/* the significant digits of a number in text, without sign, point, exponent or zeros around them */
+static size_t format_digits(char const * text, char * digits)
+{
+	size_t n = 0;
+	for (; *text && *text != 'e'; text++)
+		if (*text >= '0' && *text <= '9' && (n || *text != '0')) digits[n++] = *text;
+	while (n && digits[n - 1] == '0') n--;
+	digits[n] = '\0';
+	return n;
+}
+
+/* x comes back from the text, which has the digits of the closest shortest decimal that does */
+static int check_double(double x)
+{
+	struct buf buf = make_buf_default();
+	CHECK(buf_append_double(&buf, x) == 0 && buf_push_byte(&buf, '\0') == 0);
+	char const * const text = buf.data;
+	double const back = strtod(text, NULL);
+	int const same = memcmp(&back, &x, sizeof(x)) == 0;
+	if (!same) fprintf(stderr, "%a came back as %s\n", x, text);
+	CHECK(same);
+
+	char digits[32], shortest[32], ref[40];
+	size_t const n = format_digits(text, digits);
+	CHECK(n >= 1 && n <= 17);
+	snprintf(ref, sizeof(ref), "%.*e", (int)n - 1, x);
+	CHECK(strtod(ref, NULL) == x);
+	format_digits(ref, shortest);
+	if (strcmp(digits, shortest) != 0) fprintf(stderr, "%s has other digits than %s\n", text, ref);
+	CHECK(strcmp(digits, shortest) == 0);
+	if (n > 1) {
+		snprintf(ref, sizeof(ref), "%.*e", (int)n - 2, x);
+		CHECK(strtod(ref, NULL) != x);
+	}
+	buf_free(&buf);
+	return 0;
+}
+
+static int test_format(void)
+{
+	/* the notation of repr() in Python */
+	struct { double x; char const * text; } const reprs[] = {
+		{ 0.0, "0.0" }, { -0.0, "-0.0" }, { 1.5, "1.5" }, { 100.0, "100.0" }, { 0.1, "0.1" },
+		{ 0.0001, "0.0001" }, { 1e-5, "1e-05" }, { 123.456, "123.456" }, { 1e15, "1000000000000000.0" },
+		{ 9007199254740992.0, "9007199254740992.0" }, { 1e16, "1e+16" }, { 1e100, "1e+100" },
+		{ 5e-324, "5e-324" }, { 1e-323, "1e-323" }, { 2.2250738585072014e-308, "2.2250738585072014e-308" },
+		{ 1.7976931348623157e+308, "1.7976931348623157e+308" }, { -2.5e-7, "-2.5e-07" },
+		{ INFINITY, "inf" }, { -INFINITY, "-inf" }, { NAN, "nan" },
+	};
+	struct buf buf = make_buf_default();
+	for (size_t i = 0; i < sizeof(reprs) / sizeof(*reprs); i++) {
+		buf_clear(&buf);
+		CHECK(buf_append_double(&buf, reprs[i].x) == 0);
+		if (!view_equals(buf_view(&buf), view_str((char *)reprs[i].text)))
+			fprintf(stderr, "%.*s instead of %s\n", (int)buf.size, (char *)buf.data, reprs[i].text);
+		CHECK(view_equals(buf_view(&buf), view_str((char *)reprs[i].text)));
+	}
+
+	/* powers of ten, and their neighbours, all the way */
+	for (int e = -323; e <= 308; e++) {
+		char text[16];
+		snprintf(text, sizeof(text), "1e%d", e);
+		double const x = strtod(text, NULL);
+		CHECK(check_double(x) == 0 && check_double(nextafter(x, 0)) == 0 && check_double(nextafter(x, INFINITY)) == 0);
+	}
+	/* subnormals, the smallest normals and random bit patterns */
+	for (uint64_t bits = 1; bits < 1000; bits++) {
+		double x;
+		memcpy(&x, &bits, sizeof(x));
+		CHECK(check_double(x) == 0 && check_double(-x) == 0);
+	}
+	uint64_t state = 0x9e3779b97f4a7c15ull;
+	for (int i = 0; i < 200000; i++) {
+		state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+		uint64_t bits = i & 1 ? state : state >> 12 | (uint64_t)(i % 8) << 52;
+		double x;
+		memcpy(&x, &bits, sizeof(x));
+		if (isfinite(x)) CHECK(check_double(x) == 0);
+	}
+
+	/* integers next to the data, and printf() growing the buffer */
+	char big[5000];
+	memset(big, 'b', sizeof(big) - 1), big[sizeof(big) - 1] = '\0';
+	buf_clear(&buf);
+	CHECK(buf_append_int(&buf, LLONG_MIN) == 0 && buf_append(&buf, view_str(" ")) == 0);
+	CHECK(buf_append_uint(&buf, ULLONG_MAX) == 0 && buf_append_int(&buf, 0) == 0);
+	CHECK(buf_appendf(&buf, " %s|%d", "x", -12) == 6);
+	CHECK(buf_appendf(&buf, "%s", big) == (int)sizeof(big) - 1);
+	CHECK(buf_appendf(&buf, "%s", "") == 0);
+	char expected[sizeof(big) + 64];
+	int const n = snprintf(expected, sizeof(expected), "%lld %llu0 x|-12%s", LLONG_MIN, ULLONG_MAX, big);
+	CHECK(buf.size == (size_t)n && memcmp(buf.data, expected, n) == 0 && ((char *)buf.data)[n] == '\0');
+	buf_free(&buf);
+	return 0;
+}
+
+/* an element of any dtype as a double */
+static double expr_value(void const * p, struct dtype dtype)
+{
+	double x;
+	dtype_convert((struct view){ &x, sizeof(x) }, make_dtype(DTYPE_FLOAT, 8), (struct view){ (void *)p, dtype.size }, dtype);
+	return x;
+}
+
+static double expr_reference(enum expr_op op, double x, double y)
+{
+	switch (op) {
+	case EXPR_NEG: return -x;
+	case EXPR_ABS: return fabs(x);
+	case EXPR_SQRT: return sqrt(x);
+	case EXPR_NOT: return x == 0;
+	case EXPR_ADD: return x + y;
+	case EXPR_SUB: return x - y;
+	case EXPR_MUL: return x * y;
+	case EXPR_DIV: return x / y;
+	case EXPR_MIN: return x != x || x < y ? x : y;
+	case EXPR_MAX: return x != x || x > y ? x : y;
+	case EXPR_LT: return x < y;
+	case EXPR_LE: return x <= y;
+	case EXPR_GT: return x > y;
+	case EXPR_GE: return x >= y;
+	case EXPR_EQ: return x == y;
+	case EXPR_NE: return x != y;
+	case EXPR_AND: return x != 0 && y != 0;
+	case EXPR_OR: return x != 0 || y != 0;
+	default: return NAN;
+	}
+}
+
+#define EXPR_N 600
+
+/* an operator over n elements, through the vector loops and their tails, against one at a time */
+static int check_expr_op(enum expr_op op, struct dtype dtype, size_t n)
+{
+	static unsigned char a[EXPR_N * 8], b[EXPR_N * 8], out[EXPR_N * 8];
+	static double x[EXPR_N], y[EXPR_N];
+	for (size_t i = 0; i < n; i++) {
+		x[i] = dtype.kind == DTYPE_FLOAT && i % 13 == 5 ? NAN : (double)(i * 7 % 23) - 11;
+		y[i] = dtype.kind == DTYPE_FLOAT && i % 17 == 9 ? NAN : 2.0 * (i * 5 % 19) - 17;
+	}
+	struct dtype const f8 = make_dtype(DTYPE_FLOAT, 8);
+	dtype_convert((struct view){ a, n * dtype.size }, dtype, (struct view){ x, n * 8 }, f8);
+	dtype_convert((struct view){ b, n * dtype.size }, dtype, (struct view){ y, n * 8 }, f8);
+
+	struct expr expr = make_expr();
+	struct ndview const va = { a, 1, (size_t[]){ n }, (ssize_t[]){ dtype.size } };
+	struct ndview const vb = { b, 1, (size_t[]){ n }, (ssize_t[]){ dtype.size } };
+	int const xa = expr_input(&expr, &va, dtype), yb = expr_input(&expr, &vb, dtype);
+	int const root = op <= EXPR_NOT ? expr_unary(&expr, op, xa) : expr_binary(&expr, op, xa, yb);
+	CHECK(root >= 0);
+	struct dtype const type = expr.nodes[root].type;
+	struct ndview const vo = { out, 1, (size_t[]){ n }, (ssize_t[]){ type.size } };
+	CHECK(expr_eval(&expr, root, &vo, type, 1) == 0);
+	for (size_t i = 0; i < n; i++) {
+		double const got = expr_value(out + i * type.size, type);
+		double want = expr_reference(op, x[i], y[i]);
+		if (type.kind == DTYPE_FLOAT && type.size == 4) want = (float)want;
+		if (!(got == want || (isnan(got) && isnan(want))))
+			fprintf(stderr, "op %d of %c%zu, element %zu of %zu: %g instead of %g\n", op, dtype.kind == DTYPE_FLOAT ? 'f' : 'i', dtype.size, i, n, got, want);
+		CHECK(got == want || (isnan(got) && isnan(want)));
+	}
+	return 0;
+}
+
+/* the type of a node made of two inputs of the given dtypes */
+static struct dtype expr_type_of(enum expr_op op, struct dtype x, struct dtype y)
+{
+	static char data[8];
+	struct ndview const v = { data, 1, (size_t[]){ 1 }, (ssize_t[]){ 0 } };
+	struct expr expr = make_expr();
+	int const root = expr_binary(&expr, op, expr_input(&expr, &v, x), expr_input(&expr, &v, y));
+	return root < 0 ? INVALID_DTYPE : expr.nodes[root].type;
+}
+
+static int test_expr(void)
+{
+	struct dtype const b1 = make_dtype(DTYPE_BOOL, 1), i2 = make_dtype(DTYPE_INT, 2), i4 = make_dtype(DTYPE_INT, 4);
+	struct dtype const i8 = make_dtype(DTYPE_INT, 8), u1 = make_dtype(DTYPE_UINT, 1);
+	struct dtype const f4 = make_dtype(DTYPE_FLOAT, 4), f8 = make_dtype(DTYPE_FLOAT, 8);
+
+	/* every operator of every computed type, at lengths around the vector width and past a block */
+	struct dtype const types[] = { i8, f8, f4 };
+	for (size_t t = 0; t < 3; t++)
+		for (enum expr_op op = EXPR_NEG; op <= EXPR_OR; op++)
+			for (size_t n = 1; n <= EXPR_N; n = n < 34 ? n + 1 : n == 34 ? EXPR_BLOCK + 13 : EXPR_N + 1)
+				CHECK(check_expr_op(op, types[t], n) == 0);
+
+	/* type promotion */
+	CHECK(dtype_equal(expr_type_of(EXPR_ADD, i4, f4), f8));
+	CHECK(dtype_equal(expr_type_of(EXPR_ADD, b1, f4), f4));
+	CHECK(dtype_equal(expr_type_of(EXPR_ADD, f4, f4), f4));
+	CHECK(dtype_equal(expr_type_of(EXPR_ADD, f4, f8), f8));
+	CHECK(dtype_equal(expr_type_of(EXPR_ADD, b1, i2), i8));
+	CHECK(dtype_equal(expr_type_of(EXPR_DIV, i2, u1), f8));
+	CHECK(dtype_equal(expr_type_of(EXPR_LT, f4, i2), b1));
+	CHECK(dtype_equal(expr_type_of(EXPR_AND, f8, i2), b1));
+
+	static float f[1000], g[1000];
+	static int32_t n32[1000];
+	for (size_t i = 0; i < 1000; i++) f[i] = i * 0.37f - 100, n32[i] = i * 3 - 1000;
+	struct ndview const vf = { f, 1, (size_t[]){ 1000 }, (ssize_t[]){ sizeof(float) } };
+	struct ndview const vg = { g, 1, (size_t[]){ 1000 }, (ssize_t[]){ sizeof(float) } };
+	struct ndview const vn = { n32, 1, (size_t[]){ 1000 }, (ssize_t[]){ sizeof(int32_t) } };
+
+	/* float32 stays float32 with constants, which take its type */
+	struct expr expr = make_expr();
+	int root = expr_binary(&expr, EXPR_ADD, expr_binary(&expr, EXPR_MUL, expr_input(&expr, &vf, f4), expr_float(&expr, 0.1)), expr_int(&expr, 3));
+	CHECK(root >= 0 && dtype_equal(expr.nodes[root].type, f4));
+	CHECK(expr_eval(&expr, root, &vg, f4, 1) == 0);
+	for (size_t i = 0; i < 1000; i++) {
+		float const scaled = f[i] * 0.1f;
+		CHECK(g[i] == scaled + 3.0f);
+	}
+
+	/* constants alone fill out, and casts wrap around */
+	static double d[1000];
+	struct ndview const vd = { d, 1, (size_t[]){ 1000 }, (ssize_t[]){ sizeof(double) } };
+	expr = make_expr();
+	root = expr_binary(&expr, EXPR_DIV, expr_int(&expr, 7), expr_int(&expr, 2));
+	CHECK(root >= 0 && expr_eval(&expr, root, &vd, f8, 1) == 0);
+	for (size_t i = 0; i < 1000; i++) CHECK(d[i] == 3.5);
+	expr = make_expr();
+	root = expr_binary(&expr, EXPR_ADD, expr_cast(&expr, expr_input(&expr, &vn, i4), u1), expr_float(&expr, 0.5));
+	CHECK(root >= 0 && dtype_equal(expr.nodes[root].type, f8));
+	CHECK(expr_eval(&expr, root, &vd, f8, 1) == 0);
+	for (size_t i = 0; i < 1000; i++) CHECK(d[i] == (uint8_t)n32[i] + 0.5);
+
+	/* select, over one, four and eight byte values */
+	expr = make_expr();
+	int const fx = expr_input(&expr, &vf, f4), nx = expr_input(&expr, &vn, i4);
+	int const cond = expr_binary(&expr, EXPR_LT, fx, expr_float(&expr, 0));
+	int const pick4 = expr_select(&expr, cond, fx, expr_unary(&expr, EXPR_NEG, fx));
+	int const pick8 = expr_select(&expr, cond, nx, expr_int(&expr, -1));
+	int const pick1 = expr_select(&expr, cond, expr_binary(&expr, EXPR_GT, nx, expr_int(&expr, -500)), cond);
+	CHECK(pick4 >= 0 && pick8 >= 0 && pick1 >= 0 && dtype_equal(expr.nodes[pick1].type, b1));
+	CHECK(expr_eval(&expr, pick4, &vg, f4, 1) == 0);
+	for (size_t i = 0; i < 1000; i++) CHECK(g[i] == -fabsf(f[i]));
+	CHECK(expr_eval(&expr, pick8, &vd, f8, 1) == 0);
+	for (size_t i = 0; i < 1000; i++) CHECK(d[i] == (f[i] < 0 ? n32[i] : -1));
+	CHECK(expr_eval(&expr, pick1, &vd, f8, 1) == 0);
+	for (size_t i = 0; i < 1000; i++) CHECK(d[i] == (f[i] < 0 && n32[i] > -500));
+
+	/* broadcasting a row and a column, and shapes that don't */
+	static double grid[3][1000];
+	double const column[3] = { 1, 10, 100 };
+	struct ndview const vgrid = { grid, 2, (size_t[]){ 3, 1000 }, (ssize_t[]){ sizeof(grid[0]), sizeof(double) } };
+	struct ndview const vcolumn = { (void *)column, 2, (size_t[]){ 3, 1 }, (ssize_t[]){ sizeof(double), sizeof(double) } };
+	expr = make_expr();
+	root = expr_binary(&expr, EXPR_SUB, expr_input(&expr, &vf, f4), expr_input(&expr, &vcolumn, f8));
+	CHECK(root >= 0 && expr_eval(&expr, root, &vgrid, f8, 1) == 0);
+	for (size_t i = 0; i < 3; i++)
+		for (size_t j = 0; j < 1000; j++) CHECK(grid[i][j] == (double)f[j] - column[i]);
+	struct ndview const short_row = { f, 1, (size_t[]){ 999 }, (ssize_t[]){ sizeof(float) } };
+	expr = make_expr();
+	root = expr_unary(&expr, EXPR_NEG, expr_input(&expr, &short_row, f4));
+	CHECK(root >= 0 && expr_eval(&expr, root, &vgrid, f8, 1) == EINVAL);
+	expr = make_expr();
+	root = expr_unary(&expr, EXPR_NEG, expr_input(&expr, &vgrid, f8));
+	CHECK(root >= 0 && expr_eval(&expr, root, &vd, f8, 1) == EINVAL);
+
+	/* dense dimensions merge, a transposed input keeps them apart, and out may be strided or reversed */
+	static int32_t cube[4][5][30], transposed[30][5][4];
+	static int64_t sum[8][5][30];
+	for (size_t i = 0; i < 4; i++)
+		for (size_t j = 0; j < 5; j++)
+			for (size_t k = 0; k < 30; k++) cube[i][j][k] = i * 1000 + j * 100 + k, transposed[k][j][i] = -(int32_t)k * 7;
+	struct ndview const vcube = { cube, 3, (size_t[]){ 4, 5, 30 }, (ssize_t[]){ sizeof(cube[0]), sizeof(cube[0][0]), 4 } };
+	struct ndview const vtransposed = { transposed, 3, (size_t[]){ 4, 5, 30 }, (ssize_t[]){ 4, sizeof(transposed[0][0]), sizeof(transposed[0]) } };
+	struct ndview const every_other = { sum, 3, (size_t[]){ 4, 5, 30 }, (ssize_t[]){ 2 * sizeof(sum[0]), sizeof(sum[0][0]), 8 } };
+	for (int transpose = 0; transpose < 2; transpose++) {
+		memset(sum, 0x55, sizeof(sum));
+		expr = make_expr();
+		int const c = expr_input(&expr, &vcube, i4);
+		root = expr_binary(&expr, EXPR_ADD, c, transpose ? expr_input(&expr, &vtransposed, i4) : c);
+		CHECK(root >= 0 && expr_eval(&expr, root, &every_other, i8, 1) == 0);
+		for (size_t i = 0; i < 8; i++)
+			for (size_t j = 0; j < 5; j++)
+				for (size_t k = 0; k < 30; k++) {
+					int64_t const want = i % 2 ? 0x5555555555555555 : cube[i / 2][j][k] + (transpose ? transposed[k][j][i / 2] : cube[i / 2][j][k]);
+					CHECK(sum[i][j][k] == want);
+				}
+	}
+	static int16_t narrow[3 * 1000];
+	memset(narrow, 0, sizeof(narrow));
+	struct ndview const strided = { narrow, 1, (size_t[]){ 1000 }, (ssize_t[]){ 3 * sizeof(int16_t) } };
+	struct ndview const reversed = { &d[999], 1, (size_t[]){ 1000 }, (ssize_t[]){ -(ssize_t)sizeof(double) } };
+	expr = make_expr();
+	root = expr_binary(&expr, EXPR_MUL, expr_input(&expr, &vn, i4), expr_int(&expr, 2));
+	CHECK(root >= 0 && expr_eval(&expr, root, &strided, i2, 1) == 0 && expr_eval(&expr, root, &reversed, f8, 1) == 0);
+	for (size_t i = 0; i < 1000; i++) {
+		CHECK(narrow[3 * i] == n32[i] * 2 && narrow[3 * i + 1] == 0 && narrow[3 * i + 2] == 0);
+		CHECK(d[999 - i] == n32[i] * 2);
+	}
+
+	/* out may be an input, of the computed type or not */
+	for (size_t i = 0; i < 1000; i++) d[i] = i;
+	expr = make_expr();
+	root = expr_binary(&expr, EXPR_ADD, expr_binary(&expr, EXPR_MUL, expr_input(&expr, &vd, f8), expr_float(&expr, 2)), expr_input(&expr, &vd, f8));
+	CHECK(root >= 0 && expr_eval(&expr, root, &vd, f8, 1) == 0);
+	for (size_t i = 0; i < 1000; i++) CHECK(d[i] == 3.0 * i);
+	expr = make_expr();
+	root = expr_binary(&expr, EXPR_SUB, expr_input(&expr, &vn, i4), expr_int(&expr, 5));
+	CHECK(root >= 0 && expr_eval(&expr, root, &vn, i4, 1) == 0);
+	for (size_t i = 0; i < 1000; i++) CHECK(n32[i] == (int32_t)(i * 3 - 1005));
+
+	/* threads share the tasks, which also start in the middle of rows that don't merge */
+	size_t const rows = 3 * EXPR_TASK / 1000 + 7;
+	double * big = malloc(rows * 1001 * sizeof(double)), * result = malloc(rows * 1001 * sizeof(double));
+	CHECK(big != NULL && result != NULL);
+	for (size_t i = 0; i < rows * 1001; i++) big[i] = i % 1777, result[i] = -1;
+	struct ndview const vbig = { big, 1, (size_t[]){ rows * 1001 }, (ssize_t[]){ sizeof(double) } };
+	struct ndview const vresult = { result, 1, (size_t[]){ rows * 1001 }, (ssize_t[]){ sizeof(double) } };
+	struct ndview const rows_in = { big, 2, (size_t[]){ rows, 1000 }, (ssize_t[]){ 1001 * sizeof(double), sizeof(double) } };
+	struct ndview const rows_out = { result, 2, (size_t[]){ rows, 1000 }, (ssize_t[]){ 1001 * sizeof(double), sizeof(double) } };
+	for (int shaped = 0; shaped < 2; shaped++) {
+		expr = make_expr();
+		int const in = expr_input(&expr, shaped ? &rows_in : &vbig, f8);
+		root = expr_binary(&expr, EXPR_SUB, expr_binary(&expr, EXPR_MUL, expr_unary(&expr, EXPR_SQRT, in), expr_float(&expr, 2)), in);
+		CHECK(root >= 0 && expr_eval(&expr, root, shaped ? &rows_out : &vresult, f8, 4) == 0);
+		for (size_t i = 0; i < rows * 1001; i++) {
+			double const want = shaped && i % 1001 == 1000 ? big[i] : sqrt(big[i]) * 2 - big[i];
+			CHECK(result[i] == want);
+			if (shaped) result[i] = big[i];
+		}
+		if (!shaped) memcpy(result, big, rows * 1001 * sizeof(double));
+	}
+	free(big);
+	free(result);
+	return 0;
+}
+
 int main()
 {
+	if (
+		test_scan() || test_spill() || test_npy_fortran() || test_uring() || test_kvnl_corrupt() ||
+		test_dtype() || test_read_delimited() || test_relay() || test_dispatch() ||
+		test_format() || test_expr()
+	)
+		return 1;
+
 	struct buf buf = make_buf_default();
 	buf_resize(&buf, 23);
 	buf_fprint(&buf, stderr); NL;